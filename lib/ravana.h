@@ -2,6 +2,7 @@
 #define __RAVANA_H_
 
 #include <msgpack.h>
+#include <sys/uio.h>
 
 #define ROOT (1) /* Thimble block where entire namespace is kept
                   * Also the ROOT directory's inode.
@@ -52,7 +53,13 @@ typedef enum rfs_file_op {OP_LOOKUP      = 1,
                           OP_LOCK        = 19,
                           OP_CLOSE       = 20,
                           OP_RMDIR       = 21,
-                          OP_MKNOD       = 22
+                          OP_MKNOD       = 22,
+                          OP_SHM_ATTACH  = 23,
+                          OP_READV       = 24,
+                          OP_WRITEV      = 25,
+                          OP_COMPOUND    = 26,
+                          OP_BATCH       = 27,
+                          OP_READDIRPLUS = 28
 } rfs_file_op_t;
 
 enum rfs_ctrl_op {OP_STOP_SERVER = 1001,
@@ -75,12 +82,43 @@ enum rfs_ctrl_op {OP_STOP_SERVER = 1001,
 typedef __uint128_t cid_t;   // Channel id type
 typedef __uint128_t fid_t;  // File id type, or inode num
 
-#define RFS_PROTO_VERSION  (1)
+/*
+ * Protocol versions
+ * 1: untagged, the dispatcher answers requests on a connection in order.
+ * 2: every request carries a tag that is echoed in its response. Requests
+ *    on a connection may be pipelined and are answered out of order.
+ * 3: as 2, and responses carry each FileAttr and each 128-bit id as a
+ *    msgpack bin in the fixed little-endian layout below, in place of one
+ *    msgpack integer per field. Asked for with rfs_channel_packed().
+ */
+#define RFS_PROTO_UNTAGGED (1)
+#define RFS_PROTO_VERSION  (2)
+#define RFS_PROTO_PACKED   (3)
+
+/*
+ * Fixed layouts of protocol version 3, all fields little-endian
+ * id:   0 lower 64 bits, 8 upper 64 bits
+ * attr: 0 mode, 4 uid, 8 gid, 12 links (32 bits), 16 size (64 bits),
+ *       24 dev, 40 ino (ids), 56 rdev (32 bits), 60 zero (32 bits),
+ *       64 atime, 80 ctime, 96 mtime (64 bits tv_sec then tv_nsec)
+ */
+#define RFS_ID_PACKED_SIZE   (16)
+#define RFS_ATTR_PACKED_SIZE (112)
+
+/*
+ * Protocol flags
+ * RFS_SHM_RING: the data of a read or write is passed through a slot of
+ * the ring shared with the dispatcher, the request carries the slot
+ * index instead. Set in the response to OP_SHM_ATTACH if the dispatcher
+ * attached the ring.
+ */
 #define RFS_FSAL_CLIENT    (1)
+#define RFS_SHM_RING       (4)
 typedef struct rfs_header {
     __uint32_t size;        // Size
     __uint16_t version;     // Proto version
     __uint16_t flags;       // Proto flags
+    __uint64_t tag;         // Request tag, echoed in the response
 } rfs_header_t;
 
 typedef struct rfs_request {
@@ -88,8 +126,17 @@ typedef struct rfs_request {
     char         payload[];
 } rfs_request_t;
 
+// Header of a response frame, followed by size bytes of payload
+typedef struct rfs_rsp_header {
+    __uint32_t size;        // Size of payload
+    __uint32_t flags;       // Proto flags
+    __uint64_t tag;         // Tag of the request answered
+} rfs_rsp_header_t;
+
 typedef struct rfs_response{
     __uint32_t size;        // Size of response
+    __uint32_t flags;       // Proto flags
+    __uint64_t tag;         // Tag of the request answered
     void       *payload;    // Returned stuff
 } rfs_response_t;
 
@@ -133,72 +180,11 @@ typedef struct file_name {
     char        name[NAME_MAX+1];  // filename
 } file_name_t;
 
+#include "ravana_ops.h"
 
-// OP_CREATE args. The entire structure is passed to the server.
-typedef struct rfs_arg_create {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   fname;      // File name
-    FileAttr      attr;       // Attributes to set
-} rfs_arg_create_t;
-
-// OP_CREATE response
-// If rfs_response_t returns a size <= sizeof(int32_t) it
-// means that only an error is returned and not the other
-// parts of this structure.
-typedef struct rfs_rsp_create {
-    __int32_t     error;      // POSIX error number
-    FileAttr      attr;       // Attributes of the created file
-} rfs_rsp_create_t;
-
-// OP_LOOKUP
-typedef struct rfs_arg_lookup {
-    rfs_file_op_t op;        // operation code
-    cid_t         cid;       // channel id
-    fid_t         dfid;      // Parent dir's fid
-    file_name_t   fname;     // File name
-} rfs_arg_lookup_t;
-
-// OP_LOOKUP response
-// If rfs_response_t returns a size <= sizeof(int32_t) it
-// means that only an error is returned and not the other
-// parts of this structure.
-typedef struct rfs_rsp_lookup {
-    __int32_t     error;      // POSIX error
-    FileAttr      attr;       // Attributes of the created file
-} rfs_rsp_lookup_t;
-
-// OP_SETATTRS
-typedef struct rfs_arg_setattr {
-    rfs_file_op_t  op;         // operation code
-    cid_t          cid;        // channel id
-    fid_t          fid;        // file id
-    uint32_t       attr_mask;  // attr mask to set
-    FileAttr       attr;       // attrs to set
-} rfs_arg_setattr_t;
-
-// OP_SETATTRS response
-typedef struct rfs_rsp_setattr {
-    __int32_t       error;        // POSIX error
-} rfs_rsp_setattr_t;
-
-// OP_GETATTRS
-typedef struct rfs_arg_getattr {
-    rfs_file_op_t   op;        // operation code
-    cid_t           cid;       // channel id
-    fid_t           fid;       // file id
-} rfs_arg_getattr_t;
-
-// OP_GETATTRS response
-// If rfs_response_t returns a size <= sizeof(int32_t) it
-// means that only an error is returned and not the other
-// parts of this structure.
-typedef struct rfs_rsp_getattr {
-    __int32_t   error;        // POSIX error
-    FileAttr    attr;         // get attr resp
-} rfs_rsp_getattr_t;
+// Requests and responses of the ops in ravana_ops.h
+RFS_FLAT_ARGS(RFS_ARG_STRUCT)
+RFS_FLAT_RSPS(RFS_RSP_STRUCT)
 
 typedef struct rfs_dirent {
     file_name_t fname;        // File Name
@@ -207,18 +193,47 @@ typedef struct rfs_dirent {
     //FileAttr    attr;         // stat for the entry
 } rfs_dirent_t;
 
-// OP_READDIR
-typedef struct rfs_arg_readdir {
-    rfs_file_op_t  op;        // operation code
-    cid_t          cid;       // channel id
-    fid_t          d_fid;     // directory file id
-    uint64_t       index;     // index to start from
-} rfs_arg_readdir_t;
+/*
+ * Compact readdir entry, as decoded by rfs_readdir_arena() into the
+ * caller's storage. Entries follow one another, each followed by its
+ * name and padded to the alignment of the structure; reclen is the
+ * offset of the next entry (see RFS_DIRENT_NEXT).
+ */
+typedef struct rfs_dirent_compact {
+    fid_t       fid;          // fid
+    uint64_t    whence;       // whence token
+    uint16_t    reclen;       // size of the entry, name and padding included
+    uint16_t    name_len;     // length of the name
+    char        name[];       // name, NUL terminated
+} rfs_dirent_compact_t;
+
+#define RFS_DIRENT_NEXT(d) \
+    ((rfs_dirent_compact_t *)((char *)(d) + (d)->reclen))
+
+/*
+ * OP_READDIRPLUS entry, as decoded by rfs_readdirplus(). Laid out in the
+ * arena like rfs_dirent_compact_t, with the entry's attributes and, for a
+ * symlink, the length of its target. link_len is 0 for other files.
+ */
+typedef struct rfs_direntplus {
+    fid_t       fid;          // fid
+    uint64_t    whence;       // whence token
+    FileAttr    attr;         // stat for the entry
+    uint32_t    link_len;     // length of the symlink's target
+    uint16_t    reclen;       // size of the entry, name and padding included
+    uint16_t    name_len;     // length of the name
+    char        name[];       // name, NUL terminated
+} rfs_direntplus_t;
+
+#define RFS_DIRENTPLUS_NEXT(d) \
+    ((rfs_direntplus_t *)((char *)(d) + (d)->reclen))
 
 // OP_READDIR response
 // If rfs_response_t returns a size <= sizeof(int32_t) it
 // means that only an error is returned and not the other
-// parts of this structure.
+// parts of this structure. The entries are followed by the
+// index to go on from, which goes past entries readdirplus
+// left out.
 typedef struct rfs_rsp_readdir {
     __int32_t    error;       // POSIX error
     __int32_t    eof;         // true, for end of directory
@@ -228,17 +243,12 @@ typedef struct rfs_rsp_readdir {
 } rfs_rsp_readdir_t;
 
 
+/* Size of the blocks the dispatcher keeps file data in, BLOCK_SIZE */
+#define RFS_BLOCK_SIZE  (4096)
+
 /*
- * OP_READ arguments and response structures
+ * OP_READ response structure, the arguments are in ravana_ops.h
  */
-typedef struct rfs_arg_read {
-    rfs_file_op_t  op;         /* operation code */
-    cid_t          cid;        /* channel id */
-    fid_t          fid;        /* file id */
-    uint64_t       offset;     /* read request offset */
-    __int64_t      size;       /* read request size */
-} rfs_arg_read_t;
-
 typedef struct rfs_rsp_read {
     __int32_t   error;      /* POSIX error */
     __int64_t   size;       /* read size */
@@ -247,7 +257,8 @@ typedef struct rfs_rsp_read {
 
 
 /*
- * OP_WRITE arguments and response structures
+ * OP_WRITE arguments, the data follows them. The response is in
+ * ravana_ops.h
  */
 typedef struct rfs_arg_write {
     rfs_file_op_t   op;         /* operation code */
@@ -258,101 +269,94 @@ typedef struct rfs_arg_write {
     char            buffer[];   /* data buffer */
 } rfs_arg_write_t;
 
-typedef struct rfs_rsp_write {
-    __int32_t       error;      /* POSIX error */
-    __int64_t       size;       /* written size */
-} rfs_rsp_write_t;
+/*
+ * OP_READV and OP_WRITEV arguments and response structures. All segments
+ * are of the same file and travel in one request.
+ */
+#define RFS_MAX_SEGS    (1000)
 
-// OP_MKDIR args. The entire structure is passed to the server.
-typedef struct rfs_arg_mkdir {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent dir id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   dname;      // Dir name
-    FileAttr      attr;       // attrs to set
-} rfs_arg_mkdir_t;
+typedef struct rfs_seg {
+    uint64_t        offset;     /* segment offset in the file */
+    __int64_t       size;       /* segment size */
+    char            *buf;       /* data to write or buffer to read into */
+} rfs_seg_t;
 
-// OP_MKDIR response
-// If rfs_response_t returns a size <= sizeof(int32_t) it
-// means that only an error is returned and not the other
-// parts of this structure.
-typedef struct rfs_rsp_mkdir {
-    __int32_t     error;      // POSIX error
-    FileAttr      attr;       // Attrs of newly created dir
-} rfs_rsp_mkdir_t;
-
-// OP_SYMLINK args. The entire structure is passed to the server.
-typedef struct rfs_arg_symlink {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent dir id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   name;       // Link name
-    FileAttr      attr;       // attrs to set
-    file_name_t	  link_path;  // path to link to
-} rfs_arg_symlink_t;
-
-// OP_SYMLINK response
-// If rfs_response_t returns a size <= sizeof(int32_t) it
-// means that only an error is returned and not the other
-// parts of this structure.
-typedef struct rfs_rsp_symlink {
-    __int32_t     error;      // POSIX error
-    FileAttr      attr;       // Attrs of the link created
-} rfs_rsp_symlink_t;
-
-// OP_LINK args. The entire structure is passed to the server.
-typedef struct rfs_arg_link {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent dir id
-    fid_t         fid;        // file id to link to
-    file_name_t   name;       // Link name
-} rfs_arg_link_t;
-
-// OP_LINK response
-typedef struct rfs_rsp_link {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_link_t;
-
-// OP_UNLINK args. The entire structure is passed to the server.
-typedef struct rfs_arg_unlink {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    file_name_t   name;       // file name
-} rfs_arg_unlink_t;
+typedef struct rfs_arg_readv {
+    rfs_file_op_t   op;         /* operation code */
+    cid_t           cid;        /* channel id */
+    fid_t           fid;        /* file id */
+    uint32_t        n_segs;     /* number of segments */
+    const rfs_seg_t *segs;      /* segments */
+} rfs_arg_readv_t;
 
-// OP_UNLINK response
-typedef struct rfs_rsp_unlink {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_unlink_t;
+typedef rfs_arg_readv_t rfs_arg_writev_t;
 
-typedef rfs_arg_unlink_t rfs_arg_rmdir_t;
-typedef rfs_rsp_unlink_t rfs_rsp_rmdir_t;
+typedef struct rfs_rsp_readv {
+    __int32_t       error;      /* POSIX error */
+    uint32_t        n_segs;     /* number of segments read */
+    __int64_t       *sizes;     /* size read into each segment */
+} rfs_rsp_readv_t;
+
+/*
+ * OP_COMPOUND arguments and response structures. The ops run in order on
+ * a current fid that starts as fid; OP_LOOKUP looks up fname in it and
+ * makes the file found current, OP_GETATTRS returns its attributes. The
+ * chain stops at the first op that fails.
+ */
+#define RFS_MAX_COMPOUND    (32)
+
+typedef struct rfs_compound_op {
+    rfs_file_op_t op;         // OP_LOOKUP or OP_GETATTRS
+    file_name_t   fname;      // Name to look up, for OP_LOOKUP
+} rfs_compound_op_t;
 
-// OP_RENAME args. The entire structure is passed to the server.
-typedef struct rfs_arg_rename {
+typedef struct rfs_arg_compound {
     rfs_file_op_t op;         // operation code
     cid_t         cid;        // channel id
-    fid_t         old_dfid;   // parent file id
-    file_name_t   old_name;   // Link name
-    fid_t         new_dfid;   // parent file id
-    file_name_t   new_name;   // Link name
-} rfs_arg_rename_t;
+    fid_t         fid;        // fid the chain starts from
+    uint32_t      n_ops;      // number of ops
+    const rfs_compound_op_t *ops; // ops, in order
+} rfs_arg_compound_t;
+
+typedef struct rfs_compound_res {
+    __int32_t     error;      // POSIX error of the op
+    FileAttr      attr;       // Attributes of the current fid after the op
+} rfs_compound_res_t;
+
+typedef struct rfs_rsp_compound {
+    __int32_t     error;      // POSIX error of the last op run
+    uint32_t      n_res;      // number of ops run
+    rfs_compound_res_t *res;  // their results, room for n_ops
+} rfs_rsp_compound_t;
 
-// OP_RENAME response
-typedef struct rfs_rsp_rename {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_rename_t;
+/*
+ * OP_BATCH arguments and response structures. Each op is packed as if it
+ * were sent alone and runs independently of the others; its response
+ * comes back as it would alone. Reads, OP_SHM_ATTACH and batches can't be
+ * batched.
+ */
+#define RFS_MAX_BATCH       (64)
 
-// OP_READLINK args. The entire structure is passed to the server.
-typedef struct rfs_arg_readlink {
+typedef struct rfs_arg_batch {
     rfs_file_op_t op;         // operation code
     cid_t         cid;        // channel id
-    fid_t         fid;        // link file id
-} rfs_arg_readlink_t;
+    uint32_t      n_ops;      // number of ops
+    void * const  *args;      // rfs_arg_* of each op
+} rfs_arg_batch_t;
+
+typedef struct rfs_batch_res {
+    const char    *payload;   // response of the op, in the batch's response
+    int           size;       // its size
+} rfs_batch_res_t;
+
+typedef struct rfs_rsp_batch {
+    __int32_t     error;      // POSIX error of the batch as a whole
+    uint32_t      n_res;      // number of responses
+    rfs_batch_res_t *res;     // their payloads, room for n_ops
+} rfs_rsp_batch_t;
+
+typedef rfs_arg_unlink_t rfs_arg_rmdir_t;
+typedef rfs_rsp_unlink_t rfs_rsp_rmdir_t;
 
 // OP_RENAME response
 typedef struct rfs_rsp_readlink {
@@ -364,13 +368,6 @@ typedef struct rfs_rsp_readlink {
 // OP_MKNOD args. The entire structure is passed to the server.
 typedef rfs_arg_create_t rfs_arg_mknod_t;
 
-// OP_MKNOD response
-typedef struct rfs_rsp_mknod {
-    __int32_t     error;      // POSIX error
-    FileAttr      attr;       // Attrs of newly created device
-} rfs_rsp_mknod_t;
-
-
 // OP_STATFS args. The entire structure is passed to the server.
 typedef struct rfs_arg_statfs {
     rfs_file_op_t op;         // operation code
@@ -395,15 +392,32 @@ typedef struct rfs_rsp_statfs {
 }rfs_rsp_statfs_t;
 
 // Function declarations
+void get_sock_path(char *path, cid_t cid);
+int rfs_socket_io(cid_t cid, rfs_request_t *req, rfs_response_t **rsp);
+int rfs_socket_iov(cid_t cid, rfs_request_t *req, const struct iovec *iov,
+        int iovcnt, rfs_response_t **rsp);
 rfs_request_t * serialize_request(void *opaque_ptr);
+rfs_request_t * serialize_request_tls(void *opaque_ptr);
+rfs_request_t * serialize_write_preamble(rfs_arg_write_t *wr);
+rfs_request_t * serialize_writev_preamble(rfs_arg_writev_t *wr);
+rfs_request_t * serialize_shm_request(void *opaque_ptr, uint32_t slot);
 int deserialize_rsp_create(const char *packed_buf, int size, rfs_rsp_create_t *response);
 int deserialize_rsp_lookup(const char *packed_buf, int size, rfs_rsp_lookup_t *response);
 int deserialize_rsp_setattr(const char *packed_buf, int size, rfs_rsp_setattr_t *response);
 int deserialize_rsp_getattr(const char *packed_buf, int size, rfs_rsp_getattr_t *response);
 int deserialize_rsp_readdir(const char *packed_buf, int size, rfs_rsp_readdir_t *response);
 int deserialize_rsp_readdir_entries(const char *packed_buf, int size, rfs_rsp_readdir_t *response); 
+int deserialize_rsp_readdir_arena(const char *packed_buf, int size, rfs_rsp_readdir_t *response,
+        void *arena, size_t arena_size);
+int deserialize_rsp_readdirplus_arena(const char *packed_buf, int size, rfs_rsp_readdir_t *response,
+        void *arena, size_t arena_size);
 int deserialize_rsp_write(const char *packed_buf, int size, rfs_rsp_write_t *response);
 int deserialize_rsp_read(const char *packed_buf, int size, rfs_rsp_read_t *response);
+int deserialize_rsp_read_into(const char *packed_buf, int size, rfs_rsp_read_t *response,
+        char *buf, __int64_t buf_size);
+int deserialize_rsp_read_head(const char *packed_buf, int size, __int64_t *data_size);
+int deserialize_rsp_readv(const char *packed_buf, int size, rfs_rsp_readv_t *response,
+        const rfs_seg_t *segs);
 int deserialize_rsp_readlink(const char *packed_buf, int size, rfs_rsp_readlink_t *response);
 int deserialize_rsp_rename(const char *packed_buf, int size, rfs_rsp_rename_t *response);
 int deserialize_rsp_unlink(const char *packed_buf, int size, rfs_rsp_unlink_t *response);
@@ -412,4 +426,9 @@ int deserialize_rsp_link(const char *packed_buf, int size, rfs_rsp_link_t *respo
 int deserialize_rsp_symlink(const char *packed_buf, int size, rfs_rsp_symlink_t *response);
 int deserialize_rsp_mkdir(const char *packed_buf, int size, rfs_rsp_mkdir_t *response);
 int deserialize_rsp_mknod(const char *packed_buf, int size, rfs_rsp_mknod_t *response); 
+int deserialize_rsp_compound(const char *packed_buf, int size, rfs_rsp_compound_t *response,
+        uint32_t n_ops);
+int deserialize_rsp_batch(const char *packed_buf, int size, rfs_rsp_batch_t *response,
+        uint32_t n_ops);
+int deserialize_rsp_shm_attach(const char *packed_buf, int size, rfs_rsp_shm_attach_t *response);
 #endif //  __RAVANA_H
@@ -0,0 +1,435 @@
+/*
+ * Asynchronous submission and completion of RavanaFS requests.
+ *
+ * rfs_submit() serializes an rfs_arg_* with serialize_request_tls(), sends
+ * it on the channel and returns without waiting for the response. Responses
+ * to submitted requests are queued on the channel's completion queue by
+ * whichever thread reads them off the connection. rfs_poll() and
+ * rfs_wait() reap completions, reading the connection themselves when no
+ * other thread is, with the channel's socket watched by a single epoll
+ * set. Each completion is decoded with the op's deserialize_rsp_*() and
+ * returned with the cookie given to rfs_submit().
+ *
+ * rfs_batch() sends several requests in one OP_BATCH frame and waits for
+ * their responses, decoded into completions the same way.
+ */
+
+#include "ravana_channel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/epoll.h>
+
+// Async requests in flight on a channel before rfs_submit() reads responses
+#define RFS_ASYNC_DEPTH 128
+
+/*
+ * Decode the response of a completed async request on the channel of
+ * *cid* into *cqe*, and bring the channel's caches up to date with it.
+ * Called without ch->lock.
+ */
+static void async_decode(cid_t cid, rfs_pending_t *p, rfs_cqe_t *cqe)
+{
+    rfs_response_t *rsp = p->rsp;
+    void *buf;
+    union {
+        rfs_rsp_create_t    create;
+        rfs_rsp_mknod_t     mknod;
+        rfs_rsp_lookup_t    lookup;
+        rfs_rsp_getattr_t   getattr;
+        rfs_rsp_mkdir_t     mkdir;
+        rfs_rsp_symlink_t   symlink;
+        rfs_rsp_setattr_t   setattr;
+        rfs_rsp_link_t      link;
+        rfs_rsp_unlink_t    unlink;
+        rfs_rsp_rmdir_t     rmdir;
+        rfs_rsp_rename_t    rename;
+        rfs_rsp_write_t     write;
+    } u = {0};
+
+    memset(cqe, 0, sizeof(rfs_cqe_t));
+    cqe->cookie = p->cookie;
+    cqe->op = p->op;
+    if (p->error) {
+        cqe->error = p->error;
+        if (p->arg != NULL)
+            cache_complete(cid, p->arg, cqe->error, NULL);
+        return;
+    }
+    buf = rsp->payload;
+
+    switch(p->op) {
+        case OP_CREATE:
+            deserialize_rsp_create(buf, rsp->size, &u.create);
+            cqe->error = u.create.error;
+            cqe->u.attr = u.create.attr;
+            break;
+        case OP_MKNOD:
+            deserialize_rsp_mknod(buf, rsp->size, &u.mknod);
+            cqe->error = u.mknod.error;
+            cqe->u.attr = u.mknod.attr;
+            break;
+        case OP_LOOKUP:
+            deserialize_rsp_lookup(buf, rsp->size, &u.lookup);
+            cqe->error = u.lookup.error;
+            cqe->u.attr = u.lookup.attr;
+            if (cqe->error == 0)
+                link_cache_inline(cid, &u.lookup.attr, &u.lookup.link);
+            break;
+        case OP_GETATTRS:
+            deserialize_rsp_getattr(buf, rsp->size, &u.getattr);
+            cqe->error = u.getattr.error;
+            cqe->u.attr = u.getattr.attr;
+            if (cqe->error == 0)
+                link_cache_inline(cid, &u.getattr.attr, &u.getattr.link);
+            break;
+        case OP_MKDIR:
+            deserialize_rsp_mkdir(buf, rsp->size, &u.mkdir);
+            cqe->error = u.mkdir.error;
+            cqe->u.attr = u.mkdir.attr;
+            break;
+        case OP_SYMLINK:
+            deserialize_rsp_symlink(buf, rsp->size, &u.symlink);
+            cqe->error = u.symlink.error;
+            cqe->u.attr = u.symlink.attr;
+            break;
+        case OP_SETATTRS:
+            deserialize_rsp_setattr(buf, rsp->size, &u.setattr);
+            cqe->error = u.setattr.error;
+            break;
+        case OP_LINK:
+            deserialize_rsp_link(buf, rsp->size, &u.link);
+            cqe->error = u.link.error;
+            break;
+        case OP_UNLINK:
+            deserialize_rsp_unlink(buf, rsp->size, &u.unlink);
+            cqe->error = u.unlink.error;
+            break;
+        case OP_RMDIR:
+            deserialize_rsp_rmdir(buf, rsp->size, &u.rmdir);
+            cqe->error = u.rmdir.error;
+            break;
+        case OP_RENAME:
+            deserialize_rsp_rename(buf, rsp->size, &u.rename);
+            cqe->error = u.rename.error;
+            break;
+        case OP_WRITE:
+        case OP_WRITEV:
+            deserialize_rsp_write(buf, rsp->size, &u.write);
+            cqe->error = u.write.error;
+            cqe->u.size = u.write.size;
+            break;
+        case OP_READ:
+        case OP_READLINK:
+        {
+            rfs_rsp_read_t read_rsp = {0};
+
+            // The data was streamed into the caller's buffer
+            if (p->streamed >= 0) {
+                cqe->u.size = p->streamed;
+                break;
+            }
+            deserialize_rsp_read_into(buf, rsp->size, &read_rsp, p->buf, p->len);
+            cqe->error = read_rsp.error;
+            if (cqe->error == 0)
+                cqe->u.size = read_rsp.size;
+            break;
+        }
+        case OP_READDIR:
+        {
+            rfs_rsp_readdir_t readdir_rsp = {0};
+            rfs_rsp_readdir_t *entries_rsp = NULL;
+
+            deserialize_rsp_readdir(buf, rsp->size, &readdir_rsp);
+            cqe->error = readdir_rsp.error;
+            if (cqe->error)
+                break;
+            entries_rsp = malloc(sizeof(rfs_rsp_readdir_t) +
+                    (size_t)(readdir_rsp.n_entries*sizeof(rfs_dirent_t)));
+            if (entries_rsp == NULL) {
+                cqe->error = -ENOMEM;
+                break;
+            }
+            deserialize_rsp_readdir_entries(buf, rsp->size, entries_rsp);
+            cqe->u.readdir.eof = entries_rsp->eof;
+            cqe->u.readdir.n_entries = entries_rsp->n_entries;
+            cqe->u.readdir.entries = malloc((size_t)entries_rsp->n_entries*sizeof(rfs_dirent_t));
+            if (cqe->u.readdir.entries)
+                memcpy(cqe->u.readdir.entries, entries_rsp->entries,
+                        (size_t)entries_rsp->n_entries*sizeof(rfs_dirent_t));
+            else
+                cqe->error = -ENOMEM;
+            free(entries_rsp);
+            break;
+        }
+        default:
+            cqe->error = -ENOSYS;
+            break;
+    }
+
+    if (p->arg == NULL)
+        return;
+    switch(p->op) {
+        case OP_CREATE:
+        case OP_MKNOD:
+        case OP_LOOKUP:
+        case OP_GETATTRS:
+        case OP_MKDIR:
+        case OP_SYMLINK:
+            cache_complete(cid, p->arg, cqe->error, &cqe->u.attr);
+            break;
+        default:
+            cache_complete(cid, p->arg, cqe->error, NULL);
+            break;
+    }
+}
+
+/*
+ * Read one response off the channel's connection and deliver it, waiting
+ * up to *timeout* ms (-1 for ever) for it to arrive. If another thread is
+ * already reading, wait for it to deliver something instead. Returns 0
+ * if something may have been delivered, -EAGAIN if nothing was ready and
+ * -ENOTCONN if there is no connection. Called with ch->lock held.
+ */
+static int async_receive(rfs_channel_t *ch, int timeout)
+{
+    struct epoll_event ev;
+    rfs_conn_t *conn;
+    rfs_response_t *r;
+    int nev, error = 0;
+
+    if (ch->receiving) {
+        if (timeout == 0)
+            return -EAGAIN;
+        pthread_cond_wait(&ch->cond, &ch->lock);
+        return 0;
+    }
+    if ((conn = ch->conn) == NULL)
+        return -ENOTCONN;
+
+    /* Become the receiver */
+    ch->receiving = 1;
+    conn->refs++;
+    pthread_mutex_unlock(&ch->lock);
+
+    do {
+        nev = epoll_wait(ch->epfd, &ev, 1, timeout);
+    } while (nev < 0 && errno == EINTR);
+    if (nev < 0)
+        error = -errno;
+    else if (nev == 1)
+        error = channel_recv(ch, conn, &r, 0);
+
+    pthread_mutex_lock(&ch->lock);
+    ch->receiving = 0;
+    if (nev == 1 && error == 0)
+        channel_deliver(ch, conn, r);
+    else if (error && ch->conn == conn)
+        channel_reset(ch, error == -ENOMEM ? error : -EIO);
+    conn_put(conn);
+    pthread_cond_broadcast(&ch->cond);
+
+    return nev == 0 ? -EAGAIN : 0;
+}
+
+/*
+ * Submit the request described by *arg*, a pointer to any rfs_arg_*,
+ * on *ch* and return without waiting for the response. *arg* is
+ * serialized before rfs_submit() returns and may be reused right away.
+ *
+ * For OP_READ and OP_READLINK *buf* is where the data is returned and
+ * must stay valid until the request is reaped. It must hold the read
+ * size, or PATH_MAX for OP_READLINK. *cookie* is returned untouched in
+ * the request's completion.
+ */
+int rfs_submit(rfs_channel_t *ch, void *arg, void *buf, void *cookie)
+{
+    rfs_request_t *req = NULL;
+    rfs_pending_t *p = NULL;
+    int error = 0;
+
+    /*
+     * A readv's data goes to the segments' buffers and readdirplus entries
+     * to an arena, rfs_readv() and rfs_readdirplus() only
+     */
+    if (*(rfs_file_op_t *)arg == OP_READV ||
+        *(rfs_file_op_t *)arg == OP_READDIRPLUS)
+        return -EINVAL;
+    // Buffered writes of the file go first
+    if ((error = wb_flush_arg(ch->cid, arg)) != 0)
+        return error;
+    if ((p = calloc(1, sizeof(rfs_pending_t))) == NULL)
+        return -ENOMEM;
+    p->async = 1;
+    p->op = *(rfs_file_op_t *)arg;
+    p->cookie = cookie;
+    p->buf = buf;
+    p->arg = cache_arg_copy(ch->cid, arg);
+    if (p->op == OP_READ) {
+        p->len = ((rfs_arg_read_t *)arg)->size;
+        p->stream = 1;
+    } else if (p->op == OP_READLINK)
+        p->len = PATH_MAX;
+
+    // Serialize the request
+    if ((req = serialize_request_tls(arg)) == NULL) {
+        free(p->arg);
+        free(p);
+        return -EINVAL;
+    }
+
+    /*
+     * A caller that submits without reaping would have the dispatcher
+     * block writing responses nobody reads, and so stop reading requests.
+     * Past RFS_ASYNC_DEPTH requests in flight, read responses onto the
+     * completion queue before sending more.
+     */
+    pthread_mutex_lock(&ch->lock);
+    while (ch->n_async - ch->n_completed >= RFS_ASYNC_DEPTH &&
+            async_receive(ch, -1) != -ENOTCONN)
+        ;
+    pthread_mutex_unlock(&ch->lock);
+
+    if ((error = channel_submit(ch, req, p)) == -EPIPE)
+        error = channel_submit(ch, req, p);
+    if (error) {
+        free(p->arg);
+        free(p);
+    }
+
+    return error;
+}
+
+/*
+ * Reap at least *min* and at most *max* completions into *cqes*. While
+ * fewer than *min* are queued, read responses off the connection. With
+ * min == 0 the connection is only read as long as responses are ready.
+ * Returns the number of completions reaped, which is less than *min*
+ * only if there are no more requests outstanding.
+ */
+static int async_reap(rfs_channel_t *ch, rfs_cqe_t *cqes, int min, int max)
+{
+    rfs_pending_t *p;
+    int n = 0;
+
+    pthread_mutex_lock(&ch->lock);
+    for (;;) {
+        /* Take what has completed */
+        while (n < max && (p = ch->cq_head) != NULL) {
+            if ((ch->cq_head = p->next) == NULL)
+                ch->cq_tail = NULL;
+            ch->n_async--;
+            ch->n_completed--;
+            pthread_mutex_unlock(&ch->lock);
+            async_decode(ch->cid, p, &cqes[n++]);
+            free(p->rsp);
+            free(p->arg);
+            free(p);
+            pthread_mutex_lock(&ch->lock);
+        }
+        if (n >= max || ch->n_async == 0)
+            break;
+        if (ch->receiving && n >= min)
+            break;
+        if (async_receive(ch, n < min ? -1 : 0) && ch->cq_head == NULL)
+            break;
+    }
+    pthread_mutex_unlock(&ch->lock);
+
+    return n;
+}
+
+/*
+ * Reap up to *max* completions without blocking. Returns the number
+ * reaped.
+ */
+int rfs_poll(rfs_channel_t *ch, rfs_cqe_t *cqes, int max)
+{
+    return async_reap(ch, cqes, 0, max);
+}
+
+/*
+ * Reap between *min* and *max* completions, blocking until *min* are
+ * available. Returns the number reaped.
+ */
+int rfs_wait(rfs_channel_t *ch, rfs_cqe_t *cqes, int min, int max)
+{
+    if (min > max)
+        min = max;
+    return async_reap(ch, cqes, min, max);
+}
+
+/*
+ * Run the *n_ops* requests *args*, each a pointer to an rfs_arg_*, in one
+ * round trip on the channel of *cid*. The dispatcher runs them in order,
+ * logs the modifying ones in one oplog entry, and one failing does not
+ * stop the others. The completion of args[i] is returned in cqes[i], its
+ * cookie is NULL. Reads, readlinks and compounds can't be batched.
+ * Returns 0 if each op has its completion, or an error for the whole
+ * batch.
+ */
+int rfs_batch(cid_t cid, void * const *args, uint32_t n_ops, rfs_cqe_t *cqes)
+{
+    rfs_arg_batch_t batch;
+    rfs_rsp_batch_t batch_rsp = {0};
+    rfs_batch_res_t res[RFS_MAX_BATCH];
+    rfs_request_t *req;
+    rfs_response_t *rsp = NULL;
+    uint32_t i;
+    int error;
+
+    if (n_ops == 0 || n_ops > RFS_MAX_BATCH)
+        return -EINVAL;
+    for (i = 0; i < n_ops; i++) {
+        switch (*(rfs_file_op_t *)args[i]) {
+            case OP_READ:
+            case OP_READV:
+            case OP_READLINK:
+            case OP_READDIRPLUS:
+            case OP_COMPOUND:
+            case OP_SHM_ATTACH:
+            case OP_BATCH:
+                return -EINVAL;
+            default:
+                break;
+        }
+        // Buffered writes of the files go first
+        if ((error = wb_flush_arg(cid, args[i])) != 0)
+            return error;
+    }
+
+    batch.op = OP_BATCH;
+    batch.cid = cid;
+    batch.n_ops = n_ops;
+    batch.args = args;
+    if ((req = serialize_request_tls((void *)&batch)) == NULL)
+        return -EINVAL;
+    if ((error = rfs_socket_io(cid, req, &rsp)) != 0)
+        return error;
+
+    batch_rsp.res = res;
+    if (deserialize_rsp_batch(rsp->payload, rsp->size, &batch_rsp, n_ops) != 0)
+        error = -EIO;
+    else if ((error = batch_rsp.error) == 0 && batch_rsp.n_res != n_ops)
+        error = -EIO;
+    if (error) {
+        free(rsp);
+        return error;
+    }
+    for (i = 0; i < n_ops; i++) {
+        rfs_response_t sub = {0};
+        rfs_pending_t p = {0};
+
+        sub.size = res[i].size;
+        sub.payload = (void *)res[i].payload;
+        p.op = *(rfs_file_op_t *)args[i];
+        p.rsp = &sub;
+        p.streamed = -1;
+        p.arg = args[i];
+        async_decode(cid, &p, &cqes[i]);
+    }
+    free(rsp);
+
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+Request encoding benchmark. Encodes metadata requests with
+serialize_request(), which allocates every request, and with
+serialize_request_tls(), which reuses the calling thread's buffer, and
+prints the heap allocations and time each takes per request. The write
+preambles and ring requests, encoded into the thread's buffer as well,
+are counted the same way.
+
+What a synchronous call still allocates is its response: the channel
+receives it into a new rfs_response_t for whichever thread is waiting,
+and the caller frees it. The last line counts that, receiving responses
+written to a socket pair. The dispatcher is not needed.
+
+The allocations are counted by wrapping malloc(), calloc(), realloc() and
+free() around the C library's own.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "ravana.h"
+#include "ravana_channel.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread long n_allocs = 0;
+static __thread long n_frees = 0;
+
+void *malloc(size_t size)
+{
+    n_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    n_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    n_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr)
+        n_frees++;
+    __libc_free(ptr);
+}
+
+void usage(char *argv[])
+{
+    printf("%s [requests per op (default 1000000)]\n", argv[0]);
+    exit(-1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef rfs_request_t *(*encode_t)(void *arg);
+
+static rfs_request_t *encode_write(void *arg)
+{
+    return serialize_write_preamble(arg);
+}
+
+static rfs_request_t *encode_writev(void *arg)
+{
+    return serialize_writev_preamble(arg);
+}
+
+static rfs_request_t *encode_shm(void *arg)
+{
+    return serialize_shm_request(arg, 0);
+}
+
+static void report(const char *name, const char *how, long allocs,
+        long frees, double secs, long n)
+{
+    printf("%-10s %-8s %6.2f allocs %6.2f frees %8.1f ns\n", name, how,
+            (double)allocs / n, (double)frees / n, secs / n * 1e9);
+}
+
+/*
+ * Encode *arg* *n* times with *encode*, into the thread's buffer if *tls*
+ * is set, else into requests that are freed. Prints the allocations,
+ * frees and time per request.
+ */
+static void bench(const char *name, encode_t encode, void *arg, int tls, long n)
+{
+    rfs_request_t *req;
+    long i, allocs, frees;
+    double start, secs;
+
+    // Let the thread's buffer grow to fit before counting
+    if (tls)
+        encode(arg);
+
+    allocs = n_allocs;
+    frees = n_frees;
+    start = now();
+    for (i = 0; i < n; i++) {
+        if ((req = encode(arg)) == NULL)
+            break;
+        if (!tls)
+            free(req);
+    }
+    secs = now() - start;
+    if (i < n) {
+        printf("%s: serialize failed\n", name);
+        exit(-1);
+    }
+    report(name, tls ? "thread" : "malloc", n_allocs - allocs,
+            n_frees - frees, secs, n);
+}
+
+/*
+ * Receive *n* responses of a write with conn_recv() and free them, as a
+ * synchronous call does. Prints the allocations, frees and time per
+ * response.
+ */
+static void bench_response(long n)
+{
+    static const unsigned char payload[] = { 0x00, 0x10 };   // NO_ERROR, 16
+    rfs_rsp_header_t hdr = { sizeof(payload), 0, 1 };
+    char frame[sizeof(hdr) + sizeof(payload)];
+    rfs_conn_t conn = {0};
+    rfs_response_t *rsp;
+    long i, allocs, frees;
+    double start, secs;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        exit(-1);
+    }
+    conn.fd = sv[0];
+    memcpy(frame, &hdr, sizeof(hdr));
+    memcpy(frame + sizeof(hdr), payload, sizeof(payload));
+
+    allocs = n_allocs;
+    frees = n_frees;
+    start = now();
+    for (i = 0; i < n; i++) {
+        if (write(sv[1], frame, sizeof(frame)) != sizeof(frame) ||
+            conn_recv(&conn, &rsp, 0) != 0)
+            break;
+        free(rsp);
+    }
+    secs = now() - start;
+    if (i < n) {
+        printf("response: receive failed\n");
+        exit(-1);
+    }
+    report("response", "malloc", n_allocs - allocs, n_frees - frees, secs, n);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t          lo = 0x50e7c1cb21e3ea0b;
+    uint64_t          hi = 0x9bdc739f3962c66;
+    cid_t             cid = UINT128(lo, hi);
+    long              n = 1000000;
+    file_name_t       fname;
+    rfs_arg_lookup_t  lookup = {0};
+    rfs_arg_getattr_t getattr = {0};
+    rfs_arg_create_t  creat = {0};
+    rfs_arg_setattr_t setattr = {0};
+    rfs_arg_write_t   write = {0};
+    rfs_arg_writev_t  writev = {0};
+    rfs_seg_t         segs[2] = {{0}};
+    int               tls;
+
+    if(argc > 2)
+        usage(argv);
+    if(argc > 1 && (n = atol(argv[1])) <= 0)
+        usage(argv);
+
+    sprintf(fname.name, "bench_alloc_file");
+    fname.name_len = strlen(fname.name);
+
+    lookup.op = OP_LOOKUP;
+    lookup.cid = cid;
+    lookup.dfid = ROOT;
+    lookup.fname = fname;
+
+    getattr.op = OP_GETATTRS;
+    getattr.cid = cid;
+    getattr.fid = ROOT;
+
+    creat.op = OP_CREATE;
+    creat.cid = cid;
+    creat.p_fid = ROOT;
+    creat.attr_mask = RFS_ATTR_MODE;
+    creat.attr.mode = S_IFREG | 0644;
+    creat.fname = fname;
+
+    setattr.op = OP_SETATTRS;
+    setattr.cid = cid;
+    setattr.fid = ROOT;
+    setattr.attr_mask = RFS_ATTR_MODE;
+    setattr.attr.mode = S_IFREG | 0600;
+
+    write.op = OP_WRITE;
+    write.cid = cid;
+    write.fid = ROOT;
+    write.size = 4096;
+
+    segs[0].size = segs[1].size = 4096;
+    segs[1].offset = 8192;
+    writev.op = OP_WRITEV;
+    writev.cid = cid;
+    writev.fid = ROOT;
+    writev.n_segs = 2;
+    writev.segs = segs;
+
+    printf("%ld requests per op\n", n);
+    for (tls = 0; tls <= 1; tls++) {
+        encode_t encode = tls ? serialize_request_tls : serialize_request;
+
+        bench("lookup", encode, &lookup, tls, n);
+        bench("getattr", encode, &getattr, tls, n);
+        bench("create", encode, &creat, tls, n);
+        bench("setattr", encode, &setattr, tls, n);
+    }
+    bench("write", encode_write, &write, 1, n);
+    bench("writev", encode_writev, &writev, 1, n);
+    bench("shm write", encode_shm, &write, 1, n);
+    bench_response(n);
+    return 0;
+}
@@ -0,0 +1,451 @@
+/*
+Codec throughput benchmark. Encodes the request of every op with
+serialize_request_tls() and decodes the response of every op with its
+deserialize_rsp_*(), and prints the time each takes per message and the
+MB/s of payload that makes. The requests and responses of the ops in
+ravana_ops.h are filled in from the schema, so an op added there is
+benchmarked too. Responses carry their FileAttrs field by field as
+version 2 dispatchers send them, and again in the fixed layout of
+version 3 (marked v3). The dispatcher is not needed, nothing is sent.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <msgpack.h>
+#include "ravana.h"
+
+#define N_ENTRIES   64      // readdir entries in a response
+#define N_SEGS      8       // readv and writev segments
+#define N_COMPOUND  4       // ops of a compound
+#define N_BATCH     4       // ops of a batch
+#define DATA_SIZE   4096    // read and write data
+
+void usage(char *argv[])
+{
+    printf("%s [messages per op (default 1000000)]\n", argv[0]);
+    exit(-1);
+}
+
+static double cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, const char *name, long n, size_t size, double secs)
+{
+    printf("%-6s %-16s %6zu B %8.1f ns %8.1f MB/s\n", what, name, size,
+            secs / n * 1e9, n * (double)size / secs / 1e6);
+}
+
+/* Sample values the requests and responses are filled with */
+static const fid_t sample_fid = ((fid_t)0x0123456789abcdefULL << 64) | 0xfedcba9876543210ULL;
+static file_name_t sample_name;
+static FileAttr sample_attr;
+static char sample_data[N_SEGS * DATA_SIZE];
+
+static void sample_init(void)
+{
+    strcpy(sample_name.name, "benchmark_file.dat");
+    sample_name.name_len = strlen(sample_name.name);
+    sample_attr.mode = S_IFREG | 0644;
+    sample_attr.uid = 1000;
+    sample_attr.gid = 1000;
+    sample_attr.links = 1;
+    sample_attr.size = 1 << 20;
+    sample_attr.dev = sample_fid;
+    sample_attr.ino = sample_fid;
+    sample_attr.atime.tv_sec = sample_attr.ctime.tv_sec = sample_attr.mtime.tv_sec = 1700000000;
+    sample_attr.atime.tv_nsec = sample_attr.ctime.tv_nsec = sample_attr.mtime.tv_nsec = 123456789;
+    memset(sample_data, 0xa5, sizeof(sample_data));
+}
+
+/*
+ * Requests of the ops in RFS_FLAT_ARGS: sample_<name>(op) fills the
+ * arguments of <name> for the op code *op*.
+ */
+#define SAMPLE_FID(v)       (v) = sample_fid
+#define SAMPLE_U32(v)       (v) = 4096
+#define SAMPLE_U64(v)       (v) = 1 << 20
+#define SAMPLE_I32(v)       (v) = 4096
+#define SAMPLE_I64(v)       (v) = DATA_SIZE
+#define SAMPLE_NAME(v)      (v) = sample_name
+#define SAMPLE_ATTR(v)      (v) = sample_attr
+#define SAMPLE_FIELD(type, name)    SAMPLE_##type(arg->name);
+
+#define SAMPLE_ARG(name, NAME)                                              \
+    static rfs_arg_##name##_t sample_arg_##name;                            \
+    static void *sample_##name(rfs_file_op_t op)                            \
+    {                                                                       \
+        rfs_arg_##name##_t *arg = &sample_arg_##name;                       \
+                                                                            \
+        arg->op = op;                                                       \
+        arg->cid = sample_fid;                                              \
+        RFS_ARG_##NAME(SAMPLE_FIELD)                                        \
+        return arg;                                                         \
+    }
+
+RFS_FLAT_ARGS(SAMPLE_ARG)
+
+static void bench_request(const char *name, void *arg, long n)
+{
+    rfs_request_t *req;
+    double start;
+    size_t size;
+    long i;
+
+    if ((req = serialize_request_tls(arg)) == NULL) {
+        printf("%s: encoding failed\n", name);
+        exit(-1);
+    }
+    size = req->header.size;
+    start = cpu_now();
+    for (i = 0; i < n; i++)
+        serialize_request_tls(arg);
+    report("encode", name, n, size, cpu_now() - start);
+}
+
+/*
+ * Responses, packed as the dispatcher does. pack_attr() packs FileAttrs
+ * in the fixed layout of version 3 if packed_attrs is set.
+ */
+static int packed_attrs;
+
+static void pack_fid(msgpack_packer *pk, fid_t fid)
+{
+    if (packed_attrs) {
+        uint64_t id[2] = { (uint64_t)fid, (uint64_t)(fid >> 64) };
+
+        msgpack_pack_bin(pk, sizeof(id));
+        msgpack_pack_bin_body(pk, id, sizeof(id));
+        return;
+    }
+    msgpack_pack_uint64(pk, (uint64_t)fid);
+    msgpack_pack_uint64(pk, (uint64_t)(fid >> 64));
+}
+
+static void pack_attr(msgpack_packer *pk, const FileAttr *a)
+{
+    if (packed_attrs) {
+        unsigned char b[RFS_ATTR_PACKED_SIZE] = {0}, *p = b;
+        uint64_t id[2];
+
+#define PUT(v) do { memcpy(p, &(v), sizeof(v)); p += sizeof(v); } while (0)
+        PUT(a->mode); PUT(a->uid); PUT(a->gid); PUT(a->links); PUT(a->size);
+        id[0] = (uint64_t)a->dev; id[1] = (uint64_t)(a->dev >> 64); PUT(id);
+        id[0] = (uint64_t)a->ino; id[1] = (uint64_t)(a->ino >> 64); PUT(id);
+        PUT(a->rdev);
+        p += sizeof(uint32_t);  // pad
+        PUT(a->atime.tv_sec); PUT(a->atime.tv_nsec);
+        PUT(a->ctime.tv_sec); PUT(a->ctime.tv_nsec);
+        PUT(a->mtime.tv_sec); PUT(a->mtime.tv_nsec);
+#undef PUT
+        msgpack_pack_bin(pk, sizeof(b));
+        msgpack_pack_bin_body(pk, b, sizeof(b));
+        return;
+    }
+    msgpack_pack_uint32(pk, a->mode);
+    msgpack_pack_uint32(pk, a->uid);
+    msgpack_pack_uint32(pk, a->gid);
+    msgpack_pack_uint32(pk, a->links);
+    msgpack_pack_uint64(pk, a->size);
+    pack_fid(pk, a->dev);
+    pack_fid(pk, a->ino);
+    msgpack_pack_uint32(pk, a->rdev);
+    msgpack_pack_int64(pk, a->atime.tv_sec);
+    msgpack_pack_int64(pk, a->atime.tv_nsec);
+    msgpack_pack_int64(pk, a->ctime.tv_sec);
+    msgpack_pack_int64(pk, a->ctime.tv_nsec);
+    msgpack_pack_int64(pk, a->mtime.tv_sec);
+    msgpack_pack_int64(pk, a->mtime.tv_nsec);
+}
+
+static void pack_name(msgpack_packer *pk, const file_name_t *fname)
+{
+    msgpack_pack_bin(pk, fname->name_len);
+    msgpack_pack_bin_body(pk, fname->name, fname->name_len);
+}
+
+/*
+ * Responses of the ops in RFS_FLAT_RSPS: bench_rsp_<name>() packs the
+ * response of <name> and times its decoding.
+ */
+#define PACK_FID(v)         pack_fid(pk, (v))
+#define PACK_U32(v)         msgpack_pack_uint32(pk, (v))
+#define PACK_U64(v)         msgpack_pack_uint64(pk, (v))
+#define PACK_I32(v)         msgpack_pack_int32(pk, (v))
+#define PACK_I64(v)         msgpack_pack_int64(pk, (v))
+#define PACK_NAME(v)        pack_name(pk, &(v))
+#define PACK_ATTR(v)        pack_attr(pk, &(v))
+#define PACK_FIELD(type, name)      SAMPLE_##type(sample.name); PACK_##type(sample.name);
+
+#define BENCH_RSP(name, NAME)                                               \
+    static void bench_rsp_##name(msgpack_packer *pk, msgpack_sbuffer *sbuf, \
+            long n)                                                         \
+    {                                                                       \
+        rfs_rsp_##name##_t sample = {0}, rsp;                               \
+        double start;                                                       \
+        long i;                                                             \
+                                                                            \
+        msgpack_pack_int32(pk, 0);                                          \
+        RFS_RSP_##NAME(PACK_FIELD)                                          \
+        start = cpu_now();                                                  \
+        for (i = 0; i < n; i++)                                             \
+            deserialize_rsp_##name(sbuf->data, sbuf->size, &rsp);           \
+        report("decode", #name, n, sbuf->size, cpu_now() - start);          \
+        (void)sample;       /* unused by responses of an error alone */     \
+    }
+
+RFS_FLAT_RSPS(BENCH_RSP)
+
+/* The flat responses */
+static const struct {
+    void (*bench)(msgpack_packer *pk, msgpack_sbuffer *sbuf, long n);
+} flat_rsps[] = {
+#define FLAT_RSP(name, NAME)    { bench_rsp_##name },
+    RFS_FLAT_RSPS(FLAT_RSP)
+#undef FLAT_RSP
+};
+
+/* Packs the readdir entries, with attributes for readdirplus */
+static void pack_entries(msgpack_packer *pk, int plus)
+{
+    int i;
+
+    msgpack_pack_int32(pk, 0);
+    msgpack_pack_int32(pk, 1);
+    msgpack_pack_uint32(pk, N_ENTRIES);
+    for (i = 0; i < N_ENTRIES; i++) {
+        pack_name(pk, &sample_name);
+        pack_fid(pk, sample_fid + i);
+        msgpack_pack_uint64(pk, i + 1);
+        if (plus) {
+            pack_attr(pk, &sample_attr);
+            msgpack_pack_uint32(pk, 0);
+        }
+    }
+    msgpack_pack_uint64(pk, N_ENTRIES);
+}
+
+static void bench_responses(long n)
+{
+    static char arena[N_ENTRIES * 512] __attribute__((aligned(16)));
+    static rfs_compound_res_t compound_res[N_COMPOUND];
+    static rfs_batch_res_t batch_res[N_BATCH];
+    msgpack_sbuffer  sbuf;
+    msgpack_packer   pk;
+    rfs_rsp_read_t   read_rsp;
+    rfs_rsp_readdir_t readdir_rsp;
+    rfs_rsp_readv_t  readv_rsp;
+    rfs_rsp_compound_t compound_rsp;
+    rfs_rsp_batch_t  batch_rsp;
+    rfs_rsp_readlink_t *readlink_rsp;
+    rfs_rsp_rmdir_t  rmdir_rsp;
+    __int64_t        sizes[N_SEGS];
+    rfs_seg_t        segs[N_SEGS];
+    char             *buf;
+    double           start;
+    unsigned         j;
+    long             i;
+
+    buf = malloc(N_SEGS * DATA_SIZE);
+    readlink_rsp = malloc(sizeof(rfs_rsp_readlink_t) + PATH_MAX);
+    if (buf == NULL || readlink_rsp == NULL) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    for (j = 0; j < N_SEGS; j++) {
+        segs[j].offset = (uint64_t)j * DATA_SIZE;
+        segs[j].size = DATA_SIZE;
+        segs[j].buf = buf + j * DATA_SIZE;
+    }
+
+#define RESET() do { msgpack_sbuffer_clear(&sbuf); } while (0)
+#define TIME(name, decode) do {                                             \
+        start = cpu_now();                                                  \
+        for (i = 0; i < n; i++)                                             \
+            decode;                                                         \
+        report("decode", name, n, sbuf.size, cpu_now() - start);           \
+    } while (0)
+
+    for (packed_attrs = 0; packed_attrs < 2; packed_attrs++) {
+        msgpack_sbuffer_init(&sbuf);
+        msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+        if (packed_attrs)
+            printf("-- FileAttrs and ids in the fixed layout (v3)\n");
+
+        for (j = 0; j < sizeof(flat_rsps) / sizeof(flat_rsps[0]); j++) {
+            RESET();
+            flat_rsps[j].bench(&pk, &sbuf, n);
+        }
+
+        RESET();
+        msgpack_pack_int32(&pk, 0);
+        TIME("rmdir", deserialize_rsp_rmdir(sbuf.data, sbuf.size, &rmdir_rsp));
+
+        RESET();
+        msgpack_pack_int32(&pk, 0);
+        msgpack_pack_int64(&pk, DATA_SIZE);
+        msgpack_pack_bin(&pk, DATA_SIZE);
+        msgpack_pack_bin_body(&pk, sample_data, DATA_SIZE);
+        TIME("read", deserialize_rsp_read_into(sbuf.data, sbuf.size, &read_rsp, buf, DATA_SIZE));
+
+        RESET();
+        msgpack_pack_int32(&pk, 0);
+        msgpack_pack_int64(&pk, sample_name.name_len);
+        pack_name(&pk, &sample_name);
+        TIME("readlink", deserialize_rsp_readlink(sbuf.data, sbuf.size, readlink_rsp));
+
+        RESET();
+        msgpack_pack_int32(&pk, 0);
+        msgpack_pack_uint32(&pk, N_SEGS);
+        for (j = 0; j < N_SEGS; j++)
+            msgpack_pack_int64(&pk, DATA_SIZE);
+        msgpack_pack_bin(&pk, N_SEGS * DATA_SIZE);
+        msgpack_pack_bin_body(&pk, sample_data, N_SEGS * DATA_SIZE);
+        readv_rsp.sizes = sizes;
+        TIME("readv", (readv_rsp.n_segs = N_SEGS,
+                    deserialize_rsp_readv(sbuf.data, sbuf.size, &readv_rsp, segs)));
+
+        RESET();
+        pack_entries(&pk, 0);
+        TIME("readdir", deserialize_rsp_readdir_arena(sbuf.data, sbuf.size, &readdir_rsp,
+                    arena, sizeof(arena)));
+
+        RESET();
+        pack_entries(&pk, 1);
+        TIME("readdirplus", deserialize_rsp_readdirplus_arena(sbuf.data, sbuf.size,
+                    &readdir_rsp, arena, sizeof(arena)));
+
+        RESET();
+        msgpack_pack_int32(&pk, 0);
+        msgpack_pack_uint32(&pk, N_COMPOUND);
+        for (j = 0; j < N_COMPOUND; j++) {
+            msgpack_pack_int32(&pk, 0);
+            pack_attr(&pk, &sample_attr);
+        }
+        compound_rsp.res = compound_res;
+        TIME("compound", deserialize_rsp_compound(sbuf.data, sbuf.size, &compound_rsp,
+                    N_COMPOUND));
+
+        // A batch of getattrs, each reply a bin holding its response
+        {
+            msgpack_sbuffer one;
+            msgpack_packer  one_pk;
+
+            msgpack_sbuffer_init(&one);
+            msgpack_packer_init(&one_pk, &one, msgpack_sbuffer_write);
+            msgpack_pack_int32(&one_pk, 0);
+            pack_attr(&one_pk, &sample_attr);
+            RESET();
+            msgpack_pack_int32(&pk, 0);
+            msgpack_pack_uint32(&pk, N_BATCH);
+            for (j = 0; j < N_BATCH; j++) {
+                msgpack_pack_bin(&pk, one.size);
+                msgpack_pack_bin_body(&pk, one.data, one.size);
+            }
+            msgpack_sbuffer_destroy(&one);
+        }
+        batch_rsp.res = batch_res;
+        TIME("batch", deserialize_rsp_batch(sbuf.data, sbuf.size, &batch_rsp, N_BATCH));
+
+        msgpack_sbuffer_destroy(&sbuf);
+    }
+#undef TIME
+#undef RESET
+
+    free(readlink_rsp);
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    long             n = 1000000;
+    rfs_arg_write_t  *wr;
+    rfs_arg_readv_t  readv;
+    rfs_arg_compound_t compound;
+    rfs_compound_op_t ops[N_COMPOUND];
+    rfs_arg_batch_t  batch;
+    void             *batch_args[N_BATCH];
+    rfs_seg_t        segs[N_SEGS];
+    unsigned         i;
+
+    if(argc > 2)
+        usage(argv);
+    if(argc > 1 && (n = atol(argv[1])) <= 0)
+        usage(argv);
+
+    sample_init();
+
+    // The ops in ravana_ops.h, from the schema
+    bench_request("create", sample_create(OP_CREATE), n);
+    bench_request("mknod", sample_create(OP_MKNOD), n);
+    bench_request("lookup", sample_lookup(OP_LOOKUP), n);
+    bench_request("setattr", sample_setattr(OP_SETATTRS), n);
+    bench_request("getattr", sample_getattr(OP_GETATTRS), n);
+    bench_request("readdir", sample_readdir(OP_READDIR), n);
+    bench_request("readdirplus", sample_readdir(OP_READDIRPLUS), n);
+    bench_request("read", sample_read(OP_READ), n);
+    bench_request("mkdir", sample_mkdir(OP_MKDIR), n);
+    bench_request("symlink", sample_symlink(OP_SYMLINK), n);
+    bench_request("link", sample_link(OP_LINK), n);
+    bench_request("unlink", sample_unlink(OP_UNLINK), n);
+    bench_request("rmdir", sample_unlink(OP_RMDIR), n);
+    bench_request("rename", sample_rename(OP_RENAME), n);
+    bench_request("readlink", sample_readlink(OP_READLINK), n);
+    bench_request("shm_attach", sample_shm_attach(OP_SHM_ATTACH), n);
+
+    // The ops encoded by hand
+    if ((wr = malloc(sizeof(rfs_arg_write_t) + DATA_SIZE)) == NULL) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    wr->op = OP_WRITE;
+    wr->cid = sample_fid;
+    wr->fid = sample_fid;
+    wr->offset = 0;
+    wr->size = DATA_SIZE;
+    memcpy(wr->buffer, sample_data, DATA_SIZE);
+    bench_request("write", wr, n);
+
+    for (i = 0; i < N_SEGS; i++) {
+        segs[i].offset = (uint64_t)i * DATA_SIZE;
+        segs[i].size = DATA_SIZE;
+        segs[i].buf = sample_data + i * DATA_SIZE;
+    }
+    readv.op = OP_READV;
+    readv.cid = sample_fid;
+    readv.fid = sample_fid;
+    readv.n_segs = N_SEGS;
+    readv.segs = segs;
+    bench_request("readv", &readv, n);
+    readv.op = OP_WRITEV;
+    bench_request("writev", &readv, n);
+
+    for (i = 0; i < N_COMPOUND; i++) {
+        ops[i].op = i + 1 < N_COMPOUND ? OP_LOOKUP : OP_GETATTRS;
+        ops[i].fname = sample_name;
+    }
+    compound.op = OP_COMPOUND;
+    compound.cid = sample_fid;
+    compound.fid = sample_fid;
+    compound.n_ops = N_COMPOUND;
+    compound.ops = ops;
+    bench_request("compound", &compound, n);
+
+    for (i = 0; i < N_BATCH; i++)
+        batch_args[i] = sample_getattr(OP_GETATTRS);
+    batch.op = OP_BATCH;
+    batch.cid = sample_fid;
+    batch.n_ops = N_BATCH;
+    batch.args = batch_args;
+    bench_request("batch", &batch, n);
+    free(wr);
+
+    bench_responses(n);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+Read response decoding benchmark. Decodes read responses of a range of
+sizes the way rfs_read() used to, into a response allocated for the read
+and then into the caller's buffer, and with deserialize_rsp_read_into(),
+which copies the data once straight into the caller's buffer. Prints
+the GB/s each decodes per core, from the thread's CPU time. The
+dispatcher is not needed, nothing is sent.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <msgpack.h>
+#include "ravana.h"
+
+void usage(char *argv[])
+{
+    printf("%s [data decoded per size in MB (default 1024)]\n", argv[0]);
+    exit(-1);
+}
+
+static double cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Decode the read response *packed* of *packed_size* bytes, holding
+ * *size* bytes of data, until *total* bytes are decoded into *buf*. The
+ * old path if *direct* is not set. Prints GB/s per core.
+ */
+static void bench(const char *packed, int packed_size, __int64_t size,
+        char *buf, __int64_t total, int direct)
+{
+    rfs_rsp_read_t read_rsp = {0};
+    rfs_rsp_read_t *rsp;
+    __int64_t done;
+    double start, secs;
+
+    start = cpu_now();
+    for (done = 0; done < total; done += size) {
+        if (direct) {
+            deserialize_rsp_read_into(packed, packed_size, &read_rsp, buf, size);
+        } else {
+            if ((rsp = malloc(sizeof(rfs_rsp_read_t) + (size_t)size)) == NULL) {
+                perror("malloc failed");
+                exit(-1);
+            }
+            deserialize_rsp_read(packed, packed_size, rsp);
+            memcpy(buf, rsp->buffer, (size_t)rsp->size);
+            read_rsp.size = rsp->size;
+            free(rsp);
+        }
+        if (read_rsp.size != size) {
+            printf("decoded %ld bytes of %ld\n", read_rsp.size, size);
+            exit(-1);
+        }
+    }
+    secs = cpu_now() - start;
+    printf("%8ld B %-7s %8.2f GB/s per core\n", size,
+            direct ? "direct" : "copied", total / secs / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    static const __int64_t sizes[] = {512, 4096, 16 << 10, 64 << 10, 1 << 20};
+    __int64_t        total = 1024LL << 20;
+    msgpack_sbuffer  sbuf;
+    msgpack_packer   pk;
+    char             *data, *buf;
+    unsigned         i;
+
+    if(argc > 2)
+        usage(argv);
+    if(argc > 1 && (total = atol(argv[1]) << 20) <= 0)
+        usage(argv);
+
+    data = malloc(sizes[4]);
+    buf = malloc(sizes[4]);
+    if(data == NULL || buf == NULL) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    memset(data, 0xa5, sizes[4]);
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        // A successful read response, as the dispatcher sends it
+        msgpack_sbuffer_init(&sbuf);
+        msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+        msgpack_pack_int32(&pk, 0);
+        msgpack_pack_int64(&pk, sizes[i]);
+        msgpack_pack_bin(&pk, sizes[i]);
+        msgpack_pack_bin_body(&pk, data, sizes[i]);
+
+        bench(sbuf.data, sbuf.size, sizes[i], buf, total, 0);
+        bench(sbuf.data, sbuf.size, sizes[i], buf, total, 1);
+        msgpack_sbuffer_destroy(&sbuf);
+    }
+
+    free(buf);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+Read/write throughput benchmark. Writes and then reads back a file in
+sequential chunks, first with the data going over the socket and then
+through a ring shared with the dispatcher (rfs_channel_shm()), and prints
+the throughput of each.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ravana.h"
+#include "ravana_interfaces.h"
+
+#define RING_SLOTS  (16)
+
+void usage(char *argv[])
+{
+    printf("%s <filename> [io size in KB (default 1024)] [file size in MB (default 256)]\n", argv[0]);
+    exit(-1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Write *total* bytes to *fid* in *io_size* chunks, then read them back.
+ * Prints the throughput of both passes.
+ */
+static void bench(const char *name, cid_t cid, fid_t fid, char *buf,
+        __int64_t io_size, __int64_t total)
+{
+    __int64_t off, out_size;
+    double start, secs;
+    int32_t error;
+
+    start = now();
+    for (off = 0; off < total; off += io_size) {
+        error = rfs_write(cid, fid, off, io_size, buf, &out_size);
+        if (error || out_size != io_size) {
+            printf("%s: write at %ld failed, error:%d\n", name, off, error);
+            exit(-1);
+        }
+    }
+    secs = now() - start;
+    printf("%-6s write %8.1f MB/s\n", name, total / secs / (1 << 20));
+
+    start = now();
+    for (off = 0; off < total; off += io_size) {
+        error = rfs_read(cid, fid, off, io_size, &out_size, buf);
+        if (error || out_size != io_size) {
+            printf("%s: read at %ld failed, error:%d\n", name, off, error);
+            exit(-1);
+        }
+    }
+    secs = now() - start;
+    printf("%-6s read  %8.1f MB/s\n", name, total / secs / (1 << 20));
+}
+
+int main(int argc, char *argv[]) {
+    int32_t       error = 0;
+    file_name_t   fname;
+    uint64_t      lo = 0x50e7c1cb21e3ea0b;
+    uint64_t      hi = 0x9bdc739f3962c66;
+    cid_t         cid = UINT128(lo, hi);
+    FileAttr      attr = {0};
+    FileAttr      attr_out = {0};
+    __int64_t     io_size = 1024 << 10;
+    __int64_t     total = 256 << 20;
+    rfs_channel_t *ch;
+    char          *buf;
+
+    /* validate arguments */
+    if(argc < 2 || argc > 4)
+        usage(argv);
+    if(argc > 2)
+        io_size = atol(argv[2]) << 10;
+    if(argc > 3)
+        total = atol(argv[3]) << 20;
+    if(io_size <= 0 || total < io_size)
+        usage(argv);
+    total -= total % io_size;
+
+    if((buf = malloc(io_size)) == NULL) {
+        perror("malloc failed");
+        exit(-1);
+    }
+    memset(buf, 0xa5, io_size);
+
+    if((ch = rfs_channel_open(cid)) == NULL) {
+        printf("Failed to connect to the dispatcher\n");
+        exit(-1);
+    }
+
+    sprintf(fname.name, "%s", argv[1]);
+    fname.name_len = strlen(fname.name);
+    attr.mode = S_IFREG | 0644;
+    error = rfs_create(cid, ROOT, RFS_ATTR_MODE, fname, attr, &attr_out);
+    if(error && error != EEXIST) {
+        printf("Failed to create %s, error:%d\n", fname.name, error);
+        exit(error);
+    }
+    if(error == EEXIST &&
+       (error = rfs_lookup(cid, ROOT, fname, &attr_out)) != 0) {
+        printf("Failed to lookup %s, error:%d\n", fname.name, error);
+        exit(error);
+    }
+
+    printf("io size %ld KB, file size %ld MB\n", io_size >> 10, total >> 20);
+    bench("socket", cid, attr_out.ino, buf, io_size, total);
+
+    error = rfs_channel_shm(ch, RING_SLOTS, io_size);
+    if(error) {
+        printf("Shared ring not available, error:%d\n", error);
+        exit(-1);
+    }
+    bench("ring", cid, attr_out.ino, buf, io_size, total);
+
+    rfs_unlink(cid, ROOT, fname);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,681 @@
+/*
+ * Block cache of a channel.
+ *
+ * rfs_read() on a channel with a block cache reads whole blocks of
+ * RFS_BLOCK_SIZE bytes, as the dispatcher keeps them, and keeps them by
+ * (fid, block number) in a pool allocated when the cache is turned on,
+ * evicting the least recently used. Small reads of a file then cost a
+ * round trip per block read instead of one per read.
+ *
+ * A read that goes on from where the previous read of the file ended is
+ * taken for a stream, as is a first read at offset 0. The blocks past a
+ * stream are read ahead: a read of a window of blocks is sent and left
+ * outstanding on the channel, and once the stream is halfway into what
+ * was read ahead, the next window is sent, twice as large as the last up
+ * to max_window. Reads ahead are reaped by whichever read needs their
+ * blocks, or by any read once their response is in.
+ *
+ * Blocks carry the mtime and size of their file when they were read; a
+ * block of a file whose mtime or size is different now is stale and
+ * dropped. The file's attributes come from rfs_getattr(), which answers
+ * from the attribute cache if the channel has one. That catches writes
+ * that grow or truncate the file, but not writes in place: the
+ * dispatcher sets mtime only when a write extends the file, and to a
+ * coarse clock at that. So blocks are also good only for a while after
+ * they were read, for the ttl of the attribute cache, as the attributes
+ * they are checked against are, or RFS_BLOCK_TTL without one. The
+ * channel's own writes and setattrs drop the blocks of the file at once;
+ * changes by others are seen within the ttl, sooner if they change the
+ * file's size.
+ */
+
+#include "ravana_channel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/* Blocks a block cache may have at most, 4GB of them */
+#define RFS_BLOCK_CACHE_MAX (1U << 20)
+/* Blocks read ahead of a new stream */
+#define RFS_READAHEAD_MIN   (4)
+/* ms blocks are good for on a channel without an attribute cache */
+#define RFS_BLOCK_TTL       (3000)
+
+static inline uint32_t block_hash(fid_t fid, uint64_t bno)
+{
+    __uint64_t h = ((__uint64_t)fid ^ (__uint64_t)(fid >> 64)) * 0x9e3779b97f4a7c15ULL;
+
+    h = (h ^ bno) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+/*
+ * Whether data of a file of *mtime* and *size*, good until *expires*,
+ * is still good at *now* for the file of *attr*
+ */
+static inline int block_fresh(const struct timespec *mtime, uint64_t size,
+        __int64_t expires, const FileAttr *attr, __int64_t now)
+{
+    return expires > now && mtime->tv_sec == attr->mtime.tv_sec &&
+           mtime->tv_nsec == attr->mtime.tv_nsec && size == attr->size;
+}
+
+/* ms the blocks read on *ch* are good for */
+static int block_ttl(rfs_channel_t *ch)
+{
+    rfs_attr_cache_t *c = ch->attrs;
+    int ttl = 0;
+
+    if (c != NULL) {
+        pthread_mutex_lock(&c->lock);
+        ttl = c->ttl;
+        pthread_mutex_unlock(&c->lock);
+    }
+    return ttl > 0 ? ttl : RFS_BLOCK_TTL;
+}
+
+/* Move *b* to the head of the LRU list, it has just been used */
+static void block_touch(rfs_block_cache_t *bc, rfs_block_t *b)
+{
+    if (bc->lru == b)
+        return;
+    // Blocks on the list other than its head have a prev, new ones not
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+        if (b->next != NULL)
+            b->next->prev = b->prev;
+        else
+            bc->lru_tail = b->prev;
+    }
+    b->prev = NULL;
+    b->next = bc->lru;
+    if (bc->lru != NULL)
+        bc->lru->prev = b;
+    bc->lru = b;
+    if (bc->lru_tail == NULL)
+        bc->lru_tail = b;
+}
+
+/* Take *b* out of its hash chain and the LRU list onto the free list */
+static void block_remove(rfs_block_cache_t *bc, rfs_block_t *b)
+{
+    rfs_block_t **pp = &bc->chains[b->hash & bc->mask];
+
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+
+    if (b->prev != NULL)
+        b->prev->next = b->next;
+    else
+        bc->lru = b->next;
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+    else
+        bc->lru_tail = b->prev;
+
+    b->hnext = NULL;
+    b->prev = NULL;
+    b->next = bc->free;
+    bc->free = b;
+}
+
+/* Block *bno* of *fid*, NULL if it is not cached */
+static rfs_block_t *block_find(rfs_block_cache_t *bc, fid_t fid, uint64_t bno)
+{
+    uint32_t hash = block_hash(fid, bno);
+    rfs_block_t *b;
+
+    for (b = bc->chains[hash & bc->mask]; b != NULL; b = b->hnext) {
+        if (b->hash == hash && b->fid == fid && b->bno == bno)
+            return b;
+    }
+    return NULL;
+}
+
+/*
+ * Cache the *len* bytes at *data* as block *bno* of *fid*, read when
+ * the file had *mtime* and *size*, good until *expires*.
+ */
+static void block_put(rfs_block_cache_t *bc, fid_t fid, uint64_t bno,
+        const char *data, uint32_t len, const struct timespec *mtime,
+        uint64_t size, __int64_t expires)
+{
+    rfs_block_t *b;
+
+    if ((b = block_find(bc, fid, bno)) == NULL) {
+        if (bc->free == NULL)
+            block_remove(bc, bc->lru_tail);
+        b = bc->free;
+        bc->free = b->next;
+        b->next = NULL;
+        b->fid = fid;
+        b->bno = bno;
+        b->hash = block_hash(fid, bno);
+        b->hnext = bc->chains[b->hash & bc->mask];
+        bc->chains[b->hash & bc->mask] = b;
+    }
+    memcpy(b->data, data, len);
+    b->len = len;
+    b->mtime = *mtime;
+    b->size = size;
+    b->expires = expires;
+    block_touch(bc, b);
+}
+
+/*
+ * Cache the *len* bytes read into *buf* from block *bno* of *fid* on,
+ * as many blocks as they fill, at most *n_blocks*.
+ */
+static void block_put_all(rfs_block_cache_t *bc, fid_t fid, uint64_t bno,
+        uint32_t n_blocks, const char *buf, __int64_t len,
+        const struct timespec *mtime, uint64_t size, __int64_t expires)
+{
+    uint32_t i;
+    __int64_t off;
+
+    for (i = 0, off = 0; i < n_blocks && off < len; i++, off += RFS_BLOCK_SIZE)
+        block_put(bc, fid, bno + i, buf + off,
+                  len - off < RFS_BLOCK_SIZE ? (uint32_t)(len - off) : RFS_BLOCK_SIZE,
+                  mtime, size, expires);
+}
+
+/* Empty the cache, all blocks back on the free list */
+static void block_flush(rfs_block_cache_t *bc)
+{
+    uint32_t i;
+
+    memset(bc->chains, 0, ((size_t)bc->mask + 1) * sizeof(rfs_block_t *));
+    for (i = 0; i < bc->n_blocks; i++) {
+        memset(&bc->blocks[i], 0, sizeof(rfs_block_t));
+        bc->blocks[i].data = bc->data + (size_t)i * RFS_BLOCK_SIZE;
+        bc->blocks[i].next = i + 1 < bc->n_blocks ? &bc->blocks[i + 1] : NULL;
+    }
+    bc->free = bc->blocks;
+    bc->lru = NULL;
+    bc->lru_tail = NULL;
+    memset(bc->streams, 0, sizeof(bc->streams));
+    for (i = 0; i < RFS_READAHEADS; i++)
+        bc->ra[i].stale = 1;
+}
+
+/*
+ * Keep up to *n_blocks* blocks of the files read on *ch*, reading up to
+ * *max_readahead* blocks ahead of streams. Returns -EBUSY if the cache
+ * is already on with another size.
+ */
+int rfs_channel_block_cache(rfs_channel_t *ch, uint32_t n_blocks,
+        uint32_t max_readahead)
+{
+    rfs_block_cache_t *bc;
+    uint32_t n = 1;
+
+    if (ch == NULL || n_blocks == 0 || n_blocks > RFS_BLOCK_CACHE_MAX)
+        return -EINVAL;
+    // Windows bigger than that would evict each other
+    if (max_readahead > n_blocks / 4)
+        max_readahead = n_blocks / 4;
+
+    if ((bc = ch->blocks) != NULL) {
+        // Resizing would pull the pool from under its users
+        if (bc->n_blocks != n_blocks)
+            return -EBUSY;
+        pthread_mutex_lock(&bc->lock);
+        bc->max_window = max_readahead;
+        block_flush(bc);
+        pthread_mutex_unlock(&bc->lock);
+        return 0;
+    }
+
+    while (n < n_blocks)
+        n <<= 1;
+    if ((bc = calloc(1, sizeof(rfs_block_cache_t))) == NULL)
+        return -ENOMEM;
+    bc->blocks = calloc(n_blocks, sizeof(rfs_block_t));
+    bc->data = malloc((size_t)n_blocks * RFS_BLOCK_SIZE);
+    bc->chains = calloc(n, sizeof(rfs_block_t *));
+    if (bc->blocks == NULL || bc->data == NULL || bc->chains == NULL) {
+        free(bc->blocks);
+        free(bc->data);
+        free(bc->chains);
+        free(bc);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->cond, NULL);
+    bc->n_blocks = n_blocks;
+    bc->mask = n - 1;
+    bc->max_window = max_readahead;
+    block_flush(bc);
+    ch->blocks = bc;
+
+    return 0;
+}
+
+/*
+ * Free the block cache of *ch*. The channel has been reset, so the reads
+ * ahead still outstanding are done and off the connection.
+ */
+void block_cache_free(rfs_channel_t *ch)
+{
+    rfs_block_cache_t *bc;
+    int i;
+
+    if ((bc = ch->blocks) == NULL)
+        return;
+    for (i = 0; i < RFS_READAHEADS; i++) {
+        if (bc->ra[i].p != NULL) {
+            free(bc->ra[i].p->rsp);
+            free(bc->ra[i].p->buf);
+            free(bc->ra[i].p);
+        }
+    }
+    pthread_cond_destroy(&bc->cond);
+    pthread_mutex_destroy(&bc->lock);
+    free(bc->chains);
+    free(bc->data);
+    free(bc->blocks);
+    free(bc);
+    ch->blocks = NULL;
+}
+
+/*
+ * Drop the blocks of *fid* the *size* bytes at *offset* are in, all of
+ * them for a *size* of -1, and the reads ahead of the file outstanding.
+ */
+void block_cache_drop(cid_t cid, fid_t fid, uint64_t offset, __int64_t size)
+{
+    rfs_channel_t *ch;
+    rfs_block_cache_t *bc;
+    rfs_block_t *b, *next;
+    uint64_t bno;
+    int i;
+
+    if ((ch = rfs_channel_open(cid)) == NULL || (bc = ch->blocks) == NULL)
+        return;
+    pthread_mutex_lock(&bc->lock);
+    if (size < 0) {
+        for (b = bc->lru; b != NULL; b = next) {
+            next = b->next;
+            if (b->fid == fid)
+                block_remove(bc, b);
+        }
+    } else if (size > 0) {
+        for (bno = offset / RFS_BLOCK_SIZE;
+             bno <= (offset + size - 1) / RFS_BLOCK_SIZE; bno++) {
+            if ((b = block_find(bc, fid, bno)) != NULL)
+                block_remove(bc, b);
+        }
+    }
+    for (i = 0; i < RFS_READAHEADS; i++) {
+        if (bc->ra[i].state != RFS_RA_FREE && bc->ra[i].fid == fid)
+            bc->ra[i].stale = 1;
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/*
+ * Read *n_blocks* blocks of *fid* from *bno* into *buf*, as rfs_read()
+ * does, the size read into *len*.
+ */
+static int block_read(cid_t cid, fid_t fid, uint64_t bno, uint32_t n_blocks,
+        char *buf, __int64_t *len)
+{
+    rfs_pending_t p = {0};
+    rfs_arg_read_t read;
+    rfs_request_t *req;
+    rfs_response_t *rsp = NULL;
+    rfs_rsp_read_t read_rsp = {0};
+    int error;
+
+    read.op  = OP_READ;
+    read.cid = cid;
+    read.fid = fid;
+    read.offset = bno * RFS_BLOCK_SIZE;
+    read.size   = (__int64_t)n_blocks * RFS_BLOCK_SIZE;
+    if ((req = serialize_request_tls((void *)&read)) == NULL)
+        return -ENOMEM;
+
+    p.buf = buf;
+    p.len = read.size;
+    p.stream = 1;
+    if ((error = socket_call(cid, req, NULL, 0, &p, &rsp)) != 0)
+        return error;
+    if (p.streamed >= 0) {
+        *len = p.streamed;
+        free(rsp);
+        return 0;
+    }
+    deserialize_rsp_read_into(rsp->payload, rsp->size, &read_rsp, buf, read.size);
+    *len = read_rsp.size;
+    free(rsp);
+
+    return read_rsp.error;
+}
+
+/*
+ * Send a read ahead of *n_blocks* blocks of *fid* from *bno* in *ra*,
+ * marked RFS_RA_BUSY by the caller, for the file of *attr*. Called with
+ * bc->lock held, which is dropped while sending. The read is
+ * RFS_RA_SENT after, or freed if it could not be sent.
+ */
+static void ra_send(rfs_channel_t *ch, rfs_block_cache_t *bc,
+        rfs_readahead_t *ra, fid_t fid, uint64_t bno, uint32_t n_blocks,
+        const FileAttr *attr)
+{
+    rfs_arg_read_t read;
+    rfs_request_t *req;
+    rfs_pending_t *p;
+    int error = -ENOMEM;
+
+    ra->fid = fid;
+    ra->bno = bno;
+    ra->n_blocks = n_blocks;
+    ra->mtime = attr->mtime;
+    ra->size = attr->size;
+    ra->expires = now_ms() + block_ttl(ch);
+    ra->stale = 0;
+    pthread_mutex_unlock(&bc->lock);
+
+    read.op  = OP_READ;
+    read.cid = ch->cid;
+    read.fid = fid;
+    read.offset = bno * RFS_BLOCK_SIZE;
+    read.size   = (__int64_t)n_blocks * RFS_BLOCK_SIZE;
+    if ((p = calloc(1, sizeof(rfs_pending_t))) != NULL &&
+        (p->buf = malloc(read.size)) != NULL &&
+        (req = serialize_request_tls((void *)&read)) != NULL) {
+        p->len = read.size;
+        p->stream = 1;
+        if ((error = channel_submit(ch, req, p)) == -EPIPE)
+            error = channel_submit(ch, req, p);
+    }
+
+    pthread_mutex_lock(&bc->lock);
+    if (error) {
+        if (p != NULL)
+            free(p->buf);
+        free(p);
+        ra->state = RFS_RA_FREE;
+    } else {
+        ra->p = p;
+        ra->state = RFS_RA_SENT;
+        bc->read_ahead += n_blocks;
+    }
+    pthread_cond_broadcast(&bc->cond);
+}
+
+/*
+ * Wait for the read ahead in *ra*, marked RFS_RA_BUSY by the caller, and
+ * cache its blocks unless the file changed meanwhile. Called with
+ * bc->lock held, which is dropped while waiting.
+ */
+static void ra_reap(rfs_channel_t *ch, rfs_block_cache_t *bc,
+        rfs_readahead_t *ra)
+{
+    rfs_pending_t *p = ra->p;
+    rfs_response_t *rsp = NULL;
+    rfs_rsp_read_t read_rsp = {0};
+    __int64_t len = -1;
+
+    pthread_mutex_unlock(&bc->lock);
+    // The deadline ran from the send, the stream may get here much later
+    pthread_mutex_lock(&ch->lock);
+    if (!p->done)
+        p->deadline = channel_deadline(ch);
+    pthread_mutex_unlock(&ch->lock);
+    if (channel_complete(ch, p, &rsp) == 0) {
+        if (p->streamed >= 0) {
+            len = p->streamed;
+        } else {
+            deserialize_rsp_read_into(rsp->payload, rsp->size, &read_rsp,
+                    p->buf, p->len);
+            if (read_rsp.error == 0)
+                len = read_rsp.size;
+        }
+    }
+    free(rsp);
+
+    pthread_mutex_lock(&bc->lock);
+    if (len > 0 && !ra->stale)
+        block_put_all(bc, ra->fid, ra->bno, ra->n_blocks, p->buf, len,
+                &ra->mtime, ra->size, ra->expires);
+    free(p->buf);
+    free(p);
+    ra->p = NULL;
+    ra->state = RFS_RA_FREE;
+    pthread_cond_broadcast(&bc->cond);
+}
+
+/* Reap the reads ahead whose responses are in. Called with bc->lock held. */
+static void ra_reap_done(rfs_channel_t *ch, rfs_block_cache_t *bc)
+{
+    rfs_readahead_t *ra;
+    int i, done;
+
+    for (i = 0; i < RFS_READAHEADS; i++) {
+        ra = &bc->ra[i];
+        if (ra->state != RFS_RA_SENT)
+            continue;
+        pthread_mutex_lock(&ch->lock);
+        done = ra->p->done;
+        pthread_mutex_unlock(&ch->lock);
+        if (done) {
+            ra->state = RFS_RA_BUSY;
+            ra_reap(ch, bc, ra);
+        }
+    }
+}
+
+/* The read ahead outstanding that has block *bno* of *fid*, NULL if none */
+static rfs_readahead_t *ra_find(rfs_block_cache_t *bc, fid_t fid, uint64_t bno,
+        const FileAttr *attr, __int64_t now)
+{
+    rfs_readahead_t *ra;
+    int i;
+
+    for (i = 0; i < RFS_READAHEADS; i++) {
+        ra = &bc->ra[i];
+        if (ra->state != RFS_RA_FREE && !ra->stale && ra->fid == fid &&
+            bno >= ra->bno && bno < ra->bno + ra->n_blocks &&
+            block_fresh(&ra->mtime, ra->size, ra->expires, attr, now))
+            return ra;
+    }
+    return NULL;
+}
+
+/*
+ * The stream of *fid* for a read at *offset*, taking the slot of the
+ * least recently used stream for a file not read before. *seq* is set
+ * if the read goes on from where the last one ended.
+ */
+static rfs_stream_t *stream_get(rfs_block_cache_t *bc, fid_t fid,
+        uint64_t offset, int *seq)
+{
+    rfs_stream_t *s, *lru = &bc->streams[0];
+    int i;
+
+    bc->tick++;
+    for (i = 0; i < RFS_STREAMS; i++) {
+        s = &bc->streams[i];
+        if (s->used && s->fid == fid)
+            break;
+        if (s->used < lru->used)
+            lru = s;
+    }
+    if (i == RFS_STREAMS) {
+        s = lru;
+        memset(s, 0, sizeof(rfs_stream_t));
+        s->fid = fid;
+        *seq = offset == 0;
+    } else if (!(*seq = s->next == offset)) {
+        // Seeked, start over
+        s->window = 0;
+        s->ra_next = 0;
+    }
+    s->used = bc->tick;
+    return s;
+}
+
+/*
+ * Read ahead of the stream *s* of the file of *attr*, whose next block
+ * not read yet is *bno*, at *now*. Called with bc->lock held, which may
+ * be dropped.
+ */
+static void stream_read_ahead(rfs_channel_t *ch, rfs_block_cache_t *bc,
+        rfs_stream_t *s, uint64_t bno, const FileAttr *attr, __int64_t now)
+{
+    uint64_t eof = (attr->size + RFS_BLOCK_SIZE - 1) / RFS_BLOCK_SIZE;
+    rfs_readahead_t *ra = NULL;
+    rfs_block_t *b;
+    uint32_t n;
+    int i;
+
+    if (bc->max_window == 0)
+        return;
+    if (s->window == 0)
+        s->window = RFS_READAHEAD_MIN < bc->max_window ?
+                    RFS_READAHEAD_MIN : bc->max_window;
+    if (s->ra_next < bno)
+        s->ra_next = bno;
+    // The next window goes once the stream is halfway into the last
+    if (s->ra_next >= eof || s->ra_next - bno > s->window / 2)
+        return;
+
+    n = eof - s->ra_next < s->window ? (uint32_t)(eof - s->ra_next) : s->window;
+    bno = s->ra_next;
+    s->ra_next += n;
+    if ((s->window *= 2) > bc->max_window)
+        s->window = bc->max_window;
+
+    // Blocks read before, a stream over a file read again
+    if ((b = block_find(bc, s->fid, bno)) != NULL &&
+        block_fresh(&b->mtime, b->size, b->expires, attr, now))
+        return;
+    for (i = 0; i < RFS_READAHEADS && ra == NULL; i++) {
+        if (bc->ra[i].state == RFS_RA_FREE)
+            ra = &bc->ra[i];
+    }
+    if (ra == NULL)
+        return;
+    ra->state = RFS_RA_BUSY;
+    ra_send(ch, bc, ra, s->fid, bno, n, attr);
+}
+
+/*
+ * Read *size* bytes of *fid* at *offset* into *buffer* through the block
+ * cache of the channel of *cid*, the size read into *out_size*. Returns
+ * -EOPNOTSUPP if the channel has no block cache, or the read is too big
+ * to go through it, for the caller to read from the dispatcher.
+ */
+int block_cache_read(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        __int64_t *out_size, char *buffer)
+{
+    rfs_channel_t *ch;
+    rfs_block_cache_t *bc;
+    rfs_readahead_t *ra;
+    rfs_stream_t *s;
+    rfs_block_t *b;
+    FileAttr attr;
+    uint64_t end, bno, last;
+    __int64_t got = 0, len, now, expires;
+    uint32_t n, off, max_miss;
+    char *buf;
+    int error = 0, seq;
+
+    if ((ch = rfs_channel_open(cid)) == NULL || (bc = ch->blocks) == NULL)
+        return -EOPNOTSUPP;
+    // Reads that would take a good part of the cache go around it
+    max_miss = bc->n_blocks / 4 ? bc->n_blocks / 4 : 1;
+    if (size <= 0 || (uint64_t)size > (uint64_t)max_miss * RFS_BLOCK_SIZE)
+        return -EOPNOTSUPP;
+    if ((error = rfs_getattr(cid, fid, &attr)) != 0)
+        return error;
+    if (!S_ISREG(attr.mode))
+        return -EOPNOTSUPP;
+
+    end = offset + size < attr.size ? offset + size : attr.size;
+    if (offset >= end) {
+        if (out_size)
+            *out_size = 0;
+        return 0;
+    }
+    last = (end - 1) / RFS_BLOCK_SIZE;
+
+    now = now_ms();
+    pthread_mutex_lock(&bc->lock);
+    ra_reap_done(ch, bc);
+    s = stream_get(bc, fid, offset, &seq);
+    bno = offset / RFS_BLOCK_SIZE;
+    while (bno <= last) {
+        if ((b = block_find(bc, fid, bno)) != NULL &&
+            !block_fresh(&b->mtime, b->size, b->expires, &attr, now)) {
+            block_remove(bc, b);
+            b = NULL;
+        }
+        if (b != NULL) {
+            bc->hits++;
+            block_touch(bc, b);
+            off = bno == offset / RFS_BLOCK_SIZE ? offset % RFS_BLOCK_SIZE : 0;
+            if (b->len <= off)
+                break;
+            len = b->len - off;
+            if (len > (__int64_t)(end - offset) - got)
+                len = (__int64_t)(end - offset) - got;
+            memcpy(buffer + got, b->data + off, len);
+            got += len;
+            // A short block is the last of the file
+            if (b->len < RFS_BLOCK_SIZE)
+                break;
+            bno++;
+            continue;
+        }
+
+        // A read ahead on its way with the block, wait for it
+        if ((ra = ra_find(bc, fid, bno, &attr, now)) != NULL) {
+            if (ra->state == RFS_RA_BUSY) {
+                pthread_cond_wait(&bc->cond, &bc->lock);
+            } else {
+                ra->state = RFS_RA_BUSY;
+                ra_reap(ch, bc, ra);
+            }
+            if (block_find(bc, fid, bno) != NULL || ra_find(bc, fid, bno, &attr, now))
+                continue;
+        }
+
+        // Read the rest of the blocks asked for
+        n = (uint32_t)(last - bno + 1);
+        bc->misses += n;
+        pthread_mutex_unlock(&bc->lock);
+        len = 0;
+        expires = now_ms() + block_ttl(ch);
+        if ((buf = malloc((size_t)n * RFS_BLOCK_SIZE)) == NULL)
+            error = -ENOMEM;
+        else
+            error = block_read(cid, fid, bno, n, buf, &len);
+        pthread_mutex_lock(&bc->lock);
+        if (error == 0 && len > 0)
+            block_put_all(bc, fid, bno, n, buf, len, &attr.mtime, attr.size,
+                    expires);
+        free(buf);
+        if (error)
+            break;
+        // The file ended before its size said it would
+        if (len == 0 || block_find(bc, fid, bno) == NULL)
+            break;
+    }
+
+    s->next = offset + got;
+    if (seq && error == 0)
+        stream_read_ahead(ch, bc, s,
+                (s->next + RFS_BLOCK_SIZE - 1) / RFS_BLOCK_SIZE, &attr, now);
+    pthread_mutex_unlock(&bc->lock);
+
+    if (error)
+        return error;
+    if (out_size)
+        *out_size = got;
+    return 0;
+}
@@ -0,0 +1,833 @@
+/*
+ * Client side caches of a channel.
+ *
+ * The attribute cache keeps the FileAttrs the dispatcher returns, keyed
+ * by fid, in a table of a fixed number of entries allocated when the
+ * cache is turned on. A fid goes into one of two neighbouring entries
+ * picked by its hash; a new fid takes whichever of them expires first.
+ * An entry is good for the cache's ttl after the response that carried
+ * it. Requests of the channel that change a file drop its entry once
+ * they complete (see cache_fids()), so the channel sees its own changes
+ * right away and those of other clients within the ttl.
+ *
+ * The dentry cache maps the names in directories, (dfid, name), to the
+ * fids they are of, or marks them as not existing after a lookup found
+ * nothing. Its entries come from a pool allocated when the cache is
+ * turned on and are found through hash chains; once the pool is used up
+ * the least recently used entry is taken for a new name. The channel's
+ * lookups, creates, links, unlinks and renames put the names they
+ * resolve, make and remove (see cache_complete()). Entries are good for
+ * the ttl, or until evicted if it is 0.
+ *
+ * The symlink target cache keeps the targets of symlinks by fid, in a
+ * table like that of the attribute cache. Fids are never reused and a
+ * symlink's target never changes, so entries are good until a new fid
+ * takes their place; of the two entries a fid may go into, it takes the
+ * one used last longest ago.
+ *
+ * The block cache, of file data, is in ravana_blocks.c.
+ *
+ * The caches of a channel are looked up by cid, like the channel itself,
+ * and set up before the channel is shared; they are never replaced.
+ */
+
+#include "ravana_channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* Entries an attribute, dentry or symlink target cache may have at most */
+#define RFS_ATTR_CACHE_MAX   (1U << 24)
+#define RFS_DENTRY_CACHE_MAX (1U << 22)
+#define RFS_LINK_CACHE_MAX   (1U << 20)
+
+/* Hash of *fid* for the tables of fids */
+static inline uint32_t fid_hash(fid_t fid)
+{
+    __uint64_t h = ((__uint64_t)fid ^ (__uint64_t)(fid >> 64)) * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(h >> 32);
+}
+
+/* First of the two entries *fid* may go into */
+static inline rfs_attr_entry_t *attr_slot(rfs_attr_cache_t *c, fid_t fid)
+{
+    return &c->entries[fid_hash(fid) & c->mask & ~1U];
+}
+
+/* Attribute cache of the channel of *cid*, NULL if it has none */
+static rfs_attr_cache_t *attr_cache(cid_t cid)
+{
+    rfs_channel_t *ch;
+
+    if ((ch = rfs_channel_open(cid)) == NULL)
+        return NULL;
+    return ch->attrs;
+}
+
+/*
+ * Keep the attributes of up to *n_entries* files of *ch* for *ttl_ms*.
+ * Returns -EBUSY if the cache is already on with another size.
+ */
+int rfs_channel_attr_cache(rfs_channel_t *ch, uint32_t n_entries, int ttl_ms)
+{
+    rfs_attr_cache_t *c;
+    uint32_t n = 2;
+
+    if (ch == NULL || n_entries == 0 || n_entries > RFS_ATTR_CACHE_MAX)
+        return -EINVAL;
+    while (n < n_entries)
+        n <<= 1;
+
+    if ((c = ch->attrs) != NULL) {
+        // Resizing would pull the table from under its users
+        if (c->mask + 1 != n)
+            return -EBUSY;
+        pthread_mutex_lock(&c->lock);
+        c->ttl = ttl_ms > 0 ? ttl_ms : 0;
+        memset(c->entries, 0, (size_t)n * sizeof(rfs_attr_entry_t));
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    if ((c = calloc(1, sizeof(rfs_attr_cache_t))) == NULL)
+        return -ENOMEM;
+    if ((c->entries = calloc(n, sizeof(rfs_attr_entry_t))) == NULL) {
+        free(c);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    c->ttl = ttl_ms > 0 ? ttl_ms : 0;
+    c->mask = n - 1;
+    ch->attrs = c;
+
+    return 0;
+}
+
+/*
+ * Hit and miss counts of the caches of *ch*, 0 for caches that are off.
+ */
+int rfs_channel_cache_stats(rfs_channel_t *ch, rfs_cache_stats_t *stats)
+{
+    rfs_attr_cache_t *c;
+    rfs_dentry_cache_t *d;
+    rfs_link_cache_t *l;
+    rfs_block_cache_t *bc;
+    rfs_write_back_t *wb;
+
+    if (ch == NULL || stats == NULL)
+        return -EINVAL;
+    memset(stats, 0, sizeof(rfs_cache_stats_t));
+    if ((c = ch->attrs) != NULL) {
+        pthread_mutex_lock(&c->lock);
+        stats->attr_hits = c->hits;
+        stats->attr_misses = c->misses;
+        pthread_mutex_unlock(&c->lock);
+    }
+    if ((d = ch->dentries) != NULL) {
+        pthread_mutex_lock(&d->lock);
+        stats->dentry_hits = d->hits;
+        stats->dentry_negative_hits = d->negative_hits;
+        stats->dentry_misses = d->misses;
+        pthread_mutex_unlock(&d->lock);
+    }
+    if ((l = ch->links) != NULL) {
+        pthread_mutex_lock(&l->lock);
+        stats->link_hits = l->hits;
+        stats->link_misses = l->misses;
+        pthread_mutex_unlock(&l->lock);
+    }
+    if ((bc = ch->blocks) != NULL) {
+        pthread_mutex_lock(&bc->lock);
+        stats->block_hits = bc->hits;
+        stats->block_misses = bc->misses;
+        stats->block_read_ahead = bc->read_ahead;
+        pthread_mutex_unlock(&bc->lock);
+    }
+    if ((wb = ch->wb) != NULL) {
+        pthread_mutex_lock(&wb->lock);
+        stats->wb_writes = wb->writes;
+        stats->wb_requests = wb->requests;
+        stats->wb_rmw_asked = wb->rmw_asked;
+        stats->wb_rmw_sent = wb->rmw_sent;
+        pthread_mutex_unlock(&wb->lock);
+    }
+    return 0;
+}
+
+void cache_free(rfs_channel_t *ch)
+{
+    rfs_attr_cache_t *c;
+    rfs_dentry_cache_t *d;
+    rfs_link_cache_t *l;
+    uint32_t i;
+
+    if ((c = ch->attrs) != NULL) {
+        pthread_mutex_destroy(&c->lock);
+        free(c->entries);
+        free(c);
+        ch->attrs = NULL;
+    }
+    if ((d = ch->dentries) != NULL) {
+        pthread_mutex_destroy(&d->lock);
+        free(d->chains);
+        free(d->entries);
+        free(d);
+        ch->dentries = NULL;
+    }
+    if ((l = ch->links) != NULL) {
+        pthread_mutex_destroy(&l->lock);
+        for (i = 0; i <= l->mask; i++)
+            free(l->entries[i].target);
+        free(l->entries);
+        free(l);
+        ch->links = NULL;
+    }
+    block_cache_free(ch);
+}
+
+/*
+ * Copy the cached attributes of *fid* to *attr*. Returns 1 on a hit, 0
+ * on a miss or if the cache is off.
+ */
+int attr_cache_get(cid_t cid, fid_t fid, FileAttr *attr)
+{
+    rfs_attr_cache_t *c;
+    rfs_attr_entry_t *e;
+    __int64_t now;
+    int i, hit = 0;
+
+    if ((c = attr_cache(cid)) == NULL)
+        return 0;
+    now = now_ms();
+    pthread_mutex_lock(&c->lock);
+    if (c->ttl) {
+        e = attr_slot(c, fid);
+        for (i = 0; i < 2; i++, e++) {
+            if (e->fid == fid && e->expires > now) {
+                *attr = e->attr;
+                hit = 1;
+                break;
+            }
+        }
+        if (hit)
+            c->hits++;
+        else
+            c->misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return hit;
+}
+
+/*
+ * Cache *attr*, fresh from the dispatcher, as the attributes of attr->ino.
+ */
+void attr_cache_put(cid_t cid, const FileAttr *attr)
+{
+    rfs_attr_cache_t *c;
+    rfs_attr_entry_t *e;
+    __int64_t now;
+
+    if ((c = attr_cache(cid)) == NULL)
+        return;
+    now = now_ms();
+    pthread_mutex_lock(&c->lock);
+    if (c->ttl) {
+        e = attr_slot(c, attr->ino);
+        // The fid's own entry, else the one that expires first
+        if (e[1].fid == attr->ino ||
+            (e[0].fid != attr->ino && e[1].expires < e[0].expires))
+            e++;
+        e->fid = attr->ino;
+        e->expires = now + c->ttl;
+        e->attr = *attr;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Drop the cached attributes of the *n_fids* files *fids*.
+ */
+void attr_cache_drop(cid_t cid, const fid_t *fids, int n_fids)
+{
+    rfs_attr_cache_t *c;
+    rfs_attr_entry_t *e;
+    int i, j;
+
+    if (n_fids == 0 || (c = attr_cache(cid)) == NULL)
+        return;
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < n_fids; i++) {
+        e = attr_slot(c, fids[i]);
+        for (j = 0; j < 2; j++, e++) {
+            if (e->fid == fids[i])
+                e->expires = 0;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Symlink target cache of the channel of *cid*, NULL if it has none */
+static rfs_link_cache_t *link_cache(cid_t cid)
+{
+    rfs_channel_t *ch;
+
+    if ((ch = rfs_channel_open(cid)) == NULL)
+        return NULL;
+    return ch->links;
+}
+
+/*
+ * Keep the targets of up to *n_entries* symlinks of *ch*. Returns -EBUSY
+ * if the cache is already on with another size.
+ */
+int rfs_channel_link_cache(rfs_channel_t *ch, uint32_t n_entries)
+{
+    rfs_link_cache_t *l;
+    uint32_t n = 2;
+
+    if (ch == NULL || n_entries == 0 || n_entries > RFS_LINK_CACHE_MAX)
+        return -EINVAL;
+    while (n < n_entries)
+        n <<= 1;
+
+    if ((l = ch->links) != NULL)
+        return l->mask + 1 == n ? 0 : -EBUSY;
+
+    if ((l = calloc(1, sizeof(rfs_link_cache_t))) == NULL)
+        return -ENOMEM;
+    if ((l->entries = calloc(n, sizeof(rfs_link_entry_t))) == NULL) {
+        free(l);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    l->mask = n - 1;
+    ch->links = l;
+
+    return 0;
+}
+
+/*
+ * Copy the cached target of the symlink *fid* to *buffer* and its length
+ * to *size*. Returns 1 on a hit, 0 on a miss or if the cache is off.
+ */
+int link_cache_get(cid_t cid, fid_t fid, char *buffer, __int64_t *size)
+{
+    rfs_link_cache_t *l;
+    rfs_link_entry_t *e;
+    int i, hit = 0;
+
+    if ((l = link_cache(cid)) == NULL)
+        return 0;
+    pthread_mutex_lock(&l->lock);
+    e = &l->entries[fid_hash(fid) & l->mask & ~1U];
+    for (i = 0; i < 2; i++, e++) {
+        if (e->fid == fid) {
+            if (buffer)
+                memcpy(buffer, e->target, e->len);
+            if (size)
+                *size = e->len;
+            e->used = ++l->tick;
+            hit = 1;
+            break;
+        }
+    }
+    if (hit)
+        l->hits++;
+    else
+        l->misses++;
+    pthread_mutex_unlock(&l->lock);
+
+    return hit;
+}
+
+/*
+ * Cache the *len* bytes of *target* as the target of the symlink *fid*.
+ */
+void link_cache_put(cid_t cid, fid_t fid, const char *target, __int64_t len)
+{
+    rfs_link_cache_t *l;
+    rfs_link_entry_t *e;
+    char *copy;
+
+    if (len <= 0 || len > PATH_MAX || (l = link_cache(cid)) == NULL)
+        return;
+    if ((copy = malloc((size_t)len)) == NULL)
+        return;
+    memcpy(copy, target, (size_t)len);
+    pthread_mutex_lock(&l->lock);
+    e = &l->entries[fid_hash(fid) & l->mask & ~1U];
+    // The fid's own entry, else the one used last longest ago
+    if (e[1].fid == fid || (e[0].fid != fid && e[1].used < e[0].used))
+        e++;
+    free(e->target);
+    e->fid = fid;
+    e->len = (uint32_t)len;
+    e->target = copy;
+    e->used = ++l->tick;
+    pthread_mutex_unlock(&l->lock);
+}
+
+/*
+ * Cache the target *link* a lookup or getattr response carried with the
+ * attributes *attr*, if they are of a symlink whose target it is.
+ */
+void link_cache_inline(cid_t cid, const FileAttr *attr, const file_name_t *link)
+{
+    if (S_ISLNK(attr->mode) && link->name_len > 0 &&
+        (__uint64_t)link->name_len == attr->size)
+        link_cache_put(cid, attr->ino, link->name, link->name_len);
+}
+
+/*
+ * The files whose attributes the request *arg*, any rfs_arg_*, changes,
+ * at most two, into *fids*. Returns their number. Files a request
+ * creates are left out, the response carries their attributes.
+ */
+static int cache_fids(const void *arg, fid_t *fids)
+{
+    switch (*(const rfs_file_op_t *)arg) {
+        case OP_SETATTRS:
+            fids[0] = ((const rfs_arg_setattr_t *)arg)->fid;
+            return 1;
+        case OP_WRITE:
+            fids[0] = ((const rfs_arg_write_t *)arg)->fid;
+            return 1;
+        case OP_WRITEV:
+            fids[0] = ((const rfs_arg_writev_t *)arg)->fid;
+            return 1;
+        case OP_CREATE:
+        case OP_MKNOD:
+            fids[0] = ((const rfs_arg_create_t *)arg)->p_fid;
+            return 1;
+        case OP_MKDIR:
+            fids[0] = ((const rfs_arg_mkdir_t *)arg)->p_fid;
+            return 1;
+        case OP_SYMLINK:
+            fids[0] = ((const rfs_arg_symlink_t *)arg)->p_fid;
+            return 1;
+        case OP_UNLINK:
+        case OP_RMDIR:
+            fids[0] = ((const rfs_arg_unlink_t *)arg)->p_fid;
+            return 1;
+        case OP_LINK:
+            fids[0] = ((const rfs_arg_link_t *)arg)->p_fid;
+            fids[1] = ((const rfs_arg_link_t *)arg)->fid;
+            return 2;
+        case OP_RENAME:
+            fids[0] = ((const rfs_arg_rename_t *)arg)->old_dfid;
+            fids[1] = ((const rfs_arg_rename_t *)arg)->new_dfid;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/* Dentry cache of the channel of *cid*, NULL if it has none */
+static rfs_dentry_cache_t *dentry_cache(cid_t cid)
+{
+    rfs_channel_t *ch;
+
+    if ((ch = rfs_channel_open(cid)) == NULL)
+        return NULL;
+    return ch->dentries;
+}
+
+/* FNV-1a of *name*, mixed with the directory it is in */
+static inline uint32_t dentry_hash(fid_t dfid, const char *name, int len)
+{
+    __uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    h ^= (__uint64_t)dfid ^ (__uint64_t)(dfid >> 64);
+    h *= 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(h >> 32);
+}
+
+/* Move *e* to the head of the LRU list, it has just been used */
+static void dentry_touch(rfs_dentry_cache_t *d, rfs_dentry_t *e)
+{
+    if (d->lru == e)
+        return;
+    // Entries on the list other than its head have a prev, new ones not
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+        if (e->next != NULL)
+            e->next->prev = e->prev;
+        else
+            d->lru_tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = d->lru;
+    if (d->lru != NULL)
+        d->lru->prev = e;
+    d->lru = e;
+    if (d->lru_tail == NULL)
+        d->lru_tail = e;
+}
+
+/* Take *e* out of its hash chain and the LRU list onto the free list */
+static void dentry_remove(rfs_dentry_cache_t *d, rfs_dentry_t *e)
+{
+    rfs_dentry_t **pp = &d->chains[e->hash & d->mask];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        d->lru = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        d->lru_tail = e->prev;
+
+    e->hnext = NULL;
+    e->prev = NULL;
+    e->next = d->free;
+    d->free = e;
+}
+
+/* The entry of *name* in *dfid*, NULL if none */
+static rfs_dentry_t *dentry_find(rfs_dentry_cache_t *d, fid_t dfid,
+        const file_name_t *name, uint32_t hash)
+{
+    rfs_dentry_t *e;
+
+    for (e = d->chains[hash & d->mask]; e != NULL; e = e->hnext) {
+        if (e->hash == hash && e->dfid == dfid &&
+            e->name_len == name->name_len &&
+            memcmp(e->name, name->name, name->name_len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/* Empty the cache, all entries back on the free list */
+static void dentry_flush(rfs_dentry_cache_t *d)
+{
+    uint32_t i;
+
+    memset(d->chains, 0, ((size_t)d->mask + 1) * sizeof(rfs_dentry_t *));
+    memset(d->entries, 0, (size_t)d->n_entries * sizeof(rfs_dentry_t));
+    for (i = 0; i + 1 < d->n_entries; i++)
+        d->entries[i].next = &d->entries[i + 1];
+    d->free = d->entries;
+    d->lru = NULL;
+    d->lru_tail = NULL;
+}
+
+/*
+ * Keep up to *n_entries* names of *ch* for *ttl_ms*, 0 for as long as
+ * they are not evicted. An *n_entries* of 0 turns the cache off. Returns
+ * -EBUSY if the cache is already on with another size.
+ */
+int rfs_channel_dentry_cache(rfs_channel_t *ch, uint32_t n_entries, int ttl_ms)
+{
+    rfs_dentry_cache_t *d;
+    uint32_t n = 1;
+
+    if (ch == NULL || n_entries > RFS_DENTRY_CACHE_MAX)
+        return -EINVAL;
+
+    if ((d = ch->dentries) != NULL) {
+        // Resizing would pull the pool from under its users
+        if (n_entries != 0 && n_entries != d->n_entries)
+            return -EBUSY;
+        pthread_mutex_lock(&d->lock);
+        d->on = n_entries != 0;
+        d->ttl = ttl_ms > 0 ? ttl_ms : 0;
+        dentry_flush(d);
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+    if (n_entries == 0)
+        return 0;
+
+    while (n < n_entries)
+        n <<= 1;
+    if ((d = calloc(1, sizeof(rfs_dentry_cache_t))) == NULL)
+        return -ENOMEM;
+    d->entries = calloc(n_entries, sizeof(rfs_dentry_t));
+    d->chains = calloc(n, sizeof(rfs_dentry_t *));
+    if (d->entries == NULL || d->chains == NULL) {
+        free(d->entries);
+        free(d->chains);
+        free(d);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    d->on = 1;
+    d->ttl = ttl_ms > 0 ? ttl_ms : 0;
+    d->n_entries = n_entries;
+    d->mask = n - 1;
+    dentry_flush(d);
+    ch->dentries = d;
+
+    return 0;
+}
+
+/*
+ * Find *name* in *dfid*. Returns 1 and its fid in *fid* if it is cached,
+ * -ENOENT if it is known not to exist, 0 on a miss or if the cache is off.
+ */
+int dentry_cache_get(cid_t cid, fid_t dfid, const file_name_t *name, fid_t *fid)
+{
+    rfs_dentry_cache_t *d;
+    rfs_dentry_t *e;
+    uint32_t hash;
+    int ret = 0;
+
+    if ((d = dentry_cache(cid)) == NULL || name->name_len > NAME_MAX)
+        return 0;
+    hash = dentry_hash(dfid, name->name, name->name_len);
+    pthread_mutex_lock(&d->lock);
+    if (d->on) {
+        if ((e = dentry_find(d, dfid, name, hash)) != NULL &&
+            e->expires != 0 && e->expires <= now_ms()) {
+            dentry_remove(d, e);
+            e = NULL;
+        }
+        if (e == NULL) {
+            d->misses++;
+        } else if (e->negative) {
+            dentry_touch(d, e);
+            d->negative_hits++;
+            ret = -ENOENT;
+        } else {
+            dentry_touch(d, e);
+            d->hits++;
+            *fid = e->fid;
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return ret;
+}
+
+/* dentry_cache_put() with the lock held */
+static void dentry_set(rfs_dentry_cache_t *d, fid_t dfid,
+        const file_name_t *name, fid_t fid, int error)
+{
+    rfs_dentry_t *e;
+    uint32_t hash = dentry_hash(dfid, name->name, name->name_len);
+
+    e = dentry_find(d, dfid, name, hash);
+    if (error != 0 && error != ENOENT) {
+        if (e != NULL)
+            dentry_remove(d, e);
+        return;
+    }
+    if (e == NULL) {
+        if ((e = d->free) != NULL) {
+            d->free = e->next;
+            e->next = NULL;
+        } else {
+            // Evict the least recently used name
+            e = d->lru_tail;
+            dentry_remove(d, e);
+            d->free = e->next;
+            e->next = NULL;
+        }
+        e->dfid = dfid;
+        e->hash = hash;
+        e->name_len = name->name_len;
+        memcpy(e->name, name->name, name->name_len);
+        e->name[name->name_len] = '\0';
+        e->hnext = d->chains[hash & d->mask];
+        d->chains[hash & d->mask] = e;
+    }
+    e->fid = error == 0 ? fid : 0;
+    e->negative = error != 0;
+    e->expires = d->ttl ? now_ms() + d->ttl : 0;
+    dentry_touch(d, e);
+}
+
+/*
+ * Cache the outcome of resolving *name* in *dfid*: *fid* for an *error*
+ * of 0, a name that does not exist for ENOENT. Any other error drops what
+ * is cached of the name.
+ */
+void dentry_cache_put(cid_t cid, fid_t dfid, const file_name_t *name,
+        fid_t fid, int error)
+{
+    rfs_dentry_cache_t *d;
+
+    if ((d = dentry_cache(cid)) == NULL || name->name_len > NAME_MAX)
+        return;
+    pthread_mutex_lock(&d->lock);
+    if (d->on)
+        dentry_set(d, dfid, name, fid, error);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * Forget *name* in *dfid*, or, if *gone*, cache it as not existing.
+ * Returns 1 and the fid it was of in *fid* if it was cached.
+ */
+static int dentry_cache_forget(cid_t cid, fid_t dfid, const file_name_t *name,
+        int gone, fid_t *fid)
+{
+    rfs_dentry_cache_t *d;
+    rfs_dentry_t *e;
+    int ret = 0;
+
+    if ((d = dentry_cache(cid)) == NULL || name->name_len > NAME_MAX)
+        return 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->on) {
+        e = dentry_find(d, dfid, name, dentry_hash(dfid, name->name, name->name_len));
+        if (e != NULL && !e->negative) {
+            *fid = e->fid;
+            ret = 1;
+        }
+        dentry_set(d, dfid, name, 0, gone ? ENOENT : EIO);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return ret;
+}
+
+/*
+ * A copy of the request *arg* for cache_complete() once it has been
+ * answered, or NULL if the channel of *cid* has no caches or the request
+ * does not touch them. Freed by the caller.
+ */
+void *cache_arg_copy(cid_t cid, const void *arg)
+{
+    rfs_channel_t *ch;
+    size_t size;
+    void *copy;
+
+    if ((ch = rfs_channel_open(cid)) == NULL ||
+        (ch->attrs == NULL && ch->dentries == NULL && ch->links == NULL &&
+         ch->blocks == NULL))
+        return NULL;
+    switch (*(const rfs_file_op_t *)arg) {
+        case OP_LOOKUP:   size = sizeof(rfs_arg_lookup_t); break;
+        case OP_GETATTRS: size = sizeof(rfs_arg_getattr_t); break;
+        case OP_SETATTRS: size = sizeof(rfs_arg_setattr_t); break;
+        case OP_WRITE:    size = sizeof(rfs_arg_write_t); break;
+        case OP_WRITEV:   size = sizeof(rfs_arg_writev_t); break;
+        case OP_CREATE:
+        case OP_MKNOD:    size = sizeof(rfs_arg_create_t); break;
+        case OP_MKDIR:    size = sizeof(rfs_arg_mkdir_t); break;
+        case OP_SYMLINK:  size = sizeof(rfs_arg_symlink_t); break;
+        case OP_LINK:     size = sizeof(rfs_arg_link_t); break;
+        case OP_UNLINK:
+        case OP_RMDIR:    size = sizeof(rfs_arg_unlink_t); break;
+        case OP_RENAME:   size = sizeof(rfs_arg_rename_t); break;
+        default:
+            return NULL;
+    }
+    if ((copy = malloc(size)) != NULL)
+        memcpy(copy, arg, size);
+
+    return copy;
+}
+
+/*
+ * Bring the caches of the channel of *cid* up to date with the request
+ * *arg*, answered with *error* and, for the ops that return them, the
+ * attributes *attr*, NULL otherwise. Called whether the request
+ * succeeded or not.
+ */
+void cache_complete(cid_t cid, const void *arg, int error, const FileAttr *attr)
+{
+    fid_t fids[4], fid;
+    int n = cache_fids(arg, fids);
+    fid_t ino = attr != NULL && error == 0 ? attr->ino : 0;
+
+    switch (*(const rfs_file_op_t *)arg) {
+        case OP_WRITE: {
+            const rfs_arg_write_t *a = arg;
+
+            block_cache_drop(cid, a->fid, a->offset, a->size);
+            break;
+        }
+        case OP_WRITEV:
+            // The segments may be gone by the time an async writev completes
+            block_cache_drop(cid, ((const rfs_arg_writev_t *)arg)->fid, 0, -1);
+            break;
+        case OP_SETATTRS: {
+            const rfs_arg_setattr_t *a = arg;
+
+            if (a->attr_mask & RFS_ATTR_SIZE)
+                block_cache_drop(cid, a->fid, 0, -1);
+            break;
+        }
+        case OP_LOOKUP: {
+            const rfs_arg_lookup_t *a = arg;
+
+            dentry_cache_put(cid, a->dfid, &a->fname, ino, error);
+            break;
+        }
+        case OP_CREATE:
+        case OP_MKNOD: {
+            const rfs_arg_create_t *a = arg;
+
+            dentry_cache_put(cid, a->p_fid, &a->fname, ino, error);
+            break;
+        }
+        case OP_MKDIR: {
+            const rfs_arg_mkdir_t *a = arg;
+
+            dentry_cache_put(cid, a->p_fid, &a->dname, ino, error);
+            break;
+        }
+        case OP_SYMLINK: {
+            const rfs_arg_symlink_t *a = arg;
+
+            dentry_cache_put(cid, a->p_fid, &a->name, ino, error);
+            if (ino)
+                link_cache_put(cid, ino, a->link_path.name, a->link_path.name_len);
+            break;
+        }
+        case OP_LINK: {
+            const rfs_arg_link_t *a = arg;
+
+            dentry_cache_put(cid, a->p_fid, &a->name, a->fid, error);
+            break;
+        }
+        case OP_UNLINK:
+        case OP_RMDIR: {
+            const rfs_arg_unlink_t *a = arg;
+
+            // The file unlinked lost a link
+            if (dentry_cache_forget(cid, a->p_fid, &a->name,
+                        error == 0 || error == ENOENT, &fid))
+                fids[n++] = fid;
+            break;
+        }
+        case OP_RENAME: {
+            const rfs_arg_rename_t *a = arg;
+            int moved;
+
+            moved = dentry_cache_forget(cid, a->old_dfid, &a->old_name,
+                    error == 0, &fid);
+            if (moved)
+                fids[n++] = fid;
+            // A file replaced by the rename lost a link
+            if (dentry_cache_forget(cid, a->new_dfid, &a->new_name, 0, &fids[n]))
+                n++;
+            if (moved && error == 0)
+                dentry_cache_put(cid, a->new_dfid, &a->new_name, fid, 0);
+            break;
+        }
+        default:
+            break;
+    }
+
+    attr_cache_drop(cid, fids, n);
+    if (attr != NULL && error == 0)
+        attr_cache_put(cid, attr);
+}
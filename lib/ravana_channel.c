@@ -0,0 +1,1096 @@
+/*
+ * Channel handles for talking to a RavanaFS dispatcher.
+ *
+ * A channel is a connected AF_UNIX stream to the dispatcher socket of a
+ * single cid. It is opened once and reused by every rfs_* call on that
+ * cid, so a getattr or lookup costs a request and a response instead of
+ * a socket(), connect(), shutdown() and close() as well.
+ *
+ * Channels are kept in a process wide table keyed by cid, an array of
+ * slots published with release stores, so that looking a channel up
+ * takes no lock. Opening and closing channels is serialized by
+ * table_lock; a channel is connected before it goes in the table, with
+ * the lock dropped. The array only grows, into a copy twice the size;
+ * the old copies are kept for lookups that may still be on them.
+ *
+ * A child forked while channels are open shares their sockets, epoll
+ * sets and rings with its parent, and their locks may have been held by
+ * threads it does not have. Its copies are dropped without being used
+ * (see channel_atfork_child()), and the child opens channels of its own.
+ *
+ * Every request sent on a channel carries a tag (RFS_PROTO_VERSION 2)
+ * which the dispatcher echoes in the response. Any number of requests
+ * can be outstanding on a channel and the dispatcher may answer them in
+ * any order. Sends are serialized by send_lock so request frames don't
+ * interleave. Responses are read by whichever waiting thread gets there
+ * first (the receiver); it hands responses meant for other threads to
+ * their pending entries and wakes them up. Responses to requests sent
+ * with rfs_submit() go to the channel's completion queue instead, see
+ * ravana_async.c.
+ *
+ * Large read responses are not buffered: the receiver reads the head of
+ * the response and then the data straight into the buffer of the read
+ * waiting for it (see channel_recv()).
+ *
+ * Sockets are nonblocking and every wait is a poll() or timed wait
+ * bounded by the deadline of the call, set from the channel's timeout
+ * (rfs_channel_timeout()) or the calling thread's (rfs_call_timeout()).
+ * A call past its deadline fails with -ETIMEDOUT, one whose dispatcher
+ * is gone with -EIO; neither takes the process down.
+ */
+
+#include "ravana_channel.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX (1024)
+#endif
+
+/* Read responses this big are streamed into the reader's buffer */
+#define RFS_STREAM_MIN  (16 << 10)
+/* Bytes read to decode the head of a read response, more than it takes */
+#define RFS_STREAM_HEAD (32)
+/* ms a call without a deadline retries a dispatcher with a full backlog */
+#define RFS_CONNECT_RETRY   (5000)
+/* Slots of the first channel table */
+#define RFS_CHANNELS_MIN    (8)
+
+/* The table of open channels, see rfs_channel_open() */
+typedef struct rfs_channel_table {
+    uint32_t                    size;   // number of slots
+    struct rfs_channel_table    *old;   // the table this one replaced
+    _Atomic(rfs_channel_t *)    slots[];
+} rfs_channel_table_t;
+
+/* All open channels, changed under table_lock and read without it */
+static _Atomic(rfs_channel_table_t *) channel_table = NULL;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  atfork_once = PTHREAD_ONCE_INIT;
+
+/* Timeout set by rfs_call_timeout() for calls made by this thread */
+static __thread int call_timeout_set = 0;
+static __thread int call_timeout = -1;
+
+__int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Deadline of a call starting now on *ch*, 0 if it may wait for ever.
+ */
+__int64_t channel_deadline(rfs_channel_t *ch)
+{
+    int timeout = call_timeout_set ? call_timeout : ch->timeout;
+
+    return timeout < 0 ? 0 : now_ms() + timeout;
+}
+
+/*
+ * Milliseconds left until *deadline*, as poll() takes them: -1 for no
+ * deadline and 0 once it has passed.
+ */
+int deadline_left(__int64_t deadline)
+{
+    __int64_t left;
+
+    if (deadline == 0)
+        return -1;
+    if ((left = deadline - now_ms()) <= 0)
+        return 0;
+    return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+/*
+ * *deadline* as an absolute time on *clock*, for the pthread timed waits.
+ */
+void deadline_ts(__int64_t deadline, clockid_t clock, struct timespec *ts)
+{
+    __int64_t left = deadline_left(deadline);
+
+    clock_gettime(clock, ts);
+    ts->tv_sec += left / 1000;
+    ts->tv_nsec += (left % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Wait until *fd* is ready for *events* or *deadline* passes. Returns 0
+ * or -ETIMEDOUT. Errors and hangups count as ready, the following read
+ * or write reports them.
+ */
+static int wait_fd(int fd, short events, __int64_t deadline)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int n;
+
+    do {
+        n = poll(&pfd, 1, deadline_left(deadline));
+    } while (n < 0 && errno == EINTR);
+    return n == 0 ? -ETIMEDOUT : 0;
+}
+
+void get_sock_path(char *path, cid_t cid)
+{
+
+    sprintf(path, "/opt/kinant/" CID_STR_FMT "/RavanaSocket",
+            CID_PRINT_STR(cid));
+#if 0
+    sprintf(path, "%s/" CID_STR_FMT "/RavanaSocket" ,
+            getenv("KINANT_PATH"), CID_PRINT_STR(cid));
+#endif
+}
+
+/*
+ * Drop a reference on a connection. Called with ch->lock held.
+ */
+void conn_put(rfs_conn_t *conn)
+{
+    if (--conn->refs > 0)
+        return;
+    close(conn->fd);
+    free(conn);
+}
+
+/*
+ * Open a nonblocking socket connected to the channel's dispatcher.
+ * Returns the fd, -ETIMEDOUT if the dispatcher did not accept the
+ * connection by *deadline* or -EIO if it is not there. Without a
+ * deadline, a dispatcher whose backlog stays full for RFS_CONNECT_RETRY
+ * ms is taken for gone.
+ */
+static int sock_connect(rfs_channel_t *ch, __int64_t deadline)
+{
+    struct sockaddr_un addr = {0};
+    socklen_t len = sizeof(int);
+    __int64_t retry_until = deadline ? deadline : now_ms() + RFS_CONNECT_RETRY;
+    int fd, error = 0;
+
+    if ( (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket error");
+        return -EIO;
+    }
+    addr.sun_family = AF_UNIX;
+    // Checked to fit by rfs_channel_open()
+    memcpy(addr.sun_path, ch->sock_path, strlen(ch->sock_path) + 1);
+
+    while (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN) {
+            /* The dispatcher's backlog is full, try again shortly */
+            if (deadline_left(retry_until) == 0) {
+                error = deadline ? -ETIMEDOUT : -EIO;
+                break;
+            }
+            usleep(1000);
+            continue;
+        }
+        if (errno == EINPROGRESS) {
+            if ((error = wait_fd(fd, POLLOUT, deadline)) == 0 &&
+                (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error))
+                error = -EIO;
+            break;
+        }
+        perror("socket connect error");
+        error = -EIO;
+        break;
+    }
+    if (error) {
+        close(fd);
+        return error;
+    }
+    return fd;
+}
+
+/*
+ * Connect the channel, giving up at *deadline*. Called with ch->lock
+ * held.
+ */
+int channel_connect(rfs_channel_t *ch, __int64_t deadline)
+{
+    rfs_conn_t *conn;
+    int fd, shm = 0;
+
+    if ((fd = sock_connect(ch, deadline)) < 0)
+        return fd;
+    /*
+     * Attach the ring before anything else goes out on the connection. A
+     * dispatcher that knows nothing of rings drops the connection, carry
+     * on over the socket alone then.
+     */
+    if (ch->ring && (shm = ring_attach(ch, fd, deadline)) < 0) {
+        close(fd);
+        if ((fd = sock_connect(ch, deadline)) < 0)
+            return fd;
+        shm = 0;
+    }
+    if ((conn = malloc(sizeof(rfs_conn_t))) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    conn->shm = shm;
+    ch->conn = conn;
+    if (ch->epfd >= 0) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(ch->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    return 0;
+}
+
+static void pending_unlink(rfs_channel_t *ch, rfs_pending_t *p)
+{
+    rfs_pending_t **pp;
+
+    for (pp = &ch->pending; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == p) {
+            *pp = p->next;
+            break;
+        }
+    }
+}
+
+/*
+ * Complete a pending request. Async requests move to the completion
+ * queue. Called with ch->lock held.
+ */
+static void pending_done(rfs_channel_t *ch, rfs_pending_t *p, rfs_response_t *rsp, int error)
+{
+    p->streaming = 0;
+    p->rsp = rsp;
+    p->error = error;
+    p->done = 1;
+    if (!p->async)
+        return;
+    pending_unlink(ch, p);
+    p->next = NULL;
+    if (ch->cq_tail)
+        ch->cq_tail->next = p;
+    else
+        ch->cq_head = p;
+    ch->cq_tail = p;
+    ch->n_completed++;
+}
+
+/*
+ * Drop the channel's connection and fail every request outstanding on
+ * it with *error*. The next request reconnects. A request whose data the
+ * receiver is streaming is left to the receiver, which fails it once it
+ * is done with the buffer. Called with ch->lock held.
+ */
+void channel_reset(rfs_channel_t *ch, int error)
+{
+    rfs_conn_t *conn = ch->conn;
+    rfs_pending_t *p, *next;
+
+    if (conn == NULL)
+        return;
+    ch->conn = NULL;
+    /* Requests given up on will never be answered now */
+    if (ch->ring)
+        ring_reclaim(ch->ring, conn, 0);
+    /* Wakes up a receiver blocked on the connection */
+    shutdown(conn->fd, SHUT_RDWR);
+    if (ch->epfd >= 0)
+        epoll_ctl(ch->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    for (p = ch->pending; p != NULL; p = next) {
+        next = p->next;
+        if (p->conn == conn && !p->done && !p->streaming)
+            pending_done(ch, p, NULL, error);
+    }
+    conn_put(conn);
+    pthread_cond_broadcast(&ch->cond);
+}
+
+/* The table stays whole across fork() */
+static void channel_atfork_prepare(void)
+{
+    pthread_mutex_lock(&table_lock);
+}
+
+static void channel_atfork_parent(void)
+{
+    pthread_mutex_unlock(&table_lock);
+}
+
+/*
+ * Drop the channels inherited from the parent. Only the forking thread
+ * made it into the child, so the channels' locks may be held for good
+ * and their pending requests may belong to threads that are gone; the
+ * channels are left alone but for closing the child's copies of their
+ * fds, which the parent goes on using, and their memory is leaked.
+ */
+static void channel_atfork_child(void)
+{
+    rfs_channel_table_t *tab = atomic_load(&channel_table);
+    rfs_channel_t *ch;
+    uint32_t i;
+
+    for (i = 0; tab != NULL && i < tab->size; i++) {
+        if ((ch = atomic_load(&tab->slots[i])) == NULL)
+            continue;
+        if (ch->conn != NULL)
+            close(ch->conn->fd);
+        if (ch->epfd >= 0)
+            close(ch->epfd);
+        if (ch->ring != NULL)
+            ring_forget(ch->ring);
+    }
+    atomic_store(&channel_table, NULL);
+    pthread_mutex_unlock(&table_lock);
+}
+
+static void channel_atfork(void)
+{
+    pthread_atfork(channel_atfork_prepare, channel_atfork_parent,
+                   channel_atfork_child);
+}
+
+/* The channel of *cid* in the table, NULL if it has none */
+static rfs_channel_t *channel_find(cid_t cid)
+{
+    rfs_channel_table_t *tab = atomic_load_explicit(&channel_table, memory_order_acquire);
+    rfs_channel_t *ch;
+    uint32_t i;
+
+    for (i = 0; tab != NULL && i < tab->size; i++) {
+        ch = atomic_load_explicit(&tab->slots[i], memory_order_acquire);
+        if (ch != NULL && ch->cid == cid)
+            return ch;
+    }
+    return NULL;
+}
+
+/*
+ * Put *ch* in a free slot of the table, growing it if it has none.
+ * Called with table_lock held. Returns -ENOMEM if the table can't grow.
+ */
+static int channel_insert(rfs_channel_t *ch)
+{
+    rfs_channel_table_t *tab = atomic_load(&channel_table), *grown;
+    uint32_t i, size;
+
+    for (i = 0; tab != NULL && i < tab->size; i++) {
+        if (atomic_load(&tab->slots[i]) == NULL) {
+            atomic_store_explicit(&tab->slots[i], ch, memory_order_release);
+            return 0;
+        }
+    }
+    size = tab != NULL ? tab->size * 2 : RFS_CHANNELS_MIN;
+    if ((grown = calloc(1, sizeof(rfs_channel_table_t) +
+                           size * sizeof(grown->slots[0]))) == NULL)
+        return -ENOMEM;
+    grown->size = size;
+    grown->old = tab;
+    for (i = 0; tab != NULL && i < tab->size; i++)
+        atomic_init(&grown->slots[i], atomic_load(&tab->slots[i]));
+    atomic_init(&grown->slots[i], ch);
+    atomic_store_explicit(&channel_table, grown, memory_order_release);
+    return 0;
+}
+
+/* Free *ch*, which is not in the table, and its connection if any */
+static void channel_free(rfs_channel_t *ch)
+{
+    pthread_mutex_lock(&ch->lock);
+    channel_reset(ch, -EIO);
+    pthread_mutex_unlock(&ch->lock);
+    if (ch->ring)
+        ring_free(ch->ring);
+    cache_free(ch);
+    wb_free(ch);
+    if (ch->epfd >= 0)
+        close(ch->epfd);
+    pthread_cond_destroy(&ch->cond);
+    pthread_mutex_destroy(&ch->send_lock);
+    pthread_mutex_destroy(&ch->lock);
+    free(ch);
+}
+
+/*
+ * Open a channel to the dispatcher serving *cid*. If the channel is
+ * already open the existing handle is returned. Returns NULL if the
+ * dispatcher cannot be reached or its socket path does not fit a
+ * sockaddr_un.
+ */
+rfs_channel_t *rfs_channel_open(cid_t cid)
+{
+    pthread_condattr_t attr;
+    rfs_channel_t *ch, *other;
+
+    if ((ch = channel_find(cid)) != NULL)
+        return ch;
+    pthread_once(&atfork_once, channel_atfork);
+
+    if ((ch = calloc(1, sizeof(rfs_channel_t))) == NULL)
+        return NULL;
+    ch->cid = cid;
+    ch->timeout = -1;
+    ch->version = RFS_PROTO_VERSION;
+    ch->epfd = epoll_create1(EPOLL_CLOEXEC);
+    pthread_mutex_init(&ch->lock, NULL);
+    pthread_mutex_init(&ch->send_lock, NULL);
+    /* Timed waits on cond are against deadlines, which are monotonic */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ch->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    get_sock_path(ch->sock_path, cid);
+    if (strlen(ch->sock_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        errno = ENAMETOOLONG;
+        perror(ch->sock_path);
+        channel_free(ch);
+        return NULL;
+    }
+
+    // Connected before it can be found, without holding up other cids
+    if (channel_connect(ch, channel_deadline(ch))) {
+        channel_free(ch);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&table_lock);
+    // Another thread may have opened the channel meanwhile
+    if ((other = channel_find(cid)) == NULL && channel_insert(ch) != 0) {
+        pthread_mutex_unlock(&table_lock);
+        channel_free(ch);
+        return NULL;
+    }
+    pthread_mutex_unlock(&table_lock);
+    if (other != NULL) {
+        channel_free(ch);
+        return other;
+    }
+
+    return ch;
+}
+
+/*
+ * Close a channel and remove it from the channel table. The caller must
+ * make sure no other thread is using the channel and that every request
+ * sent with rfs_channel_send() or rfs_submit() has been reaped.
+ */
+void rfs_channel_close(rfs_channel_t *ch)
+{
+    rfs_channel_table_t *tab;
+    uint32_t i;
+
+    if (ch == NULL)
+        return;
+    // Buffered writes go while the channel can still be found by cid
+    wb_flush_all(ch);
+
+    pthread_mutex_lock(&table_lock);
+    tab = atomic_load(&channel_table);
+    for (i = 0; tab != NULL && i < tab->size; i++) {
+        if (atomic_load(&tab->slots[i]) == ch) {
+            atomic_store_explicit(&tab->slots[i], NULL, memory_order_release);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    channel_free(ch);
+}
+
+/*
+ * Set a timeout of *timeout_ms* on every call made on *ch*, -1 to wait
+ * for ever.
+ */
+int rfs_channel_timeout(rfs_channel_t *ch, int timeout_ms)
+{
+    if (ch == NULL)
+        return -EINVAL;
+    pthread_mutex_lock(&ch->lock);
+    ch->timeout = timeout_ms < 0 ? -1 : timeout_ms;
+    pthread_mutex_unlock(&ch->lock);
+    return 0;
+}
+
+/*
+ * Have the dispatcher of *ch* answer in protocol version 3, with
+ * FileAttrs and ids in their fixed layout. A getattr of the root sent in
+ * version 3 finds out if it can; a dispatcher that does not know the
+ * version drops the connection on it, and the channel reconnects on
+ * version 2 with the next request. The channel must not have requests
+ * outstanding. Returns -EOPNOTSUPP if the dispatcher does not take it.
+ */
+int rfs_channel_packed(rfs_channel_t *ch)
+{
+    rfs_arg_getattr_t getattr;
+    rfs_request_t *req;
+    rfs_response_t *rsp = NULL;
+    rfs_pending_t p = {0};
+    int error;
+
+    if (ch == NULL)
+        return -EINVAL;
+    pthread_mutex_lock(&ch->lock);
+    if (ch->pending || ch->receiving) {
+        pthread_mutex_unlock(&ch->lock);
+        return -EBUSY;
+    }
+    ch->version = RFS_PROTO_PACKED;
+    pthread_mutex_unlock(&ch->lock);
+
+    getattr.op = OP_GETATTRS;
+    getattr.cid = ch->cid;
+    getattr.fid = ROOT;
+    if ((req = serialize_request_tls((void *)&getattr)) == NULL) {
+        error = -ENOMEM;
+    } else if ((error = channel_submit(ch, req, &p)) == -EPIPE) {
+        error = channel_submit(ch, req, &p);
+    }
+    if (error == 0)
+        error = channel_complete(ch, &p, &rsp);
+    free(rsp);
+    if (error == 0)
+        return 0;
+
+    pthread_mutex_lock(&ch->lock);
+    ch->version = RFS_PROTO_VERSION;
+    pthread_mutex_unlock(&ch->lock);
+    return error == -EIO || error == -EPIPE ? -EOPNOTSUPP : error;
+}
+
+/*
+ * Set a timeout of *timeout_ms* on calls made by this thread, whatever
+ * the channel's. A negative timeout reverts to the channel's.
+ */
+void rfs_call_timeout(int timeout_ms)
+{
+    call_timeout_set = timeout_ms >= 0;
+    call_timeout = timeout_ms;
+}
+
+/*
+ * Read *len* bytes from *fd* into *buf*, polling for them until
+ * *deadline*. The number of bytes read goes to *got*. Returns 0,
+ * -ETIMEDOUT or -EIO if the connection failed.
+ */
+static int read_all(int fd, void *buf, size_t len, __int64_t deadline, size_t *got)
+{
+    ssize_t n;
+
+    *got = 0;
+    while (*got < len) {
+        if ((n = read(fd, (char *)buf + *got, len - *got)) > 0) {
+            *got += n;
+            continue;
+        }
+        if (n == 0)
+            return -EIO;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -EIO;
+        if (wait_fd(fd, POLLIN, deadline))
+            return -ETIMEDOUT;
+    }
+    return 0;
+}
+
+/*
+ * Read the header of a response frame off *conn*, waiting for it until
+ * *deadline*. Returns -ETIMEDOUT if no response started arriving by
+ * then, the connection is still good; a header cut short makes it -EIO.
+ */
+static int recv_header(rfs_conn_t *conn, rfs_rsp_header_t *hdr, __int64_t deadline)
+{
+    size_t got;
+    int error;
+
+    if ((error = read_all(conn->fd, hdr, sizeof(*hdr), deadline, &got)) != 0) {
+        if (error == -ETIMEDOUT && got == 0)
+            return error;
+        perror("read failed");
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Read the payload of the frame with header *hdr* off *conn* into a new
+ * response. The first *head_len* bytes of the payload, already read,
+ * are in *head*.
+ */
+static int recv_payload(rfs_conn_t *conn, rfs_rsp_header_t *hdr, const void *head,
+        size_t head_len, rfs_response_t **rsp, __int64_t deadline)
+{
+    rfs_response_t *buf = NULL;
+    size_t got;
+
+    /* Allocate the the payload */
+    buf = malloc( hdr->size + sizeof(rfs_response_t) );
+    if(buf == NULL) {
+        perror("malloc failed");
+        return -ENOMEM;
+    }
+
+    buf->size = hdr->size;
+    buf->flags = hdr->flags;
+    buf->tag = hdr->tag;
+    /* payload points to the end of the structure */
+    buf->payload = (rfs_response_t *)((char *)buf + sizeof(rfs_response_t));
+    if (head_len)
+        memcpy(buf->payload, head, head_len);
+    /* read the payload */
+    if (read_all(conn->fd, (char *)buf->payload + head_len, hdr->size - head_len,
+                 deadline, &got) != 0) {
+        perror("read of errno failed");
+        free(buf);
+        return -EIO;
+    }
+    *rsp = buf;
+    return 0;
+}
+
+/*
+ * Read a response frame off *conn*, waiting for it until *deadline*.
+ * Returns -ETIMEDOUT if no response started arriving by then, the
+ * connection is still good; a frame cut short makes it -EIO. Called
+ * without ch->lock.
+ */
+int conn_recv(rfs_conn_t *conn, rfs_response_t **rsp, __int64_t deadline)
+{
+    rfs_rsp_header_t hdr;
+    int error;
+
+    if ((error = recv_header(conn, &hdr, deadline)) != 0)
+        return error;
+    return recv_payload(conn, &hdr, NULL, 0, rsp, deadline);
+}
+
+/*
+ * Read the payload of the read response with header *hdr* for *p*. If
+ * it is a successful read whose data fits p->buf, the data goes straight
+ * there and the response returned holds only the head; p->streamed is
+ * set to the size of the data. Anything else is read into the response
+ * as usual.
+ */
+static int recv_stream(rfs_conn_t *conn, rfs_rsp_header_t *hdr, rfs_pending_t *p,
+        rfs_response_t **rsp, __int64_t deadline)
+{
+    char head[RFS_STREAM_HEAD];
+    rfs_response_t *buf;
+    __int64_t data_size;
+    size_t got, in_head;
+    int head_len;
+
+    if (read_all(conn->fd, head, sizeof(head), deadline, &got) != 0)
+        return -EIO;
+    head_len = deserialize_rsp_read_head(head, sizeof(head), &data_size);
+    if (head_len < 0 || head_len + data_size != hdr->size || data_size > p->len)
+        return recv_payload(conn, hdr, head, sizeof(head), rsp, deadline);
+
+    if ((buf = malloc(sizeof(rfs_response_t) + head_len)) == NULL)
+        return -ENOMEM;
+    /* The data read with the head, then the rest of it */
+    in_head = sizeof(head) - head_len;
+    memcpy(p->buf, head + head_len, in_head);
+    if (read_all(conn->fd, (char *)p->buf + in_head, data_size - in_head,
+                 deadline, &got) != 0) {
+        free(buf);
+        return -EIO;
+    }
+    buf->size = head_len;
+    buf->flags = hdr->flags;
+    buf->tag = hdr->tag;
+    buf->payload = (rfs_response_t *)((char *)buf + sizeof(rfs_response_t));
+    memcpy(buf->payload, head, head_len);
+    p->streamed = data_size;
+    *rsp = buf;
+    return 0;
+}
+
+/*
+ * Read a response frame off *conn* of *ch* like conn_recv(). A large
+ * response to a request queued with a buffer for its data is streamed
+ * into the buffer; the request is marked streaming meanwhile so that
+ * neither a reset nor its own deadline lets its owner go while the
+ * buffer is being filled. Called without ch->lock.
+ */
+int channel_recv(rfs_channel_t *ch, rfs_conn_t *conn, rfs_response_t **rsp,
+        __int64_t deadline)
+{
+    rfs_rsp_header_t hdr;
+    rfs_pending_t *p;
+    int error;
+
+    if ((error = recv_header(conn, &hdr, deadline)) != 0)
+        return error;
+    if (hdr.size < RFS_STREAM_MIN)
+        return recv_payload(conn, &hdr, NULL, 0, rsp, deadline);
+
+    pthread_mutex_lock(&ch->lock);
+    for (p = ch->pending; p != NULL; p = p->next) {
+        if (p->tag == hdr.tag && p->conn == conn && !p->done)
+            break;
+    }
+    if (p && p->stream && p->buf)
+        p->streaming = 1;
+    else
+        p = NULL;
+    pthread_mutex_unlock(&ch->lock);
+    if (p == NULL)
+        return recv_payload(conn, &hdr, NULL, 0, rsp, deadline);
+
+    error = recv_stream(conn, &hdr, p, rsp, deadline);
+
+    pthread_mutex_lock(&ch->lock);
+    p->streaming = 0;
+    if (error)
+        pending_done(ch, p, NULL, error == -ENOMEM ? error : -EIO);
+    pthread_cond_broadcast(&ch->cond);
+    pthread_mutex_unlock(&ch->lock);
+    return error;
+}
+
+/*
+ * Hand a response to the request it answers. Called with ch->lock held.
+ */
+void channel_deliver(rfs_channel_t *ch, rfs_conn_t *conn, rfs_response_t *rsp)
+{
+    rfs_pending_t *p;
+
+    for (p = ch->pending; p != NULL; p = p->next) {
+        if (p->tag == rsp->tag && p->conn == conn && !p->done) {
+            pending_done(ch, p, rsp, 0);
+            return;
+        }
+    }
+    /* Nobody is waiting for it, any more perhaps */
+    if (ch->ring)
+        ring_reclaim(ch->ring, conn, rsp->tag);
+    free(rsp);
+}
+
+/*
+ * Send all of *iov* on *fd*, picking up after short sends and polling
+ * while the socket is full until *deadline*. Modifies *iov*. The number
+ * of bytes sent goes to *sent*. Returns 0, -ETIMEDOUT, or -EPIPE if the
+ * connection failed.
+ */
+int sendv_all(int fd, struct iovec *iov, int iovcnt, __int64_t deadline,
+        size_t *sent)
+{
+    return sendv_fd(fd, iov, iovcnt, -1, deadline, sent);
+}
+
+/*
+ * sendv_all() passing *pass_fd*, unless it is -1, as SCM_RIGHTS along
+ * with the first bytes sent.
+ */
+int sendv_fd(int fd, struct iovec *iov, int iovcnt, int pass_fd,
+        __int64_t deadline, size_t *sent)
+{
+    union {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } control;
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    if (pass_fd != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    *sent = 0;
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        /* MSG_NOSIGNAL: a dead dispatcher must not SIGPIPE the caller */
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -EPIPE;
+            if (wait_fd(fd, POLLOUT, deadline))
+                return -ETIMEDOUT;
+            continue;
+        }
+        /* The fd went with the bytes just sent */
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        *sent += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Tag *req*, queue *p* for its response and send it, followed by the
+ * *iovcnt* buffers of *iov* in a single sendmsg(). The request's size
+ * covers the buffers, they are the tail of its payload. *p* gets the
+ * deadline of the call. Returns -EPIPE if the request could not be
+ * sent, -ETIMEDOUT if it could not be sent in time and -EOPNOTSUPP for
+ * a request flagged RFS_SHM_RING if the connection has no ring attached.
+ */
+int channel_submitv(rfs_channel_t *ch, rfs_request_t *req,
+        const struct iovec *iov, int iovcnt, rfs_pending_t *p)
+{
+    struct iovec v[iovcnt + 1];
+    struct timespec ts;
+    size_t tail = 0, sent = 0;
+    rfs_conn_t *conn;
+    int i, error = 0, failed, version;
+
+    if (iovcnt < 0 || iovcnt >= IOV_MAX)
+        return -EINVAL;
+    for (i = 0; i < iovcnt; i++) {
+        v[i + 1] = iov[i];
+        tail += iov[i].iov_len;
+    }
+    if (tail > req->header.size)
+        return -EINVAL;
+    /* total request size = size of header + payload */
+    v[0].iov_base = req;
+    v[0].iov_len = sizeof(rfs_request_t) + req->header.size - tail;
+
+    pthread_mutex_lock(&ch->lock);
+    p->deadline = channel_deadline(ch);
+    if (ch->conn == NULL && (error = channel_connect(ch, p->deadline)) != 0) {
+        pthread_mutex_unlock(&ch->lock);
+        return error;
+    }
+    conn = ch->conn;
+    if ((req->header.flags & RFS_SHM_RING) && !conn->shm) {
+        pthread_mutex_unlock(&ch->lock);
+        return -EOPNOTSUPP;
+    }
+    conn->refs++;
+    p->tag = ++ch->next_tag;
+    p->conn = conn;
+    p->done = 0;
+    p->error = 0;
+    p->rsp = NULL;
+    p->streaming = 0;
+    p->streamed = -1;
+    if (p->async)
+        ch->n_async++;
+    p->next = ch->pending;
+    ch->pending = p;
+    version = ch->version;
+    pthread_mutex_unlock(&ch->lock);
+
+    req->header.version = version;
+    req->header.tag = p->tag;
+    if (p->deadline == 0) {
+        pthread_mutex_lock(&ch->send_lock);
+        failed = 0;
+    } else {
+        deadline_ts(p->deadline, CLOCK_REALTIME, &ts);
+        failed = -pthread_mutex_timedlock(&ch->send_lock, &ts);
+    }
+    if (failed == 0) {
+        failed = sendv_all(conn->fd, v, iovcnt + 1, p->deadline, &sent);
+        pthread_mutex_unlock(&ch->send_lock);
+    }
+
+    pthread_mutex_lock(&ch->lock);
+    if (failed) {
+        /* Take p back before the reset can complete it */
+        pending_unlink(ch, p);
+        if (p->async)
+            ch->n_async--;
+        /* A frame cut short leaves the connection unusable */
+        if ((failed != -ETIMEDOUT || sent > 0) && ch->conn == conn)
+            channel_reset(ch, -EIO);
+        error = failed == -ETIMEDOUT ? failed : -EPIPE;
+    }
+    conn_put(conn);
+    pthread_mutex_unlock(&ch->lock);
+
+    return error;
+}
+
+int channel_submit(rfs_channel_t *ch, rfs_request_t *req, rfs_pending_t *p)
+{
+    return channel_submitv(ch, req, NULL, 0, p);
+}
+
+/*
+ * Wait for the response to the request queued as *p*, until its
+ * deadline. If no other thread is reading the connection, read
+ * responses until ours shows up, delivering the others on the way.
+ * Returns -ETIMEDOUT if the deadline passed first; a response that
+ * shows up later is dropped, and the ring slot of the request, if it
+ * has one, lost until then.
+ */
+int channel_complete(rfs_channel_t *ch, rfs_pending_t *p, rfs_response_t **rsp)
+{
+    struct timespec ts;
+    rfs_conn_t *conn;
+    rfs_response_t *r;
+    int error;
+
+    pthread_mutex_lock(&ch->lock);
+    while (!p->done) {
+        if (deadline_left(p->deadline) == 0 && !p->streaming) {
+            pending_unlink(ch, p);
+            if (p->in_ring && ch->ring)
+                ring_lose(ch->ring, p->conn, p->tag, p->slot);
+            pthread_mutex_unlock(&ch->lock);
+            *rsp = NULL;
+            return -ETIMEDOUT;
+        }
+        if (ch->receiving) {
+            if (p->deadline == 0 || p->streaming) {
+                pthread_cond_wait(&ch->cond, &ch->lock);
+            } else {
+                deadline_ts(p->deadline, CLOCK_MONOTONIC, &ts);
+                pthread_cond_timedwait(&ch->cond, &ch->lock, &ts);
+            }
+            continue;
+        }
+        ch->receiving = 1;
+        conn = p->conn;
+        conn->refs++;
+        pthread_mutex_unlock(&ch->lock);
+
+        error = channel_recv(ch, conn, &r, p->deadline);
+
+        pthread_mutex_lock(&ch->lock);
+        ch->receiving = 0;
+        if (error == 0)
+            channel_deliver(ch, conn, r);
+        else if (error != -ETIMEDOUT && ch->conn == conn)
+            channel_reset(ch, error == -ENOMEM ? error : -EIO);
+        conn_put(conn);
+        /* Wake up waiters, one of them takes over as receiver */
+        pthread_cond_broadcast(&ch->cond);
+    }
+    pending_unlink(ch, p);
+    pthread_mutex_unlock(&ch->lock);
+
+    *rsp = p->rsp;
+    return p->error;
+}
+
+/*
+ * Send *req* on the channel without waiting for the response. The tag
+ * to collect the response with is returned in *tag*. Every tag must be
+ * passed to rfs_channel_recv() exactly once.
+ */
+int rfs_channel_send(rfs_channel_t *ch, rfs_request_t *req, __uint64_t *tag)
+{
+    rfs_pending_t *p;
+    int error;
+
+    if ((p = calloc(1, sizeof(rfs_pending_t))) == NULL)
+        return -ENOMEM;
+    if ((error = channel_submit(ch, req, p)) != 0) {
+        free(p);
+        return error;
+    }
+    *tag = p->tag;
+    return 0;
+}
+
+/*
+ * Wait for the response to the request sent with *tag*. The response is
+ * allocated and must be freed by the caller.
+ */
+int rfs_channel_recv(rfs_channel_t *ch, __uint64_t tag, rfs_response_t **rsp)
+{
+    rfs_pending_t *p;
+    int error;
+
+    pthread_mutex_lock(&ch->lock);
+    for (p = ch->pending; p != NULL; p = p->next) {
+        if (p->tag == tag)
+            break;
+    }
+    pthread_mutex_unlock(&ch->lock);
+    if (p == NULL)
+        return -EINVAL;
+
+    error = channel_complete(ch, p, rsp);
+    free(p);
+    return error;
+}
+
+/*
+ * Send *req* and wait for its response on the channel for *cid*,
+ * opening the channel on first use. The *iovcnt* buffers of *iov* are
+ * sent as the tail of the request's payload, straight from the caller's
+ * memory.
+ *
+ * If the request cannot be sent because the dispatcher dropped the
+ * connection, the channel reconnects and sends it once more. A request
+ * that was sent is never resent, since the dispatcher may already have
+ * executed it. Returns -ETIMEDOUT if the call's deadline passed and
+ * -EIO if the dispatcher cannot be reached.
+ */
+int rfs_socket_iov(cid_t cid, rfs_request_t *req, const struct iovec *iov,
+        int iovcnt, rfs_response_t **rsp)
+{
+    rfs_pending_t p = {0};
+
+    return socket_call(cid, req, iov, iovcnt, &p, rsp);
+}
+
+/*
+ * rfs_socket_iov() with the request queued as *p*, which may carry a
+ * buffer for the data of a read.
+ */
+int socket_call(cid_t cid, rfs_request_t *req, const struct iovec *iov,
+        int iovcnt, rfs_pending_t *p, rfs_response_t **rsp)
+{
+    rfs_channel_t *ch;
+    int error;
+
+    if ((ch = rfs_channel_open(cid)) == NULL)
+        return -EIO;
+
+    if ((error = channel_submitv(ch, req, iov, iovcnt, p)) == -EPIPE)
+        error = channel_submitv(ch, req, iov, iovcnt, p);
+    if (error == -EPIPE)
+        error = -EIO;
+    if (error) {
+        perror("write to socket failed: ");
+        return error;
+    }
+    return channel_complete(ch, p, rsp);
+}
+
+int rfs_socket_io(cid_t cid, rfs_request_t *req, rfs_response_t **rsp)
+{
+    return rfs_socket_iov(cid, req, NULL, 0, rsp);
+}
@@ -0,0 +1,352 @@
+/*
+ * Channel internals shared by the files implementing the client side of
+ * the dispatcher protocol. Users of the library go through
+ * ravana_interfaces.h instead.
+ */
+#ifndef __RAVANA_CHANNEL_H_
+#define __RAVANA_CHANNEL_H_
+
+#include "ravana.h"
+#include "ravana_interfaces.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A connection to the dispatcher. When a connection fails the channel
+ * drops it and connects afresh on the next request. Threads still
+ * holding the old connection keep it alive through refs, the socket is
+ * closed when the last of them lets go, so a stale fd is never reused.
+ */
+typedef struct rfs_conn {
+    int                 fd;         // connected socket
+    int                 refs;       // users of fd, +1 while it is current
+    int                 shm;        // the channel's ring is attached
+} rfs_conn_t;
+
+/*
+ * The request a ring slot was lost to: it was given up on before its
+ * response came in, tag on conn, and the dispatcher may still use the
+ * slot. conn is NULL for slots not lost.
+ */
+typedef struct rfs_ring_lost {
+    rfs_conn_t          *conn;      // connection the request went out on
+    __uint64_t          tag;        // tag of the request
+} rfs_ring_lost_t;
+
+/*
+ * A memfd backed ring of n_slots slots of slot_size bytes, mapped by the
+ * client and by the dispatcher of every connection it is attached to.
+ * Reads and writes that fit a slot pass their data through one.
+ */
+typedef struct rfs_ring {
+    int                 fd;         // memfd
+    char                *base;      // mapping of the memfd
+    uint32_t            n_slots;    // number of slots
+    uint32_t            slot_size;  // size of a slot
+    pthread_mutex_t     lock;       // protects the fields below
+    uint32_t            n_free;     // number of free slots
+    uint32_t            *free;      // stack of free slots
+    uint32_t            n_lost;     // number of lost slots
+    rfs_ring_lost_t     *lost;      // by slot, see ring_lose()
+} rfs_ring_t;
+
+/*
+ * The attributes of fid, good until expires, a CLOCK_MONOTONIC time in ms.
+ * Unused entries have expires 0.
+ */
+typedef struct rfs_attr_entry {
+    fid_t               fid;        // file the attributes are of
+    __int64_t           expires;    // ms the entry is good until
+    FileAttr            attr;       // attributes
+} rfs_attr_entry_t;
+
+/*
+ * The attribute cache of a channel, a table of mask + 1 entries. A fid
+ * may go into either of two neighbouring entries, see ravana_cache.c.
+ */
+typedef struct rfs_attr_cache {
+    pthread_mutex_t     lock;       // protects the fields below
+    int                 ttl;        // ms entries are good for, 0 when off
+    uint32_t            mask;       // number of entries - 1, a power of 2 - 1
+    rfs_attr_entry_t    *entries;   // the table
+    __uint64_t          hits;       // getattrs answered from the cache
+    __uint64_t          misses;     // getattrs sent to the dispatcher
+} rfs_attr_cache_t;
+
+/*
+ * The target of the symlink fid. Unused entries have fid 0.
+ */
+typedef struct rfs_link_entry {
+    fid_t               fid;        // symlink the target is of
+    __uint64_t          used;       // tick of the last use of the entry
+    uint32_t            len;        // length of target
+    char                *target;    // target, not NUL terminated
+} rfs_link_entry_t;
+
+/*
+ * The symlink target cache of a channel, a table of mask + 1 entries
+ * used like that of the attribute cache. Of the two entries a fid may go
+ * into, a new fid takes the one used last longest ago.
+ */
+typedef struct rfs_link_cache {
+    pthread_mutex_t     lock;       // protects the fields below
+    uint32_t            mask;       // number of entries - 1, a power of 2 - 1
+    __uint64_t          tick;       // uses of the cache so far
+    rfs_link_entry_t    *entries;   // the table
+    __uint64_t          hits;       // readlinks answered from the cache
+    __uint64_t          misses;     // readlinks sent to the dispatcher
+} rfs_link_cache_t;
+
+/*
+ * A name in a directory and the file it is of, or, if negative, a name
+ * the directory is known not to have.
+ */
+typedef struct rfs_dentry {
+    fid_t               dfid;       // directory the name is in
+    fid_t               fid;        // file of that name, unless negative
+    __int64_t           expires;    // ms the entry is good until, 0 for ever
+    uint32_t            hash;       // hash of dfid and name
+    uint16_t            name_len;   // length of name
+    uint16_t            negative;   // the name does not exist
+    struct rfs_dentry   *hnext;     // next entry of the hash chain
+    struct rfs_dentry   *prev;      // LRU list, most recently used first,
+    struct rfs_dentry   *next;      // or the free list
+    char                name[NAME_MAX+1];
+} rfs_dentry_t;
+
+/*
+ * The dentry cache of a channel, a pool of n_entries entries found
+ * through mask + 1 hash chains and evicted least recently used first.
+ */
+typedef struct rfs_dentry_cache {
+    pthread_mutex_t     lock;       // protects the fields below
+    int                 on;         // off once turned off
+    int                 ttl;        // ms entries are good for, 0 for ever
+    uint32_t            n_entries;  // number of entries
+    uint32_t            mask;       // number of hash chains - 1
+    rfs_dentry_t        *entries;   // the pool
+    rfs_dentry_t        **chains;   // hash chains
+    rfs_dentry_t        *lru;       // most recently used entry
+    rfs_dentry_t        *lru_tail;  // least recently used entry
+    rfs_dentry_t        *free;      // unused entries
+    __uint64_t          hits;       // lookups of names found
+    __uint64_t          negative_hits; // lookups of names found not to exist
+    __uint64_t          misses;     // lookups of names not cached
+} rfs_dentry_cache_t;
+
+/*
+ * Block bno of the data of fid, len bytes of it, fewer than
+ * RFS_BLOCK_SIZE only for the last block of the file. mtime and size are
+ * those of the file when the block was read; the block is stale once the
+ * file's are different, or once it expires.
+ */
+typedef struct rfs_block {
+    fid_t               fid;        // file the block is of
+    uint64_t            bno;        // block number in the file
+    uint32_t            len;        // bytes of data in the block
+    uint32_t            hash;       // hash of fid and bno
+    struct timespec     mtime;      // mtime of the file when read
+    uint64_t            size;       // size of the file when read
+    __int64_t           expires;    // ms the block is good until
+    struct rfs_block    *hnext;     // next block of the hash chain
+    struct rfs_block    *prev;      // LRU list, most recently used first,
+    struct rfs_block    *next;      // or the free list
+    char                *data;      // RFS_BLOCK_SIZE bytes
+} rfs_block_t;
+
+/*
+ * The len bytes at offset of fid written and not sent yet, since a
+ * CLOCK_MONOTONIC time in ms. Unused slots have len 0.
+ */
+typedef struct rfs_wb_file {
+    fid_t               fid;        // file written
+    uint64_t            offset;     // offset of the data in the file
+    uint32_t            len;        // bytes buffered
+    __int64_t           since;      // ms the oldest of them was written at
+    char                *data;      // max_bytes bytes, NULL until used
+} rfs_wb_file_t;
+
+#define RFS_WB_FILES    (16)        // files with data buffered at most
+
+/* The write-back buffer of a channel, see ravana_writeback.c */
+typedef struct rfs_write_back {
+    pthread_mutex_t     lock;       // protects the fields below, held
+                                    // while buffered data is sent
+    uint32_t            max_bytes;  // bytes a file may have buffered
+    int                 delay;      // ms data may stay buffered, 0 for ever
+    rfs_wb_file_t       files[RFS_WB_FILES];
+    __uint64_t          writes;     // writes buffered
+    __uint64_t          requests;   // writes sent for them
+    __uint64_t          rmw_asked;  // partial blocks of the writes buffered
+    __uint64_t          rmw_sent;   // partial blocks of the writes sent
+} rfs_write_back_t;
+
+/* A sequential reader of fid, see ravana_blocks.c */
+typedef struct rfs_stream {
+    fid_t               fid;        // file read
+    uint64_t            next;       // offset a sequential read goes on from
+    uint64_t            ra_next;    // first block not read ahead yet
+    uint32_t            window;     // blocks read ahead at a time
+    __uint64_t          used;       // tick of the last read, 0 if unused
+} rfs_stream_t;
+
+/* A read of n_blocks blocks from bno, ahead of a stream or for a miss */
+typedef struct rfs_readahead {
+    int                 state;      // RFS_RA_*
+    int                 stale;      // the file changed since it was sent
+    fid_t               fid;        // file read
+    uint64_t            bno;        // first block read
+    uint32_t            n_blocks;   // number of blocks read
+    struct timespec     mtime;      // mtime of the file when sent
+    uint64_t            size;       // size of the file when sent
+    __int64_t           expires;    // ms the blocks read are good until
+    struct rfs_pending  *p;         // the read, its data goes to p->buf
+} rfs_readahead_t;
+
+#define RFS_RA_FREE     (0)         // slot unused
+#define RFS_RA_SENT     (1)         // read outstanding
+#define RFS_RA_BUSY     (2)         // a thread is sending or reaping it
+
+#define RFS_STREAMS     (8)         // sequential readers tracked
+#define RFS_READAHEADS  (8)         // reads ahead outstanding at most
+
+/*
+ * The block cache of a channel, a pool of n_blocks blocks found through
+ * mask + 1 hash chains and evicted least recently used first.
+ */
+typedef struct rfs_block_cache {
+    pthread_mutex_t     lock;       // protects the fields below
+    pthread_cond_t      cond;       // signalled when a readahead is reaped
+    uint32_t            n_blocks;   // number of blocks
+    uint32_t            mask;       // number of hash chains - 1
+    uint32_t            max_window; // blocks read ahead at a time at most
+    rfs_block_t         *blocks;    // the pool
+    char                *data;      // data of the blocks
+    rfs_block_t         **chains;   // hash chains
+    rfs_block_t         *lru;       // most recently used block
+    rfs_block_t         *lru_tail;  // least recently used block
+    rfs_block_t         *free;      // unused blocks
+    __uint64_t          tick;       // reads so far, to age streams
+    rfs_stream_t        streams[RFS_STREAMS];
+    rfs_readahead_t     ra[RFS_READAHEADS];
+    __uint64_t          hits;       // blocks read from the cache
+    __uint64_t          misses;     // blocks read from the dispatcher
+    __uint64_t          read_ahead; // blocks read ahead
+} rfs_block_cache_t;
+
+// A request waiting for its response
+typedef struct rfs_pending {
+    __uint64_t          tag;        // tag of the request
+    rfs_conn_t          *conn;      // connection the request went out on
+    int                 done;       // response (or error) delivered
+    int                 error;      // 0 or -errno
+    rfs_response_t      *rsp;       // response, if no error
+    int                 async;      // completes on the completion queue
+    rfs_file_op_t       op;         // async: op of the request
+    void                *cookie;    // async: caller's cookie
+    void                *buf;       // caller's buffer for read data
+    __int64_t           len;        // size of buf
+    int                 stream;     // read data may go straight to buf
+    int                 streaming;  // the receiver is filling buf
+    __int64_t           streamed;   // size streamed into buf, -1 if not
+    __int64_t           deadline;   // CLOCK_MONOTONIC ms to give up at, 0 never
+    int                 in_ring;    // the request's data is in ring slot slot
+    uint32_t            slot;
+    void                *arg;       // async: copy of the request, for the caches
+    struct rfs_pending  *next;      // pending list or completion queue
+} rfs_pending_t;
+
+struct rfs_channel {
+    cid_t               cid;        // channel id
+    rfs_conn_t          *conn;      // current connection, NULL if none
+    int                 epfd;       // epoll set watching conn
+    pthread_mutex_t     lock;       // protects the fields below
+    pthread_mutex_t     send_lock;  // keeps request frames whole
+    pthread_cond_t      cond;       // signalled on delivery to pending
+    int                 receiving;  // a thread is reading responses
+    __uint64_t          next_tag;   // last tag handed out
+    rfs_pending_t       *pending;   // requests awaiting responses
+    rfs_pending_t       *cq_head;   // completed async requests
+    rfs_pending_t       *cq_tail;
+    int                 n_async;    // async requests not yet reaped
+    int                 n_completed;// of which on the completion queue
+    rfs_ring_t          *ring;      // shared ring, NULL if none
+    rfs_attr_cache_t    *attrs;     // attribute cache, NULL if none
+    rfs_dentry_cache_t  *dentries;  // dentry cache, NULL if none
+    rfs_link_cache_t    *links;     // symlink target cache, NULL if none
+    rfs_block_cache_t   *blocks;    // block cache, NULL if none
+    rfs_write_back_t    *wb;        // write-back buffer, NULL if none
+    int                 timeout;    // ms a call may take, -1 for ever
+    int                 version;    // protocol version of requests sent
+    char                sock_path[NAME_MAX+1];
+};
+
+// Deadlines are CLOCK_MONOTONIC times in ms, 0 for none
+__int64_t now_ms(void);
+__int64_t channel_deadline(rfs_channel_t *ch);
+int deadline_left(__int64_t deadline);
+void deadline_ts(__int64_t deadline, clockid_t clock, struct timespec *ts);
+
+// Called with ch->lock held
+void conn_put(rfs_conn_t *conn);
+int channel_connect(rfs_channel_t *ch, __int64_t deadline);
+int ring_attach(rfs_channel_t *ch, int fd, __int64_t deadline);
+void channel_reset(rfs_channel_t *ch, int error);
+void channel_deliver(rfs_channel_t *ch, rfs_conn_t *conn, rfs_response_t *rsp);
+
+// Called without ch->lock
+int conn_recv(rfs_conn_t *conn, rfs_response_t **rsp, __int64_t deadline);
+int channel_recv(rfs_channel_t *ch, rfs_conn_t *conn, rfs_response_t **rsp,
+        __int64_t deadline);
+int sendv_all(int fd, struct iovec *iov, int iovcnt, __int64_t deadline,
+        size_t *sent);
+int sendv_fd(int fd, struct iovec *iov, int iovcnt, int pass_fd,
+        __int64_t deadline, size_t *sent);
+int channel_submit(rfs_channel_t *ch, rfs_request_t *req, rfs_pending_t *p);
+int channel_submitv(rfs_channel_t *ch, rfs_request_t *req,
+        const struct iovec *iov, int iovcnt, rfs_pending_t *p);
+int channel_complete(rfs_channel_t *ch, rfs_pending_t *p, rfs_response_t **rsp);
+int socket_call(cid_t cid, rfs_request_t *req, const struct iovec *iov,
+        int iovcnt, rfs_pending_t *p, rfs_response_t **rsp);
+void ring_free(rfs_ring_t *ring);
+void ring_forget(rfs_ring_t *ring);
+// Called with ch->lock held
+void ring_lose(rfs_ring_t *ring, rfs_conn_t *conn, __uint64_t tag, uint32_t slot);
+void ring_reclaim(rfs_ring_t *ring, rfs_conn_t *conn, __uint64_t tag);
+int shm_write(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        char *buffer, __int64_t *out_size);
+int shm_read(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        __int64_t *out_size, char *buffer);
+int write_now(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        char *buffer, __int64_t *out_size);
+
+// Caches of the channel of cid, see ravana_cache.c
+void cache_free(rfs_channel_t *ch);
+void *cache_arg_copy(cid_t cid, const void *arg);
+void cache_complete(cid_t cid, const void *arg, int error, const FileAttr *attr);
+int attr_cache_get(cid_t cid, fid_t fid, FileAttr *attr);
+void attr_cache_put(cid_t cid, const FileAttr *attr);
+void attr_cache_drop(cid_t cid, const fid_t *fids, int n_fids);
+int dentry_cache_get(cid_t cid, fid_t dfid, const file_name_t *name, fid_t *fid);
+void dentry_cache_put(cid_t cid, fid_t dfid, const file_name_t *name, fid_t fid,
+        int error);
+int link_cache_get(cid_t cid, fid_t fid, char *buffer, __int64_t *size);
+void link_cache_put(cid_t cid, fid_t fid, const char *target, __int64_t len);
+void link_cache_inline(cid_t cid, const FileAttr *attr, const file_name_t *link);
+
+// Block cache of the channel of cid, see ravana_blocks.c
+void block_cache_free(rfs_channel_t *ch);
+int block_cache_read(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        __int64_t *out_size, char *buffer);
+void block_cache_drop(cid_t cid, fid_t fid, uint64_t offset, __int64_t size);
+
+// Write-back buffer of the channel of cid, see ravana_writeback.c
+void wb_free(rfs_channel_t *ch);
+int wb_write(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        char *buffer, __int64_t *out_size);
+int wb_flush(cid_t cid, fid_t fid);
+int wb_flush_attr(cid_t cid, FileAttr *attr);
+int wb_flush_arg(cid_t cid, const void *arg);
+int wb_flush_all(rfs_channel_t *ch);
+
+#endif /* __RAVANA_CHANNEL_H_ */
@@ -0,0 +1,151 @@
+/*
+Generates src/SerializeOps.jl, the dispatcher's decoders of the requests
+and encoders of the responses of the ops in ravana_ops.h, from the same
+field lists the C client is built from. Run it whenever a list changes
+and check the output in:
+
+    gcc -o ravana_gen_ops ravana_gen_ops.c && ./ravana_gen_ops > ../src/SerializeOps.jl
+
+It needs nothing but ravana_ops.h and writes the file to stdout.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ravana_ops.h"
+
+/* A field of a list, its type and name as spelled in ravana_ops.h */
+typedef struct gen_field {
+    const char *type;
+    const char *name;
+} gen_field_t;
+
+/* A request or response expanded from the schema, fields NULL terminated */
+typedef struct gen_op {
+    const char          *name;
+    const char          *list;
+    const gen_field_t   *fields;
+} gen_op_t;
+
+#define GEN_FIELD(type, name)   { #type, #name },
+#define GEN_ARG(name, NAME)                                                 \
+    { #name, "RFS_ARG_" #NAME,                                              \
+      (const gen_field_t[]){ RFS_ARG_##NAME(GEN_FIELD) { NULL, NULL } } },
+#define GEN_RSP(name, NAME)                                                 \
+    { #name, "RFS_RSP_" #NAME,                                              \
+      (const gen_field_t[]){ RFS_RSP_##NAME(GEN_FIELD) { NULL, NULL } } },
+
+static const gen_op_t gen_args[] = { RFS_FLAT_ARGS(GEN_ARG) };
+static const gen_op_t gen_rsps[] = { RFS_FLAT_RSPS(GEN_RSP) };
+
+#define N_ARGS  (sizeof(gen_args) / sizeof(gen_args[0]))
+#define N_RSPS  (sizeof(gen_rsps) / sizeof(gen_rsps[0]))
+
+/* How a field type is decoded, what it is when missing and how it is encoded */
+typedef struct gen_type {
+    const char *type;
+    const char *unpack;
+    const char *zero;
+    const char *pack;       // printf format of the value
+} gen_type_t;
+
+static const gen_type_t gen_types[] = {
+    { "FID",  "rfs_fid_unpack(iob)",          "fid_t(0)",   "rfs_fid_pack(iob, %s)" },
+    { "U32",  "UInt32(MsgPack.unpack(iob))",  "UInt32(0)",  "MsgPack.pack(iob, UInt32(%s))" },
+    { "U64",  "UInt64(MsgPack.unpack(iob))",  "UInt64(0)",  "MsgPack.pack(iob, UInt64(%s))" },
+    { "I32",  "Int32(MsgPack.unpack(iob))",   "Int32(0)",   "MsgPack.pack(iob, Int32(%s))" },
+    { "I64",  "Int64(MsgPack.unpack(iob))",   "Int64(0)",   "MsgPack.pack(iob, Int64(%s))" },
+    { "NAME", "String(MsgPack.unpack(iob))",  "\"\"",       "MsgPack.pack(iob, String(%s))" },
+    { "ATTR", "rfs_attr_unpack(iob)",         "FileAttr()", "rfs_attr_pack(iob, %s)" },
+};
+
+static const gen_type_t *gen_type(const char *type)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(gen_types) / sizeof(gen_types[0]); i++) {
+        if (strcmp(gen_types[i].type, type) == 0)
+            return &gen_types[i];
+    }
+    fprintf(stderr, "unknown field type %s in ravana_ops.h\n", type);
+    exit(1);
+}
+
+/* The fields of *op* as Julia names, separated by ", " */
+static void gen_names(const gen_op_t *op)
+{
+    const gen_field_t *f;
+
+    for (f = op->fields; f->type != NULL; f++)
+        printf("%s%s", f == op->fields ? "" : ", ", f->name);
+}
+
+static void gen_fields_table(const char *name, const gen_op_t *ops, size_t n)
+{
+    const gen_field_t *f;
+    size_t i;
+
+    printf("const %s = [\n", name);
+    for (i = 0; i < n; i++) {
+        printf("    :%s => Tuple{Symbol, Symbol}[", ops[i].name);
+        for (f = ops[i].fields; f->type != NULL; f++)
+            printf("%s(:%s, :%s)", f == ops[i].fields ? "" : ", ", f->type, f->name);
+        printf("],\n");
+    }
+    printf("]\n\n");
+}
+
+int main(void)
+{
+    const gen_field_t *f;
+    const gen_type_t *t;
+    size_t i;
+
+    printf("# Generated by lib/ravana_gen_ops.c from lib/ravana_ops.h, do not edit.\n"
+           "\n"
+           "#=\n"
+           "    rfs_X_args(iob)\n"
+           "Unpacks the fields of RFS_ARG_<X> that follow the op code, skipping\n"
+           "the channel id, as a tuple. Fields an older client does not send at the\n"
+           "end of its request are 0.\n"
+           "\n"
+           "    rfs_X_rsp_pack(iob, fields...)\n"
+           "Packs NO_ERROR and the fields of the RFS_RSP_* that X replies with.\n"
+           "\n"
+           "RFS_FLAT_ARG_FIELDS and RFS_FLAT_RSP_FIELDS list the (type, name) of\n"
+           "the fields of each, for the tests.\n"
+           "=#\n\n");
+
+    gen_fields_table("RFS_FLAT_ARG_FIELDS", gen_args, N_ARGS);
+    gen_fields_table("RFS_FLAT_RSP_FIELDS", gen_rsps, N_RSPS);
+
+    for (i = 0; i < N_ARGS; i++) {
+        printf("# %s\n", gen_args[i].list);
+        printf("function rfs_%s_args(iob)\n", gen_args[i].name);
+        printf("    rfs_cid_unpack(iob)\n");
+        for (f = gen_args[i].fields; f->type != NULL; f++) {
+            t = gen_type(f->type);
+            printf("    %s = eof(iob) ? %s : %s\n", f->name, t->zero, t->unpack);
+        }
+        printf("    return (");
+        gen_names(&gen_args[i]);
+        printf(",)\nend\n\n");
+    }
+
+    for (i = 0; i < N_RSPS; i++) {
+        printf("# %s\n", gen_rsps[i].list);
+        printf("function rfs_%s_rsp_pack(iob", gen_rsps[i].name);
+        if (gen_rsps[i].fields->type != NULL)
+            printf(", ");
+        gen_names(&gen_rsps[i]);
+        printf(")\n    MsgPack.pack(iob, NO_ERROR) # errno\n");
+        for (f = gen_rsps[i].fields; f->type != NULL; f++) {
+            printf("    ");
+            printf(gen_type(f->type)->pack, f->name);
+            printf("\n");
+        }
+        printf("end\n%s", i + 1 < N_RSPS ? "\n" : "");
+    }
+
+    return 0;
+}
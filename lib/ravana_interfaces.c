@@ -5,6 +5,7 @@
 
 #include "ravana.h"
 #include "ravana_interfaces.h"
+#include "ravana_channel.h"
 #include <stdio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -14,85 +15,6 @@
 #include <stdlib.h>
 #include <errno.h>
 
-void get_sock_path(char *path, cid_t cid)
-{
-
-    sprintf(path, "/opt/kinant/" CID_STR_FMT "/RavanaSocket",
-            CID_PRINT_STR(cid));
-#if 0
-    sprintf(path, "%s/" CID_STR_FMT "/RavanaSocket" ,
-            getenv("KINANT_PATH"), CID_PRINT_STR(cid));
-#endif
-}
-/*
- * Connects, reads and writes to the socket file
- */
-int rfs_socket_io(cid_t cid, rfs_request_t *req, rfs_response_t **rsp)
-{
-    struct sockaddr_un addr = {0};
-    int fd;
-    uint32_t req_size = 0;
-    uint32_t size = 0;
-    rfs_response_t *buf = NULL;
-    int i=0;
-    char sock_path[NAME_MAX+1];
-
-
-    get_sock_path(sock_path, cid);
-    /* Set up socket and structure */
-    if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("socket error");
-        exit(-1);
-    }
-    addr.sun_family = AF_UNIX;
-    
-    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path)-1);
-
-    /* Connect */
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("socket connect error");
-        exit(-1);
-    }
-
-    /* total request size = size of header + payload */
-    req_size = sizeof(rfs_request_t) + req->header.size;
-    /* Write request to socket */
-    if (write(fd, req, req_size) != req_size) {
-        perror("write to socket failed: ");
-        exit(-1);
-    }
-
-    /* First read the size of the response returned */
-    if (read(fd, &size, sizeof(uint32_t)) != sizeof(uint32_t)) {
-        perror("read failed");
-        exit(-1);
-    }
-
-    /* Allocate the the payload */
-    buf = malloc( size + sizeof(rfs_response_t) );
-    if(buf == NULL) {
-        perror("malloc failed");
-        exit(-1);
-    }
-
-    buf->size = size;
-    /* payload points to the end of the structure */
-    buf->payload = (rfs_response_t *)((char *)buf + sizeof(rfs_response_t));
-    /* read the payload */
-    if (read(fd, buf->payload, size) != size) {
-        perror("read of errno failed");
-        exit(-1);
-    }
-    *rsp = buf;
-    shutdown(fd, 2);
-    close(fd);
-
-
-    return 0;
-}
-
-
-
 /* create */
 int rfs_create(cid_t  cid,
         fid_t         p_fid,
@@ -115,26 +37,25 @@ int rfs_create(cid_t  cid,
     creat.attr = attr_in;
     creat.fname = fname;
     // Serialize the request
-    if ((req = serialize_request((void *)&creat)) == NULL) {
+    if ((req = serialize_request_tls((void *)&creat)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_create(buf, rsp->size, &creat_rsp);
     error = creat_rsp.error;
+    cache_complete(cid, &creat, error, &creat_rsp.attr);
     if(error == 0) {
         if(attr_out)
             memcpy(attr_out, &creat_rsp.attr, sizeof(FileAttr));
     }
 
-    free(req);
     free(rsp);
 
     return error;
@@ -152,37 +73,157 @@ int rfs_lookup(cid_t  cid,
     rfs_response_t *rsp = NULL;
     rfs_rsp_lookup_t lookup_rsp = {0};
     void *buf = NULL;
+    fid_t fid;
+
+    // Names resolved within the ttl of the channel's dentry cache
+    switch (dentry_cache_get(cid, dfid, &fname, &fid)) {
+        case -ENOENT:
+            return ENOENT;
+        case 1:
+            if (attr_out == NULL)
+                return 0;
+            // With the file's buffered writes in the size
+            if (attr_cache_get(cid, fid, attr_out))
+                return wb_flush_attr(cid, attr_out);
+            break;
+    }
 
     lookup.op  = OP_LOOKUP;
     lookup.cid = cid;
     lookup.dfid = dfid;
     lookup.fname = fname;
     // Serialize the request
-    if ((req = serialize_request((void *)&lookup)) == NULL) {
+    if ((req = serialize_request_tls((void *)&lookup)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_lookup(buf, rsp->size, &lookup_rsp);
     error = lookup_rsp.error;
+    cache_complete(cid, &lookup, error, &lookup_rsp.attr);
     if(error == 0) {
-        if(attr_out)
+        link_cache_inline(cid, &lookup_rsp.attr, &lookup_rsp.link);
+        if(attr_out) {
             memcpy(attr_out, &lookup_rsp.attr, sizeof(FileAttr));
+            error = wb_flush_attr(cid, attr_out);
+        }
+    }
+    free(rsp);
+
+    return error;
+}
+
+
+int rfs_compound(cid_t  cid,
+        fid_t         fid,
+        const rfs_compound_op_t *ops,
+        uint32_t      n_ops,
+        uint32_t      *n_res,
+        rfs_compound_res_t *res)
+{
+    int32_t error = 0;
+    rfs_arg_compound_t compound;
+    rfs_request_t *req = NULL;
+    rfs_response_t *rsp = NULL;
+    rfs_rsp_compound_t compound_rsp = {0};
+    uint32_t i;
+    int ret;
+    fid_t cur = fid;
+
+    if (n_ops == 0 || n_ops > RFS_MAX_COMPOUND)
+        return -EINVAL;
+
+    compound.op  = OP_COMPOUND;
+    compound.cid = cid;
+    compound.fid = fid;
+    compound.n_ops = n_ops;
+    compound.ops = ops;
+    // Serialize the request
+    if ((req = serialize_request_tls((void *)&compound)) == NULL) {
+        perror("serialize request error");
+        return -ENOMEM;
+    }
+
+    /* Perform socket I/O */
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
+    }
+
+    compound_rsp.res = res;
+    if (deserialize_rsp_compound(rsp->payload, rsp->size, &compound_rsp, n_ops) != 0) {
+        error = -EIO;
+    } else {
+        error = compound_rsp.error;
+        for (i = 0; i < compound_rsp.n_res; i++) {
+            if (ops[i].op == OP_LOOKUP)
+                dentry_cache_put(cid, cur, &ops[i].fname, res[i].attr.ino,
+                        res[i].error);
+            if (res[i].error == 0) {
+                cur = res[i].attr.ino;
+                if ((ret = wb_flush_attr(cid, &res[i].attr)) != 0 && error == 0)
+                    error = ret;
+                attr_cache_put(cid, &res[i].attr);
+            }
+        }
     }
-    free(req);
+    if (n_res)
+        *n_res = compound_rsp.n_res;
     free(rsp);
 
     return error;
 }
 
 
+int rfs_lookup_path(cid_t  cid,
+        fid_t         dfid,
+        const char    *path,
+        FileAttr      *attr_out)
+{
+    rfs_compound_op_t ops[RFS_MAX_COMPOUND];
+    rfs_compound_res_t res[RFS_MAX_COMPOUND];
+    uint32_t n_ops, n_res;
+    const char *comp = path;
+    size_t len;
+    int32_t error;
+
+    do {
+        // Pack as many components as fit one compound
+        for (n_ops = 0; *comp && n_ops < RFS_MAX_COMPOUND; comp += len) {
+            while (*comp == '/')
+                comp++;
+            len = strcspn(comp, "/");
+            if (len == 0 || (len == 1 && *comp == '.'))
+                continue;
+            if (len > NAME_MAX)
+                return ENAMETOOLONG;
+            ops[n_ops].op = OP_LOOKUP;
+            ops[n_ops].fname.name_len = len;
+            memcpy(ops[n_ops].fname.name, comp, len);
+            ops[n_ops].fname.name[len] = '\0';
+            n_ops++;
+        }
+        // Nothing to look up, return dfid itself
+        if (n_ops == 0)
+            ops[n_ops++].op = OP_GETATTRS;
+        if ((error = rfs_compound(cid, dfid, ops, n_ops, &n_res, res)) != 0)
+            return error;
+        if (n_res != n_ops)
+            return -EIO;
+        dfid = res[n_res - 1].attr.ino;
+    } while (*comp);
+
+    if (attr_out)
+        memcpy(attr_out, &res[n_res - 1].attr, sizeof(FileAttr));
+    return 0;
+}
+
+
 int rfs_setattr(cid_t cid,
         fid_t         fid,
         uint32_t      attr_mask,
@@ -195,28 +236,31 @@ int rfs_setattr(cid_t cid,
     rfs_rsp_setattr_t setattr_rsp = {0};
     void *buf = NULL;
 
+    // Buffered writes of the file go first
+    if ((error = wb_flush(cid, fid)) != 0)
+        return error;
+
     setattr.op  = OP_SETATTRS;
     setattr.cid = cid;
     setattr.fid = fid;
     setattr.attr_mask = attr_mask;
     setattr.attr = attr;
     // Serialize the request
-    if ((req = serialize_request((void *)&setattr)) == NULL) {
+    if ((req = serialize_request_tls((void *)&setattr)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_setattr(buf, rsp->size, &setattr_rsp);
     error = setattr_rsp.error; /* assign error */
+    cache_complete(cid, &setattr, error, NULL);
 
-    free(req);
     free(rsp);
 
     return error;
@@ -233,29 +277,36 @@ int rfs_getattr(cid_t cid,
     rfs_rsp_getattr_t getattr_rsp = {0};
     void *buf = NULL;
 
+    // Buffered writes of the file go first
+    if ((error = wb_flush(cid, fid)) != 0)
+        return error;
+    // Attributes fetched within the ttl of the channel's attribute cache
+    if (attr_cache_get(cid, fid, attr ? attr : &getattr_rsp.attr))
+        return 0;
+
     getattr.op  = OP_GETATTRS;
     getattr.cid = cid;
     getattr.fid = fid;
     // Serialize the request
-    if ((req = serialize_request((void *)&getattr)) == NULL) {
+    if ((req = serialize_request_tls((void *)&getattr)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_getattr(buf, rsp->size, &getattr_rsp);
     error = getattr_rsp.error;
+    cache_complete(cid, &getattr, error, &getattr_rsp.attr);
     if(error == 0) {
+        link_cache_inline(cid, &getattr_rsp.attr, &getattr_rsp.link);
         if(attr)
             memcpy(attr, &getattr_rsp.attr, sizeof(FileAttr));
     }
-    free(req);
     free(rsp);
 
     return error;
@@ -281,16 +332,17 @@ int rfs_readdir(cid_t  cid,
     readdir.cid = cid;
     readdir.d_fid = dfid;
     readdir.index = index;
+    readdir.max_entries = 0;
+    readdir.max_bytes = 0;
     // Serialize the request
-    if ((req = serialize_request((void *)&readdir)) == NULL) {
+    if ((req = serialize_request_tls((void *)&readdir)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
@@ -301,8 +353,8 @@ int rfs_readdir(cid_t  cid,
         readdir_rsp_entries = malloc(sizeof(rfs_rsp_readdir_t)+
                 (size_t)(readdir_rsp.n_entries*sizeof(rfs_dirent_t)));
         if(readdir_rsp_entries == NULL) {
-            error = -ENOMEM;
-            return error;
+            free(rsp);
+            return -ENOMEM;
         }
         deserialize_rsp_readdir_entries(buf, rsp->size, readdir_rsp_entries);
         if(eof)
@@ -310,19 +362,133 @@ int rfs_readdir(cid_t  cid,
         if(n_entries)
             memcpy(n_entries, &readdir_rsp_entries->n_entries, sizeof(uint32_t));
 
-        *entries = malloc((size_t)(*n_entries)*sizeof(rfs_dirent_t));
+        *entries = malloc((size_t)readdir_rsp_entries->n_entries*sizeof(rfs_dirent_t));
         if(*entries)
-            memcpy(*entries, readdir_rsp_entries->entries, (size_t)(*n_entries)*sizeof(rfs_dirent_t));
+            memcpy(*entries, readdir_rsp_entries->entries,
+                    (size_t)readdir_rsp_entries->n_entries*sizeof(rfs_dirent_t));
         else
             error = -ENOMEM;
     }
-    free(req);
     free(rsp);
     free(readdir_rsp_entries);
 
     return error;
 }
 
+/*
+ * readdir or readdirplus, as *op*, from *index* into *arena*, see
+ * rfs_readdir_arena().
+ */
+static int readdir_arena(rfs_file_op_t op,
+        cid_t          cid,
+        fid_t          dfid,
+        uint64_t       index,
+        uint32_t       max_entries,
+        void           *arena,
+        size_t         arena_size,
+        __int32_t      *eof,
+        uint32_t       *n_entries,
+        uint64_t       *next_index)
+{
+    int32_t error = 0;
+    rfs_arg_readdir_t readdir;
+    rfs_request_t *req = NULL;
+    rfs_response_t *rsp = NULL;
+    rfs_rsp_readdir_t readdir_rsp = {0};
+    int used, ret;
+
+    readdir.op  = op;
+    readdir.cid = cid;
+    readdir.d_fid = dfid;
+    readdir.index = index;
+    readdir.max_entries = max_entries;
+    /* The arena's entries are larger than their encoding, this only
+     * keeps the server from sending far more than fits */
+    readdir.max_bytes = arena_size > UINT32_MAX ? UINT32_MAX : (uint32_t)arena_size;
+    // Serialize the request
+    if ((req = serialize_request_tls((void *)&readdir)) == NULL) {
+        perror("serialize request error");
+        return -ENOMEM;
+    }
+
+    /* Perform socket I/O */
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
+    }
+
+    readdir_rsp.index = index;
+    if (op == OP_READDIRPLUS)
+        used = deserialize_rsp_readdirplus_arena(rsp->payload, rsp->size, &readdir_rsp,
+                arena, arena_size);
+    else
+        used = deserialize_rsp_readdir_arena(rsp->payload, rsp->size, &readdir_rsp,
+                arena, arena_size);
+    error = used < 0 ? used : readdir_rsp.error;
+    if(error == 0) {
+        if (op == OP_READDIRPLUS) {
+            rfs_direntplus_t *d = arena;
+            uint32_t i;
+
+            for (i = 0; i < readdir_rsp.n_entries; i++, d = RFS_DIRENTPLUS_NEXT(d)) {
+                if ((ret = wb_flush_attr(cid, &d->attr)) != 0 && error == 0)
+                    error = ret;
+                attr_cache_put(cid, &d->attr);
+            }
+        }
+        if(eof)
+            *eof = readdir_rsp.eof;
+        if(n_entries)
+            *n_entries = readdir_rsp.n_entries;
+        if(next_index)
+            *next_index = readdir_rsp.index;
+    }
+    free(rsp);
+
+    return error;
+}
+
+/*
+ * readdir from *index* into the caller's *arena* of *arena_size* bytes,
+ * decoding the response in a single pass with no allocation. Entries are
+ * rfs_dirent_compact_t, walked with RFS_DIRENT_NEXT. At most
+ * *max_entries* are returned, 0 leaves the page size to the server.
+ * Unless *eof* is set the listing goes on from *next_index*, also when
+ * the arena filled up before the entries returned ran out. Returns
+ * -EINVAL if the arena can't hold a single entry.
+ */
+int rfs_readdir_arena(cid_t  cid,
+        fid_t          dfid,
+        uint64_t       index,
+        uint32_t       max_entries,  // entries to return at most, 0 for any
+        void           *arena,
+        size_t         arena_size,
+        __int32_t      *eof,         // true, for end of directory
+        uint32_t       *n_entries,   // number of entries decoded
+        uint64_t       *next_index)  // index to go on from
+{
+    return readdir_arena(OP_READDIR, cid, dfid, index, max_entries, arena, arena_size,
+            eof, n_entries, next_index);
+}
+
+/*
+ * rfs_readdir_arena() that also returns each entry's attributes and
+ * symlink target length, saving a getattr per entry. Entries are
+ * rfs_direntplus_t, walked with RFS_DIRENTPLUS_NEXT.
+ */
+int rfs_readdirplus(cid_t  cid,
+        fid_t          dfid,
+        uint64_t       index,
+        uint32_t       max_entries,  // entries to return at most, 0 for any
+        void           *arena,
+        size_t         arena_size,
+        __int32_t      *eof,         // true, for end of directory
+        uint32_t       *n_entries,   // number of entries decoded
+        uint64_t       *next_index)  // index to go on from
+{
+    return readdir_arena(OP_READDIRPLUS, cid, dfid, index, max_entries, arena, arena_size,
+            eof, n_entries, next_index);
+}
+
 
 int rfs_write(cid_t   cid,
         fid_t           fid,
@@ -330,48 +496,166 @@ int rfs_write(cid_t   cid,
         __int64_t       size,
         char            *buffer,
         __int64_t       *out_size)
+{
+    int error;
+
+    // Small writes wait in the channel's write-back buffer, if it has one
+    if ((error = wb_write(cid, fid, offset, size, buffer, out_size)) != -EOPNOTSUPP)
+        return error;
+    return write_now(cid, fid, offset, size, buffer, out_size);
+}
+
+/*
+ * rfs_write() past the write-back buffer, for the writes it does not
+ * take and the data it sends.
+ */
+int write_now(cid_t   cid,
+        fid_t           fid,
+        uint64_t        offset,
+        __int64_t       size,
+        char            *buffer,
+        __int64_t       *out_size)
 {
     int32_t error = 0;
-    rfs_arg_write_t *write = NULL;
+    rfs_arg_write_t write;
     rfs_request_t *req = NULL;
     rfs_response_t *rsp = NULL;
     rfs_rsp_write_t write_rsp = {0};
+    struct iovec iov;
     void *buf = NULL;
 
-    write = malloc(sizeof(rfs_arg_write_t)+size);
-    if(write == NULL) {
-        perror("Failed to allocate write buffer.\n");
-        error = -ENOMEM;
+    write.op  = OP_WRITE;
+    write.cid = cid;
+    write.fid = fid;
+    write.offset = offset;
+    write.size   = size;
+
+    // Pass the data through the shared ring if the channel has one
+    if ((error = shm_write(cid, fid, offset, size, buffer, out_size)) != -EOPNOTSUPP) {
+        cache_complete(cid, &write, error, NULL);
         return error;
     }
-    write->op  = OP_WRITE;
-    write->cid = cid;
-    write->fid = fid;
-    write->offset = offset;
-    write->size   = size;
-    memcpy(write->buffer, buffer, size);
-    // Serialize the request
-    if ((req = serialize_request((void *)write)) == NULL) {
+    error = 0;
+    // Serialize all but the data, which is sent from the caller's buffer
+    if ((req = serialize_write_preamble(&write)) == NULL) {
         perror("serialize request error");
-        exit(-1);
+        return -ENOMEM;
     }
+    iov.iov_base = buffer;
+    iov.iov_len = size;
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_iov(cid, req, &iov, 1, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_write(buf, rsp->size, &write_rsp);
     error = write_rsp.error; /* assign error */
+    cache_complete(cid, &write, error, NULL);
     if(error == 0) {
         /* copy responses back to user args */
         if(out_size)
             memcpy(out_size, &write_rsp.size, sizeof(__int64_t));
     }
-    free(write);
-    free(req);
+    free(rsp);
+
+    return error;
+}
+
+
+int rfs_writev(cid_t   cid,
+        fid_t           fid,
+        const rfs_seg_t *segs,
+        uint32_t        n_segs,
+        __int64_t       *out_size)
+{
+    int32_t error = 0;
+    rfs_arg_writev_t writev;
+    rfs_request_t *req = NULL;
+    rfs_response_t *rsp = NULL;
+    rfs_rsp_write_t write_rsp = {0};
+    struct iovec iov[RFS_MAX_SEGS];
+    uint32_t i;
+
+    if (n_segs > RFS_MAX_SEGS)
+        return -EINVAL;
+    // Buffered writes of the file go first
+    if ((error = wb_flush(cid, fid)) != 0)
+        return error;
+
+    writev.op  = OP_WRITEV;
+    writev.cid = cid;
+    writev.fid = fid;
+    writev.n_segs = n_segs;
+    writev.segs = segs;
+    // Serialize all but the data, which is sent from the segments' buffers
+    if ((req = serialize_writev_preamble(&writev)) == NULL) {
+        perror("serialize request error");
+        return -ENOMEM;
+    }
+    for (i = 0; i < n_segs; i++) {
+        iov[i].iov_base = segs[i].buf;
+        iov[i].iov_len = segs[i].size;
+    }
+
+    /* Perform socket I/O */
+    if((error = rfs_socket_iov(cid, req, iov, n_segs, &rsp)) != 0) {
+        return error;
+    }
+
+    deserialize_rsp_write(rsp->payload, rsp->size, &write_rsp);
+    error = write_rsp.error; /* assign error */
+    cache_complete(cid, &writev, error, NULL);
+    if(error == 0 && out_size)
+        *out_size = write_rsp.size;
+    free(rsp);
+
+    return error;
+}
+
+
+int rfs_readv(cid_t   cid,
+        fid_t           fid,
+        const rfs_seg_t *segs,
+        uint32_t        n_segs,
+        __int64_t       *out_sizes)
+{
+    int32_t error = 0;
+    rfs_arg_readv_t readv;
+    rfs_request_t *req = NULL;
+    rfs_response_t *rsp = NULL;
+    rfs_rsp_readv_t readv_rsp = {0};
+    __int64_t sizes[RFS_MAX_SEGS];
+
+    if (n_segs > RFS_MAX_SEGS)
+        return -EINVAL;
+    // Buffered writes of the file go first
+    if ((error = wb_flush(cid, fid)) != 0)
+        return error;
+
+    readv.op  = OP_READV;
+    readv.cid = cid;
+    readv.fid = fid;
+    readv.n_segs = n_segs;
+    readv.segs = segs;
+    // Serialize the request
+    if ((req = serialize_request_tls((void *)&readv)) == NULL) {
+        perror("serialize request error");
+        return -ENOMEM;
+    }
+
+    /* Perform socket I/O */
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
+    }
+
+    readv_rsp.n_segs = n_segs;
+    readv_rsp.sizes = out_sizes ? out_sizes : sizes;
+    if (deserialize_rsp_readv(rsp->payload, rsp->size, &readv_rsp, segs) != 0)
+        error = -EIO;
+    else
+        error = readv_rsp.error;
     free(rsp);
 
     return error;
@@ -389,44 +673,50 @@ int rfs_read(cid_t   cid,
     rfs_arg_read_t read;
     rfs_request_t *req = NULL;
     rfs_response_t *rsp = NULL;
-    rfs_rsp_read_t *read_rsp = NULL;
-    void *buf = NULL;
+    rfs_rsp_read_t read_rsp = {0};
+    rfs_pending_t p = {0};
 
-    read_rsp = malloc(sizeof(rfs_rsp_read_t)+ (size_t)size);
-    if(read_rsp == NULL) {
-        error = -ENOMEM;
+    // Buffered writes of the file go first
+    if ((error = wb_flush(cid, fid)) != 0)
         return error;
-    }
+    // Blocks kept by the channel's block cache, if it has one
+    if ((error = block_cache_read(cid, fid, offset, size, out_size, buffer)) != -EOPNOTSUPP)
+        return error;
+    // Pass the data through the shared ring if the channel has one
+    if ((error = shm_read(cid, fid, offset, size, out_size, buffer)) != -EOPNOTSUPP)
+        return error;
+    error = 0;
+
     read.op  = OP_READ;
     read.cid = cid;
     read.fid = fid;
     read.offset = offset;
     read.size   = size;
     // Serialize the request
-    if ((req = serialize_request((void *)&read)) == NULL) {
+    if ((req = serialize_request_tls((void *)&read)) == NULL) {
         perror("serialize request error");
-        exit(-1);
+        return -ENOMEM;
     }
 
-    /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    /* Perform socket I/O, large data is streamed straight into buffer */
+    p.buf = buffer;
+    p.len = size;
+    p.stream = 1;
+    if((error = socket_call(cid, req, NULL, 0, &p, &rsp)) != 0) {
+        return error;
     }
-
-    buf = rsp->payload;
-    deserialize_rsp_read(buf, rsp->size, read_rsp);
-    error = read_rsp->error;
-    if(error == 0)
-    {
-        /* copy responses back to user args */
+    if (p.streamed >= 0) {
         if(out_size)
-            memcpy(out_size, &read_rsp->size, sizeof(__int64_t));
-        if(buffer)
-            memcpy(buffer, read_rsp->buffer, (size_t)read_rsp->size);
+            *out_size = p.streamed;
+        free(rsp);
+        return 0;
     }
-    free(read_rsp);
-    free(req);
+
+    // Small reads are copied once, from the response into buffer
+    deserialize_rsp_read_into(rsp->payload, rsp->size, &read_rsp, buffer, size);
+    error = read_rsp.error;
+    if(error == 0 && out_size)
+        *out_size = read_rsp.size;
     free(rsp);
 
     return error;
@@ -453,26 +743,25 @@ int rfs_mkdir(cid_t  cid,
     mkdir.attr = attr_in;
     mkdir.dname = dname;
     // Serialize the request
-    if ((req = serialize_request((void *)&mkdir)) == NULL) {
+    if ((req = serialize_request_tls((void *)&mkdir)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_mkdir(buf, rsp->size, &mkdir_rsp);
     error = mkdir_rsp.error;
+    cache_complete(cid, &mkdir, error, &mkdir_rsp.attr);
     if(error == 0) {
         /* copy responses back to user args */
         if(attr_out)
             memcpy(attr_out, &mkdir_rsp.attr, sizeof(FileAttr));
     }
-    free(req);
     free(rsp);
 
     return error;
@@ -509,26 +798,25 @@ int rfs_symlink(cid_t cid,
     link_path_int.name[NAME_MAX-1] = '\0';
     symlink.link_path = link_path_int;
     // Serialize the request
-    if ((req = serialize_request((void *)&symlink)) == NULL) {
+    if ((req = serialize_request_tls((void *)&symlink)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_symlink(buf, rsp->size, &symlink_rsp);
     error = symlink_rsp.error;
+    cache_complete(cid, &symlink, error, &symlink_rsp.attr);
     if(error == 0) {
         /* copy responses back to user args */
         if(attr_out)
             memcpy(attr_out, &symlink_rsp.attr, sizeof(FileAttr));
     }
-    free(req);
     free(rsp);
 
     return error;
@@ -550,21 +838,20 @@ int rfs_unlink(cid_t  cid,
     unlink.p_fid = p_fid;
     unlink.name = name;
     // Serialize the request
-    if ((req = serialize_request((void *)&unlink)) == NULL) {
+    if ((req = serialize_request_tls((void *)&unlink)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_unlink(buf, rsp->size, &unlink_rsp);
     error = unlink_rsp.error; /* assign error */
-    free(req);
+    cache_complete(cid, &unlink, error, NULL);
     free(rsp);
 
     return error;
@@ -588,21 +875,20 @@ int rfs_link(cid_t  cid,
     link.fid = fid;
     link.name = name;
     // Serialize the request
-    if ((req = serialize_request((void *)&link)) == NULL) {
+    if ((req = serialize_request_tls((void *)&link)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_link(buf, rsp->size, &link_rsp);
     error = link_rsp.error; /* assign error */
-    free(req);
+    cache_complete(cid, &link, error, NULL);
     free(rsp);
 
     return error;
@@ -624,21 +910,20 @@ int rfs_rmdir(cid_t  cid,
     rmdir.p_fid = p_fid;
     rmdir.name = name;
     // Serialize the request
-    if ((req = serialize_request((void *)&rmdir)) == NULL) {
+    if ((req = serialize_request_tls((void *)&rmdir)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_rmdir(buf, rsp->size, &rmdir_rsp);
     error = rmdir_rsp.error; /* assign error */
-    free(req);
+    cache_complete(cid, &rmdir, error, NULL);
     free(rsp);
 
     return error;
@@ -664,21 +949,20 @@ int rfs_rename(cid_t  cid,
     rename.old_name = old_name;
     rename.new_name = new_name;
     // Serialize the request
-    if ((req = serialize_request((void *)&rename)) == NULL) {
+    if ((req = serialize_request_tls((void *)&rename)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_rename(buf, rsp->size, &rename_rsp);
     error = rename_rsp.error; /* assign error */
-    free(req);
+    cache_complete(cid, &rename, error, NULL);
     free(rsp);
 
     return error;
@@ -693,41 +977,38 @@ int rfs_readlink(cid_t   cid,
     rfs_arg_readlink_t readlink;
     rfs_request_t *req = NULL;
     rfs_response_t *rsp = NULL;
-    rfs_rsp_readlink_t *readlink_rsp = NULL;
+    rfs_rsp_read_t readlink_rsp = {0};
     void *buf = NULL;
 
-    readlink_rsp = malloc(sizeof(rfs_rsp_readlink_t)+ (size_t)PATH_MAX);
-    if(readlink_rsp == NULL) {
-        error = -ENOMEM;
-        return error;
-    }
+    // Targets read before, or that came with a lookup or getattr
+    if (link_cache_get(cid, fid, buffer, out_size))
+        return 0;
+
     readlink.op  = OP_READLINK;
     readlink.cid = cid;
     readlink.fid = fid;
     // Serialize the request
-    if ((req = serialize_request((void *)&readlink)) == NULL) {
+    if ((req = serialize_request_tls((void *)&readlink)) == NULL) {
         perror("serialize request error");
-        exit(-1);
+        return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
-    deserialize_rsp_readlink(buf, rsp->size, readlink_rsp);
-    error = readlink_rsp->error;
+    // The target goes straight into buffer, of PATH_MAX bytes
+    deserialize_rsp_read_into(buf, rsp->size, &readlink_rsp, buffer, PATH_MAX);
+    error = readlink_rsp.error;
     if(error == 0) {
         /* copy responses back to user args */
         if(out_size)
-            memcpy(out_size, &readlink_rsp->size, sizeof(__int64_t));
+            memcpy(out_size, &readlink_rsp.size, sizeof(__int64_t));
         if(buffer)
-            memcpy(buffer, readlink_rsp->buffer, (size_t)readlink_rsp->size);
+            link_cache_put(cid, fid, buffer, readlink_rsp.size);
     }
-    free(readlink_rsp);
-    free(req);
     free(rsp);
 
     return error;
@@ -755,26 +1036,25 @@ int rfs_mknod(cid_t  cid,
     mknod.attr = attr_in;
     mknod.fname = name;
     // Serialize the request
-    if ((req = serialize_request((void *)&mknod)) == NULL) {
+    if ((req = serialize_request_tls((void *)&mknod)) == NULL) {
       perror("serialize request error");
-      exit(-1);
+      return -ENOMEM;
     }
 
     /* Perform socket I/O */
-    if(rfs_socket_io(cid, req, &rsp)) {
-        perror("socket io failed");
-        exit(-1);
+    if((error = rfs_socket_io(cid, req, &rsp)) != 0) {
+        return error;
     }
 
     buf = rsp->payload;
     deserialize_rsp_mknod(buf, rsp->size, &mknod_rsp);
     error = mknod_rsp.error;
+    cache_complete(cid, &mknod, error, &mknod_rsp.attr);
     if(error == 0) {
         /* copy responses back to user args */
         if(attr_out)
             memcpy(attr_out, &mknod_rsp.attr, sizeof(FileAttr));
     }
-    free(req);
     free(rsp);
 
     return error;
@@ -4,6 +4,215 @@
 
 #include "ravana.h"
 
+/*
+ * A channel is a persistent connection to the dispatcher of one cid.
+ * rfs_* calls open the channel for their cid on first use and reuse it
+ * afterwards; rfs_channel_open() may be called up front to connect
+ * eagerly. Channels are safe to share between threads. They do not
+ * survive fork(): the child starts with no channels, and opens its own
+ * on first use, so handles opened before the fork must not be used in
+ * the child. Writes buffered by the parent are left to the parent.
+ */
+typedef struct rfs_channel rfs_channel_t;
+
+rfs_channel_t *rfs_channel_open(cid_t cid);
+
+void rfs_channel_close(rfs_channel_t *ch);
+
+/*
+ * Deadlines. rfs_channel_timeout() bounds every call on ch, connecting,
+ * sending and waiting for the response included, to timeout_ms;
+ * rfs_call_timeout() does the same for the calls of the calling thread
+ * on any channel, overriding the channel's timeout until it is set back
+ * to -1. A call that runs out of time returns -ETIMEDOUT, one whose
+ * dispatcher cannot be reached -EIO. By default calls wait for ever.
+ */
+int rfs_channel_timeout(rfs_channel_t *ch,
+        int             timeout_ms);
+
+void rfs_call_timeout(int timeout_ms);
+
+/*
+ * Shared memory transport. rfs_channel_shm() shares a ring of n_slots
+ * slots of slot_size bytes with the dispatcher; from then on rfs_read()
+ * and rfs_write() on the channel's cid pass data that fits a slot
+ * through the ring instead of the socket. Call it before the channel has
+ * requests outstanding. Returns -EOPNOTSUPP if the dispatcher does not
+ * take the ring, the channel keeps working over the socket then.
+ */
+int rfs_channel_shm(rfs_channel_t *ch,
+        uint32_t        n_slots,
+        uint32_t        slot_size);
+
+/*
+ * Wire format. rfs_channel_packed() has the dispatcher answer in protocol
+ * version 3, FileAttrs and ids in a fixed layout decoded with plain loads.
+ * Call it before the channel has requests outstanding. Returns
+ * -EOPNOTSUPP if the dispatcher does not know version 3, the channel
+ * keeps to version 2 then.
+ */
+int rfs_channel_packed(rfs_channel_t *ch);
+
+/*
+ * Attribute cache. rfs_channel_attr_cache() keeps the FileAttrs returned
+ * by any call on the channel's cid, for up to n_entries files, and
+ * rfs_getattr() answers from them for ttl_ms after they arrived. The
+ * channel's own setattr, write, create, link, unlink, rename and the
+ * like drop the attributes they change; changes made by other clients
+ * show once the ttl runs out. A ttl_ms of 0 turns the cache off. Call it
+ * before the channel is shared between threads; it may be called again
+ * to change the ttl, with the same n_entries.
+ */
+int rfs_channel_attr_cache(rfs_channel_t *ch,
+        uint32_t        n_entries,
+        int             ttl_ms);
+
+/*
+ * Dentry cache. rfs_channel_dentry_cache() keeps up to n_entries names
+ * looked up, created or removed on the channel's cid, with the fid they
+ * are of or, after ENOENT, the fact that they don't exist. rfs_lookup()
+ * fails with ENOENT on a name known not to exist, and answers a name
+ * found from the attribute cache when that has its file. The channel's
+ * own create, mkdir, link, unlink, rmdir, rename and the like keep it up
+ * to date. Changes made by other clients are seen after ttl_ms, or not
+ * until the name is evicted with a ttl_ms of 0. The least recently used
+ * names are evicted first. An n_entries of 0 turns the cache off. Call
+ * it before the channel is shared between threads.
+ */
+int rfs_channel_dentry_cache(rfs_channel_t *ch,
+        uint32_t        n_entries,
+        int             ttl_ms);
+
+/*
+ * Symlink target cache. rfs_channel_link_cache() keeps the targets of up
+ * to n_entries symlinks, by fid, for rfs_readlink() to answer from. They
+ * come from the channel's readlinks and symlinks, and from its lookups
+ * and getattrs of symlinks, whose responses carry the target when it is
+ * no longer than NAME_MAX, so a path walk through a symlink takes no
+ * readlink. A symlink's target never changes, the entries are good until
+ * evicted. Call it before the channel is shared between threads.
+ */
+int rfs_channel_link_cache(rfs_channel_t *ch,
+        uint32_t        n_entries);
+
+/*
+ * Block cache. rfs_channel_block_cache() keeps up to n_blocks blocks of
+ * RFS_BLOCK_SIZE bytes of the files rfs_read() reads on the channel's
+ * cid. Reads that go on from where the previous read of the file ended
+ * are taken for a stream, and the blocks after it are read ahead
+ * without waiting, in windows that grow from 4 blocks to max_readahead
+ * as the stream goes on; a max_readahead of 0 reads nothing ahead.
+ * Blocks are checked against the mtime and size of the file from
+ * rfs_getattr(), so turn on the attribute cache as well, else every
+ * read costs a getattr. The channel's own writes and setattrs drop the
+ * blocks of the file. Writes in place by other clients change neither
+ * the size nor, reliably, the mtime, so blocks are good only for the
+ * attribute cache's ttl after they were read, or 3 s without one; such
+ * writes are seen within that, as with the attribute cache. Call it before the channel is shared between
+ * threads; it may be called again to change max_readahead, with the
+ * same n_blocks.
+ */
+int rfs_channel_block_cache(rfs_channel_t *ch,
+        uint32_t        n_blocks,
+        uint32_t        max_readahead);
+
+/*
+ * Write-back. rfs_channel_write_back() has rfs_write() on the channel's
+ * cid keep writes smaller than max_bytes and return at once, merging
+ * those that overlap or follow each other in a file into one write of
+ * whole blocks where it can, so the dispatcher reads back fewer partial
+ * blocks and logs fewer writes. Buffered data is sent once it would
+ * grow past max_bytes, by the first write on the channel after it is
+ * delay_ms old (0 for no such limit), before any read, getattr or
+ * setattr of the file through the channel, by rfs_flush() and by
+ * rfs_channel_close(). The error of a buffered write is returned by the
+ * call that sends it. Call it before the channel is shared between
+ * threads; it may be called again to change delay_ms, with the same
+ * max_bytes.
+ */
+int rfs_channel_write_back(rfs_channel_t *ch,
+        uint32_t        max_bytes,
+        int             delay_ms);
+
+/*
+ * Send the data of fid buffered on the channel of cid, as on fsync() or
+ * close().
+ */
+int rfs_flush(cid_t cid,
+        fid_t           fid);
+
+typedef struct rfs_cache_stats {
+    __uint64_t      attr_hits;      // attributes found in the cache
+    __uint64_t      attr_misses;    // attributes sent for
+    __uint64_t      dentry_hits;    // names found
+    __uint64_t      dentry_negative_hits; // names found not to exist
+    __uint64_t      dentry_misses;  // names not cached
+    __uint64_t      link_hits;      // symlink targets found in the cache
+    __uint64_t      link_misses;    // symlink targets sent for
+    __uint64_t      block_hits;     // blocks read from the cache
+    __uint64_t      block_misses;   // blocks read from the dispatcher
+    __uint64_t      block_read_ahead; // blocks read ahead
+    __uint64_t      wb_writes;      // writes buffered
+    __uint64_t      wb_requests;    // writes sent for them, oplog entries
+    __uint64_t      wb_rmw_asked;   // partial blocks of the writes buffered
+    __uint64_t      wb_rmw_sent;    // partial blocks of the writes sent
+} rfs_cache_stats_t;
+
+int rfs_channel_cache_stats(rfs_channel_t *ch,
+        rfs_cache_stats_t *stats);
+
+/*
+ * Pipelining. rfs_channel_send() sends a serialized request and returns
+ * without waiting; the response is collected with the returned tag by
+ * rfs_channel_recv(), in any order and from any thread.
+ */
+int rfs_channel_send(rfs_channel_t *ch,
+        rfs_request_t   *req,
+        __uint64_t      *tag);
+
+int rfs_channel_recv(rfs_channel_t *ch,
+        __uint64_t      tag,
+        rfs_response_t  **rsp);
+
+/*
+ * Asynchronous interface. rfs_submit() queues any rfs_arg_* on a channel
+ * and returns immediately; rfs_poll() and rfs_wait() reap completions.
+ * rfs_batch() runs several in one round trip and waits for them.
+ */
+typedef struct rfs_cqe {
+    void            *cookie;    // cookie passed to rfs_submit()
+    rfs_file_op_t   op;         // op of the request completed
+    __int32_t       error;      // POSIX error, or -errno from the client
+    union {
+        FileAttr    attr;       // CREATE, MKNOD, LOOKUP, GETATTRS, MKDIR, SYMLINK
+        __int64_t   size;       // READ, WRITE, READLINK: bytes transferred
+        struct {
+            __int32_t       eof;        // true, for end of directory
+            uint32_t        n_entries;  // number of entries returned
+            rfs_dirent_t    *entries;   // freed by the caller
+        } readdir;              // READDIR
+    } u;
+} rfs_cqe_t;
+
+int rfs_submit(rfs_channel_t *ch,
+        void            *arg,
+        void            *buf,
+        void            *cookie);
+
+int rfs_poll(rfs_channel_t *ch,
+        rfs_cqe_t       *cqes,
+        int             max);
+
+int rfs_wait(rfs_channel_t *ch,
+        rfs_cqe_t       *cqes,
+        int             min,
+        int             max);
+
+int rfs_batch(cid_t cid,
+        void * const    *args,
+        uint32_t        n_ops,
+        rfs_cqe_t       *cqes);
+
 int rfs_create(cid_t cid,
         fid_t p_fid,
         uint32_t      attr_mask,
@@ -16,6 +225,30 @@ int rfs_lookup(cid_t  cid,
         file_name_t   fname,
         FileAttr      *attr_out);
 
+/*
+ * Run the n_ops (at most RFS_MAX_COMPOUND) OP_LOOKUP and OP_GETATTRS ops
+ * ops on fid in one round trip, each on the fid the previous one
+ * resolved. The results of the ops run, up to and including the first
+ * that failed, are returned in res[0..*n_res-1]. Returns the error of the
+ * last op run.
+ */
+int rfs_compound(cid_t  cid,
+        fid_t         fid,
+        const rfs_compound_op_t *ops,
+        uint32_t      n_ops,
+        uint32_t      *n_res,
+        rfs_compound_res_t *res);
+
+/*
+ * Look up the '/' separated path relative to dfid, RFS_MAX_COMPOUND
+ * components per round trip, and return the attributes of its last
+ * component.
+ */
+int rfs_lookup_path(cid_t  cid,
+        fid_t         dfid,
+        const char    *path,
+        FileAttr      *attr_out);
+
 int rfs_setattr(cid_t cid,
         fid_t         fid,
         uint32_t      attr_mask,
@@ -32,6 +265,26 @@ int rfs_readdir(cid_t  cid,
         uint32_t       *n_entries,   // number of entries returned
         rfs_dirent_t   **entries);
 
+int rfs_readdir_arena(cid_t  cid,
+        fid_t          dfid,
+        uint64_t       index,
+        uint32_t       max_entries,  // entries to return at most, 0 for any
+        void           *arena,
+        size_t         arena_size,
+        __int32_t      *eof,         // true, for end of directory
+        uint32_t       *n_entries,   // number of entries decoded
+        uint64_t       *next_index); // index to go on from
+
+int rfs_readdirplus(cid_t  cid,
+        fid_t          dfid,
+        uint64_t       index,
+        uint32_t       max_entries,  // entries to return at most, 0 for any
+        void           *arena,
+        size_t         arena_size,
+        __int32_t      *eof,         // true, for end of directory
+        uint32_t       *n_entries,   // number of entries decoded
+        uint64_t       *next_index); // index to go on from
+
 int rfs_write(cid_t   cid,
         fid_t           fid,
         uint64_t        offset,
@@ -46,6 +299,24 @@ int rfs_read(cid_t   cid,
         __int64_t       *out_size,
         char            *buffer);
 
+/*
+ * Vectored write and read of the n_segs (offset, size, buf) segments
+ * segs of fid, at most RFS_MAX_SEGS, in one request. rfs_writev() returns
+ * the total size written in out_size, rfs_readv() the size read into each
+ * segment, short at end of file, in out_sizes[0..n_segs-1].
+ */
+int rfs_writev(cid_t   cid,
+        fid_t           fid,
+        const rfs_seg_t *segs,
+        uint32_t        n_segs,
+        __int64_t       *out_size);
+
+int rfs_readv(cid_t   cid,
+        fid_t           fid,
+        const rfs_seg_t *segs,
+        uint32_t        n_segs,
+        __int64_t       *out_sizes);
+
 
 int rfs_mkdir(cid_t   cid,
         fid_t         p_fid,
@@ -0,0 +1,169 @@
+#ifndef __RAVANA_OPS_H_
+#define __RAVANA_OPS_H_
+
+/*
+ * Schema of the ops whose requests and responses are flat lists of fields.
+ *
+ * A request is the op code, the channel id and then the fields of its
+ * RFS_ARG_<OP>, a response is the POSIX error and then the fields of its
+ * RFS_RSP_<OP>, in the order listed. The rfs_arg_* and rfs_rsp_*
+ * structures below, their encoders and decoders in ravana_serialize.c,
+ * the dispatcher's request decoders and response encoders in
+ * src/SerializeOps.jl and ravana_bench_codec are all expanded from these
+ * lists, so a field is added here and nowhere else; SerializeOps.jl is
+ * generated by ravana_gen_ops.c and checked in, regenerate it after
+ * changing a list. Fields are only ever
+ * added at the end of a list: whoever decodes takes the fields missing at
+ * the end of an older peer's message as 0.
+ *
+ * Field types, and how they travel:
+ *   FID   fid_t or cid_t, two uint64 (lower, upper) or a version 3 id bin
+ *   U32, U64, I32, I64   integers of that width
+ *   NAME  file_name_t, a bin of name_len bytes
+ *   ATTR  FileAttr, field by field or a version 3 attr bin
+ *
+ * Ops carrying data or lists of things (write, readv, writev, compound,
+ * batch, and the responses of read, readlink, readdir, readv, compound
+ * and batch) are encoded by hand.
+ */
+
+#define RFS_ARG_CREATE(F)                                                   \
+    F(FID,  p_fid)          /* parent file id */                            \
+    F(U32,  attr_mask)      /* attr mask to set */                          \
+    F(NAME, fname)          /* File name */                                 \
+    F(ATTR, attr)           /* Attributes to set */
+
+#define RFS_ARG_LOOKUP(F)                                                   \
+    F(FID,  dfid)           /* Parent dir's fid */                          \
+    F(NAME, fname)          /* File name */
+
+#define RFS_ARG_SETATTR(F)                                                  \
+    F(FID,  fid)            /* file id */                                   \
+    F(U32,  attr_mask)      /* attr mask to set */                          \
+    F(ATTR, attr)           /* attrs to set */
+
+#define RFS_ARG_GETATTR(F)                                                  \
+    F(FID,  fid)            /* file id */
+
+/* OP_READDIR and OP_READDIRPLUS */
+#define RFS_ARG_READDIR(F)                                                  \
+    F(FID,  d_fid)          /* directory file id */                         \
+    F(U64,  index)          /* index to start from */                       \
+    F(U32,  max_entries)    /* entries to return at most, 0 for the default */ \
+    F(U32,  max_bytes)      /* encoded size of the entries at most, 0 for any */
+
+#define RFS_ARG_READ(F)                                                     \
+    F(FID,  fid)            /* file id */                                   \
+    F(U64,  offset)         /* read request offset */                       \
+    F(I64,  size)           /* read request size */
+
+#define RFS_ARG_MKDIR(F)                                                    \
+    F(FID,  p_fid)          /* parent dir id */                             \
+    F(U32,  attr_mask)      /* attr mask to set */                          \
+    F(NAME, dname)          /* Dir name */                                  \
+    F(ATTR, attr)           /* attrs to set */
+
+#define RFS_ARG_SYMLINK(F)                                                  \
+    F(FID,  p_fid)          /* parent dir id */                             \
+    F(U32,  attr_mask)      /* attr mask to set */                          \
+    F(NAME, name)           /* Link name */                                 \
+    F(ATTR, attr)           /* attrs to set */                              \
+    F(NAME, link_path)      /* path to link to */
+
+#define RFS_ARG_LINK(F)                                                     \
+    F(FID,  p_fid)          /* parent dir id */                             \
+    F(FID,  fid)            /* file id to link to */                        \
+    F(NAME, name)           /* Link name */
+
+/* OP_UNLINK and OP_RMDIR */
+#define RFS_ARG_UNLINK(F)                                                   \
+    F(FID,  p_fid)          /* parent file id */                            \
+    F(NAME, name)           /* file name */
+
+#define RFS_ARG_RENAME(F)                                                   \
+    F(FID,  old_dfid)       /* parent file id */                            \
+    F(NAME, old_name)       /* Link name */                                 \
+    F(FID,  new_dfid)       /* parent file id */                            \
+    F(NAME, new_name)       /* Link name */
+
+#define RFS_ARG_READLINK(F)                                                 \
+    F(FID,  fid)            /* link file id */
+
+/* The ring's memfd goes along with the request, as SCM_RIGHTS */
+#define RFS_ARG_SHM_ATTACH(F)                                               \
+    F(U32,  n_slots)        /* number of slots in the ring */               \
+    F(U32,  slot_size)      /* size of a slot */
+
+/* Requests expanded from the schema, as X(name, NAME) */
+#define RFS_FLAT_ARGS(X)                                                    \
+    X(create, CREATE)                                                       \
+    X(lookup, LOOKUP)                                                       \
+    X(setattr, SETATTR)                                                     \
+    X(getattr, GETATTR)                                                     \
+    X(readdir, READDIR)                                                     \
+    X(read, READ)                                                           \
+    X(mkdir, MKDIR)                                                         \
+    X(symlink, SYMLINK)                                                     \
+    X(link, LINK)                                                           \
+    X(unlink, UNLINK)                                                       \
+    X(rename, RENAME)                                                       \
+    X(readlink, READLINK)                                                   \
+    X(shm_attach, SHM_ATTACH)
+
+/* OP_CREATE, OP_MKNOD, OP_MKDIR and OP_SYMLINK */
+#define RFS_RSP_ATTR(F)                                                     \
+    F(ATTR, attr)           /* Attributes of the file */
+
+/* OP_LOOKUP and OP_GETATTRS. A symlink's target comes along when it fits
+ * a name, link.name_len is then attr.size; it is empty otherwise. */
+#define RFS_RSP_ATTR_LINK(F)                                                \
+    F(ATTR, attr)           /* Attributes of the file */                    \
+    F(NAME, link)           /* Target of the symlink */
+
+#define RFS_RSP_ERROR(F)    /* The error alone */
+
+#define RFS_RSP_WRITE(F)                                                    \
+    F(I64,  size)           /* written size */
+
+/* Responses expanded from the schema, as X(name, NAME) */
+#define RFS_FLAT_RSPS(X)                                                    \
+    X(create, ATTR)                                                         \
+    X(mknod, ATTR)                                                          \
+    X(lookup, ATTR_LINK)                                                    \
+    X(getattr, ATTR_LINK)                                                   \
+    X(mkdir, ATTR)                                                          \
+    X(symlink, ATTR)                                                        \
+    X(setattr, ERROR)                                                       \
+    X(link, ERROR)                                                          \
+    X(unlink, ERROR)                                                        \
+    X(rename, ERROR)                                                        \
+    X(shm_attach, ERROR)                                                    \
+    X(write, WRITE)
+
+/* C types of the field types */
+#define RFS_CTYPE_FID       fid_t
+#define RFS_CTYPE_U32       uint32_t
+#define RFS_CTYPE_U64       uint64_t
+#define RFS_CTYPE_I32       __int32_t
+#define RFS_CTYPE_I64       __int64_t
+#define RFS_CTYPE_NAME      file_name_t
+#define RFS_CTYPE_ATTR      FileAttr
+
+#define RFS_FIELD_DECL(type, name)  RFS_CTYPE_##type name;
+
+#define RFS_ARG_STRUCT(name, NAME)                                          \
+    typedef struct rfs_arg_##name {                                         \
+        rfs_file_op_t op;   /* operation code */                            \
+        cid_t         cid;  /* channel id */                                \
+        RFS_ARG_##NAME(RFS_FIELD_DECL)                                      \
+    } rfs_arg_##name##_t;
+
+/* A response that carries only an error is all that comes back for a
+ * failed op, the other fields are then 0. */
+#define RFS_RSP_STRUCT(name, NAME)                                          \
+    typedef struct rfs_rsp_##name {                                         \
+        __int32_t     error; /* POSIX error */                              \
+        RFS_RSP_##NAME(RFS_FIELD_DECL)                                      \
+    } rfs_rsp_##name##_t;
+
+#endif //  __RAVANA_OPS_H_
@@ -5,42 +5,20 @@
  */
 
 #include <errno.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <msgpack.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <endian.h>
 #include "ravana.h"
 
 #define UNPACKER_INIT()							\
     int ret = 0;							\
-    msgpack_unpacker pac;						\
-    msgpack_unpacked result;						\
-    msgpack_unpacker_init(&pac, MSGPACK_UNPACKER_INIT_BUFFER_SIZE);	\
-    msgpack_unpacker_reserve_buffer(&pac, size);			\
-    memcpy(msgpack_unpacker_buffer(&pac), packed_buf, size);		\
-    msgpack_unpacker_buffer_consumed(&pac, size);			\
-    msgpack_unpacked_init(&result);
+    rfs_unpacker_t pac = { (const unsigned char *)packed_buf, size };
 
 #define UNPACKER_FREE_AND_RETURN()	\
-    msgpack_unpacked_destroy(&result);	\
-    msgpack_unpacker_destroy(&pac);	\
-    return ret;				
-
-#define UNPACK_ERRNO_AND_ATTR()						\
-    unpack_generic_int32(&pac, &result, &response->error);		\
-    unpack_generic_uint32(&pac, &result, &response->attr.mode);		\
-    unpack_generic_uint32(&pac, &result, &response->attr.uid);		\
-    unpack_generic_uint32(&pac, &result, &response->attr.gid);		\
-    unpack_generic_uint32(&pac, &result, &response->attr.links);	\
-    unpack_generic_uint64(&pac, &result, &response->attr.size);		\
-    unpack_generic_uint128(&pac, &result, &response->attr.dev);		\
-    unpack_generic_uint128(&pac, &result, &response->attr.ino);		\
-    unpack_generic_uint32(&pac, &result, &response->attr.rdev);		\
-    unpack_generic_uint64(&pac, &result, &response->attr.atime.tv_sec);	\
-    unpack_generic_uint64(&pac, &result, &response->attr.atime.tv_nsec);	\
-    unpack_generic_uint64(&pac, &result, &response->attr.ctime.tv_sec);	\
-    unpack_generic_uint64(&pac, &result, &response->attr.ctime.tv_nsec);	\
-    unpack_generic_uint64(&pac, &result, &response->attr.mtime.tv_sec);	\
-    unpack_generic_uint64(&pac, &result, &response->attr.mtime.tv_nsec);	\
+    return ret;
 
 // Serialize file_name_t structure
 static inline int serialize_fname(msgpack_packer *pk, file_name_t *fname) {
@@ -74,130 +52,71 @@ static inline int serialize_attr(msgpack_packer *pk, FileAttr *attr) {
     return 0;
 }
 
+// Pack a field of the type given in ravana_ops.h
+#define PACK_FID(pk, v)     do {                                        \
+        msgpack_pack_uint64(pk, LOWER64(v));                            \
+        msgpack_pack_uint64(pk, UPPER64(v));                            \
+    } while (0)
+#define PACK_U32(pk, v)     msgpack_pack_uint32(pk, v)
+#define PACK_U64(pk, v)     msgpack_pack_uint64(pk, v)
+#define PACK_I32(pk, v)     msgpack_pack_int32(pk, v)
+#define PACK_I64(pk, v)     msgpack_pack_int64(pk, v)
+#define PACK_NAME(pk, v)    serialize_fname(pk, &(v))
+#define PACK_ATTR(pk, v)    serialize_attr(pk, &(v))
+#define PACK_FIELD(type, name)  PACK_##type(pk, arg->name);
+
+/* msgpack_pack_<op>() of each op in RFS_FLAT_ARGS: the op, the cid and
+ * the op's fields in order */
+#define PACK_ARG(name, NAME)                                                \
+static inline void msgpack_pack_##name(msgpack_packer *pk, rfs_arg_##name##_t *arg) { \
+    msgpack_pack_uint32(pk, arg->op);                                       \
+    PACK_FID(pk, arg->cid);                                                 \
+    RFS_ARG_##NAME(PACK_FIELD)                                              \
+}
+RFS_FLAT_ARGS(PACK_ARG)
 
+// Pack rfs_compound, each op followed by its name if it takes one
+static inline void msgpack_pack_compound(msgpack_packer *pk, rfs_arg_compound_t *cp) {
+    uint32_t i;
 
-// Pack an rfs_create argument
-static inline void msgpack_pack_create(msgpack_packer *pk, rfs_arg_create_t *cr) {
-    msgpack_pack_uint32(pk, cr->op);
-    msgpack_pack_uint64(pk, LOWER64(cr->cid));
-    msgpack_pack_uint64(pk, UPPER64(cr->cid));
-    msgpack_pack_uint64(pk, LOWER64(cr->p_fid));
-    msgpack_pack_uint64(pk, UPPER64(cr->p_fid));
-    msgpack_pack_uint32(pk, cr->attr_mask);
-    serialize_fname(pk, &cr->fname);
-    serialize_attr(pk, &cr->attr);
-}
-
-// Pack an rfs_symlink argument
-static inline void msgpack_pack_symlink(msgpack_packer *pk, rfs_arg_symlink_t *sym) {
-    msgpack_pack_uint32(pk, sym->op);
-    msgpack_pack_uint64(pk, LOWER64(sym->cid));
-    msgpack_pack_uint64(pk, UPPER64(sym->cid));
-    msgpack_pack_uint64(pk, LOWER64(sym->p_fid));
-    msgpack_pack_uint64(pk, UPPER64(sym->p_fid));
-    msgpack_pack_uint32(pk, sym->attr_mask);
-    serialize_fname(pk, &sym->name);
-    serialize_attr(pk, &sym->attr);
-    serialize_fname(pk, &sym->link_path); 
-}
-
-// Pack an rfs_rename argument
-static inline void msgpack_pack_rename(msgpack_packer *pk, rfs_arg_rename_t *rn) {
-    msgpack_pack_uint32(pk, rn->op);
-    msgpack_pack_uint64(pk, LOWER64(rn->cid));
-    msgpack_pack_uint64(pk, UPPER64(rn->cid));
-    msgpack_pack_uint64(pk, LOWER64(rn->old_dfid));
-    msgpack_pack_uint64(pk, UPPER64(rn->old_dfid));
-    serialize_fname(pk, &rn->old_name);
-    msgpack_pack_uint64(pk, LOWER64(rn->new_dfid));
-    msgpack_pack_uint64(pk, UPPER64(rn->new_dfid));
-    serialize_fname(pk, &rn->new_name);
-}
-
-// Pack an rfs_link argument
-static inline void msgpack_pack_link(msgpack_packer *pk, rfs_arg_link_t *l) {
-    msgpack_pack_uint32(pk, l->op);
-    msgpack_pack_uint64(pk, LOWER64(l->cid));
-    msgpack_pack_uint64(pk, UPPER64(l->cid));
-    msgpack_pack_uint64(pk, LOWER64(l->p_fid));
-    msgpack_pack_uint64(pk, UPPER64(l->p_fid));
-    msgpack_pack_uint64(pk, LOWER64(l->fid));
-    msgpack_pack_uint64(pk, UPPER64(l->fid));
-    serialize_fname(pk, &l->name);
-}
-
-// Pack an rfs_unlink argument
-static inline void msgpack_pack_unlink(msgpack_packer *pk, rfs_arg_unlink_t *ul) {
-    msgpack_pack_uint32(pk, ul->op);
-    msgpack_pack_uint64(pk, LOWER64(ul->cid));
-    msgpack_pack_uint64(pk, UPPER64(ul->cid));
-    msgpack_pack_uint64(pk, LOWER64(ul->p_fid));
-    msgpack_pack_uint64(pk, UPPER64(ul->p_fid));
-    serialize_fname(pk, &ul->name);
-}
-
-// Pack an rfs_lookup argument
-static inline void msgpack_pack_lookup(msgpack_packer *pk, rfs_arg_lookup_t *lr) {
-    msgpack_pack_uint32(pk, lr->op);
-    msgpack_pack_uint64(pk, LOWER64(lr->cid));
-    msgpack_pack_uint64(pk, UPPER64(lr->cid));
-    msgpack_pack_uint64(pk, LOWER64(lr->dfid));
-    msgpack_pack_uint64(pk, UPPER64(lr->dfid));
-    serialize_fname(pk, &lr->fname);
-}
-
-// Pack an rfs_setattr argument
-static inline void msgpack_pack_setattr(msgpack_packer *pk, rfs_arg_setattr_t *sr) {
-    msgpack_pack_uint32(pk, sr->op);
-    msgpack_pack_uint64(pk, LOWER64(sr->cid));
-    msgpack_pack_uint64(pk, UPPER64(sr->cid));
-    msgpack_pack_uint64(pk, LOWER64(sr->fid));
-    msgpack_pack_uint64(pk, UPPER64(sr->fid));
-    msgpack_pack_uint32(pk, sr->attr_mask);
-    serialize_attr(pk, &sr->attr);
-}
-
-// Pack an rfs_getattr argument
-static inline void msgpack_pack_getattr(msgpack_packer *pk, rfs_arg_getattr_t *gr) {
-    msgpack_pack_uint32(pk, gr->op);
-    msgpack_pack_uint64(pk, LOWER64(gr->cid));
-    msgpack_pack_uint64(pk, UPPER64(gr->cid));
-    msgpack_pack_uint64(pk, LOWER64(gr->fid));
-    msgpack_pack_uint64(pk, UPPER64(gr->fid));
-}
-
-// Pack an rfs_readdir argument
-static inline void msgpack_pack_readdir(msgpack_packer *pk, rfs_arg_readdir_t *rdr) {
-    msgpack_pack_uint32(pk, rdr->op);
-    msgpack_pack_uint64(pk, LOWER64(rdr->cid));
-    msgpack_pack_uint64(pk, UPPER64(rdr->cid));
-    msgpack_pack_uint64(pk, LOWER64(rdr->d_fid));
-    msgpack_pack_uint64(pk, UPPER64(rdr->d_fid));
-    msgpack_pack_uint64(pk, rdr->index);
-}
-
-// Pack rfs_read
-static inline void msgpack_pack_read(msgpack_packer *pk, rfs_arg_read_t *rd ) {
-    msgpack_pack_uint32(pk, rd->op);
-    msgpack_pack_uint64(pk, LOWER64(rd->cid));
-    msgpack_pack_uint64(pk, UPPER64(rd->cid));
-    msgpack_pack_uint64(pk, LOWER64(rd->fid));
-    msgpack_pack_uint64(pk, UPPER64(rd->fid));
-    msgpack_pack_uint64(pk, rd->offset);
-    msgpack_pack_int64(pk, rd->size);
-}
-
-// Pack rfs_readlink
-static inline void msgpack_pack_readlink(msgpack_packer *pk, rfs_arg_readlink_t *rdl) {
-    msgpack_pack_uint32(pk, rdl->op);
-    msgpack_pack_uint64(pk, LOWER64(rdl->cid));
-    msgpack_pack_uint64(pk, UPPER64(rdl->cid));
-    msgpack_pack_uint64(pk, LOWER64(rdl->fid));
-    msgpack_pack_uint64(pk, UPPER64(rdl->fid));
+    msgpack_pack_uint32(pk, cp->op);
+    msgpack_pack_uint64(pk, LOWER64(cp->cid));
+    msgpack_pack_uint64(pk, UPPER64(cp->cid));
+    msgpack_pack_uint64(pk, LOWER64(cp->fid));
+    msgpack_pack_uint64(pk, UPPER64(cp->fid));
+    msgpack_pack_uint32(pk, cp->n_ops);
+    for (i = 0; i < cp->n_ops; i++) {
+        msgpack_pack_uint32(pk, cp->ops[i].op);
+        if (cp->ops[i].op == OP_LOOKUP)
+            serialize_fname(pk, (file_name_t *)&cp->ops[i].fname);
+    }
+}
+
+/* Pack rfs_batch, each op as a bin holding its request as if sent alone.
+ * Returns -1 if an op can't be packed.
+ */
+static inline int msgpack_pack_batch(msgpack_packer *pk, rfs_arg_batch_t *ba) {
+    rfs_request_t *req;
+    uint32_t i;
+
+    msgpack_pack_uint32(pk, ba->op);
+    msgpack_pack_uint64(pk, LOWER64(ba->cid));
+    msgpack_pack_uint64(pk, UPPER64(ba->cid));
+    msgpack_pack_uint32(pk, ba->n_ops);
+    for (i = 0; i < ba->n_ops; i++) {
+        if (*(int *)ba->args[i] == OP_BATCH ||
+            (req = serialize_request(ba->args[i])) == NULL)
+            return -1;
+        msgpack_pack_bin(pk, req->header.size);
+        msgpack_pack_bin_body(pk, req->payload, req->header.size);
+        free(req);
+    }
+    return 0;
 }
 
 // Pack rfs_write
-static inline void msgpack_pack_write(msgpack_packer *pk, rfs_arg_write_t *wr) {
+// Pack an rfs_write argument up to, but not including, the data
+static inline void msgpack_pack_write_preamble(msgpack_packer *pk, rfs_arg_write_t *wr) {
     msgpack_pack_uint32(pk, wr->op);
     msgpack_pack_uint64(pk, LOWER64(wr->cid));
     msgpack_pack_uint64(pk, UPPER64(wr->cid));
@@ -205,43 +124,87 @@ static inline void msgpack_pack_write(msgpack_packer *pk, rfs_arg_write_t *wr) {
     msgpack_pack_uint64(pk, UPPER64(wr->fid));
     msgpack_pack_uint64(pk, wr->offset);
     msgpack_pack_uint64(pk, wr->size);
-    // Pack the write buffer
+    // Header of the write buffer
     msgpack_pack_bin(pk, wr->size);
+}
+
+static inline void msgpack_pack_write(msgpack_packer *pk, rfs_arg_write_t *wr) {
+    msgpack_pack_write_preamble(pk, wr);
     msgpack_pack_bin_body(pk, wr->buffer, wr->size);
 }
 
-// Pack rfs_mkdir
-static inline void msgpack_pack_mkdir(msgpack_packer *pk, rfs_arg_mkdir_t *mkd) {
-    msgpack_pack_uint32(pk, mkd->op);
-    msgpack_pack_uint64(pk, LOWER64(mkd->cid));
-    msgpack_pack_uint64(pk, UPPER64(mkd->cid));
-    msgpack_pack_uint64(pk, LOWER64(mkd->p_fid));
-    msgpack_pack_uint64(pk, UPPER64(mkd->p_fid));
-    msgpack_pack_uint32(pk, mkd->attr_mask);
-    serialize_fname(pk, &mkd->dname);
-    serialize_attr(pk, &mkd->attr);
+// Pack rfs_readv, also the segments of an rfs_writev
+static inline void msgpack_pack_readv(msgpack_packer *pk, rfs_arg_readv_t *rv) {
+    uint32_t i;
+
+    msgpack_pack_uint32(pk, rv->op);
+    msgpack_pack_uint64(pk, LOWER64(rv->cid));
+    msgpack_pack_uint64(pk, UPPER64(rv->cid));
+    msgpack_pack_uint64(pk, LOWER64(rv->fid));
+    msgpack_pack_uint64(pk, UPPER64(rv->fid));
+    msgpack_pack_uint32(pk, rv->n_segs);
+    for (i = 0; i < rv->n_segs; i++) {
+        msgpack_pack_uint64(pk, rv->segs[i].offset);
+        msgpack_pack_uint64(pk, rv->segs[i].size);
+    }
 }
 
-// Pack rfs_rmdir
-static inline void msgpack_pack_rmdir(msgpack_packer *pk, rfs_arg_rmdir_t *rmd) {
-    msgpack_pack_uint32(pk, rmd->op);
-    msgpack_pack_uint64(pk, LOWER64(rmd->cid));
-    msgpack_pack_uint64(pk, UPPER64(rmd->cid));
-    msgpack_pack_uint64(pk, LOWER64(rmd->p_fid));
-    msgpack_pack_uint64(pk, UPPER64(rmd->p_fid));
-    serialize_fname(pk, &rmd->name);
+// Size of the data of all segments of an rfs_writev
+static inline uint64_t writev_size(rfs_arg_writev_t *wr) {
+    uint64_t size = 0;
+    uint32_t i;
+
+    for (i = 0; i < wr->n_segs; i++)
+        size += wr->segs[i].size;
+    return size;
 }
 
-// Generic call to serialize an incoming request.
-// opaque_ptr to a rfs_arg(ravana fs argument)
-// opaque_ptr will be type cast to the appropriate type
-rfs_request_t * serialize_request(void *opaque_ptr) {
+// Pack an rfs_writev argument up to, but not including, the data. The data
+// of all segments follows in one buffer.
+static inline void msgpack_pack_writev_preamble(msgpack_packer *pk, rfs_arg_writev_t *wr) {
+    msgpack_pack_readv(pk, wr);
+    msgpack_pack_bin(pk, writev_size(wr));
+}
+
+static inline void msgpack_pack_writev(msgpack_packer *pk, rfs_arg_writev_t *wr) {
+    uint32_t i;
+
+    msgpack_pack_writev_preamble(pk, wr);
+    for (i = 0; i < wr->n_segs; i++)
+        msgpack_pack_bin_body(pk, wr->segs[i].buf, wr->segs[i].size);
+}
+
+// Pack the descriptor of a read or write whose data is in ring slot *slot*
+static inline void msgpack_pack_shm_rw(msgpack_packer *pk, rfs_arg_read_t *rd, uint32_t slot) {
+    msgpack_pack_read(pk, rd);
+    msgpack_pack_uint32(pk, slot);
+}
+
+// Put what was packed in sbuf into a request with header flags *flags*.
+// Frees sbuf and pak.
+static rfs_request_t * make_request(msgpack_sbuffer *sbuf, msgpack_packer *pak, uint16_t flags) {
     rfs_request_t *req;
 
-    // Init msgpack related
-    msgpack_sbuffer *sbuf = msgpack_sbuffer_new();
-    msgpack_packer *pak = msgpack_packer_new(sbuf, msgpack_sbuffer_write);
+    // Create request structure
+    if ((req = malloc(sizeof(rfs_request_t) + sbuf->size + 1)) == NULL) {
+      perror("request structure error");
+      msgpack_sbuffer_free(sbuf);
+      msgpack_packer_free(pak);
+      return NULL;
+    }
+    req->header.version = RFS_PROTO_VERSION;
+    req->header.flags = flags;
+    req->header.size = sbuf->size;
+    req->header.tag = 0;   // Assigned by the channel the request is sent on
+    memcpy(req->payload, sbuf->data, sbuf->size);
+    msgpack_sbuffer_free(sbuf);
+    msgpack_packer_free(pak);
+    return req;
+}
 
+// Pack the request opaque_ptr points to, a rfs_arg(ravana fs argument)
+// type cast to the appropriate type. Returns -1 for ops that can't be sent.
+static int pack_request(msgpack_packer *pak, void *opaque_ptr) {
     // Opaque ptr points to a request arg structure
     // First field in request arg is always an opcode
     // This is why we need multiple dispatch in C
@@ -262,6 +225,7 @@ rfs_request_t * serialize_request(void *opaque_ptr) {
             msgpack_pack_getattr(pak, (rfs_arg_getattr_t *)opaque_ptr);
             break;
         case OP_READDIR:
+        case OP_READDIRPLUS:
             msgpack_pack_readdir(pak, (rfs_arg_readdir_t *)opaque_ptr);
             break;
         case OP_READ:
@@ -270,11 +234,22 @@ rfs_request_t * serialize_request(void *opaque_ptr) {
         case OP_WRITE:
             msgpack_pack_write(pak, (rfs_arg_write_t *)opaque_ptr);
             break;
+        case OP_READV:
+            msgpack_pack_readv(pak, (rfs_arg_readv_t *)opaque_ptr);
+            break;
+        case OP_WRITEV:
+            msgpack_pack_writev(pak, (rfs_arg_writev_t *)opaque_ptr);
+            break;
+        case OP_COMPOUND:
+            msgpack_pack_compound(pak, (rfs_arg_compound_t *)opaque_ptr);
+            break;
+        case OP_BATCH:
+            return msgpack_pack_batch(pak, (rfs_arg_batch_t *)opaque_ptr);
         case OP_MKDIR:
             msgpack_pack_mkdir(pak, (rfs_arg_mkdir_t *)opaque_ptr);
             break;
         case OP_RMDIR:
-            msgpack_pack_rmdir(pak, (rfs_arg_rmdir_t *)opaque_ptr);
+            msgpack_pack_unlink(pak, (rfs_arg_rmdir_t *)opaque_ptr);
             break;
         case OP_SYMLINK:
             msgpack_pack_symlink(pak, (rfs_arg_symlink_t *)opaque_ptr);
@@ -291,6 +266,9 @@ rfs_request_t * serialize_request(void *opaque_ptr) {
         case OP_READLINK:
             msgpack_pack_readlink(pak, (rfs_arg_readlink_t *)opaque_ptr);
             break;
+        case OP_SHM_ATTACH:
+            msgpack_pack_shm_attach(pak, (rfs_arg_shm_attach_t *)opaque_ptr);
+            break;
         case OP_TEST_ACCESS:
         case OP_OPEN:
         case OP_REOPEN:
@@ -300,209 +278,753 @@ rfs_request_t * serialize_request(void *opaque_ptr) {
         case OP_CLOSE:
         default:
             perror("Operation not Implemented!");
-	    msgpack_sbuffer_free(sbuf);
-	    msgpack_packer_free(pak);
-            return NULL;
+            return -1;
     }
-    // Create request structure
-    if ((req = malloc(sizeof(rfs_request_t) + sbuf->size + 1)) == NULL) {
-      perror("request structure error");
-      msgpack_sbuffer_free(sbuf);
-      msgpack_packer_free(pak);
-      return NULL;
+    return 0;
+}
+
+// Generic call to serialize an incoming request.
+// opaque_ptr to a rfs_arg(ravana fs argument)
+// opaque_ptr will be type cast to the appropriate type
+rfs_request_t * serialize_request(void *opaque_ptr) {
+    // Init msgpack related
+    msgpack_sbuffer *sbuf = msgpack_sbuffer_new();
+    msgpack_packer *pak = msgpack_packer_new(sbuf, msgpack_sbuffer_write);
+
+    if (pack_request(pak, opaque_ptr) != 0) {
+        msgpack_sbuffer_free(sbuf);
+        msgpack_packer_free(pak);
+        return NULL;
     }
-    req->header.version = RFS_PROTO_VERSION;
-    req->header.flags = RFS_FSAL_CLIENT;
-    req->header.size = sbuf->size;
-    memcpy(req->payload, sbuf->data, sbuf->size);
+    return make_request(sbuf, pak, RFS_FSAL_CLIENT);
+}
+
+/*
+ * Each thread encodes its requests for serialize_request_tls(), the
+ * write preambles and the ring requests into a buffer of its own, kept
+ * from one request to the next, with the rfs_header_t packed in front
+ * of the payload. Once the buffer has grown to fit the thread's
+ * requests, encoding one allocates nothing. A buffer grown past
+ * RFS_REQ_BUF_MAX is given back before it is used again.
+ */
+#define RFS_REQ_BUF_MAX (64 << 10)
+
+static __thread msgpack_sbuffer *req_buf = NULL;
+static pthread_key_t req_buf_key;
+static pthread_once_t req_buf_once = PTHREAD_ONCE_INIT;
+
+static void req_buf_free(void *sbuf)
+{
     msgpack_sbuffer_free(sbuf);
-    msgpack_packer_free(pak);
+}
+
+static void req_buf_key_create(void)
+{
+    pthread_key_create(&req_buf_key, req_buf_free);
+}
+
+/*
+ * The calling thread's request buffer, emptied, with room for the
+ * rfs_request_t written in front. NULL if it can't be had.
+ */
+static msgpack_sbuffer * req_buf_begin(void) {
+    static const rfs_request_t header;
+
+    if (req_buf == NULL) {
+        pthread_once(&req_buf_once, req_buf_key_create);
+        if ((req_buf = msgpack_sbuffer_new()) == NULL)
+            return NULL;
+        // Freed when the thread exits
+        pthread_setspecific(req_buf_key, req_buf);
+    } else if (req_buf->alloc > RFS_REQ_BUF_MAX) {
+        msgpack_sbuffer_destroy(req_buf);
+        msgpack_sbuffer_init(req_buf);
+    }
+    msgpack_sbuffer_clear(req_buf);
+    if (msgpack_sbuffer_write(req_buf, (const char *)&header, sizeof(header)) != 0)
+        return NULL;
+    return req_buf;
+}
+
+// Fill in the header of the request packed since req_buf_begin()
+static rfs_request_t * req_buf_end(uint16_t flags) {
+    rfs_request_t *req = (rfs_request_t *)req_buf->data;
+
+    req->header.version = RFS_PROTO_VERSION;
+    req->header.flags = flags;
+    req->header.size = req_buf->size - sizeof(rfs_request_t);
+    req->header.tag = 0;   // Assigned by the channel the request is sent on
+    return req;
+}
+
+// serialize_request() into the calling thread's request buffer. The
+// request stays valid until the thread's next serialize_*() other than
+// serialize_request() and must not be freed.
+rfs_request_t * serialize_request_tls(void *opaque_ptr) {
+    msgpack_sbuffer *sbuf;
+    msgpack_packer pak;
+
+    if ((sbuf = req_buf_begin()) == NULL)
+        return NULL;
+    msgpack_packer_init(&pak, sbuf, msgpack_sbuffer_write);
+    if (pack_request(&pak, opaque_ptr) != 0)
+        return NULL;
+    return req_buf_end(RFS_FSAL_CLIENT);
+}
+
+// Serialize a write without its data into the thread's request buffer,
+// as serialize_request_tls() does. The request's size accounts for the
+// data, which the caller sends right after the request.
+rfs_request_t * serialize_write_preamble(rfs_arg_write_t *wr) {
+    msgpack_sbuffer *sbuf;
+    msgpack_packer pak;
+    rfs_request_t *req;
+
+    if ((sbuf = req_buf_begin()) == NULL)
+        return NULL;
+    msgpack_packer_init(&pak, sbuf, msgpack_sbuffer_write);
+    msgpack_pack_write_preamble(&pak, wr);
+    req = req_buf_end(RFS_FSAL_CLIENT);
+    req->header.size += wr->size;
     return req;
 }
 
-static inline int unpacker_init(msgpack_unpacker **pac, msgpack_unpacked **result, int size, const char *packed_buf) {
-    int ret = 0;
-    /* msgpack_unpacker init */
-    if ((*pac = (msgpack_unpacker *)malloc(sizeof(msgpack_unpacker))) == NULL) {
-	perror("unpacker_init error");
-	return ENOMEM;
+// Serialize a writev without its data, sent by the caller right after the
+// request as with serialize_write_preamble().
+rfs_request_t * serialize_writev_preamble(rfs_arg_writev_t *wr) {
+    msgpack_sbuffer *sbuf;
+    msgpack_packer pak;
+    rfs_request_t *req;
+
+    if ((sbuf = req_buf_begin()) == NULL)
+        return NULL;
+    msgpack_packer_init(&pak, sbuf, msgpack_sbuffer_write);
+    msgpack_pack_writev_preamble(&pak, wr);
+    req = req_buf_end(RFS_FSAL_CLIENT);
+    req->header.size += writev_size(wr);
+    return req;
+}
+
+// Serialize a read or write whose data is passed through ring slot *slot*
+// into the thread's request buffer. opaque_ptr is an rfs_arg_read_t or
+// rfs_arg_write_t, the write's buffer is not sent.
+rfs_request_t * serialize_shm_request(void *opaque_ptr, uint32_t slot) {
+    msgpack_sbuffer *sbuf;
+    msgpack_packer pak;
+    rfs_arg_read_t rd;
+
+    switch(*(int *)opaque_ptr) {
+        case OP_READ:
+            rd = *(rfs_arg_read_t *)opaque_ptr;
+            break;
+        case OP_WRITE:
+        {
+            rfs_arg_write_t *wr = (rfs_arg_write_t *)opaque_ptr;
+            rd.op = wr->op;
+            rd.cid = wr->cid;
+            rd.fid = wr->fid;
+            rd.offset = wr->offset;
+            rd.size = wr->size;
+            break;
+        }
+        default:
+            return NULL;
+    }
+    if ((sbuf = req_buf_begin()) == NULL)
+        return NULL;
+    msgpack_packer_init(&pak, sbuf, msgpack_sbuffer_write);
+    msgpack_pack_shm_rw(&pak, &rd, slot);
+    return req_buf_end(RFS_FSAL_CLIENT | RFS_SHM_RING);
+}
+
+/* Decode a msgpack unsigned integer at *b*, of at most *n* bytes. Returns
+ * the number of bytes it takes or -1.
+ */
+static int unpack_head_uint(const unsigned char *b, int n, uint64_t *v) {
+    int len, i;
+
+    if (n < 1)
+        return -1;
+    if (b[0] <= 0x7f) {         // positive fixint
+        *v = b[0];
+        return 1;
+    }
+    switch (b[0]) {
+        case 0xcc: case 0xd0: len = 1; break;
+        case 0xcd: case 0xd1: len = 2; break;
+        case 0xce: case 0xd2: len = 4; break;
+        case 0xcf: case 0xd3: len = 8; break;
+        default: return -1;
     }
+    if (n < 1 + len || (b[0] >= 0xd0 && (b[1] & 0x80)))
+        return -1;
+    for (*v = 0, i = 1; i <= len; i++)
+        *v = *v << 8 | b[i];
+    return 1 + len;
+}
 
-    if ((*result = (msgpack_unpacked *)malloc(sizeof(msgpack_unpacked))) == NULL) {
-	perror("unpacker_init error");
-	return ENOMEM;
+/* Decode the header of a msgpack bin at *b*, of at most *n* bytes, into
+ * the bin's length *len*. Returns the number of bytes it takes or -1.
+ */
+static int unpack_head_bin(const unsigned char *b, int n, uint64_t *len) {
+    int l, i;
+
+    if (n < 1)
+        return -1;
+    switch (b[0]) {
+        case 0xc4: l = 1; break;
+        case 0xc5: l = 2; break;
+        case 0xc6: l = 4; break;
+        default: return -1;
     }
-    msgpack_unpacker_init(*pac, MSGPACK_UNPACKER_INIT_BUFFER_SIZE);
+    if (n < 1 + l)
+        return -1;
+    for (*len = 0, i = 1; i <= l; i++)
+        *len = *len << 8 | b[i];
+    return 1 + l;
+}
 
-    /* in-buffer copy and accounting */
-    msgpack_unpacker_reserve_buffer(*pac, size);
-    memcpy(msgpack_unpacker_buffer(*pac), packed_buf, size);
-    msgpack_unpacker_buffer_consumed(*pac, size);
+/* Decode any msgpack integer, nil or boolean at *b*, of at most *n*
+ * bytes. Signed values are returned as their two's complement. Returns the
+ * number of bytes it takes or -1.
+ */
+static int unpack_head_int(const unsigned char *b, int n, uint64_t *v) {
+    int len, i;
 
-    /* start streaming deserialization. */
-    msgpack_unpacked_init(*result);
-    return ret;
+    if (n < 1)
+        return -1;
+    if (b[0] <= 0x7f || b[0] >= 0xe0) {     // positive or negative fixint
+        *v = (uint64_t)(int64_t)(int8_t)b[0];
+        return 1;
+    }
+    switch (b[0]) {
+        case 0xc0: case 0xc2: *v = 0; return 1;     // nil, false
+        case 0xc3: *v = 1; return 1;                // true
+        case 0xcc: case 0xd0: len = 1; break;
+        case 0xcd: case 0xd1: len = 2; break;
+        case 0xce: case 0xd2: len = 4; break;
+        case 0xcf: case 0xd3: len = 8; break;
+        default: return -1;
+    }
+    if (n < 1 + len)
+        return -1;
+    for (*v = 0, i = 1; i <= len; i++)
+        *v = *v << 8 | b[i];
+    // Sign extend the narrower signed ints
+    if (b[0] >= 0xd0 && len < 8 && (b[1] & 0x80))
+        *v |= ~(uint64_t)0 << (len * 8);
+    return 1 + len;
 }
 
-// Note that the following series of functions each call msgpack_unpacker_next()
-// and assume that you have allocated and initialised pac and result. They're basically
-// fancy macros that the compiler will optimise anyway.
-static inline void unpack_generic_int32(msgpack_unpacker *pac, msgpack_unpacked *result, __int32_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    *generic = (__int32_t)(result->data.via.u64);
+/* Decode the header of a msgpack str or bin at *b*, of at most *n* bytes,
+ * into its length *len*. Returns the number of bytes it takes or -1.
+ */
+static int unpack_head_raw(const unsigned char *b, int n, uint64_t *len) {
+    int l, i;
+
+    if (n < 1)
+        return -1;
+    if (b[0] >= 0xa0 && b[0] <= 0xbf) {     // fixstr
+        *len = b[0] & 0x1f;
+        return 1;
+    }
+    switch (b[0]) {
+        case 0xd9: l = 1; break;
+        case 0xda: l = 2; break;
+        case 0xdb: l = 4; break;
+        default: return unpack_head_bin(b, n, len);
+    }
+    if (n < 1 + l)
+        return -1;
+    for (*len = 0, i = 1; i <= l; i++)
+        *len = *len << 8 | b[i];
+    return 1 + l;
 }
 
-static inline void unpack_generic_int64(msgpack_unpacker *pac, msgpack_unpacked *result, __int64_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    *generic = (__int64_t)(result->data.via.u64);
+/*
+ * Responses are decoded in place: an rfs_unpacker_t walks the caller's
+ * packed_buf and nothing is allocated or copied but the decoded values.
+ * Once the payload runs short or holds something unexpected the cursor
+ * stops, and whatever is still to decode is zero.
+ */
+typedef struct rfs_unpacker {
+    const unsigned char *p;     // next object
+    int                 left;   // bytes left from p
+} rfs_unpacker_t;
+
+static inline uint64_t unpack_next_int(rfs_unpacker_t *pac) {
+    uint64_t v = 0;
+    int n;
+
+    if ((n = unpack_head_int(pac->p, pac->left, &v)) < 0) {
+        pac->left = 0;
+        return 0;
+    }
+    pac->p += n;
+    pac->left -= n;
+    return v;
 }
 
-static inline void unpack_generic_uint16(msgpack_unpacker *pac, msgpack_unpacked *result, __uint16_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    *generic = (__uint16_t)result->data.via.u64;
+// Returns the str or bin next in the payload, of *len* bytes
+static inline const char *unpack_next_raw(rfs_unpacker_t *pac, uint64_t *len) {
+    const char *raw;
+    int n;
+
+    if ((n = unpack_head_raw(pac->p, pac->left, len)) < 0 ||
+        *len > (uint64_t)(pac->left - n)) {
+        pac->left = 0;
+        *len = 0;
+        return NULL;
+    }
+    raw = (const char *)pac->p + n;
+    pac->p += n + *len;
+    pac->left -= n + (int)*len;
+    return raw;
 }
 
-static inline void unpack_generic_uint32(msgpack_unpacker *pac, msgpack_unpacked *result, __uint32_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    *generic = (__uint32_t)result->data.via.u64;
+static inline void unpack_generic_int32(rfs_unpacker_t *pac, __int32_t *generic) {
+    *generic = (__int32_t)unpack_next_int(pac);
 }
 
-static inline void unpack_generic_uint64(msgpack_unpacker *pac, msgpack_unpacked *result, __uint64_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    *generic = (__uint64_t)result->data.via.u64;
+static inline void unpack_generic_int64(rfs_unpacker_t *pac, __int64_t *generic) {
+    *generic = (__int64_t)unpack_next_int(pac);
 }
 
-static inline void unpack_generic_uint128(msgpack_unpacker *pac, msgpack_unpacked *result, __uint128_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    __uint64_t flo = result->data.via.u64;
-    msgpack_unpacker_next(pac, result);
-    __uint64_t fup = result->data.via.u64;
-    *generic = UINT128(flo, fup);
+static inline void unpack_generic_uint16(rfs_unpacker_t *pac, __uint16_t *generic) {
+    *generic = (__uint16_t)unpack_next_int(pac);
 }
 
-static inline void unpack_fname(msgpack_unpacker *pac, msgpack_unpacked *result, file_name_t *generic) {
-    msgpack_unpacker_next(pac, result);
-    memcpy(generic->name, result->data.via.str.ptr, result->data.via.str.size);
-    generic->name_len = (short)result->data.via.str.size;
+static inline void unpack_generic_uint32(rfs_unpacker_t *pac, __uint32_t *generic) {
+    *generic = (__uint32_t)unpack_next_int(pac);
 }
 
-static inline void unpack_generic_buffer(msgpack_unpacker *pac, msgpack_unpacked *result, char *generic) {
-    msgpack_unpacker_next(pac, result);
-    memcpy(generic, result->data.via.str.ptr, result->data.via.str.size);
+static inline void unpack_generic_uint64(rfs_unpacker_t *pac, __uint64_t *generic) {
+    *generic = (__uint64_t)unpack_next_int(pac);
 }
-/* Calls for derserializing responses from ravana. In each packed_buf is what's sent in
- * and the response buf is allocated and freed by the caller
+
+/* Returns the fixed layout of *len* bytes if that's what is next in the
+ * payload, a bin of protocol version 3, or NULL.
  */
+static inline const unsigned char *unpack_next_packed(rfs_unpacker_t *pac, int len) {
+    const unsigned char *b = pac->p;
 
-/* Create response deserialize */
-int deserialize_rsp_create(const char *packed_buf, int size, rfs_rsp_create_t *response) {
-    UNPACKER_INIT();
-    UNPACK_ERRNO_AND_ATTR();
-    UNPACKER_FREE_AND_RETURN();
+    if (pac->left < 2 + len || b[0] != 0xc4 || b[1] != len)
+        return NULL;
+    pac->p += 2 + len;
+    pac->left -= 2 + len;
+    return b + 2;
 }
 
-// Deserialize lookup
-int deserialize_rsp_lookup(const char *packed_buf, int size, rfs_rsp_lookup_t *response) {
-    UNPACKER_INIT();
-    UNPACK_ERRNO_AND_ATTR();
-    UNPACKER_FREE_AND_RETURN();
+static inline uint32_t load_le32(const unsigned char *b) {
+    uint32_t v;
+
+    memcpy(&v, b, sizeof(v));
+    return le32toh(v);
 }
 
-int deserialize_rsp_setattr(const char *packed_buf, int size, rfs_rsp_setattr_t *response) {
-    UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
-    UNPACKER_FREE_AND_RETURN();
+static inline uint64_t load_le64(const unsigned char *b) {
+    uint64_t v;
+
+    memcpy(&v, b, sizeof(v));
+    return le64toh(v);
 }
 
-int deserialize_rsp_getattr(const char *packed_buf, int size, rfs_rsp_getattr_t *response) {
-    UNPACKER_INIT();
-    UNPACK_ERRNO_AND_ATTR();
-    UNPACKER_FREE_AND_RETURN();
+static inline __uint128_t load_id(const unsigned char *b) {
+    return UINT128(load_le64(b), load_le64(b + 8));
 }
 
-int deserialize_rsp_mkdir(const char *packed_buf, int size, rfs_rsp_mkdir_t *response) {
-    UNPACKER_INIT();
-    UNPACK_ERRNO_AND_ATTR();
-    UNPACKER_FREE_AND_RETURN();
+static inline void unpack_generic_uint128(rfs_unpacker_t *pac, __uint128_t *generic) {
+    const unsigned char *b = unpack_next_packed(pac, RFS_ID_PACKED_SIZE);
+    __uint64_t flo, fup;
+
+    if (b) {
+        *generic = load_id(b);
+        return;
+    }
+    flo = unpack_next_int(pac);
+    fup = unpack_next_int(pac);
+    *generic = UINT128(flo, fup);
 }
 
-int deserialize_rsp_symlink(const char *packed_buf, int size, rfs_rsp_symlink_t *response) {
-    UNPACKER_INIT();
-    UNPACK_ERRNO_AND_ATTR();
-    UNPACKER_FREE_AND_RETURN();
+// Unpack a FileAttr, in the fixed layout or field by field
+static inline void unpack_attr(rfs_unpacker_t *pac, FileAttr *attr) {
+    const unsigned char *b = unpack_next_packed(pac, RFS_ATTR_PACKED_SIZE);
+
+    if (b) {
+        attr->mode = load_le32(b);
+        attr->uid = load_le32(b + 4);
+        attr->gid = load_le32(b + 8);
+        attr->links = load_le32(b + 12);
+        attr->size = load_le64(b + 16);
+        attr->dev = load_id(b + 24);
+        attr->ino = load_id(b + 40);
+        attr->rdev = load_le32(b + 56);
+        attr->atime.tv_sec = (time_t)load_le64(b + 64);
+        attr->atime.tv_nsec = (long)load_le64(b + 72);
+        attr->ctime.tv_sec = (time_t)load_le64(b + 80);
+        attr->ctime.tv_nsec = (long)load_le64(b + 88);
+        attr->mtime.tv_sec = (time_t)load_le64(b + 96);
+        attr->mtime.tv_nsec = (long)load_le64(b + 104);
+        return;
+    }
+    unpack_generic_uint32(pac, &attr->mode);
+    unpack_generic_uint32(pac, &attr->uid);
+    unpack_generic_uint32(pac, &attr->gid);
+    unpack_generic_uint32(pac, &attr->links);
+    unpack_generic_uint64(pac, &attr->size);
+    unpack_generic_uint128(pac, &attr->dev);
+    unpack_generic_uint128(pac, &attr->ino);
+    unpack_generic_uint32(pac, &attr->rdev);
+    unpack_generic_uint64(pac, (__uint64_t *)&attr->atime.tv_sec);
+    unpack_generic_uint64(pac, (__uint64_t *)&attr->atime.tv_nsec);
+    unpack_generic_uint64(pac, (__uint64_t *)&attr->ctime.tv_sec);
+    unpack_generic_uint64(pac, (__uint64_t *)&attr->ctime.tv_nsec);
+    unpack_generic_uint64(pac, (__uint64_t *)&attr->mtime.tv_sec);
+    unpack_generic_uint64(pac, (__uint64_t *)&attr->mtime.tv_nsec);
+}
+
+static inline void unpack_fname(rfs_unpacker_t *pac, file_name_t *generic) {
+    uint64_t len;
+    const char *name = unpack_next_raw(pac, &len);
+
+    if (len > sizeof(generic->name))
+        len = sizeof(generic->name);
+    if (len)
+        memcpy(generic->name, name, len);
+    generic->name_len = (short)len;
+}
+
+static inline void unpack_generic_buffer(rfs_unpacker_t *pac, char *generic) {
+    uint64_t len;
+    const char *raw = unpack_next_raw(pac, &len);
+
+    if (len)
+        memcpy(generic, raw, len);
+}
+/* Calls for derserializing responses from ravana. In each packed_buf is what's sent in
+ * and the response buf is allocated and freed by the caller
+ */
+
+// Unpack a field of the type given in ravana_ops.h
+#define UNPACK_FID(v)       unpack_generic_uint128(&pac, &(v))
+#define UNPACK_U32(v)       unpack_generic_uint32(&pac, &(v))
+#define UNPACK_U64(v)       unpack_generic_uint64(&pac, &(v))
+#define UNPACK_I32(v)       unpack_generic_int32(&pac, &(v))
+#define UNPACK_I64(v)       unpack_generic_int64(&pac, &(v))
+#define UNPACK_NAME(v)      unpack_fname(&pac, &(v))
+#define UNPACK_ATTR(v)      unpack_attr(&pac, &(v))
+#define UNPACK_FIELD(type, name)    UNPACK_##type(response->name);
+
+/* deserialize_rsp_<op>() of each op in RFS_FLAT_RSPS: the error and the
+ * op's fields in order */
+#define UNPACK_RSP(name, NAME)                                              \
+int deserialize_rsp_##name(const char *packed_buf, int size, rfs_rsp_##name##_t *response) { \
+    UNPACKER_INIT();                                                        \
+    unpack_generic_int32(&pac, &response->error);                           \
+    RFS_RSP_##NAME(UNPACK_FIELD)                                            \
+    UNPACKER_FREE_AND_RETURN();                                             \
 }
+RFS_FLAT_RSPS(UNPACK_RSP)
 
 int deserialize_rsp_readdir(const char *packed_buf, int size, rfs_rsp_readdir_t *response) {
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
-    unpack_generic_int32(&pac, &result, &response->eof);
-    unpack_generic_uint32(&pac, &result, &response->n_entries);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int32(&pac, &response->eof);
+    unpack_generic_uint32(&pac, &response->n_entries);
     UNPACKER_FREE_AND_RETURN();
 }
 
 int deserialize_rsp_readdir_entries(const char *packed_buf, int size, rfs_rsp_readdir_t *response) {
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
-    unpack_generic_int32(&pac, &result, &response->eof);
-    unpack_generic_uint32(&pac, &result, &response->n_entries);
-
-    for(int i=0; i<response->n_entries; i++) {
-        unpack_fname(&pac, &result, &response->entries[i].fname);
-        unpack_generic_uint128(&pac, &result, &response->entries[i].fid);
-        unpack_generic_uint64(&pac, &result, &response->entries[i].whence);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int32(&pac, &response->eof);
+    unpack_generic_uint32(&pac, &response->n_entries);
+
+    for(uint32_t i=0; i<response->n_entries; i++) {
+        unpack_fname(&pac, &response->entries[i].fname);
+        unpack_generic_uint128(&pac, &response->entries[i].fid);
+        unpack_generic_uint64(&pac, &response->entries[i].whence);
+        response->index = response->entries[i].whence;
     }
+    // Servers older than the page size hints send no index
+    if (pac.left > 0)
+        unpack_generic_uint64(&pac, &response->index);
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_read(const char *packed_buf, int size, rfs_rsp_read_t *response) {
+/* Decode the entries of a readdir response in a single pass into *arena*
+ * of *arena_size* bytes, as rfs_dirent_compact_t. Names are copied
+ * straight from packed_buf. Entries past the first one that does not
+ * fit are dropped and eof cleared; response->n_entries counts the
+ * entries decoded, response->index is the index to go on from. arena is
+ * aligned as rfs_dirent_compact_t, as malloc() aligns. Returns the bytes
+ * of arena used, or -EINVAL if not one entry fits.
+ */
+int deserialize_rsp_readdir_arena(const char *packed_buf, int size, rfs_rsp_readdir_t *response,
+        void *arena, size_t arena_size) {
+    const size_t align = _Alignof(rfs_dirent_compact_t);
+    rfs_dirent_compact_t *d;
+    const char *name;
+    uint32_t n_entries, i;
+    uint64_t len;
+    size_t used = 0, reclen;
+
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
-    unpack_generic_int64(&pac, &result, &response->size);
-    unpack_generic_buffer(&pac, &result, response->buffer);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int32(&pac, &response->eof);
+    unpack_generic_uint32(&pac, &n_entries);
+    response->n_entries = 0;
+    if (response->error)
+        return 0;
+    if ((uintptr_t)arena & (align - 1))
+        return -EINVAL;
+
+    for (i = 0; i < n_entries; i++) {
+        name = unpack_next_raw(&pac, &len);
+        if (len > NAME_MAX)
+            len = NAME_MAX;
+        reclen = (offsetof(rfs_dirent_compact_t, name) + len + 1 + align - 1) & ~(align - 1);
+        if (used + reclen > arena_size) {
+            response->eof = 0;
+            break;
+        }
+        d = (rfs_dirent_compact_t *)((char *)arena + used);
+        unpack_generic_uint128(&pac, &d->fid);
+        unpack_generic_uint64(&pac, &d->whence);
+        d->reclen = (uint16_t)reclen;
+        d->name_len = (uint16_t)len;
+        if (len)
+            memcpy(d->name, name, len);
+        d->name[len] = '\0';
+        response->index = d->whence;
+        used += reclen;
+    }
+    if (i == n_entries && pac.left > 0)
+        unpack_generic_uint64(&pac, &response->index);
+    response->n_entries = i;
+    if (i == 0 && n_entries > 0)
+        ret = -EINVAL;
+    else
+        ret = (int)used;
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_readlink(const char *packed_buf, int size, rfs_rsp_readlink_t *response) {
+/* deserialize_rsp_readdir_arena() for an OP_READDIRPLUS response, whose
+ * entries carry the file's attributes and symlink target length after
+ * the whence. Entries are rfs_direntplus_t.
+ */
+int deserialize_rsp_readdirplus_arena(const char *packed_buf, int size, rfs_rsp_readdir_t *response,
+        void *arena, size_t arena_size) {
+    const size_t align = _Alignof(rfs_direntplus_t);
+    rfs_direntplus_t *d;
+    const char *name;
+    uint32_t n_entries, i;
+    uint64_t len;
+    size_t used = 0, reclen;
+
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
-    unpack_generic_int64(&pac, &result, &response->size);
-    unpack_generic_buffer(&pac, &result, response->buffer);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int32(&pac, &response->eof);
+    unpack_generic_uint32(&pac, &n_entries);
+    response->n_entries = 0;
+    if (response->error)
+        return 0;
+    if ((uintptr_t)arena & (align - 1))
+        return -EINVAL;
+
+    for (i = 0; i < n_entries; i++) {
+        name = unpack_next_raw(&pac, &len);
+        if (len > NAME_MAX)
+            len = NAME_MAX;
+        reclen = (offsetof(rfs_direntplus_t, name) + len + 1 + align - 1) & ~(align - 1);
+        if (used + reclen > arena_size) {
+            response->eof = 0;
+            break;
+        }
+        d = (rfs_direntplus_t *)((char *)arena + used);
+        unpack_generic_uint128(&pac, &d->fid);
+        unpack_generic_uint64(&pac, &d->whence);
+        UNPACK_ATTR(d->attr);
+        unpack_generic_uint32(&pac, &d->link_len);
+        d->reclen = (uint16_t)reclen;
+        d->name_len = (uint16_t)len;
+        if (len)
+            memcpy(d->name, name, len);
+        d->name[len] = '\0';
+        response->index = d->whence;
+        used += reclen;
+    }
+    if (i == n_entries && pac.left > 0)
+        unpack_generic_uint64(&pac, &response->index);
+    response->n_entries = i;
+    if (i == 0 && n_entries > 0)
+        ret = -EINVAL;
+    else
+        ret = (int)used;
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_write(const char *packed_buf, int size, rfs_rsp_write_t *response) {
+int deserialize_rsp_read(const char *packed_buf, int size, rfs_rsp_read_t *response) {
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
-    unpack_generic_int64(&pac, &result, &response->size);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int64(&pac, &response->size);
+    unpack_generic_buffer(&pac, response->buffer);
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_link(const char *packed_buf, int size, rfs_rsp_link_t *response) {
+/* deserialize_rsp_read() that copies the data straight from packed_buf
+ * into *buf*, of *buf_size* bytes, rather than into the response, so a
+ * read takes no buffer of its own. response->size is set to the bytes
+ * copied. Also decodes a readlink response, which is laid out the same.
+ */
+int deserialize_rsp_read_into(const char *packed_buf, int size, rfs_rsp_read_t *response,
+        char *buf, __int64_t buf_size) {
+    const char *data;
+    uint64_t len;
+
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int64(&pac, &response->size);
+    data = unpack_next_raw(&pac, &len);
+    if (response->error == 0) {
+        if ((uint64_t)response->size > len)
+            response->size = (__int64_t)len;
+        if (response->size > buf_size)
+            response->size = buf_size;
+        if (response->size > 0 && buf)
+            memcpy(buf, data, (size_t)response->size);
+    }
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_unlink(const char *packed_buf, int size, rfs_rsp_unlink_t *response) {
+/* The caller sets response->n_segs to the number of segments in *segs*
+ * and response->sizes to room for as many sizes. The data of each segment
+ * is copied into its buffer.
+ */
+int deserialize_rsp_readv(const char *packed_buf, int size, rfs_rsp_readv_t *response,
+        const rfs_seg_t *segs) {
+    uint32_t n_segs, i;
+    const char *data;
+    uint64_t left;
+
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
+    unpack_generic_int32(&pac, &response->error);
+    if (response->error == 0) {
+        unpack_generic_uint32(&pac, &n_segs);
+        if (n_segs > response->n_segs) {
+            ret = -EINVAL;
+            n_segs = 0;
+        }
+        response->n_segs = n_segs;
+        for (i = 0; i < n_segs; i++)
+            unpack_generic_int64(&pac, &response->sizes[i]);
+        data = unpack_next_raw(&pac, &left);
+        for (i = 0; i < n_segs; i++) {
+            uint64_t sent = (uint64_t)response->sizes[i] < left ?
+                    (uint64_t)response->sizes[i] : left;
+
+            response->sizes[i] = sent < (uint64_t)segs[i].size ?
+                    (__int64_t)sent : segs[i].size;
+            if (response->sizes[i])
+                memcpy(segs[i].buf, data, (size_t)response->sizes[i]);
+            data += sent;
+            left -= sent;
+        }
+    }
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_rmdir(const char *packed_buf, int size, rfs_rsp_rmdir_t *response) {
+/* The head of a successful read response is everything up to the data:
+ * the error, the size and the header of the data's bin. It is decoded by
+ * hand from the first bytes of a response still on its way, which the
+ * msgpack unpacker only takes whole. Returns the head's length, with the
+ * length of the data that follows it in *data_size*, or -1 if packed_buf
+ * does not start with the head of a successful read.
+ */
+int deserialize_rsp_read_head(const char *packed_buf, int size, __int64_t *data_size) {
+    const unsigned char *b = (const unsigned char *)packed_buf;
+    uint64_t error, read_size, len;
+    int off = 0, n;
+
+    if ((n = unpack_head_uint(b, size, &error)) < 0 || error != 0)
+        return -1;
+    off += n;
+    if ((n = unpack_head_uint(b + off, size - off, &read_size)) < 0)
+        return -1;
+    off += n;
+    if ((n = unpack_head_bin(b + off, size - off, &len)) < 0 || len != read_size)
+        return -1;
+    *data_size = len;
+    return off + n;
+}
+
+int deserialize_rsp_readlink(const char *packed_buf, int size, rfs_rsp_readlink_t *response) {
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_int64(&pac, &response->size);
+    unpack_generic_buffer(&pac, response->buffer);
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_rename(const char *packed_buf, int size, rfs_rsp_rename_t *response) {
+int deserialize_rsp_rmdir(const char *packed_buf, int size, rfs_rsp_rmdir_t *response) {
     UNPACKER_INIT();
-    unpack_generic_int32(&pac, &result, &response->error);
+    unpack_generic_int32(&pac, &response->error);
     UNPACKER_FREE_AND_RETURN();
 }
 
-int deserialize_rsp_mknod(const char *packed_buf, int size, rfs_rsp_mknod_t *response) {
+/* response->res has room for the results of the *n_ops* ops sent. Only
+ * ops that succeeded carry attributes.
+ */
+int deserialize_rsp_compound(const char *packed_buf, int size, rfs_rsp_compound_t *response,
+        uint32_t n_ops) {
+    uint32_t i;
+
     UNPACKER_INIT();
-    UNPACK_ERRNO_AND_ATTR();
+    unpack_generic_int32(&pac, &response->error);
+    unpack_generic_uint32(&pac, &response->n_res);
+    if (response->n_res > n_ops) {
+        response->n_res = 0;
+        ret = -EINVAL;
+    }
+    for (i = 0; i < response->n_res; i++) {
+        unpack_generic_int32(&pac, &response->res[i].error);
+        if (response->res[i].error == 0) {
+            UNPACK_ATTR(response->res[i].attr);
+        }
+    }
     UNPACKER_FREE_AND_RETURN();
 }
+
+/* response->res has room for the responses of the *n_ops* ops sent. The
+ * payload of each points into packed_buf, which must outlive them.
+ */
+int deserialize_rsp_batch(const char *packed_buf, int size, rfs_rsp_batch_t *response,
+        uint32_t n_ops) {
+    const unsigned char *b = (const unsigned char *)packed_buf;
+    uint64_t error, n_res, len;
+    uint32_t i;
+    int off = 0, n;
+
+    response->n_res = 0;
+    if ((n = unpack_head_uint(b, size, &error)) < 0)
+        return -1;
+    off += n;
+    if ((response->error = (__int32_t)error) != 0)
+        return 0;
+    if ((n = unpack_head_uint(b + off, size - off, &n_res)) < 0 || n_res > n_ops)
+        return -EINVAL;
+    off += n;
+    for (i = 0; i < n_res; i++) {
+        if ((n = unpack_head_bin(b + off, size - off, &len)) < 0)
+            return -1;
+        off += n;
+        if (len > (uint64_t)(size - off))
+            return -1;
+        response->res[i].payload = packed_buf + off;
+        response->res[i].size = (int)len;
+        off += (int)len;
+    }
+    response->n_res = (uint32_t)n_res;
+    return 0;
+}
+
@@ -0,0 +1,339 @@
+/*
+ * Shared memory transport for read and write data.
+ *
+ * rfs_channel_shm() creates a memfd backed ring of fixed size slots and
+ * has the dispatcher map it too. The ring is attached to a connection
+ * with OP_SHM_ATTACH, sent before anything else on the connection with
+ * the memfd passed along as SCM_RIGHTS, and the dispatcher acknowledges
+ * it with RFS_SHM_RING in the response flags. The memfd is sealed
+ * against shrinking and growing, which the dispatcher checks, so that
+ * its mapping of the ring can't lose its pages.
+ * After that a read or write that fits a slot takes a slot, and only a
+ * descriptor (fid, offset, size and slot index) flagged RFS_SHM_RING goes
+ * over the socket. Write data is copied into the slot before the request
+ * is sent, read data is found in the slot when the response arrives.
+ * With every slot taken, reads and writes go over the socket.
+ *
+ * The slot of a request that timed out is lost until the dispatcher
+ * answers the request after all, or the connection is dropped, since
+ * the dispatcher may still be using it (see ring_lose()).
+ *
+ * A dispatcher that does not know about rings drops the connection on
+ * OP_SHM_ATTACH; the channel then reconnects without the ring and reads
+ * and writes keep going over the socket.
+ */
+
+#define _GNU_SOURCE
+#include "ravana_channel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/*
+ * Take a free slot into *slot*. Returns -EOPNOTSUPP if all are in use,
+ * for the caller to go over the socket.
+ */
+static int ring_get(rfs_ring_t *ring, uint32_t *slot)
+{
+    pthread_mutex_lock(&ring->lock);
+    if (ring->n_free == 0) {
+        pthread_mutex_unlock(&ring->lock);
+        return -EOPNOTSUPP;
+    }
+    *slot = ring->free[--ring->n_free];
+    pthread_mutex_unlock(&ring->lock);
+
+    return 0;
+}
+
+static void ring_put(rfs_ring_t *ring, uint32_t slot)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->free[ring->n_free++] = slot;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Set *slot* aside for the request sent with *tag* on *conn*, given up
+ * on before the dispatcher answered it. The dispatcher may still read
+ * or write the slot until it does.
+ */
+void ring_lose(rfs_ring_t *ring, rfs_conn_t *conn, __uint64_t tag, uint32_t slot)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->lost[slot].conn = conn;
+    ring->lost[slot].tag = tag;
+    ring->n_lost++;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Free the slot lost to the request sent with *tag* on *conn*, now
+ * answered, or with a *tag* of 0 every slot lost to requests on *conn*,
+ * now dropped.
+ */
+void ring_reclaim(rfs_ring_t *ring, rfs_conn_t *conn, __uint64_t tag)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&ring->lock);
+    for (i = 0; ring->n_lost > 0 && i < ring->n_slots; i++) {
+        if (ring->lost[i].conn == conn && (tag == 0 || ring->lost[i].tag == tag)) {
+            ring->lost[i].conn = NULL;
+            ring->n_lost--;
+            ring->free[ring->n_free++] = i;
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static inline char *ring_slot(rfs_ring_t *ring, uint32_t slot)
+{
+    return ring->base + (size_t)slot * ring->slot_size;
+}
+
+void ring_free(rfs_ring_t *ring)
+{
+    munmap(ring->base, (size_t)ring->n_slots * ring->slot_size);
+    close(ring->fd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->lost);
+    free(ring->free);
+    free(ring);
+}
+
+/*
+ * Unmap *ring* and close its memfd in a forked child, which must not use
+ * the parent's slots, without touching its lock.
+ */
+void ring_forget(rfs_ring_t *ring)
+{
+    munmap(ring->base, (size_t)ring->n_slots * ring->slot_size);
+    close(ring->fd);
+}
+
+static rfs_ring_t *ring_alloc(uint32_t n_slots, uint32_t slot_size)
+{
+    size_t len = (size_t)n_slots * slot_size;
+    rfs_ring_t *ring;
+    uint32_t i;
+
+    if ((ring = calloc(1, sizeof(rfs_ring_t))) == NULL)
+        return NULL;
+    if ((ring->free = malloc(n_slots * sizeof(uint32_t))) == NULL ||
+        (ring->lost = calloc(n_slots, sizeof(rfs_ring_lost_t))) == NULL) {
+        free(ring->free);
+        free(ring);
+        return NULL;
+    }
+    if ((ring->fd = memfd_create("ravana-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+        perror("memfd_create failed");
+        free(ring->lost);
+        free(ring->free);
+        free(ring);
+        return NULL;
+    }
+    if (ftruncate(ring->fd, len) == -1 ||
+        fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1 ||
+        (ring->base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           ring->fd, 0)) == MAP_FAILED) {
+        perror("ring mapping failed");
+        close(ring->fd);
+        free(ring->lost);
+        free(ring->free);
+        free(ring);
+        return NULL;
+    }
+    ring->n_slots = n_slots;
+    ring->slot_size = slot_size;
+    for (i = 0; i < n_slots; i++)
+        ring->free[i] = n_slots - 1 - i;
+    ring->n_free = n_slots;
+    pthread_mutex_init(&ring->lock, NULL);
+
+    return ring;
+}
+
+/*
+ * Attach the channel's ring on the freshly connected socket *fd*, before
+ * the connection is handed out. Returns 1 if the dispatcher attached the
+ * ring, 0 if it refused and -EIO if the connection failed or the
+ * dispatcher did not answer by *deadline*. Called with ch->lock held.
+ */
+int ring_attach(rfs_channel_t *ch, int fd, __int64_t deadline)
+{
+    rfs_arg_shm_attach_t attach;
+    rfs_rsp_shm_attach_t attach_rsp = {0};
+    rfs_conn_t conn = { .fd = fd, .refs = 1 };
+    rfs_request_t *req;
+    rfs_response_t *rsp = NULL;
+    struct iovec iov;
+    size_t sent;
+    int attached;
+
+    attach.op = OP_SHM_ATTACH;
+    attach.cid = ch->cid;
+    attach.n_slots = ch->ring->n_slots;
+    attach.slot_size = ch->ring->slot_size;
+    if ((req = serialize_request((void *)&attach)) == NULL)
+        return 0;
+
+    iov.iov_base = req;
+    iov.iov_len = sizeof(rfs_request_t) + req->header.size;
+    if (sendv_fd(fd, &iov, 1, ch->ring->fd, deadline, &sent) != 0 ||
+        conn_recv(&conn, &rsp, deadline) != 0) {
+        free(req);
+        return -EIO;
+    }
+    deserialize_rsp_shm_attach(rsp->payload, rsp->size, &attach_rsp);
+    attached = attach_rsp.error == 0 && (rsp->flags & RFS_SHM_RING);
+    free(req);
+    free(rsp);
+
+    return attached;
+}
+
+/*
+ * Share a ring of *n_slots* slots of *slot_size* bytes with the
+ * dispatcher of *ch*. The channel reconnects to attach it, so it must not
+ * have requests outstanding. Returns -EOPNOTSUPP if the dispatcher does
+ * not take the ring.
+ */
+int rfs_channel_shm(rfs_channel_t *ch, uint32_t n_slots, uint32_t slot_size)
+{
+    rfs_ring_t *ring;
+    int error = 0;
+
+    if (n_slots == 0 || slot_size == 0)
+        return -EINVAL;
+    if ((ring = ring_alloc(n_slots, slot_size)) == NULL)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&ch->lock);
+    if (ch->ring || ch->pending || ch->receiving) {
+        pthread_mutex_unlock(&ch->lock);
+        ring_free(ring);
+        return -EBUSY;
+    }
+    ch->ring = ring;
+    /* Nothing is outstanding, so the reset fails no request */
+    channel_reset(ch, -EIO);
+    if ((error = channel_connect(ch, channel_deadline(ch))) == 0 && !ch->conn->shm)
+        error = -EOPNOTSUPP;
+    if (error == -EOPNOTSUPP)
+        ch->ring = NULL;
+    pthread_mutex_unlock(&ch->lock);
+    if (error == -EOPNOTSUPP)
+        ring_free(ring);
+
+    return error;
+}
+
+/*
+ * Send the read or write *arg* of *size* bytes through a ring slot.
+ * *wbuf* is the data to write, *rbuf* receives the data read. Returns
+ * -EOPNOTSUPP if the channel of *cid* has no ring attached, the data
+ * does not fit a slot or no slot is free; the caller goes over the
+ * socket then.
+ */
+static int shm_rw(cid_t cid, void *arg, __int64_t size, char *wbuf,
+        char *rbuf, __int64_t *out_size)
+{
+    rfs_channel_t *ch;
+    rfs_ring_t *ring;
+    rfs_request_t *req;
+    rfs_response_t *rsp = NULL;
+    rfs_pending_t p = {0};
+    uint32_t slot;
+    int error;
+
+    if ((ch = rfs_channel_open(cid)) == NULL)
+        return -EOPNOTSUPP;
+    /* The ring is set up before the channel is used and never replaced */
+    if ((ring = ch->ring) == NULL || size < 0 || size > ring->slot_size)
+        return -EOPNOTSUPP;
+
+    if ((error = ring_get(ring, &slot)) != 0)
+        return error;
+    p.in_ring = 1;
+    p.slot = slot;
+    if (wbuf)
+        memcpy(ring_slot(ring, slot), wbuf, (size_t)size);
+    if ((req = serialize_shm_request(arg, slot)) == NULL) {
+        ring_put(ring, slot);
+        return -EOPNOTSUPP;
+    }
+    if ((error = channel_submit(ch, req, &p)) == -EPIPE)
+        error = channel_submit(ch, req, &p);
+    if (error) {
+        ring_put(ring, slot);
+        return error;
+    }
+    /*
+     * The slot of a request that timed out was set aside by
+     * channel_complete(), that of one whose connection is gone may be
+     * used again.
+     */
+    if ((error = channel_complete(ch, &p, &rsp)) != 0) {
+        if (error != -ETIMEDOUT)
+            ring_put(ring, slot);
+        return error;
+    }
+
+    if (wbuf) {
+        rfs_rsp_write_t write_rsp = {0};
+
+        deserialize_rsp_write(rsp->payload, rsp->size, &write_rsp);
+        error = write_rsp.error;
+        if (error == 0 && out_size)
+            *out_size = write_rsp.size;
+    } else {
+        rfs_rsp_read_t read_rsp = {0};
+
+        // The data is in the slot, the response carries none
+        deserialize_rsp_read(rsp->payload, rsp->size, &read_rsp);
+        error = read_rsp.error;
+        if (error == 0) {
+            if (read_rsp.size > size)
+                read_rsp.size = size;
+            if (out_size)
+                *out_size = read_rsp.size;
+            if (rbuf)
+                memcpy(rbuf, ring_slot(ring, slot), (size_t)read_rsp.size);
+        }
+    }
+    ring_put(ring, slot);
+    free(rsp);
+
+    return error;
+}
+
+int shm_write(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        char *buffer, __int64_t *out_size)
+{
+    rfs_arg_write_t write;
+
+    write.op = OP_WRITE;
+    write.cid = cid;
+    write.fid = fid;
+    write.offset = offset;
+    write.size = size;
+    return shm_rw(cid, &write, size, buffer, NULL, out_size);
+}
+
+int shm_read(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        __int64_t *out_size, char *buffer)
+{
+    rfs_arg_read_t read;
+
+    read.op = OP_READ;
+    read.cid = cid;
+    read.fid = fid;
+    read.offset = offset;
+    read.size = size;
+    return shm_rw(cid, &read, size, NULL, buffer, out_size);
+}
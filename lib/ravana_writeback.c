@@ -0,0 +1,356 @@
+/*
+ * Write-back buffer of a channel.
+ *
+ * The dispatcher stores file data in blocks of RFS_BLOCK_SIZE. A write
+ * that starts or ends inside a block makes it read the block, patch it
+ * and write it back (see data_write() in src/DataWorker.jl), and every
+ * write request is an entry in the oplog. Small writes are the worst
+ * case for both. rfs_write() on a channel with a write-back buffer keeps
+ * writes smaller than max_bytes instead, merged with the data already
+ * buffered for the file when they overlap it or follow right after it,
+ * and returns at once.
+ *
+ * A file has one extent of data buffered at a time. When a write would
+ * grow it past max_bytes, the whole blocks of the extent are sent in one
+ * write and the partial block at its end stays for the writes that
+ * complete it. A write elsewhere in the file, or to one more file than
+ * there are slots for, sends what was buffered first. Data buffered for
+ * longer than the delay is sent by the next write on the channel.
+ * Anything that reads or changes the file through the channel, reads,
+ * getattrs, setattrs, rfs_flush() and rfs_channel_close(), sends its
+ * buffered data before it goes. Lookups, compounds and readdirplus
+ * return the attributes of files they only find on the way; a file among
+ * them with data buffered has it sent and its attributes fetched again.
+ *
+ * A buffered write that fails is reported by the call that sent it, and
+ * its data is dropped.
+ */
+
+#include "ravana_channel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Bytes a file may have buffered at most */
+#define RFS_WB_MAX  (64 << 20)
+
+/* Write-back buffer of the channel of *cid*, NULL if it has none */
+static rfs_write_back_t *write_back(cid_t cid)
+{
+    rfs_channel_t *ch;
+
+    if ((ch = rfs_channel_open(cid)) == NULL)
+        return NULL;
+    return ch->wb;
+}
+
+/*
+ * Blocks the dispatcher reads back to write the *len* bytes at
+ * *offset*, as data_write() does.
+ */
+static uint32_t rmw_blocks(uint64_t offset, uint64_t len)
+{
+    uint64_t lbound, rbound;
+    uint32_t n = 0;
+
+    if (len == 0)
+        return 0;
+    lbound = offset & ~(uint64_t)(RFS_BLOCK_SIZE - 1);
+    rbound = (offset + len - 1) & ~(uint64_t)(RFS_BLOCK_SIZE - 1);
+    if (lbound != offset || lbound == rbound)
+        n++;
+    if (rbound + RFS_BLOCK_SIZE != offset + len && lbound != rbound)
+        n++;
+    return n;
+}
+
+/*
+ * Send the first *len* bytes buffered for *f* and keep the rest. Called
+ * with wb->lock held.
+ */
+static int wb_send(cid_t cid, rfs_write_back_t *wb, rfs_wb_file_t *f,
+        uint32_t len)
+{
+    __int64_t out_size = 0;
+    int error;
+
+    if (len == 0)
+        return 0;
+    error = write_now(cid, f->fid, f->offset, len, f->data, &out_size);
+    if (error == 0 && out_size != len)
+        error = -EIO;
+    wb->requests++;
+    wb->rmw_sent += rmw_blocks(f->offset, len);
+
+    memmove(f->data, f->data + len, f->len - len);
+    f->offset += len;
+    if ((f->len -= len) == 0)
+        f->since = 0;
+    return error;
+}
+
+/* Send the data buffered for files written *delay* ms ago or before */
+static int wb_expire(cid_t cid, rfs_write_back_t *wb, __int64_t now)
+{
+    rfs_wb_file_t *f;
+    int i, error = 0, ret;
+
+    if (wb->delay <= 0)
+        return 0;
+    for (i = 0; i < RFS_WB_FILES; i++) {
+        f = &wb->files[i];
+        if (f->len && now - f->since >= wb->delay &&
+            (ret = wb_send(cid, wb, f, f->len)) != 0 && error == 0)
+            error = ret;
+    }
+    return error;
+}
+
+/* The slot of the data buffered for *fid*, NULL if there is none */
+static rfs_wb_file_t *wb_find(rfs_write_back_t *wb, fid_t fid)
+{
+    int i;
+
+    for (i = 0; i < RFS_WB_FILES; i++) {
+        if (wb->files[i].len && wb->files[i].fid == fid)
+            return &wb->files[i];
+    }
+    return NULL;
+}
+
+/*
+ * Buffer writes smaller than *max_bytes* on *ch*, for at most *delay_ms*,
+ * 0 for until the buffer fills or is flushed. Returns -EBUSY if the
+ * buffer is already on with another size.
+ */
+int rfs_channel_write_back(rfs_channel_t *ch, uint32_t max_bytes, int delay_ms)
+{
+    rfs_write_back_t *wb;
+
+    if (ch == NULL || max_bytes < 2 * RFS_BLOCK_SIZE || max_bytes > RFS_WB_MAX)
+        return -EINVAL;
+
+    if ((wb = ch->wb) != NULL) {
+        // The files' buffers are of max_bytes
+        if (wb->max_bytes != max_bytes)
+            return -EBUSY;
+        pthread_mutex_lock(&wb->lock);
+        wb->delay = delay_ms > 0 ? delay_ms : 0;
+        pthread_mutex_unlock(&wb->lock);
+        return 0;
+    }
+
+    if ((wb = calloc(1, sizeof(rfs_write_back_t))) == NULL)
+        return -ENOMEM;
+    pthread_mutex_init(&wb->lock, NULL);
+    wb->max_bytes = max_bytes;
+    wb->delay = delay_ms > 0 ? delay_ms : 0;
+    ch->wb = wb;
+
+    return 0;
+}
+
+/*
+ * Buffer the write of *size* bytes of *buffer* to *fid* at *offset* on
+ * the channel of *cid*. Returns -EOPNOTSUPP if the channel has no
+ * write-back buffer or the write is too big for it, for the caller to
+ * send the write itself.
+ */
+int wb_write(cid_t cid, fid_t fid, uint64_t offset, __int64_t size,
+        char *buffer, __int64_t *out_size)
+{
+    rfs_write_back_t *wb;
+    rfs_wb_file_t *f;
+    uint64_t start, end, tail;
+    int i, error, ret = 0;
+
+    if ((wb = write_back(cid)) == NULL || size < 0)
+        return -EOPNOTSUPP;
+
+    pthread_mutex_lock(&wb->lock);
+    error = wb_expire(cid, wb, now_ms());
+    f = wb_find(wb, fid);
+
+    // Data that does not touch the write goes first
+    if (f != NULL && (offset > f->offset + f->len || offset + size < f->offset))
+        ret = wb_send(cid, wb, f, f->len);
+    // The data buffered goes before a write too big to buffer
+    if ((uint64_t)size >= wb->max_bytes) {
+        if (f != NULL && f->len)
+            ret = wb_send(cid, wb, f, f->len);
+        pthread_mutex_unlock(&wb->lock);
+        return error ? error : (ret ? ret : -EOPNOTSUPP);
+    }
+    if (error == 0)
+        error = ret;
+
+    if (f == NULL || f->len == 0) {
+        if (f == NULL) {
+            // A free slot, else the one of the oldest data
+            for (i = 0; i < RFS_WB_FILES; i++) {
+                if (wb->files[i].len == 0) {
+                    f = &wb->files[i];
+                    break;
+                }
+                if (f == NULL || wb->files[i].since < f->since)
+                    f = &wb->files[i];
+            }
+            if (f->len && (ret = wb_send(cid, wb, f, f->len)) != 0 && error == 0)
+                error = ret;
+        }
+        if (f->data == NULL && (f->data = malloc(wb->max_bytes)) == NULL) {
+            pthread_mutex_unlock(&wb->lock);
+            return error ? error : -EOPNOTSUPP;
+        }
+        f->fid = fid;
+        f->offset = offset;
+        f->since = now_ms();
+    }
+
+    start = offset < f->offset ? offset : f->offset;
+    end = offset + size > f->offset + f->len ? offset + size : f->offset + f->len;
+    if (end - start > wb->max_bytes) {
+        // Send the whole blocks, keep the partial one at the end
+        tail = (f->offset + f->len) & ~(uint64_t)(RFS_BLOCK_SIZE - 1);
+        if (tail > f->offset && (ret = wb_send(cid, wb, f, tail - f->offset)) != 0 &&
+            error == 0)
+            error = ret;
+        start = offset < f->offset ? offset : f->offset;
+        end = offset + size > f->offset + f->len ? offset + size : f->offset + f->len;
+        // What is left may not touch the write, or still be too much
+        if (f->len == 0 || offset > f->offset + f->len ||
+            offset + size < f->offset || end - start > wb->max_bytes) {
+            if ((ret = wb_send(cid, wb, f, f->len)) != 0 && error == 0)
+                error = ret;
+            f->offset = start = offset;
+            end = offset + size;
+            f->since = now_ms();
+        }
+    }
+    if (start < f->offset) {
+        memmove(f->data + (f->offset - start), f->data, f->len);
+        f->offset = start;
+    }
+    memcpy(f->data + (offset - f->offset), buffer, size);
+    f->len = (uint32_t)(end - start);
+
+    wb->writes++;
+    wb->rmw_asked += rmw_blocks(offset, size);
+    pthread_mutex_unlock(&wb->lock);
+
+    if (out_size)
+        *out_size = size;
+    return error;
+}
+
+/*
+ * Send the data buffered for *fid* on the channel of *cid*. Returns the
+ * error of the write, 0 if nothing was buffered.
+ */
+int wb_flush(cid_t cid, fid_t fid)
+{
+    rfs_write_back_t *wb;
+    rfs_wb_file_t *f;
+    int error = 0;
+
+    if ((wb = write_back(cid)) == NULL)
+        return 0;
+    pthread_mutex_lock(&wb->lock);
+    if ((f = wb_find(wb, fid)) != NULL)
+        error = wb_send(cid, wb, f, f->len);
+    pthread_mutex_unlock(&wb->lock);
+
+    return error;
+}
+
+/*
+ * Send the data buffered for the file of *attr*, attributes fetched
+ * before it was, and fetch them again if there was any. Returns the
+ * error of the write or the getattr.
+ */
+int wb_flush_attr(cid_t cid, FileAttr *attr)
+{
+    rfs_write_back_t *wb;
+    rfs_wb_file_t *f;
+    int error = 0, sent = 0;
+
+    if ((wb = write_back(cid)) == NULL)
+        return 0;
+    pthread_mutex_lock(&wb->lock);
+    if ((f = wb_find(wb, attr->ino)) != NULL) {
+        error = wb_send(cid, wb, f, f->len);
+        sent = 1;
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    if (error || !sent)
+        return error;
+    return rfs_getattr(cid, attr->ino, attr);
+}
+
+/*
+ * Send the data buffered for the file the request *arg*, any rfs_arg_*,
+ * reads or changes, for it to go after.
+ */
+int wb_flush_arg(cid_t cid, const void *arg)
+{
+    switch (*(const rfs_file_op_t *)arg) {
+        case OP_READ:
+            return wb_flush(cid, ((const rfs_arg_read_t *)arg)->fid);
+        case OP_WRITE:
+            return wb_flush(cid, ((const rfs_arg_write_t *)arg)->fid);
+        case OP_READV:
+        case OP_WRITEV:
+            return wb_flush(cid, ((const rfs_arg_readv_t *)arg)->fid);
+        case OP_GETATTRS:
+            return wb_flush(cid, ((const rfs_arg_getattr_t *)arg)->fid);
+        case OP_SETATTRS:
+            return wb_flush(cid, ((const rfs_arg_setattr_t *)arg)->fid);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Send everything buffered on *ch*, before it is closed.
+ */
+int wb_flush_all(rfs_channel_t *ch)
+{
+    rfs_write_back_t *wb;
+    int i, error = 0, ret;
+
+    if ((wb = ch->wb) == NULL)
+        return 0;
+    pthread_mutex_lock(&wb->lock);
+    for (i = 0; i < RFS_WB_FILES; i++) {
+        if ((ret = wb_send(ch->cid, wb, &wb->files[i], wb->files[i].len)) != 0 &&
+            error == 0)
+            error = ret;
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return error;
+}
+
+void wb_free(rfs_channel_t *ch)
+{
+    rfs_write_back_t *wb;
+    int i;
+
+    if ((wb = ch->wb) == NULL)
+        return;
+    for (i = 0; i < RFS_WB_FILES; i++)
+        free(wb->files[i].data);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+    ch->wb = NULL;
+}
+
+/*
+ * Write the data of *fid* buffered on the channel of *cid* to the
+ * dispatcher, as on fsync() or close().
+ */
+int rfs_flush(cid_t cid, fid_t fid)
+{
+    return wb_flush(cid, fid);
+}
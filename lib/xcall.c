@@ -1,50 +1,1022 @@
+/*
+ * LD_PRELOAD interposer. Unmodified binaries reach the files under
+ * MOUNT_POINT through the client library, without a kernel or FUSE hop:
+ *
+ *   gcc -shared -fPIC -o libravana_xcall.so xcall.c ravana_*.c -ldl -lmsgpackc
+ *   LD_PRELOAD=./libravana_xcall.so cat /mnt/ravana/<cid>/path/to/file
+ *
+ * The file systems are visible as /mnt/ravana/<cid>/, cid in hex as
+ * CID_STR_FMT prints it. open(), openat(), read(), pread(), write(),
+ * pwrite(), lseek(), close(), fstat(), stat(), lstat(), unlink(),
+ * unlinkat(), rmdir(), rename() and renameat() of those paths are served
+ * here; everything else goes to the next definition, libc's.
+ *
+ * A file opened here gets a real fd, an O_PATH one of /dev/null, so that
+ * its number is one the kernel won't hand out to anything else while the
+ * file is open, and the fd table maps that number to the file's (cid,
+ * fid, offset, flags). Being O_PATH, a copy of the fd made behind our
+ * back, by dup2() say, fails reads and writes with EBADF rather than
+ * reading or writing /dev/null. The table is an array indexed by fd,
+ * whose entries are never freed: an entry is filled in before it is
+ * published with a release store to used, and looked up with an acquire
+ * load, so the calls on a file take no lock. A read() or write()
+ * reserves its range of the fd's offset with an atomic add before going
+ * to the file, so that those going on at the same time on an fd never
+ * overlap; one that comes up short hands back the rest of its range,
+ * unless another has reserved past it meanwhile, which leaves a gap as a
+ * seek would. An O_APPEND write goes to the size of the file from a
+ * getattr, and may overwrite another append made at the same time.
+ *
+ * Symlinks are followed as the kernel would, up to XCALL_MAXSYMLINKS of
+ * them; one whose target leaves MOUNT_POINT sends the rest of the path
+ * back to libc. Files opened here are not seen by dup(), fcntl(), mmap(),
+ * readdir() and the like, paths not by statx() and fstatat(), and a cwd
+ * under MOUNT_POINT is not resolved.
+ *
+ * RAVANA_CACHE_MS, if set, turns on the attribute and dentry caches of
+ * the channels with that ttl; symlink targets, which never change, are
+ * always cached. It turns on the prefix cache too, which maps the
+ * directory prefixes of the paths resolved, as strings, to the directory
+ * they lead to, so that a path under one resolved before takes one
+ * lookup per component past the longest prefix cached. The cache is a
+ * table of XCALL_PREFIXES entries; an unlink, rmdir or rename here of
+ * anything but a regular file drops all of it, as does the ttl. Changes
+ * by other clients are seen within the ttl, as with the dentry cache.
+ */
+
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ravana.h"
+#include "ravana_interfaces.h"
 
 #define MOUNT_POINT "/mnt/ravana/"
 
+#define XFD_MAX             (1 << 16)   /* fds the table covers */
+#define XCALL_MAXSYMLINKS   (40)        /* symlinks a path may go through */
+#define XCALL_MAX_CIDS      (64)        /* channels set up at most */
+#define XCALL_LINK_CACHE    (4096)      /* symlink targets cached per channel */
+#define XCALL_CACHE         (65536)     /* attributes and names cached per channel */
+#define XCALL_PREFIXES      (4096)      /* path prefixes cached */
+#define XCALL_PREFIX_MAX    (240)       /* characters of a prefix cached at most */
+#define XCALL_PREFIX_DEPTH  (64)        /* prefixes of a path looked up at most */
+
+/* lookup_int() left Ravana, the path to go on with is the real one */
+#define XCALL_NOT_RAVANA    (-1)
+
+/* A file opened here, the entry of its fd */
+typedef struct xfile {
+    atomic_int          used;       // the fd is of a file opened here
+    int                 flags;      // open() flags
+    cid_t               cid;        // channel of the file
+    fid_t               fid;        // the file
+    mode_t              mode;       // its type
+    atomic_uint_fast64_t offset;    // offset of the fd
+    atomic_int          written;    // the fd wrote to the file
+} xfile_t;
+
+static xfile_t xfd_table[XFD_MAX];
 
-int open();
+/* Channels set up, see xcid_setup() */
+static pthread_mutex_t xcid_lock = PTHREAD_MUTEX_INITIALIZER;
+static cid_t xcids[XCALL_MAX_CIDS];
+static int n_xcids;
 
-int open(const char*pathname, int flags)
+/* A path prefix cached, the directory it leads to from where it starts */
+typedef struct xprefix {
+    uint64_t    hash;       // of the prefix and where it starts
+    __int64_t   expires;    // ms, CLOCK_MONOTONIC
+    unsigned    gen;        // xprefix_gen when it was cached
+    uint16_t    len;        // of path
+    cid_t       cid0;       // where the prefix starts
+    fid_t       dfid0;
+    cid_t       cid;        // the directory it leads to
+    fid_t       fid;
+    char        path[XCALL_PREFIX_MAX];
+} xprefix_t;
+
+static pthread_mutex_t xprefix_lock = PTHREAD_MUTEX_INITIALIZER;
+static xprefix_t xprefixes[XCALL_PREFIXES];
+static atomic_uint xprefix_gen = 1;
+
+static mode_t xumask;
+static int xcache_ttl;      // RAVANA_CACHE_MS, 0 for no caches
+
+/* The definitions of libc, looked up on first use */
+static int (*real_openat)(int, const char *, int, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static off_t (*real_lseek)(int, off_t, int);
+static int (*real_close)(int);
+static int (*real_fstat)(int, struct stat *);
+static int (*real_stat)(const char *, struct stat *);
+static int (*real_lstat)(const char *, struct stat *);
+static int (*real_unlinkat)(int, const char *, int);
+static int (*real_renameat)(int, const char *, int, const char *);
+
+/* The definition of *name* after this one, into *slot* */
+static void *real_sym(void **slot, const char *name)
 {
-    int mode = 0;
-    fid_t fid = 0;
+    if (*slot == NULL)
+        *slot = dlsym(RTLD_NEXT, name);
+    return *slot;
+}
+
+#define REAL(name)  ((__typeof__(real_##name))real_sym((void **)&real_##name, #name))
 
-    if(flags & O_CREAT) {
-        va_list arg;
-        va_start (arg, flags);
-        mode = va_arg (arg, int);
-        va_end (arg);
+/*
+ * A forked child has none of the parent's channels (see
+ * ravana_channel.c), set them up again on first use. The locks may have
+ * been held by threads that did not make it into the child.
+ */
+static void xcall_atfork_child(void)
+{
+    pthread_mutex_init(&xcid_lock, NULL);
+    n_xcids = 0;
+    pthread_mutex_init(&xprefix_lock, NULL);
+    atomic_fetch_add(&xprefix_gen, 1);
+}
+
+__attribute__((constructor))
+static void xcall_init(void)
+{
+    const char *env;
+
+    xumask = umask(022);
+    umask(xumask);
+    if ((env = getenv("RAVANA_CACHE_MS")) != NULL && atoi(env) > 0)
+        xcache_ttl = atoi(env);
+    REAL(openat);
+    REAL(read);
+    REAL(pread);
+    REAL(write);
+    REAL(pwrite);
+    REAL(lseek);
+    REAL(close);
+    REAL(fstat);
+    REAL(stat);
+    REAL(lstat);
+    REAL(unlinkat);
+    REAL(renameat);
+    pthread_atfork(NULL, NULL, xcall_atfork_child);
+}
+
+/* Now in ms, CLOCK_MONOTONIC */
+static __int64_t xnow_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Fail a call with the error of an rfs_* call, positive or negative */
+static int xerr(int error)
+{
+    errno = error < 0 ? -error : error;
+    return -1;
+}
+
+/* The entry of *fd*, NULL if it is not of a file opened here */
+static inline xfile_t *xfd_get(int fd)
+{
+    xfile_t *f;
+
+    if (fd < 0 || fd >= XFD_MAX)
+        return NULL;
+    f = &xfd_table[fd];
+    return atomic_load_explicit(&f->used, memory_order_acquire) ? f : NULL;
+}
+
+/*
+ * File systems will be visible in /mnt/ravana/<cid>/
+ */
+int is_ravana(const char *path)
+{
+    return strncmp(path, MOUNT_POINT, strlen(MOUNT_POINT)) == 0 &&
+        path[strlen(MOUNT_POINT)] != '\0';
+}
+
+/*
+ * Open the channel of *cid* and turn its caches on, the first time it is
+ * seen. Done under xcid_lock, before any other thread can use it.
+ */
+static int xcid_setup(cid_t cid)
+{
+    rfs_channel_t *ch;
+    int i, error = 0;
+
+    pthread_mutex_lock(&xcid_lock);
+    for (i = 0; i < n_xcids; i++) {
+        if (xcids[i] == cid) {
+            pthread_mutex_unlock(&xcid_lock);
+            return 0;
+        }
     }
+    if (n_xcids == XCALL_MAX_CIDS) {
+        error = -ENFILE;
+    } else if ((ch = rfs_channel_open(cid)) == NULL) {
+        error = -ENOMEM;
+    } else {
+        rfs_channel_link_cache(ch, XCALL_LINK_CACHE);
+        if (xcache_ttl) {
+            rfs_channel_attr_cache(ch, XCALL_CACHE, xcache_ttl);
+            rfs_channel_dentry_cache(ch, XCALL_CACHE, xcache_ttl);
+        }
+        xcids[n_xcids++] = cid;
+    }
+    pthread_mutex_unlock(&xcid_lock);
+
+    return error;
+}
 
-    if(!is_ravana(pathname)) {
-        if(mode)
-            return __open64(pathname, flags, mode);
+/*
+ * The cid at *path*, just past MOUNT_POINT, into *cid*. Returns the
+ * number of characters it takes, 0 if there is none.
+ */
+static int parse_cid(const char *path, cid_t *cid)
+{
+    cid_t v = 0;
+    int n, d;
+
+    for (n = 0; path[n] != '\0' && path[n] != '/'; n++) {
+        if (path[n] >= '0' && path[n] <= '9')
+            d = path[n] - '0';
+        else if (path[n] >= 'a' && path[n] <= 'f')
+            d = path[n] - 'a' + 10;
+        else if (path[n] >= 'A' && path[n] <= 'F')
+            d = path[n] - 'A' + 10;
         else
-            return __open64(pathname, flags);
+            return 0;
+        if (n == 32)
+            return 0;
+        v = v << 4 | (cid_t)d;
+    }
+    *cid = v;
+    return n;
+}
+
+/* Seed of the hashes of the paths that start at *dfid* of *cid* */
+static inline uint64_t xprefix_seed(cid_t cid, fid_t dfid)
+{
+    return ((uint64_t)cid ^ (uint64_t)(cid >> 64) ^ (uint64_t)dfid ^
+            (uint64_t)(dfid >> 64)) * 0x9e3779b97f4a7c15ULL ^ 0xcbf29ce484222325ULL;
+}
+
+/* FNV-1a of the *len* characters of *path*, from *h* on */
+static inline uint64_t xprefix_hash(uint64_t h, const char *path, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/* First of the two entries the prefix of hash *h* may go into */
+static inline xprefix_t *xprefix_slot(uint64_t h)
+{
+    return &xprefixes[(uint32_t)(h >> 32) & (XCALL_PREFIXES - 1) & ~1U];
+}
+
+/*
+ * The directory the *len* characters of *path*, from *dfid* of *cid*,
+ * lead to, into *cid* and *fid*, cached in generation *gen*. Returns 1
+ * if it is cached.
+ */
+static int xprefix_get(uint64_t h, cid_t *cid, fid_t dfid, const char *path,
+        size_t len, fid_t *fid, unsigned gen)
+{
+    xprefix_t *e;
+    __int64_t now = xnow_ms();
+    int i, hit = 0;
+
+    pthread_mutex_lock(&xprefix_lock);
+    for (i = 0, e = xprefix_slot(h); i < 2; i++, e++) {
+        if (e->hash == h && e->gen == gen && e->expires > now &&
+            e->len == len && e->cid0 == *cid && e->dfid0 == dfid &&
+            memcmp(e->path, path, len) == 0) {
+            *cid = e->cid;
+            *fid = e->fid;
+            hit = 1;
+            break;
+        }
     }
+    pthread_mutex_unlock(&xprefix_lock);
 
-    fid = lookup_int(pathname);
+    return hit;
 }
 
 /*
- * File systems will be visible in /mnt/ravana/<cid>/
+ * Cache *fid* of *cid* as the directory the *len* characters of *path*
+ * lead to from *dfid* of *cid0*, as found by a walk that started in
+ * generation *gen*. Nothing is cached if the cache was invalidated since,
+ * the walk may have gone through what was removed; the entry is cached
+ * with *gen* in any case, so an invalidation that comes while it is put
+ * drops it too.
  */
-int is_ravana(const char *path)
+static void xprefix_put(cid_t cid0, fid_t dfid, const char *path, size_t len,
+        cid_t cid, fid_t fid, unsigned gen)
+{
+    xprefix_t *e;
+    uint64_t h = xprefix_hash(xprefix_seed(cid0, dfid), path, len);
+    __int64_t now = xnow_ms();
+
+    if (atomic_load(&xprefix_gen) != gen)
+        return;
+    pthread_mutex_lock(&xprefix_lock);
+    e = xprefix_slot(h);
+    // The prefix's own entry, else the one that expires first
+    if (e[1].hash == h || (e[0].hash != h && e[1].expires < e[0].expires))
+        e++;
+    e->hash = h;
+    e->gen = gen;
+    e->expires = now + xcache_ttl;
+    e->len = (uint16_t)len;
+    e->cid0 = cid0;
+    e->dfid0 = dfid;
+    e->cid = cid;
+    e->fid = fid;
+    memcpy(e->path, path, len);
+    pthread_mutex_unlock(&xprefix_lock);
+}
+
+/*
+ * Forget all cached prefixes, as a directory or symlink was removed or
+ * renamed. Entries cached from here on carry the new generation.
+ */
+static void xprefix_invalidate(void)
+{
+    atomic_fetch_add(&xprefix_gen, 1);
+}
+
+/*
+ * Resolve *path*, absolute or, if *dfid* is not 0, relative to the
+ * directory *dfid* of *cid*. On success the attributes of the file are in
+ * *attr*, and *dfid* and *last* are its directory and name. A path whose
+ * last component does not exist fails with ENOENT with those set, for
+ * O_CREAT; last->name_len is 0 if a directory on the way is missing. The
+ * last component is followed if it is a symlink and *follow* is set.
+ * Returns XCALL_NOT_RAVANA with the path to go on with in *path*, of
+ * PATH_MAX bytes, if a symlink took it out of Ravana.
+ *
+ * The walk starts from the longest prefix of the path, up to a '/', whose
+ * directory is in the prefix cache, and caches the directories of the
+ * prefixes it goes through. Components that come from symlink targets
+ * are not prefixes of the path; the prefix that ends with a symlink is
+ * cached once its target is resolved.
+ */
+static int lookup_int(char *path, cid_t *cid, fid_t *dfid, file_name_t *last,
+        FileAttr *attr, int follow)
+{
+    char rest[PATH_MAX], target[PATH_MAX];
+    const char *s = path, *comp, *next;
+    uint64_t h, hashes[XCALL_PREFIX_DEPTH];
+    size_t ends[XCALL_PREFIX_DEPTH];
+    size_t slen, orig_left, cached, p;
+    __int64_t len;
+    size_t n;
+    int links = 0, n_ends = 0, error;
+    unsigned gen = atomic_load(&xprefix_gen);
+    cid_t cid0;
+    fid_t dir = *dfid, dir0;
+
+    if (*s == '/') {
+        if (!is_ravana(s))
+            return XCALL_NOT_RAVANA;
+        s += strlen(MOUNT_POINT);
+        if ((n = parse_cid(s, cid)) == 0)
+            return ENOENT;
+        if ((error = xcid_setup(*cid)) != 0)
+            return error;
+        s += n;
+        dir = ROOT;
+    }
+    while (*s == '/')
+        s++;
+    cid0 = *cid;
+    dir0 = dir;
+    slen = strlen(s);
+
+    // The longest prefix cached
+    cached = 0;
+    if (xcache_ttl) {
+        h = xprefix_seed(cid0, dir0);
+        for (p = 0; p < slen && p <= XCALL_PREFIX_MAX; p++) {
+            if (s[p] == '/' && s[p - 1] != '/' && n_ends < XCALL_PREFIX_DEPTH) {
+                hashes[n_ends] = h;
+                ends[n_ends++] = p;
+            }
+            h = (h ^ (unsigned char)s[p]) * 0x100000001b3ULL;
+        }
+        while (n_ends-- > 0) {
+            if (xprefix_get(hashes[n_ends], cid, dir0, s, ends[n_ends], &dir, gen)) {
+                cached = ends[n_ends];
+                break;
+            }
+        }
+    }
+
+    // The end of rest still to go that is the path's own
+    for (p = cached; s[p] == '/'; p++)
+        ;
+    strcpy(rest, s + p);
+    orig_left = slen - p;
+    last->name_len = 0;
+    comp = rest;
+
+    for (;;) {
+        if (*comp == '/') {
+            // An absolute symlink target, in Ravana or not
+            if (!is_ravana(comp)) {
+                memmove(path, comp, strlen(comp) + 1);
+                return XCALL_NOT_RAVANA;
+            }
+            comp += strlen(MOUNT_POINT);
+            if ((n = parse_cid(comp, cid)) == 0)
+                return ENOENT;
+            if ((error = xcid_setup(*cid)) != 0)
+                return error;
+            comp += n;
+            dir = ROOT;
+        }
+        while (*comp == '/')
+            comp++;
+        if (*comp == '\0')
+            break;
+        n = strcspn(comp, "/");
+        next = comp + n;
+        while (*next == '/')
+            next++;
+
+        // Back in the path's own components, dir is where its prefix leads
+        if (xcache_ttl && strlen(comp) <= orig_left) {
+            orig_left = strlen(comp);
+            p = slen - orig_left;
+            while (p > 0 && s[p - 1] == '/')
+                p--;
+            if (p > cached && p <= XCALL_PREFIX_MAX) {
+                xprefix_put(cid0, dir0, s, p, *cid, dir, gen);
+                cached = p;
+            }
+        }
+
+        if (n == 1 && *comp == '.') {
+            comp = next;
+            continue;
+        }
+        if (n > NAME_MAX)
+            return ENAMETOOLONG;
+
+        last->name_len = n;
+        memcpy(last->name, comp, n);
+        last->name[n] = '\0';
+        if ((error = rfs_lookup(*cid, dir, *last, attr)) != 0) {
+            // The directory stays for a create of the last component
+            if (error == ENOENT && *next == '\0')
+                *dfid = dir;
+            else
+                last->name_len = 0;
+            return error;
+        }
+
+        if (S_ISLNK(attr->mode) && (*next != '\0' || follow)) {
+            if (++links > XCALL_MAXSYMLINKS)
+                return ELOOP;
+            if ((error = rfs_readlink(*cid, attr->ino, &len, target)) != 0)
+                return error;
+            if (len <= 0)
+                return ENOENT;
+            // The target takes the place of the link in the rest of the path
+            n = strlen(next);
+            if (n < orig_left)
+                orig_left = n;
+            if ((size_t)len + 1 + n + 1 > sizeof(rest))
+                return ENAMETOOLONG;
+            if (n > 0) {
+                memmove(rest + len + 1, next, n + 1);
+                rest[len] = '/';
+            } else {
+                rest[len] = '\0';
+            }
+            memcpy(rest, target, len);
+            comp = rest;
+            last->name_len = 0;
+            continue;
+        }
+        if (*next == '\0') {
+            *dfid = dir;
+            return 0;
+        }
+        if (!S_ISDIR(attr->mode))
+            return ENOTDIR;
+        dir = attr->ino;
+        comp = next;
+    }
+
+    // The path ends on a directory, its own attributes
+    last->name_len = 0;
+    *dfid = dir;
+    return rfs_getattr(*cid, dir, attr);
+}
+
+/* Fill *st* from the attributes *attr* */
+static void xstat_fill(const FileAttr *attr, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = (dev_t)(LOWER64(attr->dev) ^ UPPER64(attr->dev));
+    st->st_ino = (ino_t)(LOWER64(attr->ino) ^ UPPER64(attr->ino));
+    st->st_mode = attr->mode;
+    st->st_nlink = attr->links;
+    st->st_uid = attr->uid;
+    st->st_gid = attr->gid;
+    st->st_rdev = attr->rdev;
+    st->st_size = (off_t)attr->size;
+    st->st_blksize = RFS_BLOCK_SIZE;
+    st->st_blocks = (blkcnt_t)((attr->size + 511) / 512);
+    st->st_atim = attr->atime;
+    st->st_mtim = attr->mtime;
+    st->st_ctim = attr->ctime;
+}
+
+/*
+ * Where *pathname*, relative to *dirfd*, starts: *cid* and *dfid* for
+ * lookup_int(), with the path copied to *path* of PATH_MAX bytes.
+ * Returns XCALL_NOT_RAVANA if it is not under MOUNT_POINT or a directory
+ * opened here.
+ */
+static int xstart(int dirfd, const char *pathname, char *path, cid_t *cid,
+        fid_t *dfid)
+{
+    xfile_t *d = NULL;
+
+    if (pathname == NULL ||
+        (pathname[0] == '/' ? !is_ravana(pathname) : (d = xfd_get(dirfd)) == NULL))
+        return XCALL_NOT_RAVANA;
+    *cid = 0;
+    *dfid = 0;
+    if (d != NULL) {
+        if (!S_ISDIR(d->mode))
+            return ENOTDIR;
+        *cid = d->cid;
+        *dfid = d->fid;
+    }
+    if (strlen(pathname) >= PATH_MAX)
+        return ENAMETOOLONG;
+    strcpy(path, pathname);
+    return 0;
+}
+
+/* open() and openat() of *pathname* relative to *dirfd* */
+static int xopen(int dirfd, const char *pathname, int flags, mode_t mode)
+{
+    char path[PATH_MAX];
+    xfile_t *f;
+    cid_t cid;
+    fid_t dfid;
+    file_name_t last;
+    FileAttr attr, attr_in;
+    int acc = flags & O_ACCMODE, fd, error;
+
+    error = xstart(dirfd, pathname, path, &cid, &dfid);
+    if (error == XCALL_NOT_RAVANA)
+        return REAL(openat)(dirfd, pathname, flags, mode);
+    if (error != 0)
+        return xerr(error);
+
+    error = lookup_int(path, &cid, &dfid, &last, &attr, !(flags & O_NOFOLLOW));
+    if (error == XCALL_NOT_RAVANA)
+        return REAL(openat)(AT_FDCWD, path, flags, mode);
+    if (error == ENOENT && (flags & O_CREAT) && last.name_len) {
+        memset(&attr_in, 0, sizeof(FileAttr));
+        attr_in.mode = S_IFREG | (mode & 07777 & ~xumask);
+        attr_in.uid = geteuid();
+        attr_in.gid = getegid();
+        error = rfs_create(cid, dfid, RFS_ATTR_MODE | RFS_ATTR_UID | RFS_ATTR_GID,
+                last, attr_in, &attr);
+    } else if (error == 0 && (flags & O_CREAT) && (flags & O_EXCL)) {
+        error = EEXIST;
+    }
+    if (error != 0)
+        return xerr(error);
+
+    if (S_ISLNK(attr.mode))
+        return xerr(ELOOP);
+    if (S_ISDIR(attr.mode) && acc != O_RDONLY)
+        return xerr(EISDIR);
+    if ((flags & O_DIRECTORY) && !S_ISDIR(attr.mode))
+        return xerr(ENOTDIR);
+    if ((flags & O_TRUNC) && acc != O_RDONLY && S_ISREG(attr.mode) && attr.size) {
+        attr.size = 0;
+        if ((error = rfs_setattr(cid, attr.ino, RFS_ATTR_SIZE, attr)) != 0)
+            return xerr(error);
+    }
+
+    // A number the kernel keeps for the file, useless for anything else
+    if ((fd = REAL(openat)(AT_FDCWD, "/dev/null", O_PATH | (flags & O_CLOEXEC))) < 0)
+        return -1;
+    if (fd >= XFD_MAX) {
+        REAL(close)(fd);
+        return xerr(EMFILE);
+    }
+    f = &xfd_table[fd];
+    f->flags = flags;
+    f->cid = cid;
+    f->fid = attr.ino;
+    f->mode = attr.mode & S_IFMT;
+    atomic_store_explicit(&f->offset, 0, memory_order_relaxed);
+    atomic_store_explicit(&f->written, 0, memory_order_relaxed);
+    atomic_store_explicit(&f->used, 1, memory_order_release);
+
+    return fd;
+}
+
+int open(const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list arg;
+
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(arg, flags);
+        mode = va_arg(arg, mode_t);
+        va_end(arg);
+    }
+    return xopen(AT_FDCWD, pathname, flags, mode);
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list arg;
+
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(arg, flags);
+        mode = va_arg(arg, mode_t);
+        va_end(arg);
+    }
+    return xopen(dirfd, pathname, flags, mode);
+}
+
+/* read() and pread() of *f* at *offset* */
+static ssize_t xread(xfile_t *f, void *buf, size_t count, uint64_t offset)
+{
+    __int64_t out_size = 0;
+    int error;
+
+    if ((f->flags & O_ACCMODE) == O_WRONLY)
+        return xerr(EBADF);
+    if (S_ISDIR(f->mode))
+        return xerr(EISDIR);
+    if (count == 0)
+        return 0;
+    if ((error = rfs_read(f->cid, f->fid, offset, (__int64_t)count, &out_size, buf)) != 0)
+        return xerr(error);
+    return (ssize_t)out_size;
+}
+
+/* write() and pwrite() of *f* at *offset* */
+static ssize_t xwrite(xfile_t *f, const void *buf, size_t count, uint64_t offset)
+{
+    __int64_t out_size = 0;
+    int error;
+
+    if ((f->flags & O_ACCMODE) == O_RDONLY)
+        return xerr(EBADF);
+    if (count == 0)
+        return 0;
+    atomic_store_explicit(&f->written, 1, memory_order_relaxed);
+    if ((error = rfs_write(f->cid, f->fid, offset, (__int64_t)count, (char *)buf,
+                    &out_size)) != 0)
+        return xerr(error);
+    return (ssize_t)out_size;
+}
+
+/*
+ * Take *count* bytes of the offset of *f* from where it is, for a read
+ * or write. Returns where they start.
+ */
+static inline uint64_t xoffset_take(xfile_t *f, size_t count)
+{
+    return atomic_fetch_add(&f->offset, (uint_fast64_t)count);
+}
+
+/*
+ * Hand back the bytes of the *count* taken at *offset* that were not
+ * read or written, *n* of them were, if no one took more since.
+ */
+static inline void xoffset_give_back(xfile_t *f, uint64_t offset, size_t count,
+        ssize_t n)
+{
+    uint_fast64_t end = offset + count;
+
+    if (n < 0)
+        n = 0;
+    if ((size_t)n < count)
+        atomic_compare_exchange_strong(&f->offset, &end, offset + (uint64_t)n);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    xfile_t *f;
+    uint64_t offset;
+    ssize_t n;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(read)(fd, buf, count);
+    offset = xoffset_take(f, count);
+    n = xread(f, buf, count, offset);
+    xoffset_give_back(f, offset, count, n);
+    return n;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    xfile_t *f;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(pread)(fd, buf, count, offset);
+    if (offset < 0)
+        return xerr(EINVAL);
+    return xread(f, buf, count, (uint64_t)offset);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    xfile_t *f;
+    FileAttr attr;
+    uint64_t offset;
+    ssize_t n;
+    int error;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(write)(fd, buf, count);
+    if (f->flags & O_APPEND) {
+        if ((error = rfs_getattr(f->cid, f->fid, &attr)) != 0)
+            return xerr(error);
+        offset = attr.size;
+        if ((n = xwrite(f, buf, count, offset)) > 0)
+            atomic_store(&f->offset, offset + (uint64_t)n);
+        return n;
+    }
+    offset = xoffset_take(f, count);
+    n = xwrite(f, buf, count, offset);
+    xoffset_give_back(f, offset, count, n);
+    return n;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    xfile_t *f;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(pwrite)(fd, buf, count, offset);
+    if (offset < 0)
+        return xerr(EINVAL);
+    return xwrite(f, buf, count, (uint64_t)offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    xfile_t *f;
+    FileAttr attr;
+    uint_fast64_t cur;
+    off_t base;
+    int error;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(lseek)(fd, offset, whence);
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            // Moves relative to reads and writes going on at the same time
+            cur = atomic_load(&f->offset);
+            do {
+                if ((off_t)cur + offset < 0)
+                    return xerr(EINVAL);
+            } while (!atomic_compare_exchange_weak(&f->offset, &cur,
+                        (uint_fast64_t)((off_t)cur + offset)));
+            return (off_t)cur + offset;
+        case SEEK_END:
+            if ((error = rfs_getattr(f->cid, f->fid, &attr)) != 0)
+                return xerr(error);
+            base = (off_t)attr.size;
+            break;
+        default:
+            return xerr(EINVAL);
+    }
+    if (base + offset < 0)
+        return xerr(EINVAL);
+    atomic_store(&f->offset, (uint_fast64_t)(base + offset));
+    return base + offset;
+}
+
+int close(int fd)
+{
+    xfile_t *f;
+    int error = 0;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(close)(fd);
+    atomic_store_explicit(&f->used, 0, memory_order_release);
+    // Writes buffered by the channel are due now
+    if (atomic_load(&f->written))
+        error = rfs_flush(f->cid, f->fid);
+    REAL(close)(fd);
+    return error ? xerr(error) : 0;
+}
+
+int fstat(int fd, struct stat *st)
 {
-    if(strlen(path) < strlen(MOUNT_POINT)) return 0;
-    if(strncmp(path, MOUNT_POINT, strlen(MOUNT_POINT)) == 0) return 1;
+    xfile_t *f;
+    FileAttr attr;
+    int error;
+
+    if ((f = xfd_get(fd)) == NULL)
+        return REAL(fstat)(fd, st);
+    if ((error = rfs_getattr(f->cid, f->fid, &attr)) != 0)
+        return xerr(error);
+    xstat_fill(&attr, st);
     return 0;
 }
 
-fid_t lookup_int(const char *pathname)
+/* stat() and lstat() of *pathname* */
+static int xstat(const char *pathname, struct stat *st, int follow)
 {
-    char *ptr = pathname + strlen(MOUNT_POINT);
-    char *comp = NULL;
-    while(comp = path_component(ptr)) {
-        rfs_lookup(comp)
+    char path[PATH_MAX];
+    cid_t cid = 0;
+    fid_t dfid = 0;
+    file_name_t last;
+    FileAttr attr;
+    int error;
+
+    if (strlen(pathname) >= sizeof(path))
+        return xerr(ENAMETOOLONG);
+    strcpy(path, pathname);
+    error = lookup_int(path, &cid, &dfid, &last, &attr, follow);
+    if (error == XCALL_NOT_RAVANA)
+        return follow ? REAL(stat)(path, st) : REAL(lstat)(path, st);
+    if (error != 0)
+        return xerr(error);
+    xstat_fill(&attr, st);
+    return 0;
+}
+
+int stat(const char *pathname, struct stat *st)
+{
+    if (!is_ravana(pathname))
+        return REAL(stat)(pathname, st);
+    return xstat(pathname, st, 1);
+}
+
+int lstat(const char *pathname, struct stat *st)
+{
+    if (!is_ravana(pathname))
+        return REAL(lstat)(pathname, st);
+    return xstat(pathname, st, 0);
+}
+
+/* unlink(), rmdir() and unlinkat() of *pathname* relative to *dirfd* */
+static int xunlink(int dirfd, const char *pathname, int flags)
+{
+    char path[PATH_MAX];
+    cid_t cid;
+    fid_t dfid;
+    file_name_t last;
+    FileAttr attr;
+    int error;
+
+    error = xstart(dirfd, pathname, path, &cid, &dfid);
+    if (error == XCALL_NOT_RAVANA)
+        return REAL(unlinkat)(dirfd, pathname, flags);
+    if (error != 0)
+        return xerr(error);
+
+    error = lookup_int(path, &cid, &dfid, &last, &attr, 0);
+    if (error == XCALL_NOT_RAVANA)
+        return REAL(unlinkat)(AT_FDCWD, path, flags);
+    if (error != 0)
+        return xerr(error);
+    // The path ends on a directory of its own, "." or the root
+    if (last.name_len == 0)
+        return xerr(attr.ino == ROOT ? EBUSY : EINVAL);
+
+    if (flags & AT_REMOVEDIR) {
+        if (!S_ISDIR(attr.mode))
+            return xerr(ENOTDIR);
+        error = rfs_rmdir(cid, dfid, last);
+    } else {
+        if (S_ISDIR(attr.mode))
+            return xerr(EISDIR);
+        error = rfs_unlink(cid, dfid, last);
     }
+    // Cached prefixes may go through the directory or symlink
+    if (!S_ISREG(attr.mode))
+        xprefix_invalidate();
+    return error ? xerr(error) : 0;
+}
+
+int unlink(const char *pathname)
+{
+    return xunlink(AT_FDCWD, pathname, 0);
+}
+
+int unlinkat(int dirfd, const char *pathname, int flags)
+{
+    return xunlink(dirfd, pathname, flags);
+}
+
+int rmdir(const char *pathname)
+{
+    return xunlink(AT_FDCWD, pathname, AT_REMOVEDIR);
+}
+
+/* rename() and renameat() */
+static int xrename(int olddirfd, const char *oldpath, int newdirfd,
+        const char *newpath)
+{
+    char old_path[PATH_MAX], new_path[PATH_MAX];
+    cid_t old_cid, new_cid;
+    fid_t old_dfid, new_dfid;
+    file_name_t old_last, new_last;
+    FileAttr old_attr, new_attr;
+    int old_error, new_error, error;
+
+    old_error = xstart(olddirfd, oldpath, old_path, &old_cid, &old_dfid);
+    new_error = xstart(newdirfd, newpath, new_path, &new_cid, &new_dfid);
+    if (old_error == XCALL_NOT_RAVANA && new_error == XCALL_NOT_RAVANA)
+        return REAL(renameat)(olddirfd, oldpath, newdirfd, newpath);
+    if (old_error == XCALL_NOT_RAVANA || new_error == XCALL_NOT_RAVANA)
+        return xerr(EXDEV);
+    if (old_error != 0 || new_error != 0)
+        return xerr(old_error ? old_error : new_error);
+
+    old_error = lookup_int(old_path, &old_cid, &old_dfid, &old_last, &old_attr, 0);
+    new_error = lookup_int(new_path, &new_cid, &new_dfid, &new_last, &new_attr, 0);
+    // Only Ravana to the same Ravana, a file system of its own
+    if (old_error == XCALL_NOT_RAVANA || new_error == XCALL_NOT_RAVANA ||
+        (old_error == 0 && (new_error == 0 || new_error == ENOENT) &&
+         old_cid != new_cid))
+        return xerr(EXDEV);
+    if (old_error != 0)
+        return xerr(old_error);
+    if (new_error != 0 && !(new_error == ENOENT && new_last.name_len))
+        return xerr(new_error);
+    if (old_last.name_len == 0 || (new_error == 0 && new_last.name_len == 0))
+        return xerr(EBUSY);
+
+    error = rfs_rename(old_cid, old_dfid, new_dfid, old_last, new_last);
+    // Cached prefixes may go through either name
+    if (!S_ISREG(old_attr.mode) || (new_error == 0 && !S_ISREG(new_attr.mode)))
+        xprefix_invalidate();
+    return error ? xerr(error) : 0;
+}
+
+int rename(const char *oldpath, const char *newpath)
+{
+    return xrename(AT_FDCWD, oldpath, AT_FDCWD, newpath);
 }
+
+int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+    return xrename(olddirfd, oldpath, newdirfd, newpath);
+}
+
+/*
+ * The large file names of the calls, which programs built with
+ * _FILE_OFFSET_BITS=64 use. off_t and struct stat are already 64 bit
+ * wide on 64 bit targets.
+ */
+#if __WORDSIZE == 64
+int open64(const char *pathname, int flags, ...)
+    __attribute__((alias("open")));
+int openat64(int dirfd, const char *pathname, int flags, ...)
+    __attribute__((alias("openat")));
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+    __attribute__((alias("pread")));
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+    __attribute__((alias("pwrite")));
+off64_t lseek64(int fd, off64_t offset, int whence)
+    __attribute__((alias("lseek")));
+int fstat64(int fd, struct stat64 *st)
+    __attribute__((alias("fstat")));
+int stat64(const char *pathname, struct stat64 *st)
+    __attribute__((alias("stat")));
+int lstat64(const char *pathname, struct stat64 *st)
+    __attribute__((alias("lstat")));
+#endif
@@ -1,4 +1,5 @@
 const ZERO_BLOCK = zeros(UInt8, BLOCK_SIZE)
+const READV_GAP = 16    # Blocks between readv segments read in one scan
 
 function init_data_worker(id::Int)
     global worker_id = id
@@ -9,6 +10,10 @@ function data_worker(op, args, ro::Bool)
         return data_write(args[1], args[2], args[3], args[4])
     elseif (op == OP_READ)
         return data_read(args[1], args[2], args[3])
+    elseif (op == OP_WRITEV)
+        return data_writev(args[1], args[2], args[3])
+    elseif (op == OP_READV)
+        return data_readv(args[1], args[2])
     elseif (op == OP_UTIL_MKFS || op == OP_MOUNT)
         return set_db(args[1])
     elseif (op == OP_UNLINK)
@@ -154,6 +159,92 @@ function data_read(fid::fid_t, offset::UInt64, len::UInt64)
     return data
 end
 
+"""
+    data_writev(fid::fid_t, segs, data::Vector{UInt8})
+Writes the segments *segs*, (offset, len) pairs, of *fid*. *data* holds
+the data of all segments back to back. The blocks of all segments go to
+the store in one kvs_write_batch(), a block shared by several segments is
+written once with all of their data, the later segment winning where they
+overlap.
+"""
+function data_writev(fid::fid_t, segs::Vector{Tuple{UInt64, UInt64}}, data::Vector{UInt8})
+    total = UInt64(0)
+    for (offset, len) in segs
+        total += len
+    end
+    if total != length(data)
+        throw(RavanaInvalidArgException("writev data is $(length(data)) bytes, segments $total", EINVAL))
+    end
+    pending = Dict{UInt64, AbstractVector{UInt8}}()     # block # => new block
+    seg_start = 1                                       # Segment's data in data
+    for (offset, len) in segs
+        if len == 0 continue end
+        for b = (offset ÷ BLOCK_SIZE):((offset + len - 1) ÷ BLOCK_SIZE)
+            bstart = b * BLOCK_SIZE
+            lo = max(offset, bstart)                    # Bytes lo:hi-1 of the
+            hi = min(offset + len, bstart + BLOCK_SIZE) # file are in block b
+            src = seg_start + (lo - offset)
+            if hi - lo == BLOCK_SIZE
+                pending[b] = view(data, src:(src + BLOCK_SIZE - 1))
+            else
+                # Partial block, update an earlier segment's copy or the stored one
+                blk::Vector{UInt8} = haskey(pending, b) ? collect(pending[b]) :
+                                     copy(read_blocks(fid, b, b)[(fid, b)])
+                blk[(lo - bstart + 1):(hi - bstart)] = view(data, src:(src + hi - lo - 1))
+                pending[b] = blk
+            end
+        end
+        seg_start += len
+    end
+    if isempty(pending) return 0 end
+    lbn = sort!(collect(keys(pending)))
+    blks = Vector{UInt8}[pending[b] for b in lbn]
+    kvs_write_batch(data_db, [(fid, b) for b in lbn], blks; raw_write=true)
+
+    return total
+end
+
+"""
+    data_readv(fid::fid_t, segs)
+Reads the segments *segs*, (offset, len) pairs, of *fid* and returns the
+data of each. Segments whose blocks are less than READV_GAP blocks apart
+are read with one kvs_get_many(), so segments spread over a small region
+cost a single scan, while far apart segments do not scan everything in
+between.
+"""
+function data_readv(fid::fid_t, segs::Vector{Tuple{UInt64, UInt64}})
+    runs = Vector{Tuple{UInt64, UInt64}}()  # Block ranges to read
+    for (offset, len) in sort(segs)
+        if len == 0 continue end
+        first_block = offset ÷ BLOCK_SIZE
+        last_block = (offset + len - 1) ÷ BLOCK_SIZE
+        if !isempty(runs) && first_block <= runs[end][2] + READV_GAP
+            runs[end] = (runs[end][1], max(runs[end][2], last_block))
+        else
+            push!(runs, (first_block, last_block))
+        end
+    end
+    blocks_read = Dict{Tuple{fid_t, UInt64}, Vector{UInt8}}()
+    for (first_block, last_block) in runs
+        merge!(blocks_read, read_blocks(fid, first_block, last_block))
+    end
+
+    ret = Vector{Vector{UInt8}}()
+    for (offset, len) in segs
+        data = Vector{UInt8}(undef, len)
+        push!(ret, data)
+        if len == 0 continue end
+        for b = (offset ÷ BLOCK_SIZE):((offset + len - 1) ÷ BLOCK_SIZE)
+            bstart = b * BLOCK_SIZE
+            lo = max(offset, bstart)
+            hi = min(offset + len, bstart + BLOCK_SIZE)
+            copyto!(data, lo - offset + 1, blocks_read[(fid, b)], lo - bstart + 1, hi - lo)
+        end
+    end
+
+    return ret
+end
+
 """
     read_blocks(fid::fid_t, first::UInt64, last::UInt64)
 Reads blocks starting from logical block number(lbn) *first* and ending
@@ -1,4 +1,9 @@
 const SEED = UInt64(0xAB1D41D)  # A prime number
+const READDIR_ENTRIES = 1024       # Entries per readdir unless the client asks
+const READDIR_MAX_ENTRIES = 65536  # Most entries a client can ask for
+const DIRENT_BYTES = 32            # Encoded size of a readdir entry, less its name
+const DIRENTPLUS_BYTES = DIRENT_BYTES + RFS_ATTR_PACKED_SIZE + 8 # Same for readdirplus
+const LINK_INLINE_MAX = 255        # Longest symlink target lookups and getattrs carry, NAME_MAX
 
 function init_ns_worker()
     #global namespace_db = KVSRocksDB("namespace")
@@ -9,6 +14,8 @@ function ns_worker(op, args, ro::Bool)
         return ns_lookup(args[1], args[2])
     elseif (op == OP_GETATTRS)
         return ns_getattr(args[1])
+    elseif (op == OP_COMPOUND)
+        return ns_compound(args[1], args[2])
     elseif (op == OP_SETATTRS)
         return ns_setattr(args[1], args[2], args[3])
     elseif (op == OP_CREATE) || (op == OP_MKNOD)
@@ -24,7 +31,9 @@ function ns_worker(op, args, ro::Bool)
     elseif (op == OP_RENAME)
         return ns_rename(args[1], args[2], args[3], args[4])
     elseif (op == OP_READDIR)
-        return ns_readdir(args[1], args[2])
+        return ns_readdir(args...)
+    elseif (op == OP_READDIRPLUS)
+        return ns_readdirplus(args...)
     elseif (op == OP_READLINK)
         return ns_readlink(args[1])
     elseif (op == OP_UTIL_MKFS)
@@ -57,21 +66,96 @@ function ns_lookup(parent_id::fid_t, fname::String)
     end
 end
 
-function ns_readdir(parent_id::fid_t, whence::UInt64)
-    #try
-        # Check if parent exists
-        if kvs_get(namespace_db, parent_id) == nothing
-            return RavanaInvalidIdException("Invalid parent_id $parent_id", EBADF)
+"""
+    ns_compound(fid::fid_t, ops)
+Run the (op, name) pairs *ops* in order on a current fid that starts as
+*fid*. OP_LOOKUP looks up name in the current fid and makes the file
+found current, OP_GETATTRS returns the current fid's attributes. Stops at
+the first op that fails and returns the result of each op run.
+"""
+function ns_compound(fid::fid_t, ops::Vector{Tuple{Int32, String}})
+    results = Vector{Any}()
+    for (op, name) in ops
+        if op == OP_LOOKUP
+            ret = ns_lookup(fid, name)
+        elseif op == OP_GETATTRS
+            ret = ns_getattr(fid)
+        else
+            ret = RavanaInvalidArgException("Op $op not allowed in a compound", EINVAL)
+        end
+        push!(results, ret)
+        if isa(ret, Exception) break end
+        fid = ret.ino
+    end
+    return results
+end
+
+"""
+    ns_readdir(parent_id::fid_t, whence::UInt64, max_entries=0, max_bytes=0)
+Read the entries of *parent_id* from *whence*, at most *max_entries*, or
+READDIR_ENTRIES if 0, and if *max_bytes* is not 0 no more than encode in
+as many bytes, counting *entry_bytes* plus the name for each. One entry
+is returned whatever its size. Returns (dir, eof, next), *next* being the
+whence to go on from; eof is set only if nothing is left after *dir*.
+"""
+function ns_readdir(parent_id::fid_t, whence::UInt64, max_entries::Integer=0,
+                    max_bytes::Integer=0, entry_bytes::Integer=DIRENT_BYTES)
+    # Check if parent exists
+    if kvs_get(namespace_db, parent_id) == nothing
+        return RavanaInvalidIdException("Invalid parent_id $parent_id", EBADF)
+    end
+    n = max_entries == 0 ? READDIR_ENTRIES : min(Int(max_entries), READDIR_MAX_ENTRIES)
+    first = (parent_id, whence, "\U0")
+    last  = (parent_id, UInt64(0xffffffffffffffff), "\Uffff")
+    @debug("$namespace_db, $first, $last, $(n + 1), inc_first=false")
+    # The entry past the n asked for tells whether the directory goes on
+    dir = assemble_dirent(kvs_get_many(namespace_db, first, last, n + 1, inc_first=false))
+    eof = length(dir) <= n
+    eof || resize!(dir, n)
+    if max_bytes != 0
+        bytes = 0
+        for i = 1:length(dir)
+            bytes += entry_bytes + sizeof(dir[i].name)
+            if bytes > max_bytes && i > 1
+                resize!(dir, i - 1)
+                eof = false
+                break
+            end
+        end
+    end
+    next = isempty(dir) ? whence : dir[end].whence
+    return (dir, eof ? UInt32(1) : UInt32(0), next)
+end
+
+"""
+    ns_readdirplus(parent_id::fid_t, whence::UInt64, max_entries=0, max_bytes=0)
+ns_readdir() that also returns, for each entry, its attributes and the
+length of its link path, 0 if it is not a symlink: (dir, attrs, eof, next).
+Entries whose inode is gone, unlinked since the scan, are left out; next
+still goes past them.
+
+Inode keys are fids picked by the clients, so the inodes of a directory
+are spread over the whole inode table and are looked up one by one rather
+than with a kvs_get_many() over a range.
+"""
+function ns_readdirplus(parent_id::fid_t, whence::UInt64, max_entries::Integer=0,
+                        max_bytes::Integer=0)
+    ret = ns_readdir(parent_id, whence, max_entries, max_bytes, DIRENTPLUS_BYTES)
+    if isa(ret, Exception) return ret end
+    (dir, eof, next) = ret
+    found = Vector{Dentry}()
+    attrs = Vector{Tuple{FileAttr, UInt32}}()
+    for d in dir
+        if (value = kvs_get(namespace_db, d.fid)) == nothing continue end
+        push!(found, d)
+        if isa(value, Tuple)
+            (attr, lpath) = value
+            push!(attrs, (attr, UInt32(sizeof(lpath))))
+        else
+            push!(attrs, (value, UInt32(0)))
         end
-        first = (parent_id, whence, "\U0")
-        last  = (parent_id, UInt64(0xffffffffffffffff), "\Uffff")
-        @debug("$namespace_db, $first, $last, 1024, inc_first=false")
-        dir = assemble_dirent(kvs_get_many(namespace_db, first, last, 1024, inc_first=false))
-        # return (dir, eof status)
-        return (dir, length(dir)<1024 ? UInt32(1) : UInt32(0))
-    #catch e
-    #    return e
-    #end
+    end
+    return (found, attrs, eof, next)
 end
 
 """
@@ -93,6 +177,18 @@ function ns_readlink(fid::fid_t)
         return e
     end
 end
+
+"""
+    ns_link_target(attr)
+The target of the file of *attr* if it is a symlink, for the lookups and
+getattrs that return it to carry. "" for other files and for targets too
+long to go as a name, which the client reads with OP_READLINK.
+"""
+function ns_link_target(attr)
+    (attr.mode & S_IFMT) == S_IFLNK || return ""
+    lpath = ns_readlink(attr.ino)
+    return isa(lpath, String) && sizeof(lpath) <= LINK_INLINE_MAX ? lpath : ""
+end
 """
 Create a new file in this namespace and return it's attribute structure
 This function handles mknod() as well.
@@ -168,7 +264,7 @@ function ns_symlink(parent_dfid::fid_t, child_id::fid_t, fname::String, lpath::S
         #@set_flag(new_attr.mode, S_IFLNK)
         new_attr.mode = new_attr.mode | S_IFLNK
         new_attr.links = 1
-        new_attr.size = length(lpath)
+        new_attr.size = sizeof(lpath)
         # To save having to write() we insert the link_path as part of the inode table
         kvs_put(namespace_db, child_id, (new_attr, lpath)) # Inode table
 
@@ -254,7 +350,7 @@ function ns_link(parent_did::fid_t, link_to::fid_t, link_name::String)
         # Bump up link count of the file linked to
         cur_attr = ns_getattr(link_to)
         cur_attr.links += 1
-        kvs_put(namespace_db, link_to, cur_attr)
+        ns_put_attr(link_to, cur_attr)
 
         # Bump up parent directory entry count
         parent_attr.size += 1
@@ -358,7 +454,7 @@ function ns_remove(op::Int32, p_fid::fid_t, name::String)
             file_attr = ns_getattr(file_id)
             if file_attr.links > 1
                 file_attr.links -= 1
-                kvs_put(namespace_db, file_id, file_attr)
+                ns_put_attr(file_id, file_attr)
                 return nothing
             else
                 ret = data_worker(op, file_id, false)
@@ -390,6 +486,16 @@ function ns_getattr(fid::fid_t)
     end
 end
 
+"""
+    ns_put_attr(fid, attr)
+Store *attr* as the attributes of *fid*. A symlink keeps its target, which
+is stored with its attributes.
+"""
+function ns_put_attr(fid::fid_t, attr::FileAttr)
+    value = kvs_get(namespace_db, fid)
+    kvs_put(namespace_db, fid, isa(value, Tuple) ? (attr, value[2]) : attr)
+end
+
 function ns_setattr(fid::fid_t, mask::UInt32, attr::FileAttr)
     try
         if (kvs_get(namespace_db, fid)) == nothing
@@ -397,7 +503,7 @@ function ns_setattr(fid::fid_t, mask::UInt32, attr::FileAttr)
         end
         cur_attr = ns_getattr(fid)
         setattr(cur_attr, attr, mask)
-        kvs_put(namespace_db, fid, cur_attr)
+        ns_put_attr(fid, cur_attr)
     catch e
         return e
     end
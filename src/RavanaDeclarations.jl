@@ -21,9 +21,12 @@ const DATA_WORKER2_PROC = 5
 const NUM_WORKERS       = 2
 const NUM_PROCS = 4
 
-const RFS_PROTO_VERSION  = UInt32(1)
+const RFS_PROTO_UNTAGGED = UInt32(1) # Requests answered in order
+const RFS_PROTO_VERSION  = UInt32(2) # Requests tagged, answered in any order
+const RFS_PROTO_PACKED   = UInt32(3) # As 2, FileAttrs and ids replied in a fixed layout
 const RFS_FSAL_CLIENT    = UInt32(1)
 const RFS_JULIA_CLIENT   = UInt32(2)
+const RFS_SHM_RING       = UInt32(4) # Data of the request is in the shared ring
 
 @enum Ftype DIR FILE CHAR BLOCK FIFO SOCK LINK
 mutable struct RavanaFs
@@ -36,18 +39,34 @@ RavanaFs() = RavanaFs(0, 0)
 #    Client and server pass each other packets of the form:
 #    type
 #        size::UInt32           # Size of payload
-#        version::UInt32        # Protocol version
-#        flags::UInt32          # Protocol flags
+#        version::UInt16        # Protocol version
+#        flags::UInt16          # Protocol flags
+#        tag::UInt64            # Request tag, only if version >= 2
 #        payload::Vector{UInt8} # Payload
 #    end
 #    If the flag indicates a fsal client, then the payload is serialized using
 #    msgpack. If the client is julia then the payload is serialized using
 #    Julia's IO serializer.
+#    Responses to tagged requests are prefixed by
+#        size::UInt32, flags::UInt32, tag::UInt64
+#    where tag is the tag of the request answered. Responses to untagged
+#    requests are prefixed by the size alone.
+#    A C client may share a memfd backed ring of fixed size slots with the
+#    dispatcher (OP_SHM_ATTACH, the first request on the connection, with
+#    the memfd passed as SCM_RIGHTS and sealed against shrinking and
+#    growing; acknowledged with RFS_SHM_RING in the response flags). Reads
+#    and writes flagged RFS_SHM_RING then carry a slot index in place of the
+#    data, which is passed through the slot.
+#    Replies to version 3 requests carry each FileAttr and each 128-bit id
+#    as a msgpack bin of RFS_ATTR_PACKED_SIZE or RFS_ID_PACKED_SIZE bytes,
+#    the fields at fixed offsets in little-endian order (see ravana.h), in
+#    place of one msgpack integer per field.
 
 mutable struct rfs_header_t
     size::UInt32        # Size
     version::UInt16     # Proto version
     flags::UInt16       # Proto flags
+    tag::UInt64         # Request tag
 end
 
 # Fs Ops
@@ -73,6 +92,12 @@ const OP_LOCK        = Int32(19)
 const OP_CLOSE       = Int32(20)
 const OP_RMDIR       = Int32(21)
 const OP_MKNOD       = Int32(22)
+const OP_SHM_ATTACH  = Int32(23)
+const OP_READV       = Int32(24)
+const OP_WRITEV      = Int32(25)
+const OP_COMPOUND    = Int32(26)
+const OP_BATCH       = Int32(27)
+const OP_READDIRPLUS = Int32(28)
 
 const OP_STOP_SERVER = Int32(1001)
 const OP_UTIL_MKFS   = Int32(1002)
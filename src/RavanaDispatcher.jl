@@ -27,7 +27,7 @@ fs's process.
 function rfs_client(cid::id_t, op::Int32, argv...)
     bytes = byte_array((op, argv))
     size = UInt32(length(bytes))
-    version = UInt16(RFS_PROTO_VERSION)
+    version = UInt16(RFS_PROTO_UNTAGGED)
     flags = UInt16(RFS_JULIA_CLIENT)
     endpoint = (cid == 0) ? base_dir() * "$(CSOCK)" : fs_base(cid) * "$(DSOCK)"
     @debug("rfs_client: writing to $(endpoint)")
@@ -61,27 +61,187 @@ function process_preamble(h::UInt64)
     (size, version, flags)
 end
 
-function get_opt(sock, lookup_table)
+"""
+    get_opt(sock, lookup_table, ring=nothing)
+Read a request off *sock*. Returns (op, argv, ro, ns, jl, hdr) where *hdr*
+is the request's rfs_header_t. Requests flagged RFS_SHM_RING have their
+data in the shared ring *ring* of the connection.
+"""
+function get_opt(sock, lookup_table, ring=nothing)
+    hdr = rfs_header_t(0, 0, 0, 0)
     try
-        (size::UInt32, version::UInt16, flags::UInt16) = process_preamble(read(sock, UInt64))
-        if version != RFS_PROTO_VERSION
-            throw(RavanaProtoException("Unsupported version $(version)", EPROTO))
+        (hdr.size, hdr.version, hdr.flags) = process_preamble(read(sock, UInt64))
+        if hdr.version == RFS_PROTO_VERSION || hdr.version == RFS_PROTO_PACKED
+            hdr.tag = read(sock, UInt64)
+        elseif hdr.version != RFS_PROTO_UNTAGGED
+            throw(RavanaProtoException("Unsupported version $(hdr.version)", EPROTO))
         end
+        size = hdr.size
 
-        if flags & RFS_JULIA_CLIENT == RFS_JULIA_CLIENT
+        if hdr.flags & RFS_JULIA_CLIENT == RFS_JULIA_CLIENT
             (op, argv) = @pcount("read_sock", array_to_type(read(sock, size)))
             (in_func, out_func) = lookup_table[op]
-            return in_func(argv)
+            return (in_func(argv)..., hdr)
         else
             iob = IOBuffer(read(sock, size))
             seek(iob, 0)
             op = MsgPack.unpack(iob)
+            if hdr.flags & RFS_SHM_RING == RFS_SHM_RING
+                ring == nothing && throw(RavanaProtoException("No shared ring", EPROTO))
+                (in_func, out_func) = shm_op_table[op]
+                return (in_func(iob, ring)..., hdr)
+            end
             (in_func, out_func) = lookup_table[op]
-            return in_func(iob)
+            return (in_func(iob)..., hdr)
         end
     catch e
         process_exception(sock, OP_UNKNOWN, e, false, op_table)
-        return (OP_UNKNOWN, nothing, true, true, false)
+        return (OP_UNKNOWN, nothing, true, true, false, hdr)
+    end
+end
+
+"""
+A ring of *n_slots* slots of *slot_size* bytes shared with a C client.
+*data* is the client's memfd mapped into the dispatcher.
+"""
+struct rfs_shm_ring_t
+    data::Vector{UInt8}
+    n_slots::UInt32
+    slot_size::UInt32
+end
+
+"""
+A slot of a shared ring. *data* aliases the slot's pages, *len* is the
+number of bytes of a read's result in it.
+"""
+struct rfs_shm_slot_t
+    data::Vector{UInt8}
+    len::UInt64
+end
+
+"""
+    shm_slot(ring, slot, len)
+Returns the first *len* bytes of *slot* of *ring* as an rfs_shm_slot_t.
+The data is not copied, the slot stays the client's and must not be
+touched after the reply to the request using it is sent.
+"""
+function shm_slot(ring::rfs_shm_ring_t, slot::UInt32, len::UInt64)
+    if slot >= ring.n_slots || len > ring.slot_size
+        throw(RavanaProtoException("Bad slot $slot len $len", EPROTO))
+    end
+    base = pointer(ring.data, UInt64(slot) * ring.slot_size + 1)
+    rfs_shm_slot_t(unsafe_wrap(Array, base, len), 0)
+end
+
+# Passing fds over the socket and sealing memfds, as in <sys/socket.h>
+# and <fcntl.h> on Linux
+const SOL_SOCKET    = Cint(1)
+const SCM_RIGHTS    = Cint(1)
+const MSG_PEEK      = Cint(2)
+const CMSG_FD_SPACE = 24        # CMSG_SPACE(sizeof(int))
+const F_GET_SEALS   = Cint(1034)
+const F_SEAL_SHRINK = Cint(2)
+const F_SEAL_GROW   = Cint(4)
+
+# struct iovec and struct msghdr, for recvmsg()
+struct iovec_t
+    base::Ptr{Cvoid}
+    len::Csize_t
+end
+
+struct msghdr_t
+    name::Ptr{Cvoid}
+    namelen::Cuint
+    iov::Ptr{iovec_t}
+    iovlen::Csize_t
+    control::Ptr{Cvoid}
+    controllen::Csize_t
+    flags::Cint
+end
+
+"""
+    recv_memfd(sock)
+The fd a client sent as SCM_RIGHTS with the first bytes on the new
+connection *sock*, -1 if it sent none. A client attaching a ring sends
+its memfd so, with OP_SHM_ATTACH. The bytes are only peeked at: libuv
+reads them as usual once the connection is served, and the kernel drops
+the fd from them then, as libuv reads with no room for it.
+"""
+function recv_memfd(sock)
+    fd = Base._fd(sock)
+    # Nothing reads the connection yet, wait for its first bytes
+    poll_fd(fd; readable=true).readable || return Cint(-1)
+    byte = zeros(UInt8, 1)
+    control = zeros(UInt8, CMSG_FD_SPACE)
+    iov = [iovec_t(pointer(byte), 1)]
+    msg = Ref(msghdr_t(C_NULL, 0, pointer(iov), 1, pointer(control), CMSG_FD_SPACE, 0))
+    n = GC.@preserve byte control iov ccall(:recvmsg, Cssize_t,
+            (Cint, Ptr{msghdr_t}, Cint), fd, msg, MSG_PEEK)
+    # struct cmsghdr: len::Csize_t, level::Cint, type::Cint, then the fd
+    (n <= 0 || msg[].controllen < CMSG_FD_SPACE) && return Cint(-1)
+    level = reinterpret(Cint, control[9:12])[1]
+    type = reinterpret(Cint, control[13:16])[1]
+    (level != SOL_SOCKET || type != SCM_RIGHTS) && return Cint(-1)
+    return reinterpret(Cint, control[17:20])[1]
+end
+
+"""
+    shm_attach(memfd, n_slots, slot_size)
+Map the ring the client sent as *memfd*, which must be exactly *n_slots*
+* *slot_size* bytes. It must be sealed against shrinking and growing, the
+dispatcher would fault on slots cut off by a client shrinking it
+otherwise. *memfd* is closed either way.
+"""
+function shm_attach(memfd::Cint, n_slots::UInt32, slot_size::UInt32)
+    memfd < 0 && throw(RavanaInvalidArgException("No ring sent", EBADF))
+    len = UInt64(n_slots) * slot_size
+    io = fdio(memfd, true)
+    try
+        # Only memfds take seals, F_GET_SEALS fails on anything else
+        seals = ccall(:fcntl, Cint, (Cint, Cint), memfd, F_GET_SEALS)
+        if seals == -1 || seals & (F_SEAL_SHRINK | F_SEAL_GROW) != (F_SEAL_SHRINK | F_SEAL_GROW)
+            throw(RavanaInvalidArgException("Ring not a sealed memfd", EPERM))
+        end
+        filesize(io) != len && throw(RavanaInvalidArgException("Ring size mismatch", EINVAL))
+        return rfs_shm_ring_t(Mmap.mmap(io, Vector{UInt8}, len; grow=false), n_slots, slot_size)
+    finally
+        close(io)
+    end
+end
+
+"""
+A client connection to the dispatcher. Requests on a connection execute
+concurrently, *lock* keeps their replies from interleaving on *sock*.
+*ring* is the ring shared with the client, if it attached one, *memfd*
+the fd of the ring it sent to attach, -1 if none or once attached.
+"""
+mutable struct rfs_conn_t
+    sock
+    lock::ReentrantLock
+    ring::Union{Nothing, rfs_shm_ring_t}
+    memfd::Cint
+end
+rfs_conn_t(sock) = rfs_conn_t(sock, ReentrantLock(), nothing, Cint(-1))
+
+"""
+    send_reply(conn, hdr, reply, flags=0)
+Write the reply an out function put together in the IOBuffer *reply* to
+the connection *conn*. Replies to tagged requests get the request's tag:
+    size::UInt32 | flags::UInt32 | tag::UInt64 | payload
+the out function has already written the size.
+"""
+function send_reply(conn::rfs_conn_t, hdr::rfs_header_t, reply::IOBuffer, flags=UInt32(0))
+    data = take!(reply)
+    length(data) == 0 && return # Nothing to return to this client
+    lock(conn.lock)
+    try
+        if hdr.version != RFS_PROTO_UNTAGGED
+            write(conn.sock, view(data, 1:4), UInt32(flags), hdr.tag, view(data, 5:length(data)))
+        else
+            write(conn.sock, data)
+        end
+    finally
+        unlock(conn.lock)
     end
 end
 
@@ -104,12 +264,18 @@ The dispatcher is made non-blocking by its use of Julia tasks (super light
 weight schedulable entities). The flow is as follows:
 1. dispatch_server()
    This is started by the module init function on the master process. It
-   opens a socket and waits for clients to send requests.
-2. log_task()
+   opens a socket and waits for clients to connect.
+2. serve_connection()
+   A task is created for each client connection. Connections are
+   persistent, the task reads requests off the connection until the
+   client closes it.
+3. log_task()
    A task is created for each new request triggered from dispatch_server().
    The task logs the operation using the logger and on completion of logging
    executes the operation through a method dispatch table.
-   The result of the execution is returned in the socket.
+   The result of the execution is returned in the socket. Requests on a
+   connection run concurrently, so with tagged requests (protocol version 2)
+   a client can pipeline requests and have them answered out of order.
 """
 function dispatch_server(base::String)
     stat(get_dsock(base)).inode != 0 && throw(RavanaEExists("Data path socket exists $(base)", EEXIST))
@@ -121,17 +287,55 @@ function dispatch_server(base::String)
             sock = accept(server)
             if isopen(sock) != true
                 @error("Error! Socket not open")
-                # return error
+                continue
             end
+            serve_connection(sock)
+        end  # while loop
+    end  # async block
 
+    while stat(get_dsock(base)).inode == 0
+        sleep(0.1)
+    end
+end
+
+"""
+    serve_connection(sock)
+Serve requests arriving on the client connection *sock* until the client
+closes it. Each request is handed to log_task(), so the connection is
+ready for the next request while the previous one executes.
+"""
+function serve_connection(sock)
+    conn = rfs_conn_t(sock)
+    @async begin
+        conn.memfd = recv_memfd(sock)
+        while isopen(sock) && !eof(sock)
             # op   | Int32 | op to execute
             # argv | Tuple | arguments to op
             # ro   | Bool  | op is read-only
             # ns   | Bool  | op operates on namespace only
             # jl   | Bool  | client is Julia
-            (op, argv, ro, ns, jl) = @pcount("get_opt_call", get_opt(sock, op_table))
+            # hdr  | rfs_header_t | request header
+            (op, argv, ro, ns, jl, hdr) = @pcount("get_opt_call", get_opt(sock, op_table, conn.ring))
             @debug("op=$op")
-            if op == OP_UNKNOWN continue end
+            # The stream can't be trusted after a bad request
+            if op == OP_UNKNOWN break end
+
+            # Attach before reading on, later requests may use the ring
+            if op == OP_SHM_ATTACH
+                reply = IOBuffer()
+                flags = UInt32(0)
+                try
+                    (memfd, conn.memfd) = (conn.memfd, Cint(-1))
+                    conn.ring = shm_attach(memfd, argv...)
+                    flags = RFS_SHM_RING
+                    rfs_shm_attach_ret(reply, nothing, jl)
+                catch e
+                    @debug("shm_attach(): $e")
+                    process_exception(reply, op, e, jl, op_table)
+                end
+                send_reply(conn, hdr, reply, flags)
+                continue
+            end
 
             try
                 if current_fs == 0 && op != OP_UTIL_MKFS && op != OP_MOUNT
@@ -144,60 +348,84 @@ function dispatch_server(base::String)
                     throw(RavanaInvalidArgException("Fs already mounted", EBUSY))
                 end
 
-                log_task(sock, op, argv, ro, ns, jl)
+                log_task(conn, hdr, op, argv, ro, ns, jl)
             catch e
-                process_exception(sock, op, e, jl, op_table)
+                reply = IOBuffer()
+                process_exception(reply, op, e, jl, op_table)
+                send_reply(conn, hdr, reply)
             end
         end  # while loop
+        conn.memfd >= 0 && ccall(:close, Cint, (Cint,), conn.memfd)
+        close(sock)
     end  # async block
-
-    while stat(get_dsock(base)).inode == 0
-        sleep(0.1)
-    end
 end
 
 """
-    log_task(sock, op, args, ro::Bool, ns::Bool)
+    log_task(conn, hdr, op, args, ro::Bool, ns::Bool, jl::Bool)
 Create a task that sends the op to the logger process and then sends
-it to for execution.
+it to for execution. The reply is sent on *conn* tagged as per *hdr*.
 """
-function log_task(sock, op, args, ro::Bool, ns::Bool, jl::Bool)
+function log_task(conn, hdr, op, args, ro::Bool, ns::Bool, jl::Bool)
     @async begin
-        if ro == false #Log only modifying ops
-            if op == OP_WRITE # do not log data locally
-                (fid, offset, len, data) = args
-                seq_no = log_it(op, (fid, offset, len))
-            else
-                seq_no = log_it(op, args)
+        task_local_storage(:rfs_packed, hdr.version == RFS_PROTO_PACKED)
+        reply = IOBuffer()
+        try
+            seq_no = nothing
+            if ro == false #Log only modifying ops
+                seq_no = log_it(op, log_payload(op, args))
+                @debug("lsn = $seq_no")
             end
-            @debug("lsn = $seq_no")
             # Some ops are executed by logger above, so return to client
             if op == OP_CHK_PT || op == OP_SYNC_FS
                 (in_func, out_func) = op_table[op]
-                out_func(sock, (seq_no), jl)
-                return
+                out_func(reply, (seq_no), jl)
+            else
+                @pcount("execute_call", execute(reply, op, args, ro, ns, jl))
             end
+        catch e
+            process_exception(reply, op, e, jl, op_table)
         end
-        @pcount("execute_call", execute(sock, op, args, ro, ns, jl))
+        send_reply(conn, hdr, reply)
     end # @async block, aka Task
 end
 
+"""
+    log_payload(op, args)
+What goes in the oplog for *op*. Write data is not logged locally, a
+batch is logged as one entry holding its modifying ops.
+"""
+function log_payload(op, args)
+    if op == OP_WRITE
+        (fid, offset, len, data) = args
+        return (fid, offset, len)
+    elseif op == OP_WRITEV # one entry for all segments
+        (fid, segs, data) = args
+        return (fid, segs)
+    elseif op == OP_BATCH
+        return [(bop, log_payload(bop, bargs)) for (bop, bargs, bro) in args if !bro]
+    end
+    return args
+end
+
 """
     execute(sock, op, args, ro::Bool, ns::Bool)
 Sends the op to a worker for execution and writes the returned
 value to the socket.
 """
 function execute(sock, op::Int32, args, ro::Bool, ns::Bool, jl::Bool)
-    if ns == false
+    if op == OP_BATCH
+        execute_batch(sock, args, jl)
+    elseif ns == false
         execute_data_op(sock, op, args, ro, ns, jl)
     else
         execute_ns_op(sock, op, args, ro, ns, jl)
     end
-    close(sock)
-    isopen(sock) && @debug("isopen(sock) = true")
 end
 
 function execute_data_op(sock, op::Int32, args, ro::Bool, ns::Bool, jl::Bool)
+    if op == OP_READV || op == OP_WRITEV
+        return execute_vec_op(sock, op, args, jl)
+    end
     # Get Attributes
     if op == OP_READ
         (fid::id_t, off::UInt64, size::UInt64) = args
@@ -217,11 +445,17 @@ function execute_data_op(sock, op::Int32, args, ro::Bool, ns::Bool, jl::Bool)
             return
         else
             csize = fattr.size - off
-            args = (fid, off, csize)
+            args = (fid, off, csize, args[4:end]...)
         end
     end
     # Dispatch to DataWorkers
     ret1 = @pcount("data_worker_call", data_worker(op, args, true))
+    # Data of a read through the shared ring goes back in the ring slot
+    if op == OP_READ && length(args) == 4
+        slot = args[4]
+        copyto!(slot.data, 1, ret1, 1, length(ret1))
+        ret1 = rfs_shm_slot_t(slot.data, length(ret1))
+    end
     # Update Attrs
     ret_attr = update_attrs(op, fattr, off, size)
 
@@ -230,6 +464,63 @@ function execute_data_op(sock, op::Int32, args, ro::Bool, ns::Bool, jl::Bool)
     out_func(sock, (ret1, ret_attr), jl)
 end
 
+"""
+    execute_batch(sock, ops, jl::Bool)
+Execute the ops of a batch in order and send all of their replies in one.
+An op that fails does not stop the ones after it.
+"""
+function execute_batch(sock, ops, jl::Bool)
+    replies = Vector{Vector{UInt8}}()
+    for (op, args, ro, ns, bjl) in ops
+        reply = IOBuffer()
+        try
+            isa(args, Exception) && throw(args)
+            execute(reply, op, args, ro, ns, bjl)
+        catch e
+            process_exception(reply, op, e, bjl, op_table)
+        end
+        push!(replies, take!(reply))
+    end
+    (in_func, out_func) = op_table[OP_BATCH]
+    out_func(sock, replies, jl)
+end
+
+"""
+    execute_vec_op(sock, op, args, jl::Bool)
+Execute OP_READV or OP_WRITEV. All segments of the request go to the
+DataWorker together, the file's attributes are read and updated once.
+"""
+function execute_vec_op(sock, op::Int32, args, jl::Bool)
+    (in_func, out_func) = op_table[op]
+    fid = args[1]
+    segs::Vector{Tuple{UInt64, UInt64}} = args[2]
+    fattr = ns_worker(OP_GETATTRS, fid, true)
+    if isa(fattr, Exception)
+        out_func(sock, (fattr, fattr), jl)
+        return
+    end
+    # Reads stop at eof
+    if op == OP_READV
+        segs = [(off, off >= fattr.size ? UInt64(0) : min(len, fattr.size - off))
+                for (off, len) in segs]
+        args = (fid, segs)
+    end
+    # Dispatch to DataWorkers
+    ret1 = @pcount("data_worker_call", data_worker(op, args, true))
+    # Update Attrs
+    ret_attr = true
+    if op == OP_WRITEV
+        eof = UInt64(0)
+        for (off, len) in segs
+            len > 0 && (eof = max(eof, off + len))
+        end
+        ret_attr = update_attrs(OP_WRITE, fattr, UInt64(0), eof)
+    end
+
+    # Process and write return value to socket
+    out_func(sock, (ret1, ret_attr), jl)
+end
+
 function execute_ns_op(sock, op, args, ro, ns, jl)
     @debug("Namespace op: $op, args:$args, ro:$ro")
     ret = ns_worker(op, args, ro)
@@ -175,6 +175,8 @@ using Printf
 using Distributed
 using Sockets
 using Dates
+using Mmap
+using FileWatching
 
 # Set default logging level
 global_logger(ConsoleLogger(stderr, Logging.Debug, Logging.default_metafmt, true, 0, Dict{Any, Int64}()))
@@ -189,7 +191,8 @@ end
 # Exported
 export fileOps, fid_t, id_t, FileAttr
 export mkfs, mount, rfs_lookup, rfs_create, rfs_getattr, rfs_setattr, rfs_mkdir, rfs_rmdir
-export rfs_readdir, rfs_write, rfs_read, rfs_symlink, rfs_link, rfs_rename, rfs_unlink
+export rfs_readdir, rfs_readdirplus, rfs_write, rfs_read, rfs_symlink, rfs_link, rfs_rename, rfs_unlink
+export rfs_writev, rfs_readv, rfs_compound
 export rfs_cd, rfs_rm
 export xcopy, ll, rfs_touch, cksum
 export RavanaFS
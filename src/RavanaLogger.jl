@@ -147,6 +147,33 @@ function checkpoint(cp_lsn)
     return cp_lsn
 end
 
+# Push *len* bytes of *fid* at *off* to the Thimble stream *sid*
+function checkpoint_extent(fs_id, sid, fid, off, len)
+    @debug("Updating Thimble stream for fid $fid at offset $off and length $len")
+    vec = Vector{Thimble.extent_t}(1)
+    (buf, err) = rfs_read(fid, off, len)
+    ex = Thimble.extent_t(fid, off, UInt32(len), buf)
+    vec[1] = ex
+    Thimble.tdb_update_stream(fs_id, sid, vec)
+end
+
+# Push the data written by the oplog entry (op, payload) to Thimble
+function checkpoint_op(fs_id, sid, op, payload)
+    if op == OP_WRITE
+        (fid, off, len) = payload
+        checkpoint_extent(fs_id, sid, fid, off, len)
+    elseif op == OP_WRITEV
+        (fid, segs) = payload
+        for (off, len) in segs
+            checkpoint_extent(fs_id, sid, fid, off, len)
+        end
+    elseif op == OP_BATCH
+        for (bop, bpayload) in payload
+            checkpoint_op(fs_id, sid, bop, bpayload)
+        end
+    end
+end
+
 function checkpoint_data(cp_lsn, sid)
     RUN = 100
     # Walk the list of op-log entries since last check point
@@ -159,15 +186,7 @@ function checkpoint_data(cp_lsn, sid)
         for i in ops
             # Push write operations to Thimble
             (ver, op, payload) = i
-            if op == OP_WRITE
-                (fid, off, len) = payload
-                @debug("Updating Thimble stream for fid $fid at offset $off and length $len")
-                vec = Vector{Thimble.extent_t}(1)
-                (buf, err) = rfs_read(fid, off, len)
-                ex = Thimble.extent_t(fid, off, UInt32(len), buf)
-                vec[1] = ex
-                Thimble.tdb_update_stream(fs_id, sid, vec)
-            end
+            checkpoint_op(fs_id, sid, op, payload)
         end
         op_entry += RUN
         ProgressMeter.update!(p, Int(op_entry-last_cp+1))
@@ -1,7 +1,8 @@
 """
 Functions in this file do packing/unpacking of arguments passed
 into and out of dispatch_server. The structure of things passed
-in and out is defined in the C header file ravana.h.
+in and out is defined in the C header files ravana.h and
+ravana_ops.h, the flat ones of which are generated from the latter.
 
     rfs_X_unpack(io)
 Unpacks all arguments from the iobuffer or iostream *io* for the
@@ -43,7 +44,49 @@ function rfs_timespec_unpack(iob)
     TimeSpec(sec, nsec)
 end
 
+# Size of the bins FileAttrs and ids are packed in for version 3 replies
+const RFS_ID_PACKED_SIZE   = 16
+const RFS_ATTR_PACKED_SIZE = 112
+const MSGPACK_BIN8         = 0xc4
+
+"""
+    packed_reply()
+True if the reply being put together is to a version 3 request, and so
+packs FileAttrs and ids in their fixed layout. log_task() keeps the
+version of the request in the task answering it.
+"""
+packed_reply() = get(task_local_storage(), :rfs_packed, false)
+
+# Reads the header of a bin of *len* bytes if that's what is next in *iob*
+function rfs_packed_next(iob, len)
+    mark(iob)
+    if read(iob, UInt8) == MSGPACK_BIN8 && read(iob, UInt8) == len
+        unmark(iob)
+        return true
+    end
+    reset(iob)
+    return false
+end
+
+rfs_packed_u128(iob) = UInt128(ltoh(read(iob, UInt64)), ltoh(read(iob, UInt64)))
+rfs_packed_timespec(iob) = TimeSpec(ltoh(read(iob, Int64)), ltoh(read(iob, Int64)))
+
 function rfs_attr_unpack(iob)
+    if rfs_packed_next(iob, RFS_ATTR_PACKED_SIZE)
+        mode  = ltoh(read(iob, UInt32))
+        uid   = ltoh(read(iob, UInt32))
+        gid   = ltoh(read(iob, UInt32))
+        links = ltoh(read(iob, UInt32))
+        size  = ltoh(read(iob, UInt64))
+        dev   = rfs_packed_u128(iob)
+        ino   = rfs_packed_u128(iob)
+        rdev  = ltoh(read(iob, UInt32))
+        read(iob, UInt32)   # pad
+        atime = rfs_packed_timespec(iob)
+        ctime = rfs_packed_timespec(iob)
+        mtime = rfs_packed_timespec(iob)
+        return FileAttr(mode, uid, gid, links, size, dev, ino, rdev, atime, ctime, mtime)
+    end
     mode = UInt32(MsgPack.unpack(iob))
     uid  = UInt32(MsgPack.unpack(iob))
     gid  = UInt32(MsgPack.unpack(iob))
@@ -62,15 +105,18 @@ function rfs_attr_unpack(iob)
     attr = FileAttr(mode, uid, gid, links, size, dev, ino, rdev, atime, ctime, mtime)
 end
 
-function rfs_fid_pack(iob, fid::fid_t)
-    MsgPack.pack(iob, lower64(fid))
-    MsgPack.pack(iob, upper64(fid))
+function rfs_u128_pack(iob, id::UInt128)
+    if packed_reply()
+        write(iob, MSGPACK_BIN8, UInt8(RFS_ID_PACKED_SIZE))
+        write(iob, htol(lower64(id)), htol(upper64(id)))
+    else
+        MsgPack.pack(iob, lower64(id))
+        MsgPack.pack(iob, upper64(id))
+    end
 end
 
-function rfs_cid_pack(iob, cid::id_t)
-    MsgPack.pack(iob, lower64(cid))
-    MsgPack.pack(iob, upper64(cid))
-end
+rfs_fid_pack(iob, fid::fid_t) = rfs_u128_pack(iob, fid)
+rfs_cid_pack(iob, cid::id_t) = rfs_u128_pack(iob, cid)
 
 function rfs_timespec_pack(iob, t::TimeSpec)
     MsgPack.pack(iob, t.sec)
@@ -78,6 +124,17 @@ function rfs_timespec_pack(iob, t::TimeSpec)
 end
 
 function rfs_attr_pack(iob, a::FileAttr)
+    if packed_reply()
+        write(iob, MSGPACK_BIN8, UInt8(RFS_ATTR_PACKED_SIZE))
+        write(iob, htol(a.mode), htol(a.uid), htol(a.gid), htol(a.links), htol(a.size))
+        write(iob, htol(lower64(a.dev)), htol(upper64(a.dev)))
+        write(iob, htol(lower64(a.ino)), htol(upper64(a.ino)))
+        write(iob, htol(a.rdev), UInt32(0))
+        for t in (a.atime, a.ctime, a.mtime)
+            write(iob, htol(t.sec), htol(t.nsec))
+        end
+        return
+    end
     MsgPack.pack(iob, a.mode)
     MsgPack.pack(iob, a.uid)
     MsgPack.pack(iob, a.gid)
@@ -92,6 +149,7 @@ function rfs_attr_pack(iob, a::FileAttr)
 end
 
 function rfs_u128_unpack(iob)
+    rfs_packed_next(iob, RFS_ID_PACKED_SIZE) && return rfs_packed_u128(iob)
     lo::UInt64 = MsgPack.unpack(iob)
     up::UInt64 = MsgPack.unpack(iob)
     UInt128(lo, up)
@@ -101,18 +159,16 @@ rfs_cid_unpack(iob) = rfs_u128_unpack(iob)
 rfs_fid_unpack(iob) = rfs_u128_unpack(iob)
 
 #=
-Unpack this:
-typedef struct rfs_arg_lookup {
-    rfs_file_op_t op;        // operation code
-    cid_t         cid;       // channel id
-    fid_t         dfid;      // Parent dir's fid
-    file_name_t   fname;     // File name
-} rfs_arg_lookup_t;
+The decoders of the requests and encoders of the responses of the ops
+whose fields are flat lists, rfs_X_args() and rfs_X_rsp_pack(), are
+generated from lib/ravana_ops.h, which the C client is built from too,
+by lib/ravana_gen_ops.c. Regenerate SerializeOps.jl when the lists change.
 =#
+include("SerializeOps.jl")
+
+# Unpack RFS_ARG_LOOKUP
 function rfs_lookup_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    dfid = rfs_fid_unpack(iob)
-    fname = String(MsgPack.unpack(iob))
+    (dfid, fname) = rfs_lookup_args(iob)
     # return (op, args, ro, ns, jl)
     return (OP_LOOKUP, (dfid, fname), true, true, false)
 end
@@ -138,21 +194,14 @@ function check_exception(iob, ret)
     return false
 end
 
-#=
-Return this:
-typedef struct rfs_rsp_lookup {
-    int           error;      // POSIX error
-    fid_t         fid;        // fid of the looked up file
-} rfs_rsp_lookup_t;
-=#
+# Return RFS_RSP_ATTR_LINK, with the target of a symlink
 function rfs_lookup_ret(sock, attrs, jl)
     if jl
         return_to_jl_client(sock, attrs)
     else
         iob = IOBuffer()
         if !check_exception(iob, attrs)   # On exception set errno
-            MsgPack.pack(iob, NO_ERROR)   # errno
-            rfs_attr_pack(iob, attrs)     # file attributes
+            rfs_lookup_rsp_pack(iob, attrs, ns_link_target(attrs))
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
@@ -160,20 +209,134 @@ end
 
 #=
 Unpack this:
-typedef struct rfs_arg_readdir {
-    rfs_file_op_t  op;        // operation code
-    cid_t          cid;       // channel id
-    fid_t          d_fid;     // directory file id
-    uint64_t       index;     // index to start from
-} rfs_arg_readdir_t;
+typedef struct rfs_arg_compound {
+    rfs_file_op_t op;         // operation code
+    cid_t         cid;        // channel id
+    fid_t         fid;        // fid the chain starts from
+    uint32_t      n_ops;      // number of ops
+    const rfs_compound_op_t *ops; // ops, in order
+} rfs_arg_compound_t;
+Each op is its op code followed, for OP_LOOKUP, by the name.
 =#
-function rfs_readdir_unpack(iob)
+function rfs_compound_unpack(iob)
     cid = rfs_cid_unpack(iob)
-    d_fid = rfs_fid_unpack(iob)
-    index = UInt64(MsgPack.unpack(iob))
+    fid = rfs_fid_unpack(iob)
+    n = Int(MsgPack.unpack(iob))
+    ops = Vector{Tuple{Int32, String}}(undef, n)
+    for i = 1:n
+        op = Int32(MsgPack.unpack(iob))
+        name = op == OP_LOOKUP ? String(MsgPack.unpack(iob)) : ""
+        ops[i] = (op, name)
+    end
+    # return (op, args, ro, ns, jl)
+    return (OP_COMPOUND, (fid, ops), true, true, false)
+end
+
+# Unpack for julia
+function rfs_compound_unpack(args::Tuple)
+    return (OP_COMPOUND, args, true, true, true)
+end
+
+#=
+Return this:
+typedef struct rfs_rsp_compound {
+    __int32_t     error;      // POSIX error of the last op run
+    uint32_t      n_res;      // number of ops run
+    rfs_compound_res_t *res;  // their results
+} rfs_rsp_compound_t;
+followed by each result, its error and, if the op succeeded, attributes.
+=#
+function rfs_compound_ret(sock, results, jl)
+    if jl
+        return_to_jl_client(sock, results)
+    else
+        iob = IOBuffer()
+        if !check_exception(iob, results)
+            errnos = [isa(r, RavanaException) ? r.errno :
+                      isa(r, Exception) ? ENODATA : NO_ERROR for r in results]
+            MsgPack.pack(iob, isempty(errnos) ? NO_ERROR : errnos[end])
+            MsgPack.pack(iob, UInt32(length(results)))
+            for (r, errno) in zip(results, errnos)
+                MsgPack.pack(iob, errno)
+                if errno == NO_ERROR
+                    rfs_attr_pack(iob, r)
+                end
+            end
+        end
+        write(sock, UInt32(length(iob.data)), iob.data)
+    end
+end
+
+# Ops that can't be part of a batch
+const BATCH_EXCLUDED = (OP_BATCH, OP_SHM_ATTACH, OP_UTIL_MKFS, OP_MOUNT,
+                        OP_STOP_SERVER, OP_CHK_PT, OP_SYNC_FS)
+
+#=
+Unpack this:
+typedef struct rfs_arg_batch {
+    rfs_file_op_t op;         // operation code
+    cid_t         cid;        // channel id
+    uint32_t      n_ops;      // number of ops
+    void          **args;     // rfs_arg_* of each op
+} rfs_arg_batch_t;
+Each op is a bin holding the op's request payload, as if sent alone.
+Returns the (op, args, ro, ns, jl) of each op; the args of an op that
+can't be unpacked are the exception, so that the op alone fails.
+=#
+function rfs_batch_unpack(iob)
+    cid = rfs_cid_unpack(iob)
+    n = Int(MsgPack.unpack(iob))
+    ops = Vector{Tuple}(undef, n)
+    for i = 1:n
+        sub = IOBuffer(MsgPack.unpack(iob))
+        op = Int32(MsgPack.unpack(sub))
+        try
+            op in BATCH_EXCLUDED && throw(RavanaInvalidArgException("Op $op not allowed in a batch", EINVAL))
+            (in_func, out_func) = op_table[op]
+            ops[i] = in_func(sub)
+        catch e
+            # An op we know nothing of gets an empty reply
+            ops[i] = (haskey(op_table, op) ? op : OP_UNKNOWN, e, true, true, false)
+        end
+    end
+    ro = all(o[3] for o in ops)
+    # return (op, args, ro, ns, jl)
+    return (OP_BATCH, ops, ro, false, false)
+end
+
+#=
+Return this:
+typedef struct rfs_rsp_batch {
+    int             error;      // POSIX error
+    uint32_t        n_res;      // number of replies
+    rfs_batch_res_t *res;       // reply of each op
+} rfs_rsp_batch_t;
+Each reply is a bin holding the op's response payload, as if sent alone.
+=#
+function rfs_batch_ret(sock, replies, jl)
+    if jl
+        return_to_jl_client(sock, replies)
+    else
+        iob = IOBuffer()
+        if !check_exception(iob, replies)
+            MsgPack.pack(iob, NO_ERROR)
+            MsgPack.pack(iob, UInt32(length(replies)))
+            for r in replies
+                # Drop the size each reply starts with
+                MsgPack.pack(iob, length(r) < 4 ? UInt8[] : r[5:end])
+            end
+        end
+        write(sock, UInt32(length(iob.data)), iob.data)
+    end
+end
+
+# Unpack RFS_ARG_READDIR. Clients older than the page size hints send
+# neither, they unpack as 0.
+function rfs_readdir_unpack(iob)
+    (d_fid, index, max_entries, max_bytes) = rfs_readdir_args(iob)
     @debug("readdir() on $d_fid")
     # return (op, args, ro, ns, jl)
-    return (OP_READDIR, (d_fid, index), true, true, false)
+    return (OP_READDIR, (d_fid, index, max_entries, max_bytes), true, true, false)
 end
 
 # Unpack for julia
@@ -181,12 +344,29 @@ function rfs_readdir_unpack(args::Tuple)
     return (OP_READDIR, args, true, true, true)
 end
 
-function rfs_dentries_pack(iob, dentries::Vector{Dentry})
-    for d in dentries
+# Unpack OP_READDIRPLUS, which takes the arguments of OP_READDIR
+function rfs_readdirplus_unpack(iob)
+    (op, args, ro, ns, jl) = rfs_readdir_unpack(iob)
+    return (OP_READDIRPLUS, args, ro, ns, jl)
+end
+
+function rfs_readdirplus_unpack(args::Tuple)
+    return (OP_READDIRPLUS, args, true, true, true)
+end
+
+# *attrs*, if given, holds the (attributes, link length) of each entry of a
+# readdirplus, packed after the entry's whence
+function rfs_dentries_pack(iob, dentries::Vector{Dentry}, attrs=nothing)
+    for (i, d) in enumerate(dentries)
         @debug("readdir(): packing $(d.name)")
         MsgPack.pack(iob, d.name)
         rfs_fid_pack(iob, d.fid)
         MsgPack.pack(iob, d.whence)
+        if attrs != nothing
+            (attr, link_len) = attrs[i]
+            rfs_attr_pack(iob, attr)
+            MsgPack.pack(iob, link_len)
+        end
     end
 end
 
@@ -202,6 +382,7 @@ typedef struct rfs_rsp_readdir {
     uint32_t     n_entries;   // number of entries returned
     rfs_dirent_t entries[];   // readdir entries
 } rfs_rsp_readdir_t;
+followed by the index to go on from.
 =#
 function rfs_readdir_ret(sock, ret, jl)
     if jl
@@ -209,11 +390,12 @@ function rfs_readdir_ret(sock, ret, jl)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)	#If ret is an exception fill ret.errno in iob
-            (dirs, eof) = ret
+            (dirs, eof, next) = ret
             MsgPack.pack(iob, NO_ERROR)
             MsgPack.pack(iob, eof)
             MsgPack.pack(iob, UInt32(length(dirs)))
             rfs_dentries_pack(iob, dirs)
+            MsgPack.pack(iob, next)
         end
         @debug(iob.data)
         write(sock, UInt32(length(iob.data)), iob.data)
@@ -221,23 +403,36 @@ function rfs_readdir_ret(sock, ret, jl)
 end
 
 #=
-Unpack this:
-typedef struct rfs_arg_create {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   fname;      // File name
-    FileAttr      attr;       // attrs to set
-} rfs_arg_create_t;
+Return this
+typedef struct rfs_rsp_readdir {
+    int32_t      error;       // POSIX error
+    int32_t      eof;         // true, for end of directory
+    uint32_t     n_entries;   // number of entries returned
+    entries[];                // name, fid, whence, attr, link length
+} rfs_rsp_readdir_t;
+followed by the index to go on from.
 =#
+function rfs_readdirplus_ret(sock, ret, jl)
+    if jl
+        return_to_jl_client(sock, ret)
+    else
+        iob = IOBuffer()
+        if !check_exception(iob, ret)
+            (dirs, attrs, eof, next) = ret
+            MsgPack.pack(iob, NO_ERROR)
+            MsgPack.pack(iob, eof)
+            MsgPack.pack(iob, UInt32(length(dirs)))
+            rfs_dentries_pack(iob, dirs, attrs)
+            MsgPack.pack(iob, next)
+        end
+        write(sock, UInt32(length(iob.data)), iob.data)
+    end
+end
+
+# Unpack RFS_ARG_CREATE
 function rfs_create_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    p_fid = rfs_fid_unpack(iob)
-    attr_mask = UInt32(MsgPack.unpack(iob))
-    fname = String(MsgPack.unpack(iob))
+    (p_fid, attr_mask, fname, attr) = rfs_create_args(iob)
     @debug("create: p_fid=$p_fid fname=$fname")
-    attr = rfs_attr_unpack(iob)
     @debug("attr: $attr")
     return (OP_CREATE, (p_fid, fid_t(), fname, attr_mask, attr), false, true, false)
 end
@@ -248,37 +443,10 @@ function rfs_create_unpack(args::Tuple)
     return (OP_CREATE, (p_fid, fid_t(), fname, attr_mask, attr), false, true, true)
 end
 
-#=
-Return this:
-typedef struct rfs_arg_create {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   fname;      // File name
-    FileAttr      attr;       // attrs to set
-} rfs_arg_create_t;
-=#
-
-
-#=
-Unpack this:
-typedef struct rfs_arg_create {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   fname;      // File name
-    FileAttr      attr;       // attrs to set
-} rfs_arg_create_t;
-=#
+# Unpack RFS_ARG_CREATE, which OP_MKNOD takes too
 function rfs_mknod_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    p_fid = rfs_fid_unpack(iob)
-    attr_mask = UInt32(MsgPack.unpack(iob))
-    fname = String(MsgPack.unpack(iob))
+    (p_fid, attr_mask, fname, attr) = rfs_create_args(iob)
     @debug("mknod: p_fid=$p_fid fname=$fname")
-    attr = rfs_attr_unpack(iob)
     @debug("attr: $attr")
     return (OP_MKNOD, (p_fid, fid_t(), fname, attr_mask, attr), false, true, false)
 end
@@ -292,32 +460,16 @@ function rfs_create_ret(sock, ret, jl::Bool)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)	#If ret is an exception fill ret.errno in iob
-            attrs = ret
-            MsgPack.pack(iob, NO_ERROR) # errno
-            rfs_attr_pack(iob, attrs)  # attrs
+            rfs_create_rsp_pack(iob, ret)
         end
         @debug("rfs_create_ret(): length=$(length(iob.data)) $(iob.data)")
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
-#=
-Unpack this
-typedef struct rfs_arg_mkdir {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent dir id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   dname;      // Dir name
-    FileAttr      attr;       // attrs to set
-} rfs_arg_mkdir_t;
-=#
+# Unpack RFS_ARG_MKDIR
 function rfs_mkdir_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    p_dfid = rfs_fid_unpack(iob)
-    attr_mask = UInt32(MsgPack.unpack(iob))
-    dname = String(MsgPack.unpack(iob))
+    (p_dfid, attr_mask, dname, attr) = rfs_mkdir_args(iob)
     @debug("mkdir: p_dfid=$p_dfid dname=$dname")
-    attr = rfs_attr_unpack(iob)
     @debug("attr: $attr")
     # Return (op, args tuple for op, read-only, namespace, julia-client)
     return (OP_MKDIR, (p_dfid, fid_t(), dname, attr_mask, attr), false, true, false)
@@ -329,48 +481,23 @@ function rfs_mkdir_unpack(args::Tuple)
     return (OP_MKDIR, (p_dfid, fid_t(), dname, attr_mask, attr), false, true, true)
 end
 
-#=
-Return this
-typedef struct rfs_rsp_mkdir {
-    __int32_t     error;      // POSIX error
-    FileAttr      attr;       // Attrs of newly created dir
-} rfs_rsp_mkdir_t;
-
-=#
+# Return RFS_RSP_ATTR, the attrs of the newly created dir
 function rfs_mkdir_ret(sock, ret, jl::Bool)
     if jl
         return_to_jl_client(sock, ret)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)	#If ret is an exception fill ret.errno in iob
-            attrs = ret
-            MsgPack.pack(iob, NO_ERROR) # errno
-            rfs_attr_pack(iob, attrs)  # attrs
+            rfs_mkdir_rsp_pack(iob, ret)
         end
         @debug("rfs_mkdir_ret(): length=$(length(iob.data)) $(iob.data)")
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Unpack this
-typedef struct rfs_arg_symlink {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent dir id
-    uint32_t      attr_mask;  // attr mask to set
-    file_name_t   name;       // Link name
-    FileAttr      attr;       // attrs to set
-    file_name_t	  link_path;  // path to link to
-} rfs_arg_symlink_t;
-=#
+# Unpack RFS_ARG_SYMLINK
 function rfs_symlink_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    p_dfid = rfs_fid_unpack(iob)
-    attr_mask = UInt32(MsgPack.unpack(iob))
-    fname = String(MsgPack.unpack(iob))
-    attr = rfs_attr_unpack(iob)
-    lpath = String(MsgPack.unpack(iob))
+    (p_dfid, attr_mask, fname, attr, lpath) = rfs_symlink_args(iob)
     @debug("symlink(): p_dfid=$p_dfid fname=$fname link path=$lpath")
     @debug("attr: $attr")
     # Return (op, args tuple for op, read-only, namespace, julia-client)
@@ -383,37 +510,22 @@ function rfs_symlink_unpack(args::Tuple)
     return (OP_SYMLINK, (p_dfid, fid_t(), fname, lpath, attr_mask, attr), false, true, true)
 end
 
-#=
-Return this
-typedef struct rfs_rsp_symlink {
-    __int32_t     error;      // POSIX error
-    FileAttr      attr;       // Attrs of the link created
-} rfs_rsp_symlink_t;
-=#
+# Return RFS_RSP_ATTR, the attrs of the link created
 function rfs_symlink_ret(sock, ret, jl)
    if jl
         return_to_jl_client(sock, ret)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)
-            MsgPack.pack(iob, NO_ERROR) # errno
-            rfs_attr_pack(iob, ret)   # attrs
+            rfs_symlink_rsp_pack(iob, ret)
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Unpack this:
-typedef struct rfs_arg_getattr {
-    rfs_file_op_t   op;        // operation code
-    cid_t           cid;       // channel id
-    fid_t           fid;       // file id
-} rfs_arg_getattr_t;
-=#
+# Unpack RFS_ARG_GETATTR
 function rfs_getattrs_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    fid = rfs_fid_unpack(iob)
+    (fid,) = rfs_getattr_args(iob)
     # return (op, args, ro, ns, jl)
     return (OP_GETATTRS, (fid), true, true, false)
 end
@@ -423,42 +535,22 @@ function rfs_getattrs_unpack(args::Tuple)
     return (OP_GETATTRS, args, true, true, true)
 end
 
-#=
-Return this:
-typedef struct rfs_rsp_getattr {
-    int         error;        // POISX error
-    FileAttr    attr;         // get attr resp
-} rfs_rsp_getattr_t;
-=#
+# Return RFS_RSP_ATTR_LINK, with the target of a symlink
 function rfs_getattrs_ret(sock, ret, jl)
     if jl
         return_to_jl_client(sock, ret)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)
-            attrs = ret
-            MsgPack.pack(iob, NO_ERROR) # errno
-            rfs_attr_pack(iob, attrs)   # attrs
+            rfs_getattr_rsp_pack(iob, ret, ns_link_target(ret))
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Pack this:
-typedef struct rfs_arg_setattr {
-    rfs_file_op_t  op;         // operation code
-    cid_t          cid;        // channel id
-    fid_t          fid;        // file id
-    uint32_t       attr_mask;  // attr mask to set
-    FileAttr       attr;       // attrs to set
-} rfs_arg_setattr_t;
-=#
+# Unpack RFS_ARG_SETATTR
 function rfs_setattrs_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    fid = rfs_fid_unpack(iob)
-    mask = UInt32(MsgPack.unpack(iob))
-    attr = rfs_attr_unpack(iob)
+    (fid, mask, attr) = rfs_setattr_args(iob)
     # return (op, args, ro, ns, jl)
     return (OP_SETATTRS, (fid, mask, attr), false, true, false)
 end
@@ -468,12 +560,7 @@ function rfs_setattrs_unpack(args::Tuple)
     return (OP_SETATTRS, args, false, true, true)
 end
 
-#=
-Return this:
-typedef struct rfs_rsp_setattr {
-    int         error;        // POISX error
-} rfs_rsp_setattr_t;
-=#
+# Return RFS_RSP_ERROR
 function rfs_setattrs_ret(sock, ret, jl)
     if jl
         return_to_jl_client(sock, ret)
@@ -481,28 +568,16 @@ function rfs_setattrs_ret(sock, ret, jl)
         iob = IOBuffer()
         if !check_exception(iob, ret)
             @debug("setattr() no error")
-            MsgPack.pack(iob, NO_ERROR) # errno
+            rfs_setattr_rsp_pack(iob)
         end
         @debug("setattr(): $(iob.data)")
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Unpack this
-typedef struct rfs_arg_link {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent dir id
-    fid_t         fid;        // file id to link to
-    file_name_t   name;       // Link name
-} rfs_arg_link_t;
-=#
+# Unpack RFS_ARG_LINK
 function rfs_link_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    p_fid = rfs_fid_unpack(iob)
-    fid = rfs_fid_unpack(iob)
-    fname = String(MsgPack.unpack(iob))
+    (p_fid, fid, fname) = rfs_link_args(iob)
     @debug("link(): parent:$p_fid file_to_link:$fid link_name:$fname")
     return(OP_LINK, (p_fid, fid, fname), false, true, false)
 end
@@ -512,12 +587,7 @@ function rfs_link_unpack(args::Tuple)
     return (OP_LINK, args, false, true, true)
 end
 
-#=
-Return this
-typedef struct rfs_rsp_link {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_link_t;
-=#
+# Return RFS_RSP_ERROR
 function rfs_link_ret(sock, ret, jl)
     if jl
 	return_to_jl_client(sock, ret)
@@ -525,30 +595,16 @@ function rfs_link_ret(sock, ret, jl)
 	iob = IOBuffer()
 	if !check_exception(iob, ret)
 	    @debug("link() no error")
-	    MsgPack.pack(iob, NO_ERROR)
+	    rfs_link_rsp_pack(iob)
 	end
 	@debug("link(): $(iob.data)")
 	write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Unpack this
-typedef struct rfs_arg_rename {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         old_dfid;   // old parent file id
-    file_name_t   old_name;   
-    fid_t         new_dfid;   // new parent file id
-    file_name_t   new_name;  
-} rfs_arg_rename_t;
-=#
+# Unpack RFS_ARG_RENAME
 function rfs_rename_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    old_dfid = rfs_fid_unpack(iob)
-    old_name = String(MsgPack.unpack(iob))
-    new_dfid = rfs_fid_unpack(iob)
-    new_name = String(MsgPack.unpack(iob))
+    (old_dfid, old_name, new_dfid, new_name) = rfs_rename_args(iob)
     @debug("rename_unpack(): old_dir:$old_dfid old_name:$old_name new_dir:$new_dfid new_name:$new_name")
     return(OP_RENAME, (old_dfid, old_name, new_dfid, new_name), false, true, false)
 end
@@ -559,37 +615,22 @@ function rfs_rename_unpack(args::Tuple)
     return (OP_RENAME, args, false, true, true)
 end
 
-#=
-Return this
-typedef struct rfs_rsp_rename {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_rename_t;
-=#
+# Return RFS_RSP_ERROR
 function rfs_rename_ret(sock, ret, jl)
     if jl
         return_to_jl_client(sock, ret)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)
-            MsgPack.pack(iob, NO_ERROR) # errno
+            rfs_rename_rsp_pack(iob)
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Unpack this
-typedef struct rfs_arg_unlink {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    file_name_t   name;       // file name
-} rfs_arg_unlink_t;
-=#
+# Unpack RFS_ARG_UNLINK
 function rfs_unlink_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    pfid = rfs_fid_unpack(iob)
-    name = String(MsgPack.unpack(iob))
+    (pfid, name) = rfs_unlink_args(iob)
     @debug("unlink_unpack(): parent:$pfid name:$name")
     return(OP_UNLINK, (pfid, name), false, true, false)
 end
@@ -600,37 +641,22 @@ function rfs_unlink_unpack(args::Tuple)
     return (OP_UNLINK, args, false, true, true)
 end
 
-#=
-Return this
-typedef struct rfs_rsp_unlink {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_unlink_t;
-=#
+# Return RFS_RSP_ERROR
 function rfs_unlink_ret(sock, ret, jl)
     if jl
         return_to_jl_client(sock, ret)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)
-            MsgPack.pack(iob, NO_ERROR) # errno
+            rfs_unlink_rsp_pack(iob)
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-#=
-Unpack this
-typedef struct rfs_arg_rmdir {
-    rfs_file_op_t op;         // operation code
-    cid_t         cid;        // channel id
-    fid_t         p_fid;      // parent file id
-    file_name_t   name;       // file name
-} rfs_arg_rmdir_t;
-=#
+# Unpack RFS_ARG_UNLINK, which OP_RMDIR takes too
 function rfs_rmdir_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    pfid = rfs_fid_unpack(iob)
-    name = String(MsgPack.unpack(iob))
+    (pfid, name) = rfs_unlink_args(iob)
     @debug("rmdir_unpack(): parent:$pfid name:$name")
     return(OP_RMDIR, (pfid, name), false, true, false)
 end
@@ -641,29 +667,23 @@ function rfs_rmdir_unpack(args::Tuple)
     return (OP_RMDIR, args, false, true, true)
 end
 
-#=
-Return this
-typedef struct rfs_rsp_rmdir {
-    __int32_t     error;      // POSIX error
-} rfs_rsp_rmdir_t;
-=#
+# Return RFS_RSP_ERROR, as unlink does
 function rfs_rmdir_ret(sock, ret, jl)
     if jl
         return_to_jl_client(sock, ret)
     else
         iob = IOBuffer()
         if !check_exception(iob, ret)
-            MsgPack.pack(iob, NO_ERROR) # errno
+            rfs_unlink_rsp_pack(iob)
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
+# Unpack RFS_ARG_READ
 function rfs_read_unpack(iob)
-    cid = rfs_cid_unpack(iob)
-    fid = rfs_fid_unpack(iob)
-    offset = UInt64(MsgPack.unpack(iob))
-    size   = UInt64(MsgPack.unpack(iob))
+    (fid, offset, size) = rfs_read_args(iob)
+    size = UInt64(size)
     # return (op, args, ro, ns, jl)
     return (OP_READ, (fid, offset, size), true, false, false)
 end
@@ -690,8 +710,13 @@ function rfs_read_ret(sock, ret, jl)
         (data, ret_attr) = ret
         if !check_exception(iob, data)
             MsgPack.pack(iob, NO_ERROR) # errno
-            MsgPack.pack(iob, UInt64(length(data)))
-            MsgPack.pack(iob, data)
+            if isa(data, rfs_shm_slot_t) # data is in the shared ring
+                MsgPack.pack(iob, UInt64(data.len))
+                MsgPack.pack(iob, UInt8[])
+            else
+                MsgPack.pack(iob, UInt64(length(data)))
+                MsgPack.pack(iob, data)
+            end
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
@@ -713,13 +738,7 @@ function rfs_write_unpack(args::Tuple)
     return (OP_WRITE, args, false, false, true)
 end
 
-#=
-Return this:
-typedef struct rfs_rsp_write {
-    __int32_t       error;      /* POISX error */
-    __int64_t       size;       /* written size */
-} rfs_rsp_write_t;
-=#
+# Return RFS_RSP_WRITE
 function rfs_write_ret(sock, ret, jl)
     if jl
         return_to_jl_client(sock, ret)
@@ -727,17 +746,119 @@ function rfs_write_ret(sock, ret, jl)
         iob = IOBuffer()
         (size, ret_attr) = ret
         if !check_exception(iob, ret) && !check_exception(iob, ret_attr)
-            MsgPack.pack(iob, NO_ERROR) # errno
-            MsgPack.pack(iob, UInt64(size))
+            rfs_write_rsp_pack(iob, size)
             @debug("error= $NO_ERROR, size= $size")
         end
         write(sock, UInt32(length(iob.data)), iob.data)
     end
 end
 
-function rfs_readlink_unpack(iob)
+# Unpack the (offset, size) of each segment of a vectored read or write
+function rfs_segs_unpack(iob)
+    n = Int(MsgPack.unpack(iob))
+    segs = Vector{Tuple{UInt64, UInt64}}(undef, n)
+    for i = 1:n
+        offset = UInt64(MsgPack.unpack(iob))
+        size   = UInt64(MsgPack.unpack(iob))
+        segs[i] = (offset, size)
+    end
+    return segs
+end
+
+function rfs_readv_unpack(iob)
     cid = rfs_cid_unpack(iob)
     fid = rfs_fid_unpack(iob)
+    segs = rfs_segs_unpack(iob)
+    # return (op, args, ro, ns, jl)
+    return (OP_READV, (fid, segs), true, false, false)
+end
+
+# Unpack for julia
+function rfs_readv_unpack(args::Tuple)
+    # return (op, args, ro, ns, jl)
+    return (OP_READV, args, true, false, true)
+end
+
+#=
+Return this:
+typedef struct rfs_rsp_readv {
+    __int32_t   error;      /* POSIX error */
+    uint32_t    n_segs;     /* number of segments read */
+    __int64_t   *sizes;     /* bytes read into each segment */
+} rfs_rsp_readv_t;
+followed by the data of all segments, back to back, in one buffer.
+=#
+function rfs_readv_ret(sock, ret, jl)
+    if jl
+        return_to_jl_client(sock, ret)
+    else
+        iob = IOBuffer()
+        (data, ret_attr) = ret
+        if !check_exception(iob, data)
+            MsgPack.pack(iob, NO_ERROR) # errno
+            MsgPack.pack(iob, UInt32(length(data)))
+            for d in data
+                MsgPack.pack(iob, UInt64(length(d)))
+            end
+            MsgPack.pack(iob, vcat(data...))
+        end
+        write(sock, UInt32(length(iob.data)), iob.data)
+    end
+end
+
+function rfs_writev_unpack(iob)
+    cid = rfs_cid_unpack(iob)
+    fid = rfs_fid_unpack(iob)
+    segs = rfs_segs_unpack(iob)
+    buffer = MsgPack.unpack(iob)    # data of all segments
+    # return (op, args, ro, ns, jl)
+    return (OP_WRITEV, (fid, segs, buffer), false, false, false)
+end
+
+# Unpack for julia
+function rfs_writev_unpack(args::Tuple)
+    # return (op, args, ro, ns, jl)
+    return (OP_WRITEV, args, false, false, true)
+end
+
+# Unpack a read whose data is returned in slot of the shared ring *ring*
+function rfs_read_shm_unpack(iob, ring)
+    (op, (fid, offset, size), ro, ns, jl) = rfs_read_unpack(iob)
+    slot = shm_slot(ring, UInt32(MsgPack.unpack(iob)), size)
+    # return (op, args, ro, ns, jl)
+    return (OP_READ, (fid, offset, size, slot), ro, ns, jl)
+end
+
+# Unpack a write whose data is in a slot of the shared ring *ring*
+function rfs_write_shm_unpack(iob, ring)
+    cid = rfs_cid_unpack(iob)
+    fid = rfs_fid_unpack(iob)
+    offset = UInt64(MsgPack.unpack(iob))
+    size   = UInt64(MsgPack.unpack(iob))
+    buffer = shm_slot(ring, UInt32(MsgPack.unpack(iob)), size).data
+    # return (op, args, ro, ns, jl)
+    return (OP_WRITE, (fid, offset, size, buffer), false, false, false)
+end
+
+# Unpack RFS_ARG_SHM_ATTACH
+function rfs_shm_attach_unpack(iob)
+    (n_slots, slot_size) = rfs_shm_attach_args(iob)
+    # return (op, args, ro, ns, jl)
+    return (OP_SHM_ATTACH, (n_slots, slot_size), true, true, false)
+end
+
+# Return RFS_RSP_ERROR
+function rfs_shm_attach_ret(sock, ret, jl)
+    iob = IOBuffer()
+    if !check_exception(iob, ret)
+        rfs_shm_attach_rsp_pack(iob)
+    end
+    write(sock, UInt32(length(iob.data)), iob.data)
+end
+
+# Unpack RFS_ARG_READLINK
+function rfs_readlink_unpack(iob)
+    (fid,) = rfs_readlink_args(iob)
     # return (op, args, ro, ns, jl)
     return (OP_READLINK, fid, true, true, false)
 end
@@ -822,6 +943,7 @@ end
 # of return values
 const op_table = Dict(OP_LOOKUP   => (rfs_lookup_unpack, rfs_lookup_ret),
                       OP_READDIR  => (rfs_readdir_unpack, rfs_readdir_ret),
+                      OP_READDIRPLUS => (rfs_readdirplus_unpack, rfs_readdirplus_ret),
                       OP_CREATE   => (rfs_create_unpack, rfs_create_ret),
                       OP_MKNOD    => (rfs_mknod_unpack, rfs_create_ret),
                       OP_MKDIR    => (rfs_mkdir_unpack, rfs_mkdir_ret),
@@ -835,6 +957,11 @@ const op_table = Dict(OP_LOOKUP   => (rfs_lookup_unpack, rfs_lookup_ret),
                       OP_UNLINK   => (rfs_unlink_unpack, rfs_unlink_ret),
                       OP_READ     => (rfs_read_unpack, rfs_read_ret),
                       OP_WRITE    => (rfs_write_unpack, rfs_write_ret),
+                      OP_COMPOUND => (rfs_compound_unpack, rfs_compound_ret),
+                      OP_BATCH    => (rfs_batch_unpack, rfs_batch_ret),
+                      OP_READV    => (rfs_readv_unpack, rfs_readv_ret),
+                      OP_WRITEV   => (rfs_writev_unpack, rfs_write_ret),
+                      OP_SHM_ATTACH => (rfs_shm_attach_unpack, rfs_shm_attach_ret),
                       OP_UTIL_MKFS => (rfs_mkfs_unpack, rfs_mkfs_ret),
                       OP_MOUNT    => (rfs_mount_unpack, rfs_mount_ret),
                       OP_CHK_PT    => (rfs_checkpoint_unpack, rfs_checkpoint_ret),
@@ -845,3 +972,7 @@ const ctl_op_table = Dict(OP_UTIL_MKFS => (rfs_mkfs_unpack, rfs_mkfs_ret),
                           OP_CHK_PT    => (rfs_checkpoint_unpack, rfs_checkpoint_ret),
                           OP_SYNC_FS   => (rfs_syncpoint_unpack, rfs_syncpoint_ret),
                           OP_SET_LOG_LEVEL => (rfs_log_level_unpack, rfs_log_level_ret))
+
+# Reads and writes flagged RFS_SHM_RING, with their data in the shared ring
+const shm_op_table = Dict(OP_READ     => (rfs_read_shm_unpack, rfs_read_ret),
+                          OP_WRITE    => (rfs_write_shm_unpack, rfs_write_ret))
@@ -0,0 +1,230 @@
+# Generated by lib/ravana_gen_ops.c from lib/ravana_ops.h, do not edit.
+
+#=
+    rfs_X_args(iob)
+Unpacks the fields of RFS_ARG_<X> that follow the op code, skipping
+the channel id, as a tuple. Fields an older client does not send at the
+end of its request are 0.
+
+    rfs_X_rsp_pack(iob, fields...)
+Packs NO_ERROR and the fields of the RFS_RSP_* that X replies with.
+
+RFS_FLAT_ARG_FIELDS and RFS_FLAT_RSP_FIELDS list the (type, name) of
+the fields of each, for the tests.
+=#
+
+const RFS_FLAT_ARG_FIELDS = [
+    :create => Tuple{Symbol, Symbol}[(:FID, :p_fid), (:U32, :attr_mask), (:NAME, :fname), (:ATTR, :attr)],
+    :lookup => Tuple{Symbol, Symbol}[(:FID, :dfid), (:NAME, :fname)],
+    :setattr => Tuple{Symbol, Symbol}[(:FID, :fid), (:U32, :attr_mask), (:ATTR, :attr)],
+    :getattr => Tuple{Symbol, Symbol}[(:FID, :fid)],
+    :readdir => Tuple{Symbol, Symbol}[(:FID, :d_fid), (:U64, :index), (:U32, :max_entries), (:U32, :max_bytes)],
+    :read => Tuple{Symbol, Symbol}[(:FID, :fid), (:U64, :offset), (:I64, :size)],
+    :mkdir => Tuple{Symbol, Symbol}[(:FID, :p_fid), (:U32, :attr_mask), (:NAME, :dname), (:ATTR, :attr)],
+    :symlink => Tuple{Symbol, Symbol}[(:FID, :p_fid), (:U32, :attr_mask), (:NAME, :name), (:ATTR, :attr), (:NAME, :link_path)],
+    :link => Tuple{Symbol, Symbol}[(:FID, :p_fid), (:FID, :fid), (:NAME, :name)],
+    :unlink => Tuple{Symbol, Symbol}[(:FID, :p_fid), (:NAME, :name)],
+    :rename => Tuple{Symbol, Symbol}[(:FID, :old_dfid), (:NAME, :old_name), (:FID, :new_dfid), (:NAME, :new_name)],
+    :readlink => Tuple{Symbol, Symbol}[(:FID, :fid)],
+    :shm_attach => Tuple{Symbol, Symbol}[(:U32, :n_slots), (:U32, :slot_size)],
+]
+
+const RFS_FLAT_RSP_FIELDS = [
+    :create => Tuple{Symbol, Symbol}[(:ATTR, :attr)],
+    :mknod => Tuple{Symbol, Symbol}[(:ATTR, :attr)],
+    :lookup => Tuple{Symbol, Symbol}[(:ATTR, :attr), (:NAME, :link)],
+    :getattr => Tuple{Symbol, Symbol}[(:ATTR, :attr), (:NAME, :link)],
+    :mkdir => Tuple{Symbol, Symbol}[(:ATTR, :attr)],
+    :symlink => Tuple{Symbol, Symbol}[(:ATTR, :attr)],
+    :setattr => Tuple{Symbol, Symbol}[],
+    :link => Tuple{Symbol, Symbol}[],
+    :unlink => Tuple{Symbol, Symbol}[],
+    :rename => Tuple{Symbol, Symbol}[],
+    :shm_attach => Tuple{Symbol, Symbol}[],
+    :write => Tuple{Symbol, Symbol}[(:I64, :size)],
+]
+
+# RFS_ARG_CREATE
+function rfs_create_args(iob)
+    rfs_cid_unpack(iob)
+    p_fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    attr_mask = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    fname = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    attr = eof(iob) ? FileAttr() : rfs_attr_unpack(iob)
+    return (p_fid, attr_mask, fname, attr,)
+end
+
+# RFS_ARG_LOOKUP
+function rfs_lookup_args(iob)
+    rfs_cid_unpack(iob)
+    dfid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    fname = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    return (dfid, fname,)
+end
+
+# RFS_ARG_SETATTR
+function rfs_setattr_args(iob)
+    rfs_cid_unpack(iob)
+    fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    attr_mask = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    attr = eof(iob) ? FileAttr() : rfs_attr_unpack(iob)
+    return (fid, attr_mask, attr,)
+end
+
+# RFS_ARG_GETATTR
+function rfs_getattr_args(iob)
+    rfs_cid_unpack(iob)
+    fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    return (fid,)
+end
+
+# RFS_ARG_READDIR
+function rfs_readdir_args(iob)
+    rfs_cid_unpack(iob)
+    d_fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    index = eof(iob) ? UInt64(0) : UInt64(MsgPack.unpack(iob))
+    max_entries = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    max_bytes = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    return (d_fid, index, max_entries, max_bytes,)
+end
+
+# RFS_ARG_READ
+function rfs_read_args(iob)
+    rfs_cid_unpack(iob)
+    fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    offset = eof(iob) ? UInt64(0) : UInt64(MsgPack.unpack(iob))
+    size = eof(iob) ? Int64(0) : Int64(MsgPack.unpack(iob))
+    return (fid, offset, size,)
+end
+
+# RFS_ARG_MKDIR
+function rfs_mkdir_args(iob)
+    rfs_cid_unpack(iob)
+    p_fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    attr_mask = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    dname = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    attr = eof(iob) ? FileAttr() : rfs_attr_unpack(iob)
+    return (p_fid, attr_mask, dname, attr,)
+end
+
+# RFS_ARG_SYMLINK
+function rfs_symlink_args(iob)
+    rfs_cid_unpack(iob)
+    p_fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    attr_mask = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    name = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    attr = eof(iob) ? FileAttr() : rfs_attr_unpack(iob)
+    link_path = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    return (p_fid, attr_mask, name, attr, link_path,)
+end
+
+# RFS_ARG_LINK
+function rfs_link_args(iob)
+    rfs_cid_unpack(iob)
+    p_fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    name = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    return (p_fid, fid, name,)
+end
+
+# RFS_ARG_UNLINK
+function rfs_unlink_args(iob)
+    rfs_cid_unpack(iob)
+    p_fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    name = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    return (p_fid, name,)
+end
+
+# RFS_ARG_RENAME
+function rfs_rename_args(iob)
+    rfs_cid_unpack(iob)
+    old_dfid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    old_name = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    new_dfid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    new_name = eof(iob) ? "" : String(MsgPack.unpack(iob))
+    return (old_dfid, old_name, new_dfid, new_name,)
+end
+
+# RFS_ARG_READLINK
+function rfs_readlink_args(iob)
+    rfs_cid_unpack(iob)
+    fid = eof(iob) ? fid_t(0) : rfs_fid_unpack(iob)
+    return (fid,)
+end
+
+# RFS_ARG_SHM_ATTACH
+function rfs_shm_attach_args(iob)
+    rfs_cid_unpack(iob)
+    n_slots = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    slot_size = eof(iob) ? UInt32(0) : UInt32(MsgPack.unpack(iob))
+    return (n_slots, slot_size,)
+end
+
+# RFS_RSP_ATTR
+function rfs_create_rsp_pack(iob, attr)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    rfs_attr_pack(iob, attr)
+end
+
+# RFS_RSP_ATTR
+function rfs_mknod_rsp_pack(iob, attr)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    rfs_attr_pack(iob, attr)
+end
+
+# RFS_RSP_ATTR_LINK
+function rfs_lookup_rsp_pack(iob, attr, link)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    rfs_attr_pack(iob, attr)
+    MsgPack.pack(iob, String(link))
+end
+
+# RFS_RSP_ATTR_LINK
+function rfs_getattr_rsp_pack(iob, attr, link)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    rfs_attr_pack(iob, attr)
+    MsgPack.pack(iob, String(link))
+end
+
+# RFS_RSP_ATTR
+function rfs_mkdir_rsp_pack(iob, attr)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    rfs_attr_pack(iob, attr)
+end
+
+# RFS_RSP_ATTR
+function rfs_symlink_rsp_pack(iob, attr)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    rfs_attr_pack(iob, attr)
+end
+
+# RFS_RSP_ERROR
+function rfs_setattr_rsp_pack(iob)
+    MsgPack.pack(iob, NO_ERROR) # errno
+end
+
+# RFS_RSP_ERROR
+function rfs_link_rsp_pack(iob)
+    MsgPack.pack(iob, NO_ERROR) # errno
+end
+
+# RFS_RSP_ERROR
+function rfs_unlink_rsp_pack(iob)
+    MsgPack.pack(iob, NO_ERROR) # errno
+end
+
+# RFS_RSP_ERROR
+function rfs_rename_rsp_pack(iob)
+    MsgPack.pack(iob, NO_ERROR) # errno
+end
+
+# RFS_RSP_ERROR
+function rfs_shm_attach_rsp_pack(iob)
+    MsgPack.pack(iob, NO_ERROR) # errno
+end
+
+# RFS_RSP_WRITE
+function rfs_write_rsp_pack(iob, size)
+    MsgPack.pack(iob, NO_ERROR) # errno
+    MsgPack.pack(iob, Int64(size))
+end
@@ -95,6 +95,16 @@ function rfs_create(dfid::fid_t, fname::String, mask::UInt32, attr::FileAttr)
     ret
 end
 
+# Runs the (op, name) pairs *ops* from *fid*, see ns_compound()
+function rfs_compound(fid::fid_t, ops::Vector{Tuple{Int32, String}})
+    ret = rfs_client(get_cfs(), OP_COMPOUND, fid, ops)
+    if isa(ret, Exception)
+        dump(ret)
+        return false
+    end
+    ret
+end
+
 function rfs_rename(old_dfid::fid_t, old_name::String, new_dfid::fid_t, new_name::String)
     ret = rfs_client(get_cfs(), OP_RENAME, old_dfid, old_name, new_dfid, new_name)
     if isa(ret, Exception)
@@ -171,6 +181,35 @@ function rfs_readdir(dfid::fid_t)
     return rfs_readdir(dfid, UInt64(0))
 end
 
+# A page of at most *max_entries* entries, that encode in no more than
+# *max_bytes* bytes; 0 leaves either up to the fs
+function rfs_readdir(dfid::fid_t, whence::UInt64, max_entries::Integer, max_bytes::Integer)
+    ret = rfs_client(get_cfs(), OP_READDIR, dfid, whence, max_entries, max_bytes)
+    if isa(ret, Exception)
+        dump(ret)
+        return false
+    end
+    ret
+end
+
+function rfs_readdirplus(dfid::fid_t, whence::UInt64)
+    ret = rfs_client(get_cfs(), OP_READDIRPLUS, dfid, whence)
+    if isa(ret, Exception)
+        dump(ret)
+        return false
+    end
+    ret
+end
+
+function rfs_readdirplus(dfid::fid_t, whence::UInt64, max_entries::Integer, max_bytes::Integer)
+    ret = rfs_client(get_cfs(), OP_READDIRPLUS, dfid, whence, max_entries, max_bytes)
+    if isa(ret, Exception)
+        dump(ret)
+        return false
+    end
+    ret
+end
+
 function rfs_write(fid::fid_t, offset::UInt64, len::UInt64, buf::Vector{UInt8})
     ret = rfs_client(get_cfs(), OP_WRITE, fid, offset, len, buf)
     if isa(ret, Exception)
@@ -189,6 +228,25 @@ function rfs_read(fid::fid_t, offset::UInt64, len::UInt64)
     ret
 end
 
+# *segs* are (offset, len) pairs, *buf* the data of all of them back to back
+function rfs_writev(fid::fid_t, segs::Vector{Tuple{UInt64, UInt64}}, buf::Vector{UInt8})
+    ret = rfs_client(get_cfs(), OP_WRITEV, fid, segs, buf)
+    if isa(ret, Exception)
+        dump(ret)
+        return false
+    end
+    ret
+end
+
+function rfs_readv(fid::fid_t, segs::Vector{Tuple{UInt64, UInt64}})
+    ret = rfs_client(get_cfs(), OP_READV, fid, segs)
+    if isa(ret, Exception)
+        dump(ret)
+        return false
+    end
+    ret
+end
+
 function rfs_readlink(fid::fid_t)
     ret = rfs_client(get_cfs(), OP_READLINK, fid)
     if isa(ret, Exception)
@@ -242,13 +300,11 @@ function ll()
     eof::UInt32 = 0
     whence::UInt64 = 0
     while eof != 1
-        (dirs, eof) = rfs_readdir(cwd, whence)
+        (dirs, attrs, eof, whence) = rfs_readdirplus(cwd, whence)
         println("$(length(dirs)) entries found. eof = $eof")
-        for i in dirs
-            attr = rfs_getattr(i.fid)
-            print_dentry(i, attr)
+        for (d, (attr, link_len)) in zip(dirs, attrs)
+            print_dentry(d, attr)
         end
-        whence = dirs[end].whence
     end
 end
 